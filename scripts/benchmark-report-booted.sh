@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# This file is part of clr-boot-manager.
+#
+# Copyright © 2024 Solus Project
+#
+# clr-boot-manager is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public License as
+# published by the Free Software Foundation; either version 2.1
+# of the License, or (at your option) any later version.
+#
+
+# Measure the exec-to-exit time of the report-booted paths, as they run on
+# the critical path of every boot. Must run as root on a system with a
+# clr-boot-manager managed kernel, as each run writes the boot marker.
+
+set -e
+
+buildDir="${1:-build}"
+runs="${RUNS:-200}"
+
+print_help() {
+    echo -e "benchmark-report-booted.sh [build directory]
+Environment:
+    RUNS		Number of runs per command (default: 200)"
+}
+
+if [[ "$1" == "--help" || "$1" == "help" ]]; then
+    print_help
+    exit 0
+fi
+
+if [[ $EUID -ne 0 ]]; then
+    echo "report-booted must be benchmarked as root"
+    exit 1
+fi
+
+# Run the given command $runs times, printing the mean time per run
+bench() {
+    local start end
+
+    # Warm the page cache so only exec and the work itself are measured
+    "$@" >/dev/null
+
+    start=$(date +%s%N)
+    for ((i = 0; i < runs; i++)); do
+        "$@" >/dev/null
+    done
+    end=$(date +%s%N)
+
+    printf "%-56s %8d us\n" "$*" $(( (end - start) / runs / 1000 ))
+}
+
+bench "$buildDir/src/clr-boot-manager" report-booted
+bench "$buildDir/src/clr-boot-manager-booted"
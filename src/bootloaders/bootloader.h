@@ -32,6 +32,11 @@ typedef bool (*boot_loader_update)(const BootManager *);
 typedef bool (*boot_loader_remove)(const BootManager *);
 typedef void (*boot_loader_destroy)(const BootManager *);
 typedef int (*boot_loader_caps)(const BootManager *);
+typedef bool (*boot_loader_get_versions)(const BootManager *, char **installed,
+                                         char **available);
+typedef bool (*boot_loader_reconcile_kernels)(const BootManager *, const KernelArray *installed,
+                                              const KernelArray *known);
+typedef const char *(*boot_loader_get_efi_path)(const BootManager *);
 
 typedef enum {
         BOOTLOADER_CAP_MIN = 1 << 0,
@@ -41,7 +46,8 @@ typedef enum {
         BOOTLOADER_CAP_EXTFS = 1 << 4,   /**<Bootloader supports ext2/3/4 */
         BOOTLOADER_CAP_FATFS = 1 << 5,   /**<Bootloader supports vfat */
         BOOTLOADER_CAP_PARTLESS = 1<< 6, /**<Bootloader supports partitionless boot */
-        BOOTLOADER_CAP_MAX = 1 << 7
+        BOOTLOADER_CAP_UKI = 1 << 7,     /**<Bootloader can assemble Unified Kernel Images */
+        BOOTLOADER_CAP_MAX = 1 << 8
 } BootLoaderCapability;
 
 /**
@@ -63,6 +69,11 @@ typedef struct BootLoader {
         boot_loader_remove remove;         /**<Remove this bootloader from the disk */
         boot_loader_destroy destroy;       /**<Perform necessary cleanups */
         boot_loader_caps get_capabilities; /**<Check capabilities */
+        boot_loader_reconcile_kernels
+            reconcile_kernels; /**<Optional: write all kernel entries at once, dropping orphans */
+        boot_loader_get_versions get_versions; /**<Optional: report installed/available versions */
+        boot_loader_get_efi_path
+            get_efi_path; /**<Optional: path within the ESP that boot entries should load */
 } BootLoader;
 
 #define __cbm_export__ __attribute__((visibility("default")))
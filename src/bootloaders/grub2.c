@@ -179,6 +179,7 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
         char *boot_prefix = NULL;
         char *initrd_name = NULL;
         char *ucode_initrd = NULL;
+        const char *bundle = NULL;
         autofree(char) *initrd_paths = NULL;
         initrd_paths = malloc(1);
         initrd_paths[0] = '\0';
@@ -272,39 +273,49 @@ bool grub2_write_kernel(const Grub2Config *config, const Kernel *kernel)
         /* Finish it off with the command line options */
         cbm_writer_append_printf(config->writer, "%s\"\n", kernel->meta.cmdline);
 
-        /* Early microcode loading initrd must be the first entry */
-        ucode_initrd = boot_manager_get_ucode_initrd(config->manager);
-        if (ucode_initrd) {
+        /* Everything is merged into a single file */
+        bundle = boot_manager_get_initrd_bundle(config->manager, kernel);
+        if (bundle) {
                 char *tmp = initrd_paths;
-                initrd_paths = string_printf("%s %s/%s",
-                                         initrd_paths,
-                                         (!config->is_separate) ? boot_prefix : "", /* i.e. /boot */
-                                         ucode_initrd);
+                initrd_paths = string_printf(" %s/%s",
+                                             (!config->is_separate) ? boot_prefix : "",
+                                             bundle);
                 free(tmp);
-        }
+        } else {
+                /* Early microcode loading initrd must be the first entry */
+                ucode_initrd = boot_manager_get_ucode_initrd(config->manager);
+                if (ucode_initrd) {
+                        char *tmp = initrd_paths;
+                        initrd_paths = string_printf("%s %s/%s",
+                                                     initrd_paths,
+                                                     (!config->is_separate) ? boot_prefix : "",
+                                                     ucode_initrd);
+                        free(tmp);
+                }
 
-        /* Optional initrd */
-        if (kernel->target.initrd_path) {
-                char *tmp = initrd_paths;
-                initrd_paths = string_printf("%s %s/%s",
-                                         initrd_paths,
-                                         (!config->is_separate) ? boot_prefix : "", /* i.e. /boot */
-                                         kernel->target.initrd_path);
-                free(tmp);
-        }
-        boot_manager_initrd_iterator_init(config->manager, &iter);
-        while (boot_manager_initrd_iterator_next(&iter, &initrd_name)) {
-                char *tmp = initrd_paths;
-                if (streq(initrd_name, ucode_initrd)) {
-                        /* This is the ucode early update initrd we already
-                         * wrote above */
-                        continue;
+                /* Optional initrd */
+                if (kernel->target.initrd_path) {
+                        char *tmp = initrd_paths;
+                        initrd_paths = string_printf("%s %s/%s",
+                                                     initrd_paths,
+                                                     (!config->is_separate) ? boot_prefix : "",
+                                                     kernel->target.initrd_path);
+                        free(tmp);
+                }
+                boot_manager_initrd_iterator_init(config->manager, &iter);
+                while (boot_manager_initrd_iterator_next(&iter, &initrd_name)) {
+                        char *tmp = initrd_paths;
+                        if (streq(initrd_name, ucode_initrd)) {
+                                /* This is the ucode early update initrd we already
+                                 * wrote above */
+                                continue;
+                        }
+                        initrd_paths = string_printf("%s %s/%s",
+                                                     initrd_paths,
+                                                     (!config->is_separate) ? boot_prefix : "",
+                                                     initrd_name);
+                        free(tmp);
                 }
-                initrd_paths = string_printf("%s %s/%s",
-                                         initrd_paths,
-                                         (!config->is_separate) ? boot_prefix : "", /* i.e. /boot */
-                                         initrd_name);
-                free(tmp);
         }
 
         if (strlen(initrd_paths)) {
@@ -336,7 +347,6 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
         const char *os_id = NULL;
         const char *keymap = NULL;
         const char *font = NULL;
-        autofree(char) *old_conf = NULL;
         autofree(char) *conf_path = NULL;
         autofree(char) *boot_dir = NULL;
         const char *prefix = NULL;
@@ -442,10 +452,8 @@ static bool grub2_write_config(const BootManager *manager, const Kernel *default
 
         conf_path = string_printf("%s/etc/grub.d/10_%s", prefix, KERNEL_NAMESPACE);
         /* If our new config matches the old config, just return. */
-        if (file_get_text(conf_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
+        if (cbm_writer_matches_file(writer, conf_path)) {
+                return true;
         }
 
         /* Ensure the grub.d directory actually exists (should do..) */
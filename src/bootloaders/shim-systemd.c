@@ -17,8 +17,10 @@
 #include "bootman.h"
 #include "bootvar.h"
 #include "config.h"
+#include "esp-index.h"
 #include "files.h"
 #include "nica/files.h"
+#include "pe.h"
 #include "systemd-class.h"
 #include <log.h>
 
@@ -75,6 +77,8 @@ static bool shim_systemd_remove(const BootManager *);
 static bool shim_systemd_init(const BootManager *);
 static void shim_systemd_destroy(const BootManager *);
 static int shim_systemd_get_capabilities(const BootManager *);
+static bool shim_systemd_get_versions(const BootManager *, char **, char **);
+static const char *shim_systemd_get_efi_path(const BootManager *);
 
 __cbm_export__ const BootLoader
     shim_systemd_bootloader = {.name = "shim-systemd",
@@ -90,7 +94,10 @@ __cbm_export__ const BootLoader
                                .update = shim_systemd_update,
                                .remove = shim_systemd_remove,
                                .destroy = shim_systemd_destroy,
-                               .get_capabilities = shim_systemd_get_capabilities };
+                               .get_capabilities = shim_systemd_get_capabilities,
+                               .reconcile_kernels = sd_class_reconcile_kernels,
+                               .get_versions = shim_systemd_get_versions,
+                               .get_efi_path = shim_systemd_get_efi_path };
 
 #if UINTPTR_MAX == 0xffffffffffffffff
 #define EFI_SUFFIX "x64.efi"
@@ -158,6 +165,7 @@ typedef struct shim_systemd_config {
         char *systemd_dst_host;
 
         char *shim_dst_esp; /* absolute location of shim on the ESP, for boot record */
+        char *esp_root;     /* where the ESP is reachable, which need not be /boot */
 
         char *efi_fallback_dir;
         char *efi_fallback_dst_host;
@@ -208,21 +216,46 @@ static bool shim_systemd_set_default_kernel(const BootManager *manager, const Ke
 
 static bool exists_identical(const char *path, const char *spath)
 {
-        if (!nc_file_exists(path)) {
+        if (!cbm_esp_exists(path)) {
                 return false;
         }
-        if (spath && !cbm_files_match(path, spath)) {
+        /* Versioned EFI binaries are compared by version, anything else in full */
+        if (spath && !cbm_pe_blobs_match(path, spath)) {
                 return false;
         }
         return true;
 }
 
-static bool shim_systemd_needs_install(__cbm_unused__ const BootManager *manager)
+/* with --no-efi-writes-if-bootable a missing boot entry is fine as long as the
+ * firmware fallback path carries our shim. */
+static bool shim_systemd_fallback_boots(const BootManager *manager)
+{
+        if (!boot_manager_is_no_efi_writes_if_bootable((BootManager *)manager)) {
+                return false;
+        }
+        return exists_identical(config.efi_fallback_dst_host, config.shim_src);
+}
+
+static bool shim_systemd_get_versions(__cbm_unused__ const BootManager *manager, char **installed,
+                                      char **available)
+{
+        /* shim carries no version section, report the second stage loader */
+        *installed = cbm_pe_get_version(config.systemd_dst_host);
+        *available = cbm_pe_get_version(config.systemd_src);
+        return true;
+}
+
+static const char *shim_systemd_get_efi_path(__cbm_unused__ const BootManager *manager)
+{
+        return config.shim_dst_esp;
+}
+
+static bool shim_systemd_needs_install(const BootManager *manager)
 {
         if (config.has_boot_rec < 0) {
                 if (!config.is_image_mode) {
                         config.has_boot_rec =
-                            bootvar_has_boot_rec(BOOT_DIRECTORY, config.shim_dst_esp);
+                            bootvar_has_boot_rec(config.esp_root, config.shim_dst_esp);
                 } else {
                         config.has_boot_rec = 1;
                 }
@@ -248,15 +281,15 @@ static bool shim_systemd_needs_install(__cbm_unused__ const BootManager *manager
         if (!exists_identical(config.bootcsv_dst_host, NULL)) {
                 return true;
         }
-        return !config.has_boot_rec;
+        return !config.has_boot_rec && !shim_systemd_fallback_boots(manager);
 }
 
-static bool shim_systemd_needs_update(__cbm_unused__ const BootManager *manager)
+static bool shim_systemd_needs_update(const BootManager *manager)
 {
         if (config.has_boot_rec < 0) {
                 if (!config.is_image_mode) {
                         config.has_boot_rec =
-                            bootvar_has_boot_rec(BOOT_DIRECTORY, config.shim_dst_esp);
+                            bootvar_has_boot_rec(config.esp_root, config.shim_dst_esp);
                 } else {
                         config.has_boot_rec = 1;
                 }
@@ -282,7 +315,7 @@ static bool shim_systemd_needs_update(__cbm_unused__ const BootManager *manager)
         if (!exists_identical(config.bootcsv_dst_host, config.bootcsv_src)) {
                 return true;
         }
-        return !config.has_boot_rec;
+        return !config.has_boot_rec && !shim_systemd_fallback_boots(manager);
 }
 
 static bool make_layout(const BootManager *manager)
@@ -290,19 +323,20 @@ static bool make_layout(const BootManager *manager)
         autofree(char) *boot_root = boot_manager_get_boot_dir((BootManager *)manager);
         autofree(char) *systemd_config_entries = NULL;
 
-        if (!nc_mkdir_p(config.bin_dst_host, 00755)) {
+        if (!cbm_mkdir_p(config.bin_dst_host, 00755)) {
                 return false;
         }
 
         systemd_config_entries =
-            nc_build_case_correct_path(boot_root, SYSTEMD_CONFIG_DIR, SYSTEMD_ENTRIES_DIR, NULL);
-        if (!nc_mkdir_p(systemd_config_entries, 00755)) {
+            cbm_esp_build_path(boot_root, SYSTEMD_CONFIG_DIR, SYSTEMD_ENTRIES_DIR, NULL);
+        if (!cbm_mkdir_p(systemd_config_entries, 00755)) {
                 return false;
         }
 
-        if (!nc_mkdir_p(config.efi_fallback_dir, 00755)) {
+        if (!cbm_mkdir_p(config.efi_fallback_dir, 00755)) {
                 return false;
         }
+
         return true;
 }
 
@@ -361,9 +395,13 @@ static bool shim_systemd_install(const BootManager *manager)
 
         if (!config.is_image_mode) {
                 if (!config.has_boot_rec && boot_manager_is_update_efi_vars((BootManager *)manager)) {
-                        if (bootvar_create(BOOT_DIRECTORY, config.shim_dst_esp, varname, 9)) {
+                        if (shim_systemd_fallback_boots(manager)) {
+                                LOG_INFO("Fallback bootloader is current, skipping EFI boot entry");
+                        } else if (bootvar_create(config.esp_root, config.shim_dst_esp, varname, 9)) {
                                 LOG_ERROR("Cannot create EFI variable (boot entry)");
                                 LOG_ERROR("Please manually update your bios to add a boot entry for %s", prefix);
+                        } else {
+                                config.has_boot_rec = 1;
                         }
                 }
         } else {
@@ -394,6 +432,8 @@ static bool shim_systemd_init(const BootManager *manager)
         autofree(char) *prefix = NULL;
         autofree(char) *boot_root = NULL;
 
+        /* the firmware may have changed since a previous manager looked */
+        config.has_boot_rec = -1;
         if (!boot_manager_is_image_mode((BootManager *)manager)) {
                 if (bootvar_init()) {
                         LOG_ERROR("Cannot parse EFI variables");
@@ -425,32 +465,33 @@ static bool shim_systemd_init(const BootManager *manager)
 
         boot_root = boot_manager_get_boot_dir((BootManager *)manager);
         config.bin_dst_host =
-            nc_build_case_correct_path(boot_root, ESP_EFI, KERNEL_NAMESPACE, NULL);
+            cbm_esp_build_path(boot_root, ESP_EFI, KERNEL_NAMESPACE, NULL);
         /* bin_dst_esp is the ESP-absolute path which will be consumed by
          * bootloaders and it have to be case-correct too, extract it from
          * case-corrected bin_dst_host. */
         config.bin_dst_esp = strdup(config.bin_dst_host + strlen(boot_root));
 
-        config.shim_dst_host = nc_build_case_correct_path(config.bin_dst_host, SHIM_DST, NULL);
-        config.mm_dst_host = nc_build_case_correct_path(config.bin_dst_host, MM_DST, NULL);
+        config.shim_dst_host = cbm_esp_build_path(config.bin_dst_host, SHIM_DST, NULL);
+        config.mm_dst_host = cbm_esp_build_path(config.bin_dst_host, MM_DST, NULL);
         config.systemd_dst_host =
-            nc_build_case_correct_path(config.bin_dst_host, SYSTEMD_DST, NULL);
+            cbm_esp_build_path(config.bin_dst_host, SYSTEMD_DST, NULL);
 
         /* extract case-corrected ESP-absolute path. needed for the boot record
          * (EFI BootXXXX variable). */
         config.shim_dst_esp = strdup(config.shim_dst_host + strlen(boot_root));
+        config.esp_root = strdup(boot_root);
 
-        config.efi_fallback_dir = nc_build_case_correct_path(boot_root, ESP_EFI, ESP_BOOT, NULL);
+        config.efi_fallback_dir = cbm_esp_build_path(boot_root, ESP_EFI, ESP_BOOT, NULL);
         config.efi_fallback_dst_host =
-            nc_build_case_correct_path(config.efi_fallback_dir, EFI_FALLBACK, NULL);
+            cbm_esp_build_path(config.efi_fallback_dir, EFI_FALLBACK, NULL);
 
-        config.fb_dst_host = nc_build_case_correct_path(config.efi_fallback_dir, FB_DST, NULL);
+        config.fb_dst_host = cbm_esp_build_path(config.efi_fallback_dir, FB_DST, NULL);
 
         config.vendor_mok = string_printf("%s/%s", prefix, VENDOR_MOK);
-        config.mok_dst = nc_build_case_correct_path(boot_root, MOK_DST, NULL);
+        config.mok_dst = cbm_esp_build_path(boot_root, MOK_DST, NULL);
 
         config.bootcsv_src = string_printf("%s/%s", prefix, BOOTCSV_SRC);
-        config.bootcsv_dst_host = nc_build_case_correct_path(config.bin_dst_host, BOOTCSV_DST, NULL);
+        config.bootcsv_dst_host = cbm_esp_build_path(config.bin_dst_host, BOOTCSV_DST, NULL);
 
         return true;
 }
@@ -466,6 +507,7 @@ static void shim_systemd_destroy(const BootManager *manager)
         free(config.fb_dst_host);
         free(config.systemd_dst_host);
         free(config.shim_dst_esp);
+        free(config.esp_root);
         free(config.efi_fallback_dir);
         free(config.efi_fallback_dst_host);
         free(config.bin_dst_host);
@@ -475,7 +517,7 @@ static void shim_systemd_destroy(const BootManager *manager)
         free(config.mok_dst);
         free(config.bootcsv_src);
         free(config.bootcsv_dst_host);
-        if (!config.is_image_mode && boot_manager_is_update_efi_vars((BootManager *)manager)) {
+        if (!config.is_image_mode) {
                 bootvar_destroy();
         }
         sd_class_destroy(manager);
@@ -98,11 +98,11 @@ bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel
 {
         autofree(char) *config_path = NULL;
         const CbmDeviceProbe *root_dev = NULL;
-        autofree(char) *old_conf = NULL;
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
         NcHashmapIter iter = { 0 };
         char *initrd_name = NULL;
         char *ucode_initrd = NULL;
+        const char *bundle = NULL;
         const char *vc_keymap = NULL;
         const char *vc_font = NULL;
         int timeout;
@@ -150,30 +150,40 @@ bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel
                 cbm_writer_append_printf(writer, "LABEL %s\n", k->target.legacy_path);
                 cbm_writer_append_printf(writer, "  KERNEL %s\n", k->target.legacy_path);
 
-                /* Early microcode loading initrd must be the first entry */
-                ucode_initrd = boot_manager_get_ucode_initrd(manager);
-                if (ucode_initrd) {
+                /* Everything is merged into a single file */
+                bundle = boot_manager_get_initrd_bundle(manager, k);
+                if (bundle) {
                         char *tmp = initrd_paths;
-                        initrd_paths = string_printf("%s,%s", initrd_paths, ucode_initrd);
+                        initrd_paths = string_printf(",%s", bundle);
                         free(tmp);
-                }
+                } else {
+                        /* Early microcode loading initrd must be the first entry */
+                        ucode_initrd = boot_manager_get_ucode_initrd(manager);
+                        if (ucode_initrd) {
+                                char *tmp = initrd_paths;
+                                initrd_paths = string_printf("%s,%s", initrd_paths, ucode_initrd);
+                                free(tmp);
+                        }
 
-                /* Add the initrd if we found one */
-                if (k->target.initrd_path) {
-                        char *tmp = initrd_paths;
-                        initrd_paths = string_printf("%s,%s", initrd_paths, k->target.initrd_path);
-                        free(tmp);
-                }
-                boot_manager_initrd_iterator_init(manager, &iter);
-                while (boot_manager_initrd_iterator_next(&iter, &initrd_name)) {
-                        char *tmp = initrd_paths;
-                        if (streq(initrd_name, ucode_initrd)) {
-                                /* This is the ucode early update initrd we already
-                                 * wrote above */
-                                continue;
+                        /* Add the initrd if we found one */
+                        if (k->target.initrd_path) {
+                                char *tmp = initrd_paths;
+                                initrd_paths = string_printf("%s,%s",
+                                                             initrd_paths,
+                                                             k->target.initrd_path);
+                                free(tmp);
+                        }
+                        boot_manager_initrd_iterator_init(manager, &iter);
+                        while (boot_manager_initrd_iterator_next(&iter, &initrd_name)) {
+                                char *tmp = initrd_paths;
+                                if (streq(initrd_name, ucode_initrd)) {
+                                        /* This is the ucode early update initrd we already
+                                         * wrote above */
+                                        continue;
+                                }
+                                initrd_paths = string_printf("%s,%s", initrd_paths, initrd_name);
+                                free(tmp);
                         }
-                        initrd_paths = string_printf("%s,%s", initrd_paths, initrd_name);
-                        free(tmp);
                 }
 
                 if (strlen(initrd_paths)) {
@@ -217,10 +227,8 @@ bool syslinux_common_set_default_kernel(const BootManager *manager, const Kernel
         }
 
         /* If the file is the same, don't write it again or sync */
-        if (cbm_file_has_content(config_path) && file_get_text(config_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
-                }
+        if (cbm_writer_matches_file(writer, config_path)) {
+                return true;
         }
 
         if (!file_set_text(config_path, writer->buffer)) {
@@ -316,7 +324,7 @@ bool syslinux_common_init(const BootManager *manager, command_writer writer)
         boot_device = get_legacy_boot_device((char *)prefix);
 
         if (!boot_device) {
-                boot_device = get_boot_device();
+                boot_device = get_boot_device(prefix);
         }
 
         CHECK_ERR_RET_VAL(!boot_device, false, "No boot partition found, you need to "
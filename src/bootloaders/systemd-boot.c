@@ -37,7 +37,10 @@ __cbm_export__ const BootLoader
                           .update = sd_class_update,
                           .remove = sd_class_remove,
                           .destroy = sd_class_destroy,
-                          .get_capabilities = sd_class_get_capabilities };
+                          .get_capabilities = sd_class_get_capabilities,
+                          .reconcile_kernels = sd_class_reconcile_kernels,
+                          .get_versions = sd_class_get_versions,
+                          .get_efi_path = sd_class_get_efi_path };
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
@@ -12,6 +12,8 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -21,9 +23,11 @@
 #include "bootloader.h"
 #include "bootman.h"
 #include "config.h"
+#include "esp-index.h"
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "pe.h"
 #include "systemd-class.h"
 #include "util.h"
 #include "writer.h"
@@ -42,6 +46,8 @@ typedef struct SdClassConfig {
         char *loader_config;
         char *kernel_dir;
         char *kernel_dir_esp;
+        char *uki_dir;
+        char *uki_stub;
 } SdClassConfig;
 
 static SdClassConfig sd_class_config = { 0 };
@@ -83,15 +89,18 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
         OOM_CHECK_RET(base_path, false);
         sd_class_config.base_path = base_path;
 
-        efi_dir = nc_build_case_correct_path(base_path, "EFI", "Boot", NULL);
+        /* Every path below is resolved against one walk of the ESP */
+        cbm_esp_index_load(base_path);
+
+        efi_dir = cbm_esp_build_path(base_path, "EFI", "Boot", NULL);
         OOM_CHECK_RET(efi_dir, false);
         sd_class_config.efi_dir = efi_dir;
 
-        vendor_dir = nc_build_case_correct_path(base_path, "EFI", sd_config->vendor_dir, NULL);
+        vendor_dir = cbm_esp_build_path(base_path, "EFI", sd_config->vendor_dir, NULL);
         OOM_CHECK_RET(vendor_dir, false);
         sd_class_config.vendor_dir = vendor_dir;
 
-        entries_dir = nc_build_case_correct_path(base_path, "loader", "entries", NULL);
+        entries_dir = cbm_esp_build_path(base_path, "loader", "entries", NULL);
         OOM_CHECK_RET(entries_dir, false);
         sd_class_config.entries_dir = entries_dir;
 
@@ -102,7 +111,7 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
             string_printf("%s/%s/%s", prefix, sd_config->efi_dir, sd_config->efi_blob);
         sd_class_config.efi_blob_source = efi_blob_source;
 
-        efi_blob_dest = nc_build_case_correct_path(sd_class_config.base_path,
+        efi_blob_dest = cbm_esp_build_path(sd_class_config.base_path,
                                                    "EFI",
                                                    sd_config->vendor_dir,
                                                    sd_config->efi_blob,
@@ -111,7 +120,7 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
         sd_class_config.efi_blob_dest = efi_blob_dest;
 
         /* default EFI loader path */
-        default_path_efi_blob = nc_build_case_correct_path(sd_class_config.base_path,
+        default_path_efi_blob = cbm_esp_build_path(sd_class_config.base_path,
                                                            "EFI",
                                                            "Boot",
                                                            DEFAULT_EFI_BLOB,
@@ -121,14 +130,21 @@ bool sd_class_init(const BootManager *manager, BootLoaderConfig *config)
 
         /* Loader entry */
         loader_config =
-            nc_build_case_correct_path(sd_class_config.base_path, "loader", "loader.conf", NULL);
+            cbm_esp_build_path(sd_class_config.base_path, "loader", "loader.conf", NULL);
         OOM_CHECK_RET(loader_config, false);
         sd_class_config.loader_config = loader_config;
 
-        sd_class_config.kernel_dir = nc_build_case_correct_path(sd_class_config.base_path,
+        sd_class_config.kernel_dir = cbm_esp_build_path(sd_class_config.base_path,
                                                                 "EFI", KERNEL_NAMESPACE, NULL);
         sd_class_config.kernel_dir_esp = strdup(sd_class_config.kernel_dir + strlen(sd_class_config.base_path));
 
+        /* Unified Kernel Images, picked up by the loader without an entry */
+        sd_class_config.uki_dir = cbm_esp_build_path(sd_class_config.base_path,
+                                                             "EFI", "Linux", NULL);
+        OOM_CHECK_RET(sd_class_config.uki_dir, false);
+        sd_class_config.uki_stub =
+            string_printf("%s/%s/%s", prefix, sd_config->efi_dir, SYSTEMD_UKI_STUB);
+
         return true;
 }
 
@@ -154,6 +170,43 @@ void sd_class_destroy(__cbm_unused__ const BootManager *manager)
         FREE_IF_SET(sd_class_config.loader_config);
         FREE_IF_SET(sd_class_config.kernel_dir);
         FREE_IF_SET(sd_class_config.kernel_dir_esp);
+        FREE_IF_SET(sd_class_config.uki_dir);
+        FREE_IF_SET(sd_class_config.uki_stub);
+        cbm_esp_index_reset();
+}
+
+/* i.e. Clear-linux-native-4.1.6-113.conf */
+static char *get_entry_name_for_kernel(BootManager *manager, const Kernel *kernel)
+{
+        return string_printf("%s-%s-%s-%d.conf",
+                             boot_manager_get_vendor_prefix(manager),
+                             kernel->meta.ktype,
+                             kernel->meta.version,
+                             kernel->meta.release);
+}
+
+/* i.e. Clear-linux-native-4.1.6-113.efi */
+static char *get_uki_name_for_kernel(BootManager *manager, const Kernel *kernel)
+{
+        return string_printf("%s-%s-%s-%d.efi",
+                             boot_manager_get_vendor_prefix(manager),
+                             kernel->meta.ktype,
+                             kernel->meta.version,
+                             kernel->meta.release);
+}
+
+/* i.e. $prefix/$boot/EFI/Linux/Clear-linux-native-4.1.6-113.efi */
+static char *get_uki_path_for_kernel(BootManager *manager, const Kernel *kernel)
+{
+        autofree(char) *item_name = NULL;
+
+        item_name = get_uki_name_for_kernel(manager, kernel);
+
+        return cbm_esp_build_path(sd_class_config.base_path,
+                                          "EFI",
+                                          "Linux",
+                                          item_name,
+                                          NULL);
 }
 
 /* i.e. $prefix/$boot/loader/entries/Clear-linux-native-4.1.6-113.conf */
@@ -163,17 +216,10 @@ static char *get_entry_path_for_kernel(BootManager *manager, const Kernel *kerne
                 return NULL;
         }
         autofree(char) *item_name = NULL;
-        const char *prefix = NULL;
-
-        prefix = boot_manager_get_vendor_prefix(manager);
 
-        item_name = string_printf("%s-%s-%s-%d.conf",
-                                  prefix,
-                                  kernel->meta.ktype,
-                                  kernel->meta.version,
-                                  kernel->meta.release);
+        item_name = get_entry_name_for_kernel(manager, kernel);
 
-        return nc_build_case_correct_path(sd_class_config.base_path,
+        return cbm_esp_build_path(sd_class_config.base_path,
                                           "loader",
                                           "entries",
                                           item_name,
@@ -182,25 +228,25 @@ static char *get_entry_path_for_kernel(BootManager *manager, const Kernel *kerne
 
 static bool sd_class_ensure_dirs(void)
 {
-        if (!nc_mkdir_p(sd_class_config.efi_dir, 00755)) {
+        if (!cbm_mkdir_p(sd_class_config.efi_dir, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.efi_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.vendor_dir, 00755)) {
+        if (!cbm_mkdir_p(sd_class_config.vendor_dir, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.vendor_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.kernel_dir, 00755)) {
+        if (!cbm_mkdir_p(sd_class_config.kernel_dir, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.kernel_dir, strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (!nc_mkdir_p(sd_class_config.entries_dir, 00755)) {
+        if (!cbm_mkdir_p(sd_class_config.entries_dir, 00755)) {
                 LOG_FATAL("Failed to create %s: %s", sd_class_config.entries_dir, strerror(errno));
                 return false;
         }
@@ -219,10 +265,11 @@ bool _append_extra_initrds(const BootManager *manager, CbmWriter *writer, const
                 for(size_t i = 0; i < files.gl_pathc; i++) {
                         LOG_DEBUG("adding extra initrd to bootloader: %s", basename(files.gl_pathv[i]));
 
-                        cbm_writer_append_printf(writer,
-                                                 "initrd %s/%s\n",
-                                                 get_kernel_destination_impl(manager),
-                                                 basename(files.gl_pathv[i]));
+                        cbm_writer_append(writer, "initrd ");
+                        cbm_writer_append_path(writer,
+                                               get_kernel_destination_impl(manager),
+                                               basename(files.gl_pathv[i]));
+                        cbm_writer_append(writer, "\n");
                 }
         }
 
@@ -230,62 +277,127 @@ bool _append_extra_initrds(const BootManager *manager, CbmWriter *writer, const
         return ret;
 }
 
-bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
+/**
+ * Append the kernel command line for @kernel, root options first
+ */
+static void sd_class_append_options(const BootManager *manager, const Kernel *kernel,
+                                    const CbmDeviceProbe *root_dev, CbmWriter *writer)
 {
-        if (!manager || !kernel) {
-                return false;
+        const char *vc_keymap = boot_manager_get_vconsole((BootManager *)manager, "KEYMAP");
+        const char *vc_font = boot_manager_get_vconsole((BootManager *)manager, "FONT");
+
+        /* Add the root= section */
+        if (root_dev->part_uuid) {
+                cbm_writer_append(writer, "root=PARTUUID=");
+                cbm_writer_append(writer, root_dev->part_uuid);
+                cbm_writer_append(writer, " ");
+        } else {
+                cbm_writer_append(writer, "root=UUID=");
+                cbm_writer_append(writer, root_dev->uuid);
+                cbm_writer_append(writer, " ");
         }
-        autofree(char) *conf_path = NULL;
-        const CbmDeviceProbe *root_dev = NULL;
-        const char *os_name = NULL;
-        const char *vc_keymap = NULL;
-        const char *vc_font = NULL;
-        autofree(char) *old_conf = NULL;
-        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        /* Add LUKS information if relevant */
+        if (root_dev->luks_uuid) {
+                cbm_writer_append(writer, "rd.luks.uuid=");
+                cbm_writer_append(writer, root_dev->luks_uuid);
+                cbm_writer_append(writer, " ");
+        }
+        /* Add Btrfs information if relevant */
+        if (root_dev->btrfs_sub) {
+                cbm_writer_append(writer, "rootflags=subvol=");
+                cbm_writer_append(writer, root_dev->btrfs_sub);
+                cbm_writer_append(writer, " ");
+        }
+        /* Add VC settings if configured */
+        if (vc_keymap) {
+                cbm_writer_append(writer, "rd.vconsole.keymap=");
+                cbm_writer_append(writer, vc_keymap);
+                cbm_writer_append(writer, " ");
+        }
+        if (vc_font) {
+                cbm_writer_append(writer, "rd.vconsole.font=");
+                cbm_writer_append(writer, vc_font);
+                cbm_writer_append(writer, " ");
+        }
+
+        /* Finish it off with the command line options */
+        cbm_writer_append(writer, kernel->meta.cmdline);
+}
+
+/**
+ * Append initrd lines for @kernel that reference the shared content addressed
+ * blobs, with only the kernel's own initrd as a separate file
+ */
+static bool sd_class_append_initrd_blobs(const BootManager *manager, const Kernel *kernel,
+                                         const char *kernel_dest, CbmWriter *writer)
+{
+        const char *own_initrd = NULL;
+        NcArray *sources = NULL;
+        bool ret = true;
+
+        own_initrd = kernel->source.user_initrd_file ? kernel->source.user_initrd_file
+                                                     : kernel->source.initrd_file;
+
+        sources = boot_manager_get_initrd_sources(manager, kernel);
+        for (uint16_t i = 0; i < sources->len; i++) {
+                const char *source = nc_array_get(sources, i);
+                const char *name = NULL;
+
+                if (own_initrd && streq(source, own_initrd)) {
+                        name = kernel->target.initrd_path;
+                } else {
+                        name = boot_manager_get_initrd_blob(manager, source);
+                }
+                if (!name) {
+                        ret = false;
+                        break;
+                }
+                cbm_writer_append(writer, "initrd ");
+                cbm_writer_append_path(writer, kernel_dest, name);
+                cbm_writer_append(writer, "\n");
+        }
+        nc_array_free(&sources, free);
+
+        return ret;
+}
+
+/**
+ * Append an initrd line for each initrd of @kernel, in load order
+ */
+static bool sd_class_append_initrds(const BootManager *manager, const Kernel *kernel,
+                                    const char *kernel_dest, CbmWriter *writer)
+{
         NcHashmapIter iter = { 0 };
+        const char *bundle = NULL;
         char *initrd_name = NULL;
         char *ucode_initrd = NULL;
 
-        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
-
-        if (!cbm_writer_open(writer)) {
-                DECLARE_OOM();
-                abort();
+        /* Everything is merged into a single file */
+        bundle = boot_manager_get_initrd_bundle(manager, kernel);
+        if (bundle) {
+                cbm_writer_append(writer, "initrd ");
+                cbm_writer_append_path(writer, kernel_dest, bundle);
+                cbm_writer_append(writer, "\n");
+                return true;
         }
 
-        /* Build the options for the entry */
-        root_dev = boot_manager_get_root_device((BootManager *)manager);
-        if (!root_dev) {
-                LOG_FATAL("Root device unknown, this should never happen! %s", kernel->source.path);
-                return false;
+        if (boot_manager_use_initrd_blobs(manager)) {
+                return sd_class_append_initrd_blobs(manager, kernel, kernel_dest, writer);
         }
 
-        os_name = boot_manager_get_os_name((BootManager *)manager);
-        vc_keymap = boot_manager_get_vconsole((BootManager *)manager, "KEYMAP");
-        vc_font = boot_manager_get_vconsole((BootManager *)manager, "FONT");
-
-        /* Standard title + linux lines */
-        cbm_writer_append_printf(writer, "title %s\n", os_name);
-        cbm_writer_append_printf(writer,
-                                 "linux %s/%s\n",
-                                 get_kernel_destination_impl(manager),
-                                 kernel->target.path);
-
         /* Early microcode loading initrd must be the first entry */
         ucode_initrd = boot_manager_get_ucode_initrd(manager);
         if (ucode_initrd) {
-                cbm_writer_append_printf(writer,
-                                         "initrd %s/%s\n",
-                                         get_kernel_destination_impl(manager),
-                                         ucode_initrd);
+                cbm_writer_append(writer, "initrd ");
+                cbm_writer_append_path(writer, kernel_dest, ucode_initrd);
+                cbm_writer_append(writer, "\n");
         }
 
         /* Optional initrd */
         if (kernel->target.initrd_path) {
-                cbm_writer_append_printf(writer,
-                                         "initrd %s/%s\n",
-                                         get_kernel_destination_impl(manager),
-                                         kernel->target.initrd_path);
+                cbm_writer_append(writer, "initrd ");
+                cbm_writer_append_path(writer, kernel_dest, kernel->target.initrd_path);
+                cbm_writer_append(writer, "\n");
         }
 
         /* Extra initrds */
@@ -298,36 +410,54 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
                          * wrote above */
                         continue;
                 }
-                cbm_writer_append_printf(writer,
-                                         "initrd %s/%s\n",
-                                         get_kernel_destination_impl(manager),
-                                         initrd_name);
+                cbm_writer_append(writer, "initrd ");
+                cbm_writer_append_path(writer, kernel_dest, initrd_name);
+                cbm_writer_append(writer, "\n");
         }
 
-        /* Add the root= section */
-        if (root_dev->part_uuid) {
-                cbm_writer_append_printf(writer, "options root=PARTUUID=%s ", root_dev->part_uuid);
-        } else {
-                cbm_writer_append_printf(writer, "options root=UUID=%s ", root_dev->uuid);
-        }
-        /* Add LUKS information if relevant */
-        if (root_dev->luks_uuid) {
-                cbm_writer_append_printf(writer, "rd.luks.uuid=%s ", root_dev->luks_uuid);
-        }
-        /* Add Btrfs information if relevant */
-        if (root_dev->btrfs_sub) {
-                cbm_writer_append_printf(writer, "rootflags=subvol=%s ", root_dev->btrfs_sub);
+        return true;
+}
+
+/**
+ * Build the loader entry for @kernel into @writer, which is closed on return
+ */
+static bool sd_class_build_entry(const BootManager *manager, const Kernel *kernel,
+                                 CbmWriter *writer)
+{
+        const CbmDeviceProbe *root_dev = NULL;
+        const char *os_name = NULL;
+        const char *kernel_dest = NULL;
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
         }
-        /* Add VC settings if configured */
-        if (vc_keymap) {
-                cbm_writer_append_printf(writer, "rd.vconsole.keymap=%s ", vc_keymap);
+
+        /* Build the options for the entry */
+        root_dev = boot_manager_get_root_device((BootManager *)manager);
+        if (!root_dev) {
+                LOG_FATAL("Root device unknown, this should never happen! %s", kernel->source.path);
+                return false;
         }
-        if (vc_font) {
-                cbm_writer_append_printf(writer, "rd.vconsole.font=%s ", vc_font);
+
+        os_name = boot_manager_get_os_name((BootManager *)manager);
+        kernel_dest = get_kernel_destination_impl(manager);
+
+        /* Standard title + linux lines */
+        cbm_writer_append(writer, "title ");
+        cbm_writer_append(writer, os_name);
+        cbm_writer_append(writer, "\nlinux ");
+        cbm_writer_append_path(writer, kernel_dest, kernel->target.path);
+        cbm_writer_append(writer, "\n");
+
+        if (!sd_class_append_initrds(manager, kernel, kernel_dest, writer)) {
+                LOG_FATAL("Cannot determine the initrds of %s", kernel->source.path);
+                return false;
         }
 
-        /* Finish it off with the command line options */
-        cbm_writer_append_printf(writer, "%s\n", kernel->meta.cmdline);
+        cbm_writer_append(writer, "options ");
+        sd_class_append_options(manager, kernel, root_dev, writer);
+        cbm_writer_append(writer, "\n");
         cbm_writer_close(writer);
 
         if (cbm_writer_error(writer) != 0) {
@@ -335,12 +465,250 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
                 abort();
         }
 
-        /* If our new config matches the old config, just return. */
-        if (file_get_text(conf_path, &old_conf)) {
-                if (streq(old_conf, writer->buffer)) {
-                        return true;
+        return true;
+}
+
+/* Section recording the inputs a UKI was assembled from */
+#define UKI_STAMP_SECTION ".cbmsrc"
+
+/**
+ * Record the identity of @path in @stamp, without reading its contents
+ */
+static void sd_class_stamp_file(CbmWriter *stamp, const char *path)
+{
+        struct stat st = { 0 };
+
+        if (stat(path, &st) != 0) {
+                cbm_writer_append_printf(stamp, "%s missing\n", path);
+                return;
+        }
+        cbm_writer_append_printf(stamp,
+                                 "%s %lld %lld.%09ld\n",
+                                 path,
+                                 (long long)st.st_size,
+                                 (long long)st.st_mtim.tv_sec,
+                                 st.st_mtim.tv_nsec);
+}
+
+/**
+ * Assemble the Unified Kernel Image for @kernel at @uki_path. The image is
+ * only rebuilt when one of its inputs changed since it was last written.
+ *
+ * @param changed Set to true if the image was (re)written
+ */
+static bool sd_class_write_uki(const BootManager *manager, const Kernel *kernel,
+                               const char *uki_path, bool *changed)
+{
+        autofree(CbmWriter) *cmdline = CBM_WRITER_INIT;
+        autofree(CbmWriter) *stamp = CBM_WRITER_INIT;
+        autofree(char) *osrel = NULL;
+        autofree(char) *uname = NULL;
+        autofree(char) *old_stamp = NULL;
+        autofree(char) *tmp_name = NULL;
+        const CbmDeviceProbe *root_dev = NULL;
+        const CbmDir *boot = NULL;
+        const char *uki_name = NULL;
+        const char *prefix = NULL;
+        const char **initrd_files = NULL;
+        const char *linux_files[] = { kernel->source.path, NULL };
+        static const char *osrel_files[] = { "etc/os-release", "usr/lib/os-release" };
+        NcArray *initrds = NULL;
+        CbmPeSection sections[6];
+        size_t n_sections = 0;
+        size_t old_len = 0;
+        bool ret = false;
+
+        root_dev = boot_manager_get_root_device((BootManager *)manager);
+        if (!root_dev) {
+                LOG_FATAL("Root device unknown, this should never happen! %s", kernel->source.path);
+                return false;
+        }
+
+        if (!cbm_writer_open(cmdline) || !cbm_writer_open(stamp)) {
+                DECLARE_OOM();
+                abort();
+        }
+        sd_class_append_options(manager, kernel, root_dev, cmdline);
+        cbm_writer_close(cmdline);
+
+        /* Same lookup order as cbm_os_release_new_for_root */
+        prefix = boot_manager_get_prefix((BootManager *)manager);
+        for (size_t i = 0; i < ARRAY_SIZE(osrel_files) && !osrel; i++) {
+                autofree(char) *path = NULL;
+
+                path = string_printf("%s/%s", prefix, osrel_files[i]);
+                if (nc_file_exists(path) && !file_get_text(path, &osrel)) {
+                        osrel = NULL;
                 }
         }
+        uname = string_printf("%s-%d.%s",
+                              kernel->meta.version,
+                              kernel->meta.release,
+                              kernel->meta.ktype);
+
+        initrds = boot_manager_get_initrd_sources(manager, kernel);
+        initrd_files = calloc((size_t)initrds->len + 1, sizeof(char *));
+        OOM_CHECK(initrd_files);
+
+        /* Everything that goes into the image, cheap to compute and compare */
+        sd_class_stamp_file(stamp, sd_class_config.uki_stub);
+        sd_class_stamp_file(stamp, kernel->source.path);
+        for (uint16_t i = 0; i < initrds->len; i++) {
+                initrd_files[i] = boot_manager_transcode_initrd(manager, nc_array_get(initrds, i));
+                sd_class_stamp_file(stamp, initrd_files[i]);
+        }
+        cbm_writer_append(stamp, "uname ");
+        cbm_writer_append(stamp, uname);
+        cbm_writer_append(stamp, "\ncmdline ");
+        cbm_writer_append(stamp, cmdline->buffer);
+        cbm_writer_append(stamp, "\nosrel\n");
+        cbm_writer_append(stamp, osrel);
+        cbm_writer_close(stamp);
+
+        if (cbm_writer_error(cmdline) != 0 || cbm_writer_error(stamp) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        old_stamp = cbm_pe_read_section(uki_path, UKI_STAMP_SECTION, &old_len);
+        if (old_stamp && old_len == stamp->buffer_n &&
+            memcmp(old_stamp, stamp->buffer, old_len) == 0) {
+                LOG_DEBUG("Unified kernel image is up to date: %s", uki_path);
+                ret = true;
+                goto end;
+        }
+
+        /* Small sections first, the loader wants .linux last */
+        if (osrel) {
+                sections[n_sections++] = (CbmPeSection){ .name = ".osrel",
+                                                         .data = osrel,
+                                                         .len = strlen(osrel) };
+        }
+        sections[n_sections++] = (CbmPeSection){ .name = ".cmdline",
+                                                 .data = cmdline->buffer,
+                                                 .len = cmdline->buffer_n };
+        sections[n_sections++] = (CbmPeSection){ .name = ".uname",
+                                                 .data = uname,
+                                                 .len = strlen(uname) };
+        sections[n_sections++] = (CbmPeSection){ .name = UKI_STAMP_SECTION,
+                                                 .data = stamp->buffer,
+                                                 .len = stamp->buffer_n };
+        if (initrds->len > 0) {
+                sections[n_sections++] = (CbmPeSection){ .name = ".initrd",
+                                                         .files = initrd_files,
+                                                         .align = CBM_INITRD_ALIGN };
+        }
+        sections[n_sections++] = (CbmPeSection){ .name = ".linux", .files = linux_files };
+
+        /* Written beneath the boot directory handle, like the kernels */
+        boot = boot_manager_get_boot_handle((BootManager *)manager);
+        if (!boot) {
+                LOG_FATAL("Cannot open %s: %s", sd_class_config.base_path, strerror(errno));
+                goto end;
+        }
+        uki_name = uki_path + strlen(sd_class_config.base_path);
+        tmp_name = string_printf("%s.TmpWrite", uki_name);
+        if (!cbm_pe_write_image(sd_class_config.uki_stub, sections, n_sections, boot, tmp_name)) {
+                LOG_FATAL("Failed to assemble unified kernel image %s", uki_path);
+                goto end;
+        }
+        if (!cbm_dir_rename(boot, tmp_name, uki_name)) {
+                LOG_FATAL("Failed to install %s: %s", uki_path, strerror(errno));
+                (void)cbm_dir_unlink(boot, tmp_name);
+                goto end;
+        }
+
+        LOG_INFO("Assembled unified kernel image %s", uki_path);
+        *changed = true;
+        ret = true;
+
+end:
+        free(initrd_files);
+        nc_array_free(&initrds, free);
+        return ret;
+}
+
+/**
+ * Remove @path if it exists, non-fatally
+ *
+ * @return true if the file was removed
+ */
+static bool sd_class_remove_file(const char *path)
+{
+        if (!path || !cbm_esp_exists(path)) {
+                return false;
+        }
+        if (!cbm_unlink(path)) {
+                LOG_ERROR("Failed to remove %s: %s", path, strerror(errno));
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Install @kernel as a Unified Kernel Image, replacing its loader entry
+ */
+static bool sd_class_install_uki(const BootManager *manager, const Kernel *kernel)
+{
+        autofree(char) *uki_path = NULL;
+        autofree(char) *conf_path = NULL;
+        const CbmDir *boot = NULL;
+        bool changed = false;
+
+        boot = boot_manager_get_boot_handle((BootManager *)manager);
+        if (!boot || !cbm_dir_mkdir_p(boot,
+                                      sd_class_config.uki_dir + strlen(sd_class_config.base_path),
+                                      00755)) {
+                LOG_FATAL("Failed to create %s: %s", sd_class_config.uki_dir, strerror(errno));
+                return false;
+        }
+
+        uki_path = get_uki_path_for_kernel((BootManager *)manager, kernel);
+        if (!sd_class_write_uki(manager, kernel, uki_path, &changed)) {
+                return false;
+        }
+
+        /* The loader would otherwise list the kernel twice */
+        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
+        if (sd_class_remove_file(conf_path)) {
+                changed = true;
+        }
+
+        if (changed) {
+                cbm_sync();
+        }
+        return true;
+}
+
+bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel)
+{
+        if (!manager || !kernel) {
+                return false;
+        }
+        autofree(char) *conf_path = NULL;
+        autofree(char) *uki_path = NULL;
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+        if (boot_manager_use_uki(manager)) {
+                return sd_class_install_uki(manager, kernel);
+        }
+
+        conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
+
+        if (!sd_class_build_entry(manager, kernel, writer)) {
+                return false;
+        }
+
+        /* Drop the image from a previous run in UKI mode */
+        uki_path = get_uki_path_for_kernel((BootManager *)manager, kernel);
+        if (sd_class_remove_file(uki_path)) {
+                cbm_sync();
+        }
+
+        /* If our new config matches the old config, just return. */
+        if (cbm_writer_matches_file(writer, conf_path)) {
+                return true;
+        }
 
         if (!file_set_text(conf_path, writer->buffer)) {
                 LOG_FATAL("Failed to create loader entry for: %s [%s]",
@@ -361,13 +729,22 @@ bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel)
         }
 
         autofree(char) *conf_path = NULL;
+        autofree(char) *uki_path = NULL;
 
         conf_path = get_entry_path_for_kernel((BootManager *)manager, kernel);
         OOM_CHECK_RET(conf_path, false);
 
+        uki_path = get_uki_path_for_kernel((BootManager *)manager, kernel);
+        OOM_CHECK_RET(uki_path, false);
+
+        /* Drop the unified kernel image, if any */
+        if (sd_class_remove_file(uki_path)) {
+                cbm_sync();
+        }
+
         /* We must take a non-fatal approach in a remove operation */
-        if (nc_file_exists(conf_path)) {
-                if (unlink(conf_path) < 0) {
+        if (cbm_esp_exists(conf_path)) {
+                if (!cbm_unlink(conf_path)) {
                         LOG_ERROR("sd_class_remove_kernel: Failed to remove %s: %s",
                                   conf_path,
                                   strerror(errno));
@@ -379,6 +756,228 @@ bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel)
         return true;
 }
 
+/**
+ * Lower-case copy of an entry name, as the ESP is case-insensitive
+ */
+static char *sd_class_entry_key(const char *name)
+{
+        char *key = strdup(name);
+
+        if (!key) {
+                DECLARE_OOM();
+                abort();
+        }
+        for (char *c = key; *c; c++) {
+                *c = (char)tolower((unsigned char)*c);
+        }
+        return key;
+}
+
+/**
+ * Map the lower-cased name of every file in @dir to its on-disk name
+ *
+ * @param create Create @dir if it does not exist yet
+ */
+static bool sd_class_read_dir(const char *dir_path, NcHashmap *map, bool create)
+{
+        struct dirent *ent = NULL;
+        DIR *dir = NULL;
+
+        dir = opendir(dir_path);
+        if (!dir) {
+                if (errno == ENOENT && (!create || cbm_mkdir_p(dir_path, 00755))) {
+                        return true;
+                }
+                LOG_FATAL("Failed to open %s: %s", dir_path, strerror(errno));
+                return false;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+                if (!nc_hashmap_put(map, sd_class_entry_key(ent->d_name), strdup(ent->d_name))) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+        closedir(dir);
+
+        return true;
+}
+
+/**
+ * Remove every file left in @map that lives in our namespace (@ns_key) and
+ * ends with @suffix, as no kernel is behind it anymore
+ *
+ * @return true if anything was removed
+ */
+static bool sd_class_remove_orphans(NcHashmap *map, const char *dir_path, const char *ns_key,
+                                    const char *suffix)
+{
+        NcHashmapIter iter = { 0 };
+        const char *key = NULL;
+        const char *name = NULL;
+        size_t ns_len = strlen(ns_key);
+        size_t suffix_len = strlen(suffix);
+        bool changed = false;
+
+        nc_hashmap_iter_init(map, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&key, (void **)&name)) {
+                autofree(char) *path = NULL;
+                size_t len = strlen(key);
+
+                if (strncmp(key, ns_key, ns_len) != 0 || len < suffix_len ||
+                    !streq(key + len - suffix_len, suffix)) {
+                        continue;
+                }
+
+                path = string_printf("%s/%s", dir_path, name);
+                LOG_INFO("Removing orphaned boot entry: %s", name);
+
+                /* We must take a non-fatal approach in a remove operation */
+                if (!cbm_unlink(path)) {
+                        LOG_ERROR("sd_class_reconcile_kernels: Failed to remove %s: %s",
+                                  path,
+                                  strerror(errno));
+                        continue;
+                }
+                changed = true;
+        }
+
+        return changed;
+}
+
+bool sd_class_reconcile_kernels(const BootManager *manager, const KernelArray *installed,
+                                const KernelArray *known)
+{
+        if (!manager) {
+                return false;
+        }
+
+        autofree(NcHashmap) *existing = NULL;
+        autofree(NcHashmap) *existing_uki = NULL;
+        autofree(char) *ns = NULL;
+        autofree(char) *ns_key = NULL;
+        bool use_uki = boot_manager_use_uki(manager);
+        bool changed = false;
+        bool ret = true;
+
+        /* Map of lower-cased name to on-disk name for every current entry */
+        existing = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        OOM_CHECK_RET(existing, false);
+        existing_uki = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+        OOM_CHECK_RET(existing_uki, false);
+
+        if (!sd_class_read_dir(sd_class_config.entries_dir, existing, true) ||
+            !sd_class_read_dir(sd_class_config.uki_dir, existing_uki, use_uki)) {
+                return false;
+        }
+
+        /* Write out only those entries that differ from what is on disk */
+        for (uint16_t i = 0; installed && i < installed->len; i++) {
+                const Kernel *k = nc_array_get((KernelArray *)installed, i);
+                autofree(char) *item_name = NULL;
+                autofree(char) *item_key = NULL;
+                autofree(char) *uki_name = NULL;
+                autofree(char) *uki_key = NULL;
+                autofree(char) *conf_path = NULL;
+                autofree(char) *uki_path = NULL;
+                autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+                const char *on_disk = NULL;
+                const char *uki_on_disk = NULL;
+
+                item_name = get_entry_name_for_kernel((BootManager *)manager, k);
+                item_key = sd_class_entry_key(item_name);
+                uki_name = get_uki_name_for_kernel((BootManager *)manager, k);
+                uki_key = sd_class_entry_key(uki_name);
+
+                /* Keep the existing spelling rather than creating a case-variant */
+                on_disk = nc_hashmap_get(existing, item_key);
+                conf_path = string_printf("%s/%s",
+                                          sd_class_config.entries_dir,
+                                          on_disk ? on_disk : item_name);
+                uki_on_disk = nc_hashmap_get(existing_uki, uki_key);
+                uki_path = string_printf("%s/%s",
+                                         sd_class_config.uki_dir,
+                                         uki_on_disk ? uki_on_disk : uki_name);
+
+                if (use_uki) {
+                        if (!sd_class_write_uki(manager, k, uki_path, &changed)) {
+                                ret = false;
+                                break;
+                        }
+                        /* The loader would otherwise list the kernel twice */
+                        if (on_disk && sd_class_remove_file(conf_path)) {
+                                changed = true;
+                        }
+                } else {
+                        if (!sd_class_build_entry(manager, k, writer)) {
+                                return false;
+                        }
+                        if (!on_disk || !cbm_writer_matches_file(writer, conf_path)) {
+                                if (!cbm_writer_write_file(writer, conf_path)) {
+                                        LOG_FATAL("Failed to create loader entry for: %s [%s]",
+                                                  k->source.path,
+                                                  strerror(errno));
+                                        ret = false;
+                                        break;
+                                }
+                                changed = true;
+                        }
+                        /* Drop the image from a previous run in UKI mode */
+                        if (uki_on_disk && sd_class_remove_file(uki_path)) {
+                                changed = true;
+                        }
+                }
+                nc_hashmap_remove(existing, item_key);
+                nc_hashmap_remove(existing_uki, uki_key);
+        }
+
+        /* Entries for kernels that still exist are left as they are */
+        for (uint16_t i = 0; known && i < known->len; i++) {
+                const Kernel *k = nc_array_get((KernelArray *)known, i);
+                autofree(char) *item_name = NULL;
+                autofree(char) *item_key = NULL;
+
+                item_name = get_entry_name_for_kernel((BootManager *)manager, k);
+                item_key = sd_class_entry_key(item_name);
+                nc_hashmap_remove(existing, item_key);
+
+                free(item_name);
+                free(item_key);
+                item_name = get_uki_name_for_kernel((BootManager *)manager, k);
+                item_key = sd_class_entry_key(item_name);
+                nc_hashmap_remove(existing_uki, item_key);
+        }
+
+        /* Anything left in our namespace no longer has a kernel behind it */
+        if (ret) {
+                ns = string_printf("%s-", boot_manager_get_vendor_prefix((BootManager *)manager));
+                ns_key = sd_class_entry_key(ns);
+
+                if (sd_class_remove_orphans(existing,
+                                            sd_class_config.entries_dir,
+                                            ns_key,
+                                            ".conf")) {
+                        changed = true;
+                }
+                if (sd_class_remove_orphans(existing_uki,
+                                            sd_class_config.uki_dir,
+                                            ns_key,
+                                            ".efi")) {
+                        changed = true;
+                }
+        }
+
+        /* One barrier for the whole set of changes */
+        if (changed) {
+                cbm_sync();
+        }
+
+        return ret;
+}
+
 bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kernel)
 {
         if (!manager) {
@@ -423,11 +1022,12 @@ bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kerne
                 console_mode_s = string_printf("");
         }
 
-        item_name = string_printf("default %s-%s-%s-%d.conf\n%s%s",
+        item_name = string_printf("default %s-%s-%s-%d.%s\n%s%s",
                                   prefix,
                                   kernel->meta.ktype,
                                   kernel->meta.version,
                                   kernel->meta.release,
+                                  boot_manager_use_uki(manager) ? "efi" : "conf",
                                   timeout_s,
                                   console_mode_s);
 
@@ -594,7 +1194,7 @@ bool sd_class_needs_install(const BootManager *manager)
         for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
                 const char *check_p = paths[i];
 
-                if (!nc_file_exists(check_p)) {
+                if (!cbm_esp_exists(check_p)) {
                         return true;
                 }
         }
@@ -615,7 +1215,7 @@ bool sd_class_needs_update(const BootManager *manager)
         for (size_t i = 0; i < ARRAY_SIZE(paths); i++) {
                 const char *check_p = paths[i];
 
-                if (nc_file_exists(check_p) && !cbm_files_match(source_path, check_p)) {
+                if (cbm_esp_exists(check_p) && !cbm_pe_blobs_match(source_path, check_p)) {
                         return true;
                 }
         }
@@ -623,6 +1223,28 @@ bool sd_class_needs_update(const BootManager *manager)
         return false;
 }
 
+bool sd_class_get_versions(const BootManager *manager, char **installed, char **available)
+{
+        if (!manager || !installed || !available) {
+                return false;
+        }
+
+        *installed = cbm_pe_get_version(sd_class_config.efi_blob_dest);
+        *available = cbm_pe_get_version(sd_class_config.efi_blob_source);
+
+        return true;
+}
+
+const char *sd_class_get_efi_path(__cbm_unused__ const BootManager *manager)
+{
+        size_t base_len = strlen(sd_class_config.base_path);
+
+        if (strncmp(sd_class_config.efi_blob_dest, sd_class_config.base_path, base_len) != 0) {
+                return NULL;
+        }
+        return sd_class_config.efi_blob_dest + base_len;
+}
+
 bool sd_class_install(const BootManager *manager)
 {
         if (!manager) {
@@ -669,7 +1291,7 @@ bool sd_class_update(const BootManager *manager)
                 return false;
         }
 
-        if (!cbm_files_match(sd_class_config.efi_blob_source, sd_class_config.efi_blob_dest)) {
+        if (!cbm_pe_blobs_match(sd_class_config.efi_blob_source, sd_class_config.efi_blob_dest)) {
                 if (!copy_file_atomic(sd_class_config.efi_blob_source,
                                       sd_class_config.efi_blob_dest,
                                       00644)) {
@@ -681,8 +1303,8 @@ bool sd_class_update(const BootManager *manager)
         }
         cbm_sync();
 
-        if (!cbm_files_match(sd_class_config.efi_blob_source,
-                             sd_class_config.default_path_efi_blob)) {
+        if (!cbm_pe_blobs_match(sd_class_config.efi_blob_source,
+                                sd_class_config.default_path_efi_blob)) {
                 if (!copy_file_atomic(sd_class_config.efi_blob_source,
                                       sd_class_config.default_path_efi_blob,
                                       00644)) {
@@ -705,14 +1327,14 @@ bool sd_class_remove(const BootManager *manager)
 
         /* We call multiple syncs in case something goes wrong in removal, where we could be seeing
          * an ESP umount after */
-        if (nc_file_exists(sd_class_config.vendor_dir) && !nc_rm_rf(sd_class_config.vendor_dir)) {
+        if (cbm_esp_exists(sd_class_config.vendor_dir) && !cbm_rm_rf(sd_class_config.vendor_dir)) {
                 LOG_FATAL("Failed to remove vendor dir: %s", strerror(errno));
                 return false;
         }
         cbm_sync();
 
-        if (nc_file_exists(sd_class_config.default_path_efi_blob) &&
-            unlink(sd_class_config.default_path_efi_blob) < 0) {
+        if (cbm_esp_exists(sd_class_config.default_path_efi_blob) &&
+            !cbm_unlink(sd_class_config.default_path_efi_blob)) {
                 LOG_FATAL("Failed to remove %s: %s",
                           sd_class_config.default_path_efi_blob,
                           strerror(errno));
@@ -720,8 +1342,8 @@ bool sd_class_remove(const BootManager *manager)
         }
         cbm_sync();
 
-        if (nc_file_exists(sd_class_config.loader_config) &&
-            unlink(sd_class_config.loader_config) < 0) {
+        if (cbm_esp_exists(sd_class_config.loader_config) &&
+            !cbm_unlink(sd_class_config.loader_config)) {
                 LOG_FATAL("Failed to remove %s: %s",
                           sd_class_config.loader_config,
                           strerror(errno));
@@ -735,7 +1357,13 @@ bool sd_class_remove(const BootManager *manager)
 int sd_class_get_capabilities(__cbm_unused__ const BootManager *manager)
 {
         /* Very trivial bootloader, we support UEFI/GPT only */
-        return BOOTLOADER_CAP_GPT | BOOTLOADER_CAP_UEFI | BOOTLOADER_CAP_FATFS;
+        int caps = BOOTLOADER_CAP_GPT | BOOTLOADER_CAP_UEFI | BOOTLOADER_CAP_FATFS;
+
+        /* Unified Kernel Images need the EFI stub to be installed */
+        if (sd_class_config.uki_stub && nc_file_exists(sd_class_config.uki_stub)) {
+                caps |= BOOTLOADER_CAP_UKI;
+        }
+        return caps;
 }
 
 /*
@@ -22,6 +22,9 @@
 #define SYSTEMD_EFI_SUFFIX "ia32.efi"
 #endif
 
+/* EFI stub used to assemble Unified Kernel Images */
+#define SYSTEMD_UKI_STUB "linux" SYSTEMD_EFI_SUFFIX ".stub"
+
 typedef struct BootLoaderConfig {
         const char *vendor_dir;
         const char *efi_dir;
@@ -35,6 +38,9 @@ bool sd_class_install_kernel(const BootManager *manager, const Kernel *kernel);
 
 bool sd_class_remove_kernel(const BootManager *manager, const Kernel *kernel);
 
+bool sd_class_reconcile_kernels(const BootManager *manager, const KernelArray *installed,
+                                const KernelArray *known);
+
 bool sd_class_set_default_kernel(const BootManager *manager, const Kernel *kernel);
 
 char *sd_class_get_default_kernel(const BootManager *manager);
@@ -43,6 +49,10 @@ bool sd_class_needs_install(const BootManager *manager);
 
 bool sd_class_needs_update(const BootManager *manager);
 
+bool sd_class_get_versions(const BootManager *manager, char **installed, char **available);
+
+const char *sd_class_get_efi_path(const BootManager *manager);
+
 bool sd_class_install(const BootManager *manager);
 
 bool sd_class_update(const BootManager *manager);
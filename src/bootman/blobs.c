@@ -0,0 +1,369 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "digest.h"
+#include "esp-index.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "stats.h"
+
+/**
+ * Absolute path of the blobs directory on the ESP
+ */
+static char *boot_manager_get_blobs_dir(BootManager *manager)
+{
+        autofree(char) *base_path = NULL;
+        const BootLoader *bootloader = boot_manager_get_bootloader(manager);
+        const char *efi_boot_dir = NULL;
+
+        if (!bootloader || !(efi_boot_dir = bootloader->get_kernel_destination(manager))) {
+                return NULL;
+        }
+
+        base_path = boot_manager_get_boot_dir(manager);
+        OOM_CHECK_RET(base_path, NULL);
+
+        return string_printf("%s%s/" BLOBS_DIR, base_path, efi_boot_dir);
+}
+
+const char *boot_manager_get_initrd_blob(const BootManager *manager, const char *source)
+{
+        BootManager *self = (BootManager *)manager;
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        char *name = NULL;
+        char *key = NULL;
+
+        assert(manager != NULL);
+        assert(source != NULL);
+
+        /* Every kernel shares the same sources, only hash them once */
+        if (!self->initrd_blobs) {
+                self->initrd_blobs =
+                    nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+                OOM_CHECK(self->initrd_blobs);
+        }
+
+        name = nc_hashmap_get(self->initrd_blobs, source);
+        if (name) {
+                return name;
+        }
+
+        /* Name the blob for what is actually installed */
+        if (!cbm_file_digest(boot_manager_transcode_initrd(manager, source), digest)) {
+                LOG_ERROR("Failed to hash initrd %s: %s", source, strerror(errno));
+                return NULL;
+        }
+        cbm_sha256_to_hex(digest, hex);
+
+        name = string_printf(BLOBS_DIR "/%s" BLOB_SUFFIX, hex);
+        key = strdup(source);
+        OOM_CHECK(key);
+        OOM_CHECK(nc_hashmap_put(self->initrd_blobs, key, name));
+
+        return name;
+}
+
+/**
+ * Whether the blob @name within @dest holds the contents it is named for. A
+ * blob we wrote and that is unchanged since is known from the manifest,
+ * anything else is read back and hashed.
+ */
+static bool boot_manager_check_initrd_blob(CbmManifest *manifest, const CbmDir *dest,
+                                           const char *name, const char *hex)
+{
+        const CbmManifestEntry *entry = NULL;
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        char actual[CBM_SHA256_HEX_SIZE];
+        autofree(char) *path = cbm_dir_path(dest, name);
+
+        if (manifest) {
+                entry = cbm_manifest_lookup(manifest, dest, name, NULL);
+        }
+        if (entry) {
+                return streq(entry->digest, hex);
+        }
+
+        if (!cbm_sha256_file(path, digest)) {
+                return false;
+        }
+        cbm_sha256_to_hex(digest, actual);
+        if (!streq(actual, hex)) {
+                return false;
+        }
+        if (manifest) {
+                cbm_manifest_record(manifest, dest, name, name, digest);
+        }
+        return true;
+}
+
+/**
+ * Ensure the blob for @source exists within @blobs_dir
+ */
+static bool boot_manager_install_initrd_blob(const BootManager *manager, const char *blobs_dir,
+                                             const char *source)
+{
+        CbmManifest *manifest = boot_manager_get_manifest((BootManager *)manager);
+        const CbmDir *dest = boot_manager_get_kernel_handle((BootManager *)manager);
+        autofree(char) *target = NULL;
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        char actual[CBM_SHA256_HEX_SIZE];
+        const char *installed = NULL;
+        const char *name = NULL;
+
+        if (!dest) {
+                return false;
+        }
+        name = boot_manager_get_initrd_blob(manager, source);
+        if (!name) {
+                return false;
+        }
+        target = string_printf("%s/%s", blobs_dir, name + strlen(BLOBS_DIR "/"));
+        snprintf(hex, sizeof(hex), "%s", name + strlen(BLOBS_DIR "/"));
+
+        /* The name only says what the blob should hold */
+        if (cbm_esp_exists(target)) {
+                if (boot_manager_check_initrd_blob(manifest, dest, name, hex)) {
+                        cbm_stats_inc(CBM_STAT_INITRD_BLOB_REUSED);
+                        return true;
+                }
+                LOG_WARNING("Initrd blob %s is corrupt, rewriting it", target);
+        }
+
+        if (!cbm_dir_mkdir(dest, BLOBS_DIR, 00755)) {
+                LOG_FATAL("Failed to create %s: %s", blobs_dir, strerror(errno));
+                return false;
+        }
+
+        LOG_DEBUG("Installing initrd blob %s for %s", name, source);
+        installed = boot_manager_transcode_initrd(manager, source);
+        if (!copy_files_atomic_at_digest(dest,
+                                         name,
+                                         (const char *[]){ installed, NULL },
+                                         0,
+                                         00644,
+                                         digest)) {
+                LOG_FATAL("Failed to install initrd %s -> %s: %s",
+                          source,
+                          target,
+                          strerror(errno));
+                return false;
+        }
+
+        /* The source changed since it was hashed, don't keep a misnamed blob */
+        cbm_sha256_to_hex(digest, actual);
+        if (!streq(actual, hex)) {
+                LOG_FATAL("Initrd %s changed while it was installed", source);
+                (void)cbm_dir_unlink(dest, name);
+                errno = EAGAIN;
+                return false;
+        }
+        /* Blobs are named for their contents, which is all that identifies them */
+        if (manifest) {
+                cbm_manifest_record(manifest, dest, name, name, digest);
+        }
+        cbm_stats_inc(CBM_STAT_INITRD_BLOB_WRITTEN);
+
+        return true;
+}
+
+bool boot_manager_install_initrd_blobs(BootManager *manager, const Kernel *kernel)
+{
+        autofree(char) *blobs_dir = NULL;
+        const char *own_initrd = NULL;
+        NcArray *sources = NULL;
+        bool ret = true;
+
+        assert(manager != NULL);
+        assert(kernel != NULL);
+
+        blobs_dir = boot_manager_get_blobs_dir(manager);
+        if (!blobs_dir) {
+                return false;
+        }
+
+        /* The kernel's own initrd is unique to it, so it stays a plain copy */
+        own_initrd = kernel->source.user_initrd_file ? kernel->source.user_initrd_file
+                                                     : kernel->source.initrd_file;
+
+        sources = boot_manager_get_initrd_sources(manager, kernel);
+        for (uint16_t i = 0; i < sources->len; i++) {
+                const char *source = nc_array_get(sources, i);
+
+                if (own_initrd && streq(source, own_initrd)) {
+                        continue;
+                }
+                if (!boot_manager_install_initrd_blob(manager, blobs_dir, source)) {
+                        ret = false;
+                        break;
+                }
+        }
+        nc_array_free(&sources, free);
+
+        return ret;
+}
+
+/**
+ * Count the references made to each blob by the entries of @kernels
+ */
+static bool boot_manager_count_blob_refs(BootManager *self, KernelArray *kernels, NcHashmap *refs)
+{
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                const Kernel *kernel = nc_array_get(kernels, i);
+                const char *own_initrd = kernel->source.user_initrd_file
+                                             ? kernel->source.user_initrd_file
+                                             : kernel->source.initrd_file;
+                NcArray *sources = boot_manager_get_initrd_sources(self, kernel);
+                bool ret = true;
+
+                for (uint16_t j = 0; j < sources->len; j++) {
+                        const char *source = nc_array_get(sources, j);
+                        const char *name = NULL;
+                        uintptr_t count;
+
+                        if (own_initrd && streq(source, own_initrd)) {
+                                continue;
+                        }
+                        name = boot_manager_get_initrd_blob(self, source);
+                        if (!name) {
+                                ret = false;
+                                break;
+                        }
+                        count = (uintptr_t)nc_hashmap_get(refs, name) + 1;
+                        OOM_CHECK(nc_hashmap_put(refs, name, (void *)count));
+                }
+                nc_array_free(&sources, free);
+
+                if (!ret) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+bool boot_manager_gc_initrd_blobs(BootManager *self, KernelArray *kernels)
+{
+        autofree(NcHashmap) *refs = NULL;
+        autofree(char) *blobs_dir = NULL;
+        autofree(DIR) *dir = NULL;
+        struct dirent *ent = NULL;
+        const BootLoader *bootloader = NULL;
+        const CbmDir *dest = NULL;
+        bool removed = false;
+        int fd;
+        bool ret = true;
+
+        assert(self != NULL);
+
+        bootloader = boot_manager_get_bootloader(self);
+        if (!bootloader || (bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) == 0) {
+                return true;
+        }
+
+        blobs_dir = boot_manager_get_blobs_dir(self);
+        if (!blobs_dir || !cbm_esp_exists(blobs_dir)) {
+                return true;
+        }
+        dest = boot_manager_get_kernel_handle(self);
+        if (!dest) {
+                return false;
+        }
+
+        /* Names are owned by the blob cache */
+        refs = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        OOM_CHECK(refs);
+
+        /* With blobs disabled nothing references them any more */
+        if (boot_manager_use_initrd_blobs(self)) {
+                if (!kernels) {
+                        return true;
+                }
+                if (!boot_manager_count_blob_refs(self, kernels, refs)) {
+                        LOG_ERROR("Cannot determine initrd blob references, skipping cleanup");
+                        return false;
+                }
+        }
+
+        fd = cbm_dir_openat(dest, BLOBS_DIR, O_RDONLY | O_DIRECTORY, 0);
+        dir = fd >= 0 ? fdopendir(fd) : NULL;
+        if (!dir) {
+                LOG_ERROR("Error opening %s: %s", blobs_dir, strerror(errno));
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return false;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *name = NULL;
+                autofree(char) *path = NULL;
+                uintptr_t count;
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+
+                name = string_printf(BLOBS_DIR "/%s", ent->d_name);
+                count = (uintptr_t)nc_hashmap_get(refs, name);
+                if (count > 0) {
+                        LOG_DEBUG("Keeping initrd blob %s (%lu references)",
+                                  name,
+                                  (unsigned long)count);
+                        continue;
+                }
+
+                path = string_printf("%s/%s", blobs_dir, ent->d_name);
+                LOG_DEBUG("Removing unreferenced initrd blob %s", name);
+                if (!cbm_dir_unlink(dest, name)) {
+                        LOG_ERROR("Failed to remove initrd blob %s: %s", path, strerror(errno));
+                        ret = false;
+                        continue;
+                }
+                removed = true;
+        }
+
+        if (removed) {
+                if (cbm_is_dir_empty(blobs_dir) && !cbm_dir_rmdir(dest, BLOBS_DIR)) {
+                        LOG_WARNING("Failed to remove %s: %s", blobs_dir, strerror(errno));
+                }
+                cbm_sync();
+        }
+
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -18,15 +18,19 @@
 #include <sys/utsname.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <glob.h>
 
 #include "bootloader.h"
 #include "bootman.h"
 #include "bootman_private.h"
 #include "cmdline.h"
+#include "digest.h"
+#include "esp-index.h"
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
 #include "system_stub.h"
+#include "topology.h"
 
 #include "config.h"
 
@@ -94,6 +98,10 @@ BootManager *boot_manager_new()
 
         /* CLI can override this */
         boot_manager_set_image_mode(r, false);
+        r->boot_mount_fd = -1;
+
+        /* Start from a fresh view of the devices */
+        cbm_topology_reset();
 
         r->initrd_freestanding = nc_hashmap_new_full(nc_string_hash,
                                                      nc_string_compare, free, free_initrd_entry);
@@ -103,40 +111,91 @@ BootManager *boot_manager_new()
         return r;
 }
 
-void boot_manager_free(BootManager *self)
+/**
+ * Release the selected bootloader, or forget that selecting one failed, so
+ * the next boot_manager_get_bootloader() selects afresh
+ */
+static void boot_manager_drop_bootloader(BootManager *self)
 {
-        if (!self) {
-                return;
-        }
-
         if (self->bootloader) {
                 self->bootloader->destroy(self);
+                self->bootloader = NULL;
         }
+        self->bootloader_failed = false;
+}
+
+/**
+ * Forget everything learned about the current root
+ */
+static void boot_manager_reset_root(BootManager *self)
+{
+        boot_manager_close_handles(self);
+        boot_manager_drop_bootloader(self);
 
         if (self->os_release) {
                 cbm_os_release_free(self->os_release);
+                self->os_release = NULL;
         }
 
         if (self->vconsole) {
                 nc_hashmap_free(self->vconsole);
+                self->vconsole = NULL;
         }
 
+        free(self->cmdline);
+        self->cmdline = NULL;
+        self->cmdline_loaded = false;
+
         cbm_free_sysconfig(self->sysconfig);
+        self->sysconfig = NULL;
+        cbm_topology_reset();
+}
+
+void boot_manager_free(BootManager *self)
+{
+        if (!self) {
+                return;
+        }
+
+        boot_manager_reset_root(self);
+        free(self->prefix);
         free(self->kernel_dir);
         free(self->initrd_freestanding_dir);
         free(self->user_initrd_freestanding_dir);
         nc_hashmap_free(self->initrd_freestanding);
+        if (self->batch_installed) {
+                nc_array_free(&self->batch_installed, NULL);
+        }
+        if (self->initrd_blobs) {
+                nc_hashmap_free(self->initrd_blobs);
+        }
+        if (self->initrd_transcoded) {
+                nc_hashmap_free(self->initrd_transcoded);
+        }
+        if (self->initrd_cache_used) {
+                nc_hashmap_free(self->initrd_cache_used);
+        }
         free(self->ucode_initrd);
         free(self->abs_bootdir);
-        free(self->cmdline);
+        free(self->boot_mount_restore);
+        if (self->boot_mount_fd >= 0) {
+                close(self->boot_mount_fd);
+        }
         free(self);
 }
 
 static bool boot_manager_select_bootloader(BootManager *self)
 {
         const BootLoader *selected = NULL;
+        const SystemConfig *config = NULL;
         int selected_boot_mask = 0;
-        int wanted_boot_mask = self->sysconfig->wanted_boot_mask;
+        int wanted_boot_mask;
+
+        config = boot_manager_get_sysconfig(self);
+        if (!config) {
+                return false;
+        }
+        wanted_boot_mask = config->wanted_boot_mask;
 
         /* Select a bootloader based on the capabilities */
         for (size_t i = 0; i < ARRAY_SIZE(bootman_known_loaders); i++) {
@@ -166,6 +225,7 @@ static bool boot_manager_select_bootloader(BootManager *self)
         if (!self->bootloader->init(self)) {
                 self->bootloader->destroy(self);
                 LOG_FATAL("Cannot initialise bootloader %s", self->bootloader->name);
+                self->bootloader = NULL;
                 return false;
         }
 
@@ -189,90 +249,163 @@ bool boot_manager_set_prefix(BootManager *self, char *prefix)
 {
         assert(self != NULL);
 
-        char *kernel_dir = NULL;
-        char *initrd_dir = NULL;
-        char *user_initrd_dir = NULL;
-        SystemConfig *config = NULL;
+        char *realp = NULL;
 
         CHECK_DBG_RET_VAL(!prefix, false, "Invalid prefix value: null");
 
-        cbm_free_sysconfig(self->sysconfig);
-        self->sysconfig = NULL;
+        realp = realpath(prefix, NULL);
+        CHECK_ERR_RET_VAL(!realp, false, "Path specified does not exist: %s", prefix);
 
-        config = cbm_inspect_root(prefix, self->image_mode);
-        CHECK_DBG_RET_VAL(!config, false, "Could not inspect root");
+        /* Everything else about the root is worked out on first use */
+        boot_manager_reset_root(self);
+        free(self->prefix);
+        self->prefix = realp;
 
-        self->sysconfig = config;
-        self->vconsole = boot_manager_parse_vconsole(prefix);
+        free(self->kernel_dir);
+        self->kernel_dir = string_printf("%s/%s", realp, KERNEL_DIRECTORY);
 
-        if (self->kernel_dir) {
-                free(self->kernel_dir);
-                self->kernel_dir = NULL;
-        }
+        free(self->initrd_freestanding_dir);
+        self->initrd_freestanding_dir = string_printf("%s/%s", realp, INITRD_DIRECTORY);
 
-        kernel_dir = string_printf("%s/%s", config->prefix, KERNEL_DIRECTORY);
+        free(self->user_initrd_freestanding_dir);
+        self->user_initrd_freestanding_dir = string_printf("%s/%s",
+                                                           realp,
+                                                           USER_INITRD_DIRECTORY);
 
-        if (self->kernel_dir) {
-                free(self->kernel_dir);
-        }
-        self->kernel_dir = kernel_dir;
+        return true;
+}
 
-        initrd_dir = string_printf("%s/%s", config->prefix, INITRD_DIRECTORY);
+void boot_manager_invalidate(BootManager *self, unsigned int stale)
+{
+        assert(self != NULL);
 
-        if (self->initrd_freestanding_dir) {
-                free(self->initrd_freestanding_dir);
+        /* No directory we watch tells of disks coming, going or renumbered */
+        if (self->sysconfig && !cbm_is_sysconfig_current(self->sysconfig, self->image_mode)) {
+                LOG_INFO("Block devices changed, inspecting the root again");
+                stale |= BOOT_MANAGER_STALE_CONFIG;
         }
-        self->initrd_freestanding_dir = initrd_dir;
-
-        user_initrd_dir = string_printf("%s/%s", config->prefix, USER_INITRD_DIRECTORY);
 
-        if (self->user_initrd_freestanding_dir) {
-                free(self->user_initrd_freestanding_dir);
+        if ((stale & BOOT_MANAGER_STALE_CONFIG) == BOOT_MANAGER_STALE_CONFIG) {
+                boot_manager_reset_root(self);
+                stale = BOOT_MANAGER_STALE_ALL;
+        } else {
+                /* Partition tables may have changed without any device doing so */
+                cbm_topology_reset();
         }
-        self->user_initrd_freestanding_dir = user_initrd_dir;
 
-        if (self->bootloader) {
-                self->bootloader->destroy(self);
-                self->bootloader = NULL;
-        }
+        /* The boot partition may have been mounted elsewhere, or not at all */
+        boot_manager_close_handles(self);
+        boot_manager_drop_bootloader(self);
+
+        /* Anything else may have written to the ESP since it was indexed */
+        cbm_esp_index_reset();
+        free(self->abs_bootdir);
+        self->abs_bootdir = NULL;
 
+        /* Cheap to parse again, and not worth watching */
         if (self->os_release) {
                 cbm_os_release_free(self->os_release);
                 self->os_release = NULL;
         }
-
-        self->os_release = cbm_os_release_new_for_root(prefix);
-        if (!self->os_release) {
-                DECLARE_OOM();
-                abort();
+        if (self->vconsole) {
+                nc_hashmap_free(self->vconsole);
+                self->vconsole = NULL;
         }
 
-        /* Load cmdline */
-        if (self->cmdline) {
+        if ((stale & BOOT_MANAGER_STALE_CMDLINE) == BOOT_MANAGER_STALE_CMDLINE) {
                 free(self->cmdline);
                 self->cmdline = NULL;
+                self->cmdline_loaded = false;
         }
-        self->cmdline = cbm_parse_cmdline_files(config->prefix);
 
-        if (!boot_manager_select_bootloader(self)) {
-                return false;
+        /* All keyed by initrd path, whatever the contents now are */
+        if ((stale & (BOOT_MANAGER_STALE_KERNELS | BOOT_MANAGER_STALE_INITRDS)) != 0) {
+                if (self->initrd_blobs) {
+                        nc_hashmap_free(self->initrd_blobs);
+                        self->initrd_blobs = NULL;
+                }
+                if (self->initrd_transcoded) {
+                        nc_hashmap_free(self->initrd_transcoded);
+                        self->initrd_transcoded = NULL;
+                }
+                if (self->initrd_cache_used) {
+                        nc_hashmap_free(self->initrd_cache_used);
+                        self->initrd_cache_used = NULL;
+                }
         }
 
-        return true;
+        if ((stale & BOOT_MANAGER_STALE_INITRDS) == BOOT_MANAGER_STALE_INITRDS) {
+                nc_hashmap_free(self->initrd_freestanding);
+                self->initrd_freestanding = nc_hashmap_new_full(nc_string_hash,
+                                                                nc_string_compare,
+                                                                free,
+                                                                free_initrd_entry);
+                OOM_CHECK(self->initrd_freestanding);
+                free(self->ucode_initrd);
+                self->ucode_initrd = NULL;
+        }
+}
+
+SystemConfig *boot_manager_get_sysconfig(BootManager *self)
+{
+        assert(self != NULL);
+        assert(self->prefix != NULL);
+
+        if (!self->sysconfig) {
+                self->sysconfig = cbm_inspect_root(self->prefix,
+                                                   self->image_mode,
+                                                   !self->read_only);
+                CHECK_DBG_RET_VAL(!self->sysconfig, NULL, "Could not inspect root");
+        }
+
+        return self->sysconfig;
+}
+
+const BootLoader *boot_manager_get_bootloader(BootManager *self)
+{
+        assert(self != NULL);
+
+        /* Selection is only attempted once, its failure was already reported */
+        if (!self->bootloader && !self->bootloader_failed &&
+            !boot_manager_select_bootloader(self)) {
+                self->bootloader_failed = true;
+        }
+
+        return self->bootloader;
+}
+
+bool boot_manager_has_bootloader(BootManager *self)
+{
+        return boot_manager_get_bootloader(self) != NULL;
+}
+
+const char *boot_manager_get_cmdline(BootManager *self)
+{
+        assert(self != NULL);
+        assert(self->prefix != NULL);
+
+        if (!self->cmdline_loaded) {
+                self->cmdline = cbm_parse_cmdline_files(self->prefix);
+                self->cmdline_loaded = true;
+        }
+
+        return self->cmdline;
 }
 
 int boot_manager_get_wanted_boot_mask(BootManager *self)
 {
         assert(self != NULL);
 
-        return self->sysconfig->wanted_boot_mask;
+        const SystemConfig *config = boot_manager_get_sysconfig(self);
+
+        return config ? config->wanted_boot_mask : 0;
 }
 
 const char *boot_manager_get_prefix(BootManager *self)
 {
         assert(self != NULL);
 
-        return (const char *)self->sysconfig->prefix;
+        return (const char *)self->prefix;
 }
 
 const char *boot_manager_get_kernel_dir(BootManager *self)
@@ -287,26 +420,47 @@ const char *boot_manager_get_vendor_prefix(__cbm_unused__ BootManager *self)
         return VENDOR_PREFIX;
 }
 
+/**
+ * Parse the os-release of the root on first use
+ */
+static CbmOsRelease *boot_manager_get_os_release(BootManager *self)
+{
+        assert(self->prefix != NULL);
+
+        if (!self->os_release) {
+                self->os_release = cbm_os_release_new_for_root(self->prefix);
+                if (!self->os_release) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
+        return self->os_release;
+}
+
 const char *boot_manager_get_os_name(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->os_release != NULL);
 
-        return cbm_os_release_get_value(self->os_release, OS_RELEASE_PRETTY_NAME);
+        return cbm_os_release_get_value(boot_manager_get_os_release(self),
+                                        OS_RELEASE_PRETTY_NAME);
 }
 
 const char *boot_manager_get_os_id(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->os_release != NULL);
 
-        return cbm_os_release_get_value(self->os_release, OS_RELEASE_ID);
+        return cbm_os_release_get_value(boot_manager_get_os_release(self), OS_RELEASE_ID);
 }
 
 const char *boot_manager_get_vconsole(BootManager *self, const char *key)
 {
         assert(self != NULL);
-        assert(self->vconsole != NULL);
+        assert(self->prefix != NULL);
+
+        if (!self->vconsole) {
+                self->vconsole = boot_manager_parse_vconsole(self->prefix);
+        }
 
         return nc_hashmap_get(self->vconsole, key);
 }
@@ -314,19 +468,20 @@ const char *boot_manager_get_vconsole(BootManager *self, const char *key)
 const CbmDeviceProbe *boot_manager_get_root_device(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->sysconfig != NULL);
 
-        return (const CbmDeviceProbe *)self->sysconfig->root_device;
+        const SystemConfig *config = boot_manager_get_sysconfig(self);
+
+        return config ? (const CbmDeviceProbe *)config->root_device : NULL;
 }
 
 bool boot_manager_install_kernel(BootManager *self, const Kernel *kernel)
 {
         assert(self != NULL);
 
-        if (!kernel || !self->bootloader) {
+        if (!kernel || !boot_manager_get_bootloader(self)) {
                 return false;
         }
-        if (!cbm_is_sysconfig_sane(self->sysconfig)) {
+        if (!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self))) {
                 return false;
         }
 
@@ -334,10 +489,53 @@ bool boot_manager_install_kernel(BootManager *self, const Kernel *kernel)
         if (!boot_manager_install_kernel_internal(self, kernel)) {
                 return false;
         }
+        /* Entries are written when the batch is reconciled */
+        if (self->batch_installed) {
+                for (uint16_t i = 0; i < self->batch_installed->len; i++) {
+                        if (nc_array_get(self->batch_installed, i) == kernel) {
+                                return true;
+                        }
+                }
+                if (!nc_array_add(self->batch_installed, (void *)kernel)) {
+                        DECLARE_OOM();
+                        return false;
+                }
+                return true;
+        }
         /* Hand over to the bootloader to finish it up */
         return self->bootloader->install_kernel(self, kernel);
 }
 
+void boot_manager_begin_kernel_batch(BootManager *self)
+{
+        assert(self != NULL);
+
+        if (self->batch_installed || !boot_manager_get_bootloader(self) ||
+            !self->bootloader->reconcile_kernels) {
+                return;
+        }
+
+        self->batch_installed = nc_array_new();
+        OOM_CHECK(self->batch_installed);
+}
+
+bool boot_manager_end_kernel_batch(BootManager *self, const KernelArray *known)
+{
+        assert(self != NULL);
+        KernelArray *installed = self->batch_installed;
+        bool ret;
+
+        if (!installed) {
+                return true;
+        }
+        self->batch_installed = NULL;
+
+        ret = self->bootloader->reconcile_kernels(self, installed, known);
+        nc_array_free(&installed, NULL);
+
+        return ret;
+}
+
 bool boot_manager_remove_kernel_wrapper(BootManager *self, const Kernel *kernel)
 {
         assert(self != NULL);
@@ -347,9 +545,9 @@ bool boot_manager_remove_kernel_wrapper(BootManager *self, const Kernel *kernel)
         bool matched = false;
         bool kernel_removed = false;
 
-        CHECK_DBG_RET_VAL(!self->bootloader, false, "Invalid boot loader: null");
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false, "Invalid boot loader: null");
 
-        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), false,
+        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self)), false,
                           "Sysconfig is not sane");
 
         CHECK_ERR_RET_VAL(!kernel, false, "No kernel specified, bailing");
@@ -373,7 +571,7 @@ bool boot_manager_remove_kernel_wrapper(BootManager *self, const Kernel *kernel)
                 }
         }
         if (did_mount > 0) {
-                umount_boot(boot_dir);
+                umount_boot(self, boot_dir);
         }
 
         CHECK_ERR(!matched, "No matching kernel in %s, bailing", self->kernel_dir);
@@ -385,16 +583,20 @@ bool boot_manager_remove_kernel(BootManager *self, const Kernel *kernel)
 {
         assert(self != NULL);
 
-        if (!kernel || !self->bootloader) {
+        if (!kernel || !boot_manager_get_bootloader(self)) {
                 return false;
         }
-        if (!cbm_is_sysconfig_sane(self->sysconfig)) {
+        if (!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self))) {
                 return false;
         }
         /* Remove the kernel blob first */
         if (!boot_manager_remove_kernel_internal(self, kernel)) {
                 return false;
         }
+        /* The entry is dropped when the batch is reconciled */
+        if (self->batch_installed) {
+                return true;
+        }
         /* Hand over to the bootloader to finish it up */
         return self->bootloader->remove_kernel(self, kernel);
 }
@@ -404,15 +606,15 @@ int boot_manager_detect_and_mount_boot(BootManager *self, char **boot_dir) {
         const char *prefix;
         int wanted_boot_mask;
 
-        wanted_boot_mask = self->sysconfig->wanted_boot_mask;
+        wanted_boot_mask = boot_manager_get_wanted_boot_mask(self);
         if ((wanted_boot_mask & BOOTLOADER_CAP_LEGACY) != BOOTLOADER_CAP_LEGACY) {
                 return mount_boot(self, boot_dir);
         }
 
-        boot_dev = get_boot_device();
+        prefix = boot_manager_get_prefix((BootManager *)self);
+        boot_dev = get_boot_device(prefix);
 
         if (!boot_dev) {
-                prefix = boot_manager_get_prefix((BootManager *)self);
                 boot_dev = get_legacy_boot_device((char *)prefix);
         }
 
@@ -430,9 +632,9 @@ bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
         bool matched = false;
         bool default_set = false;
 
-        CHECK_DBG_RET_VAL(!self->bootloader, false, "Invalid boot loader: null");
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false, "Invalid boot loader: null");
 
-        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), false,
+        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self)), false,
                           "Sysconfig is not sane");
 
         CHECK_ERR_RET_VAL(!kernel, false, "No kernel specified, bailing");
@@ -456,7 +658,7 @@ bool boot_manager_set_default_kernel(BootManager *self, const Kernel *kernel)
                 }
         }
         if (did_mount > 0) {
-                umount_boot(boot_dir);
+                umount_boot(self, boot_dir);
         }
 
         CHECK_ERR(!matched, "No matching kernel in %s, bailing", self->kernel_dir);
@@ -468,8 +670,9 @@ char *boot_manager_get_default_kernel(BootManager *self)
 {
         assert(self != NULL);
 
-        CHECK_DBG_RET_VAL(!self->bootloader, NULL, "Invalid bootloader value: null");
-        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), NULL,
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), NULL,
+                          "Invalid bootloader value: null");
+        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self)), NULL,
                             "Sysconfig is not sane");
         return self->bootloader->get_default_kernel(self);
 }
@@ -488,11 +691,42 @@ int kernel_compare_reverse(const void *a, const void *b)
         return 1;
 }
 
+/**
+ * Let go of a detached boot partition. Nothing may refer to it by path
+ * afterwards, as the descriptor number will be reused.
+ */
+static void umount_boot_detached(BootManager *self)
+{
+        autofree(char) *restore = self->boot_mount_restore;
+        int fd = self->boot_mount_fd;
+
+        self->boot_mount_restore = NULL;
+        self->boot_mount_fd = -1;
+
+        if (!boot_manager_set_boot_dir(self, restore)) {
+                LOG_WARNING("Cannot re-initialise the bootloader for %s", restore);
+        }
+
+        if (syncfs(fd) != 0) {
+                LOG_WARNING("Could not flush the boot partition: %s", strerror(errno));
+        }
+        close(fd);
+        LOG_SUCCESS("Released detached boot partition");
+}
+
 /**
  * Unmount boot directory
  */
-void umount_boot(char *boot_dir)
+void umount_boot(BootManager *self, char *boot_dir)
 {
+        /* Our handles would keep the boot partition busy */
+        boot_manager_close_handles(self);
+
+        if (self->boot_mount_fd >= 0) {
+                umount_boot_detached(self);
+                return;
+        }
+
         /* Cleanup and umount */
         LOG_INFO("Attempting umount of %s", boot_dir);
         if (cbm_system_umount(boot_dir) < 0) {
@@ -502,6 +736,69 @@ void umount_boot(char *boot_dir)
         }
 }
 
+/**
+ * Detached mounts are only reachable from within this process, through a
+ * descriptor that is closed on exec. Only the UEFI bootloaders do all of
+ * their work in-process, the others hand the boot directory to tools like
+ * extlinux and grub-mkconfig.
+ */
+static bool can_mount_boot_detached(BootManager *self)
+{
+        if (self->attach_boot || !self->bootloader ||
+            !(self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI)) {
+                return false;
+        }
+        return boot_manager_get_detached_mount_enabled(self);
+}
+
+/**
+ * Mount @device with a detached mount, reached through /proc/self/fd rather
+ * than @boot_dir, so no mount or umount event is ever seen by anybody else.
+ *
+ * Returns 1 when mounted, 0 if detached mounts are unavailable and -1 for
+ * errors, like mount_boot()
+ */
+static int mount_boot_detached(BootManager *self, const char *device, const char *boot_dir,
+                               char **boot_directory)
+{
+        autofree(char) *mount_dir = NULL;
+        const char *fs_name = NULL;
+        int fd;
+
+        fs_name = cbm_get_fstype_name(device);
+        if (!fs_name) {
+                return 0;
+        }
+
+        fd = cbm_system_mount_detached(device, fs_name, cbm_get_fstype_mount_options(device));
+        if (fd < 0) {
+                LOG_INFO("Cannot mount %s detached, mounting at %s instead: %s",
+                         device,
+                         boot_dir,
+                         strerror(errno));
+                return 0;
+        }
+
+        mount_dir = string_printf("/proc/self/fd/%d", fd);
+        self->boot_mount_fd = fd;
+        self->boot_mount_restore = strdup(boot_dir);
+        OOM_CHECK(self->boot_mount_restore);
+        LOG_SUCCESS("%s successfully mounted detached at %s", device, mount_dir);
+
+        if (!boot_manager_set_boot_dir(self, mount_dir)) {
+                LOG_FATAL("Cannot initialize with detached ESP");
+                umount_boot_detached(self);
+                return -1;
+        }
+
+        *boot_directory = strdup(mount_dir);
+        if (!*boot_directory) {
+                umount_boot_detached(self);
+                return -1;
+        }
+        return 1;
+}
+
 /**
  * Mount boot directory
  *
@@ -515,6 +812,7 @@ int mount_boot(BootManager *self, char **boot_directory)
         int ret = -1;
         char *root_base = NULL;
         const char *fs_name = NULL;
+        const SystemConfig *config = NULL;
 
         if (!boot_directory) {
                 goto out;
@@ -544,7 +842,8 @@ int mount_boot(BootManager *self, char **boot_directory)
         }
 
         /* Determine root device */
-        root_base = self->sysconfig->boot_device;
+        config = boot_manager_get_sysconfig(self);
+        root_base = config ? config->boot_device : NULL;
         CHECK_FATAL_GOTO(!root_base, out, "Cannot determine boot device");
 
         abs_bootdir = cbm_system_get_mountpoint_for_device(root_base);
@@ -554,7 +853,7 @@ int mount_boot(BootManager *self, char **boot_directory)
                  * skip if abs_bootdir is equal prefix, in that case we don't want to change
                  * boot_directory and inform we've not mounted a partition
                  */
-                if (!strcmp(abs_bootdir, self->sysconfig->prefix)) {
+                if (!strcmp(abs_bootdir, self->prefix)) {
                         ret = 0;
                         goto out;
                 }
@@ -574,6 +873,15 @@ int mount_boot(BootManager *self, char **boot_directory)
                 goto out;
         }
 
+        /* Nobody else needs to see it, so don't attach it anywhere */
+        if (can_mount_boot_detached(self)) {
+                ret = mount_boot_detached(self, root_base, boot_dir, boot_directory);
+                if (ret != 0) {
+                        goto out;
+                }
+                ret = -1;
+        }
+
         /* The boot directory isn't mounted, so we'll mount it now */
         if (!nc_file_exists(boot_dir)) {
                 LOG_INFO("Creating boot dir");
@@ -606,7 +914,7 @@ int mount_boot(BootManager *self, char **boot_directory)
         if (*boot_directory) {
                 ret = 1;
         } else {
-                umount_boot(boot_dir);
+                umount_boot(self, boot_dir);
         }
 
 out:
@@ -641,7 +949,7 @@ char **boot_manager_list_kernels(BootManager *self)
         if (did_mount >= 0) {
                 default_kernel = boot_manager_get_default_kernel(self);
                 if (did_mount > 0) {
-                        umount_boot(boot_dir);
+                        umount_boot(self, boot_dir);
                 }
         }
 
@@ -663,11 +971,63 @@ char **boot_manager_list_kernels(BootManager *self)
         return results;
 }
 
+bool boot_manager_get_status(BootManager *self, BootManagerStatus *status)
+{
+        assert(self != NULL);
+        autofree(char) *boot_dir = NULL;
+        int did_mount = -1;
+
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false, "Invalid boot loader: null");
+        CHECK_DBG_RET_VAL(!status, false, "Invalid status: null");
+
+        memset(status, 0, sizeof(BootManagerStatus));
+        status->bootloader = self->bootloader->name;
+
+        did_mount = boot_manager_detect_and_mount_boot(self, &boot_dir);
+        CHECK_DBG_RET_VAL(did_mount < 0, false, "Boot was not mounted");
+
+        status->needs_install = self->bootloader->needs_install(self);
+        status->needs_update = !status->needs_install && self->bootloader->needs_update(self);
+
+        if (self->bootloader->get_versions &&
+            !self->bootloader->get_versions(self,
+                                            &status->installed_version,
+                                            &status->available_version)) {
+                LOG_DEBUG("Unable to determine bootloader versions");
+        }
+
+        if (!boot_manager_scan_fragmentation(self,
+                                             false,
+                                             &status->kernel_files,
+                                             &status->fragmented_files)) {
+                LOG_DEBUG("Unable to inspect the kernel destination");
+                status->fragmented_files = -1;
+        }
+
+        if (did_mount > 0) {
+                umount_boot(self, boot_dir);
+        }
+
+        return true;
+}
+
+void boot_manager_status_free(BootManagerStatus *status)
+{
+        if (!status) {
+                return;
+        }
+        free(status->installed_version);
+        free(status->available_version);
+        status->installed_version = NULL;
+        status->available_version = NULL;
+}
+
 char *boot_manager_get_boot_dir(BootManager *self)
 {
         assert(self != NULL);
-        assert(self->sysconfig != NULL);
+        assert(self->prefix != NULL);
 
+        const CbmDir *handle = NULL;
         char *ret = NULL;
         char *realp = NULL;
 
@@ -675,7 +1035,15 @@ char *boot_manager_get_boot_dir(BootManager *self)
                 return strdup(self->abs_bootdir);
         }
 
-        ret = string_printf("%s%s", self->sysconfig->prefix, BOOT_DIRECTORY);
+        /* The handle already knows where it resolved to */
+        handle = boot_manager_get_boot_handle(self);
+        if (handle) {
+                ret = strdup(handle->path);
+                OOM_CHECK(ret);
+                return ret;
+        }
+
+        ret = string_printf("%s%s", self->prefix, BOOT_DIRECTORY);
 
         /* Attempt to resolve it first, removing double slashes */
         realp = realpath(ret, NULL);
@@ -705,6 +1073,7 @@ bool boot_manager_set_boot_dir(BootManager *self, const char *bootdir)
                 free(self->abs_bootdir);
         }
         self->abs_bootdir = nboot;
+        boot_manager_close_handles(self);
 
         if (!self->bootloader) {
                 return true;
@@ -719,6 +1088,121 @@ bool boot_manager_set_boot_dir(BootManager *self, const char *bootdir)
         return true;
 }
 
+const CbmDir *boot_manager_get_root_handle(BootManager *self)
+{
+        assert(self != NULL);
+
+        if (!self->root_handle && self->prefix) {
+                self->root_handle = cbm_dir_open(NULL, self->prefix, !streq(self->prefix, "/"));
+        }
+        return self->root_handle;
+}
+
+const CbmDir *boot_manager_get_boot_handle(BootManager *self)
+{
+        const CbmDir *root = NULL;
+        size_t len;
+
+        assert(self != NULL);
+
+        if (self->boot_handle) {
+                return self->boot_handle;
+        }
+
+        root = boot_manager_get_root_handle(self);
+        if (!root) {
+                return NULL;
+        }
+
+        if (!self->abs_bootdir) {
+                self->boot_handle = cbm_dir_open(root, BOOT_DIRECTORY, false);
+                return self->boot_handle;
+        }
+
+        /* Stay within the root where we can, the ESP may be mounted elsewhere */
+        len = streq(self->prefix, "/") ? 0 : strlen(self->prefix);
+        if (strncmp(self->abs_bootdir, self->prefix, len) == 0 &&
+            (self->abs_bootdir[len] == '/' || self->abs_bootdir[len] == '\0')) {
+                self->boot_handle = cbm_dir_open(root, self->abs_bootdir + len, false);
+        } else {
+                self->boot_handle = cbm_dir_open(NULL, self->abs_bootdir, root->confined);
+        }
+        return self->boot_handle;
+}
+
+const CbmDir *boot_manager_get_kernel_handle(BootManager *self)
+{
+        const BootLoader *bootloader = NULL;
+        const CbmDir *boot = NULL;
+        const char *dest = NULL;
+
+        assert(self != NULL);
+
+        if (self->kernel_handle) {
+                return self->kernel_handle;
+        }
+
+        bootloader = boot_manager_get_bootloader(self);
+        boot = boot_manager_get_boot_handle(self);
+        if (!bootloader || !boot) {
+                return NULL;
+        }
+
+        if ((bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) != BOOTLOADER_CAP_UEFI) {
+                return boot;
+        }
+
+        dest = bootloader->get_kernel_destination(self);
+        if (!dest) {
+                return NULL;
+        }
+        self->kernel_handle = cbm_dir_open(boot, dest, false);
+        return self->kernel_handle;
+}
+
+CbmManifest *boot_manager_get_manifest(BootManager *self)
+{
+        const CbmDir *dest = NULL;
+
+        assert(self != NULL);
+
+        if (self->manifest) {
+                return self->manifest;
+        }
+        dest = boot_manager_get_kernel_handle(self);
+        if (!dest) {
+                return NULL;
+        }
+        self->manifest = cbm_manifest_load(dest);
+        return self->manifest;
+}
+
+void boot_manager_close_handles(BootManager *self)
+{
+        const CbmDir *dest = NULL;
+
+        assert(self != NULL);
+
+        if (self->manifest) {
+                /* Only ever loaded through the kernel handle */
+                dest = self->kernel_handle ? self->kernel_handle : self->boot_handle;
+                if (dest && !cbm_manifest_save(self->manifest, dest)) {
+                        LOG_WARNING("Failed to write the manifest of %s: %s",
+                                    dest->path,
+                                    strerror(errno));
+                }
+                cbm_manifest_free(self->manifest);
+                self->manifest = NULL;
+        }
+
+        cbm_dir_free(self->kernel_handle);
+        self->kernel_handle = NULL;
+        cbm_dir_free(self->boot_handle);
+        self->boot_handle = NULL;
+        cbm_dir_free(self->root_handle);
+        self->root_handle = NULL;
+}
+
 void *boot_manager_get_data(BootManager *manager)
 {
         return manager->data;
@@ -734,9 +1218,10 @@ bool boot_manager_modify_bootloader(BootManager *self, int flags)
         assert(self != NULL);
         autofree(char) *boot_dir = NULL;
 
-        CHECK_DBG_RET_VAL(!self->bootloader, false, "invalid self->bootloader, null.");
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false,
+                          "invalid self->bootloader, null.");
 
-        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(self->sysconfig), false,
+        CHECK_DBG_RET_VAL(!cbm_is_sysconfig_sane(boot_manager_get_sysconfig(self)), false,
                           "The sysconfig values are not sane");
 
         /* Ensure we're up to date here on the bootloader */
@@ -755,7 +1240,11 @@ bool boot_manager_modify_bootloader(BootManager *self, int flags)
                 }
                 return true;
         } else if ((flags & BOOTLOADER_OPERATION_REMOVE) == BOOTLOADER_OPERATION_REMOVE) {
-                return self->bootloader->remove(self);
+                bool removed = self->bootloader->remove(self);
+
+                /* The kernel destination may have gone with it */
+                boot_manager_close_handles(self);
+                return removed;
         } else if ((flags & BOOTLOADER_OPERATION_UPDATE) == BOOTLOADER_OPERATION_UPDATE) {
                 if (nocheck) {
                         return self->bootloader->update(self);
@@ -781,21 +1270,35 @@ void boot_manager_set_image_mode(BootManager *self, bool image_mode)
 {
         assert(self != NULL);
 
+        /* The root is inspected differently for images */
+        if (self->image_mode != image_mode && self->sysconfig) {
+                boot_manager_drop_bootloader(self);
+                cbm_free_sysconfig(self->sysconfig);
+                self->sysconfig = NULL;
+                boot_manager_close_handles(self);
+        }
         self->image_mode = image_mode;
+
+        /* Image contents belong to the image, don't leave attributes behind */
+        cbm_set_digest_xattrs(!image_mode);
 }
 
 bool boot_manager_needs_install(BootManager *self)
 {
         assert(self != NULL);
 
-        return self->bootloader->needs_install(self);
+        const BootLoader *bootloader = boot_manager_get_bootloader(self);
+
+        return bootloader && bootloader->needs_install(self);
 }
 
 bool boot_manager_needs_update(BootManager *self)
 {
         assert(self != NULL);
 
-        return self->bootloader->needs_update(self);
+        const BootLoader *bootloader = boot_manager_get_bootloader(self);
+
+        return bootloader && bootloader->needs_update(self);
 }
 
 bool boot_manager_set_uname(BootManager *self, const char *uname)
@@ -955,22 +1458,29 @@ bool boot_manager_enumerate_initrds_freestanding(BootManager *self)
 
 bool boot_manager_copy_initrd_freestanding(BootManager *self)
 {
-        autofree(char) *base_path = NULL;
         NcHashmapIter iter = { 0 };
         void *key = NULL;
         void *val = NULL;
-        bool is_uefi = ((self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? self->bootloader->get_kernel_destination(self) : NULL;
-        base_path = boot_manager_get_boot_dir((BootManager *)self);
+        const BootLoader *bootloader = boot_manager_get_bootloader(self);
+        const CbmDir *dest = NULL;
+
+        if (!bootloader) {
+                return false;
+        }
+
+        /* Baked into each kernel image or initrd bundle, or shared as blobs */
+        if (boot_manager_use_uki(self) || boot_manager_use_initrd_bundle(self) ||
+            boot_manager_use_initrd_blobs(self)) {
+                return true;
+        }
 
-        if (!self || !self->initrd_freestanding) {
+        if (!self->initrd_freestanding) {
                 return false;
         }
 
-        /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
-        if (is_uefi && !efi_boot_dir) {
+        /* For UEFI this needs bootloader->get_kernel_destination() to return a value */
+        dest = boot_manager_get_kernel_handle(self);
+        if (!dest) {
                 return false;
         }
 
@@ -978,6 +1488,7 @@ bool boot_manager_copy_initrd_freestanding(BootManager *self)
         while (nc_hashmap_iter_next(&iter, &key, &val)) {
                 autofree(char) *initrd_target = NULL;
                 autofree(char) *initrd_source = NULL;
+                const char *initrd_install = NULL;
                 struct InitrdEntry *entry = val;
 
                 // if we put null's name to initrd entry then we're masking it
@@ -986,19 +1497,21 @@ bool boot_manager_copy_initrd_freestanding(BootManager *self)
                         continue;
                 }
 
-                initrd_target = string_printf("%s%s/%s",
-                                              base_path, (is_uefi ? efi_boot_dir : ""), (char*)key);
+                initrd_target = cbm_dir_path(dest, key);
 
                 initrd_source = string_printf("%s/%s", entry->dir, entry->name);
-
-                if (!cbm_files_match(initrd_source, initrd_target)) {
-                        if (!copy_file_atomic(initrd_source, initrd_target, 00644)) {
-                                LOG_FATAL("Failed to install initrd %s -> %s: %s",
-                                          initrd_source,
-                                          initrd_target,
-                                          strerror(errno));
-                                return false;
-                        }
+                initrd_install = boot_manager_transcode_initrd(self, initrd_source);
+
+                if (!boot_manager_copy_to_kernel_dest(self,
+                                                      dest,
+                                                      key,
+                                                      (const char *[]){ initrd_install, NULL },
+                                                      0)) {
+                        LOG_FATAL("Failed to install initrd %s -> %s: %s",
+                                  initrd_source,
+                                  initrd_target,
+                                  strerror(errno));
+                        return false;
                 }
         }
         return true;
@@ -1006,31 +1519,33 @@ bool boot_manager_copy_initrd_freestanding(BootManager *self)
 
 bool boot_manager_remove_initrd_freestanding(BootManager * self)
 {
-        autofree(char) *base_path = NULL;
-        autofree(char) *initrd_efi_path = NULL;
         autofree(DIR) *initrd_dir = NULL;
         struct dirent *ent = NULL;
-        bool is_uefi = ((self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? self->bootloader->get_kernel_destination(self) : NULL;
-        if (!self || (!self->user_initrd_freestanding_dir && !self->initrd_freestanding_dir)) {
+        const BootLoader *bootloader = boot_manager_get_bootloader(self);
+        const CbmDir *dest = NULL;
+        bool merged = false;
+        int fd;
+        if (!bootloader ||
+            (!self->user_initrd_freestanding_dir && !self->initrd_freestanding_dir)) {
                 return false;
         }
-        /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
-        if (is_uefi && !efi_boot_dir) {
+        /* No separate copies are kept when initrds are merged or shared */
+        merged = boot_manager_use_uki(self) || boot_manager_use_initrd_bundle(self) ||
+                 boot_manager_use_initrd_blobs(self);
+
+        /* For UEFI this needs bootloader->get_kernel_destination() to return a value */
+        dest = boot_manager_get_kernel_handle(self);
+        if (!dest) {
                 return false;
         }
 
-        base_path = boot_manager_get_boot_dir((BootManager *)self);
-
-        initrd_efi_path = string_printf("%s/%s",
-                                        base_path,
-                                        (is_uefi ? efi_boot_dir : ""));
-
-        initrd_dir = opendir(initrd_efi_path);
+        fd = cbm_dir_openat(dest, ".", O_RDONLY | O_DIRECTORY, 0);
+        initrd_dir = fd >= 0 ? fdopendir(fd) : NULL;
         if (!initrd_dir) {
-                LOG_ERROR("Error opening %s: %s", initrd_efi_path, strerror(errno));
+                LOG_ERROR("Error opening %s: %s", dest->path, strerror(errno));
+                if (fd >= 0) {
+                        close(fd);
+                }
                 return false;
         }
 
@@ -1041,13 +1556,11 @@ bool boot_manager_remove_initrd_freestanding(BootManager * self)
                         continue;
                 }
 
-                if (!nc_hashmap_get(self->initrd_freestanding, ent->d_name)) {
-                        initrd_target = string_printf("%s/%s",
-                                                      initrd_efi_path,
-                                                      ent->d_name);
+                if (merged || !nc_hashmap_get(self->initrd_freestanding, ent->d_name)) {
+                        initrd_target = cbm_dir_path(dest, ent->d_name);
                         /* Remove old initrd */
-                        if (nc_file_exists(initrd_target)) {
-                                if (unlink(initrd_target) < 0) {
+                        if (cbm_esp_exists(initrd_target)) {
+                                if (!cbm_dir_unlink(dest, ent->d_name)) {
                                         LOG_ERROR("Failed to remove legacy-path UEFI initrd %s: %s",
                                                   initrd_target,
                                                   strerror(errno));
@@ -1094,6 +1607,132 @@ bool boot_manager_initrd_iterator_next(NcHashmapIter *iter, char **name)
         return false;
 }
 
+/**
+ * Append the source path of every extra initrd (<initrd>.*) of @initrd_base
+ */
+static void add_extra_initrd_sources(NcArray *sources, const char *initrd_base)
+{
+        autofree(char) *initrd_glob = string_printf("%s.*", initrd_base);
+        glob_t files;
+
+        if (glob(initrd_glob, 0, NULL, &files) == 0) {
+                for (size_t i = 0; i < files.gl_pathc; i++) {
+                        char *path = strdup(files.gl_pathv[i]);
+                        OOM_CHECK(path);
+                        OOM_CHECK(nc_array_add(sources, path));
+                }
+        }
+        globfree(&files);
+}
+
+NcArray *boot_manager_get_initrd_sources(const BootManager *manager, const Kernel *kernel)
+{
+        NcArray *sources = NULL;
+        struct InitrdEntry *entry = NULL;
+        NcHashmapIter iter = { 0 };
+        const char *key = NULL;
+
+        assert(manager != NULL);
+        assert(kernel != NULL);
+
+        sources = nc_array_new();
+        OOM_CHECK(sources);
+
+        /* Early microcode loading initrd must be the first entry */
+        if (manager->ucode_initrd) {
+                entry = nc_hashmap_get(manager->initrd_freestanding, manager->ucode_initrd);
+                if (entry && entry->name) {
+                        OOM_CHECK(nc_array_add(sources,
+                                               string_printf("%s/%s", entry->dir, entry->name)));
+                }
+        }
+
+        /* User initrd takes precedence over the system one */
+        if (kernel->source.user_initrd_file) {
+                OOM_CHECK(nc_array_add(sources, strdup(kernel->source.user_initrd_file)));
+        } else if (kernel->source.initrd_file) {
+                OOM_CHECK(nc_array_add(sources, strdup(kernel->source.initrd_file)));
+        }
+        if (kernel->source.initrd_file) {
+                add_extra_initrd_sources(sources, kernel->source.initrd_file);
+        }
+
+        nc_hashmap_iter_init(manager->initrd_freestanding, &iter);
+        while (nc_hashmap_iter_next(&iter, (void **)&key, (void **)&entry)) {
+                /* Masked, or the microcode initrd we already added */
+                if (!entry->name || streq(key, manager->ucode_initrd)) {
+                        continue;
+                }
+                OOM_CHECK(nc_array_add(sources, string_printf("%s/%s", entry->dir, entry->name)));
+        }
+
+        return sources;
+}
+
+bool boot_manager_use_uki(const BootManager *manager)
+{
+        assert(manager != NULL);
+
+        const BootLoader *bootloader = NULL;
+
+        if (!manager->prefix) {
+                return false;
+        }
+        bootloader = boot_manager_selected_bootloader(manager);
+        if (!bootloader || !(bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UKI)) {
+                return false;
+        }
+        return boot_manager_get_uki_enabled((BootManager *)manager);
+}
+
+bool boot_manager_use_initrd_bundle(const BootManager *manager)
+{
+        assert(manager != NULL);
+
+        if (!manager->prefix || boot_manager_use_uki(manager)) {
+                return false;
+        }
+        return boot_manager_get_initrd_bundle_enabled((BootManager *)manager);
+}
+
+const char *boot_manager_get_initrd_bundle(const BootManager *manager, const Kernel *kernel)
+{
+        NcArray *sources = NULL;
+        bool has_initrds;
+
+        assert(kernel != NULL);
+
+        if (!boot_manager_use_initrd_bundle(manager)) {
+                return NULL;
+        }
+
+        sources = boot_manager_get_initrd_sources(manager, kernel);
+        has_initrds = sources->len > 0;
+        nc_array_free(&sources, free);
+
+        return has_initrds ? kernel->target.bundle_path : NULL;
+}
+
+bool boot_manager_use_initrd_blobs(const BootManager *manager)
+{
+        assert(manager != NULL);
+
+        const BootLoader *bootloader = NULL;
+
+        if (!manager->prefix) {
+                return false;
+        }
+        bootloader = boot_manager_selected_bootloader(manager);
+        if (!bootloader || !(bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI)) {
+                return false;
+        }
+        if (boot_manager_use_uki(manager) ||
+            boot_manager_get_initrd_bundle_enabled((BootManager *)manager)) {
+                return false;
+        }
+        return boot_manager_get_initrd_blobs_enabled((BootManager *)manager);
+}
+
 void boot_manager_set_update_efi_vars(BootManager *self, bool update_efi_vars)
 {
         assert(self != NULL);
@@ -1107,11 +1746,41 @@ bool boot_manager_is_update_efi_vars(BootManager *self)
         return self->update_efi_vars;
 }
 
-bool check_partitionless_boot(const BootManager *self, const char *boot_dir)
+void boot_manager_set_read_only(BootManager *self, bool read_only)
+{
+        assert(self != NULL);
+
+        self->read_only = read_only;
+}
+
+void boot_manager_set_attach_boot(BootManager *self, bool attach_boot)
+{
+        assert(self != NULL);
+
+        self->attach_boot = attach_boot;
+}
+
+void boot_manager_set_no_efi_writes_if_bootable(BootManager *self, bool no_writes)
 {
         assert(self != NULL);
-        return ((self->bootloader->get_capabilities(self) & BOOTLOADER_CAP_PARTLESS)
-                && !(self->sysconfig->wanted_boot_mask & BOOTLOADER_CAP_UEFI)
+
+        self->no_efi_writes_if_bootable = no_writes;
+}
+
+bool boot_manager_is_no_efi_writes_if_bootable(BootManager *self)
+{
+        assert(self != NULL);
+        return self->no_efi_writes_if_bootable;
+}
+
+bool check_partitionless_boot(BootManager *self, const char *boot_dir)
+{
+        assert(self != NULL);
+
+        const BootLoader *bootloader = boot_manager_get_bootloader(self);
+
+        return (bootloader && (bootloader->get_capabilities(self) & BOOTLOADER_CAP_PARTLESS)
+                && !(boot_manager_get_wanted_boot_mask(self) & BOOTLOADER_CAP_UEFI)
                 && !cbm_is_dir_empty(boot_dir));
 }
 
@@ -13,7 +13,10 @@
 #pragma once
 
 #include <dirent.h>
+#include <stdint.h>
 
+#include "compress.h"
+#include "dirfd.h"
 #include "nica/array.h"
 #include "nica/hashmap.h"
 #include "probe.h"
@@ -37,11 +40,63 @@ typedef enum {
         FSTYPE_EXT4 = 1 << 3,
 } FilesystemType;
 
+/**
+ * What a long-lived BootManager must forget before its next update, see
+ * boot_manager_invalidate()
+ */
+typedef enum {
+        BOOT_MANAGER_STALE_KERNELS = 1 << 0, /**<Kernel directory changed */
+        BOOT_MANAGER_STALE_INITRDS = 1 << 1, /**<Freestanding initrds changed */
+        BOOT_MANAGER_STALE_CMDLINE = 1 << 2, /**<cmdline or cmdline.d changed */
+        BOOT_MANAGER_STALE_CONFIG = 1 << 3,  /**<Anything else, forget the whole root */
+        BOOT_MANAGER_STALE_ALL = (1 << 4) - 1,
+} BootManagerStale;
+
+/**
+ * How long the watched directories must stay quiet before an update. Package
+ * transactions take a while to write a kernel, its modules and its initrd,
+ * and the default kernel must not move to one that is only half there.
+ */
+#define BOOT_MANAGER_WATCH_DEBOUNCE_MS 10000
+
+/**
+ * Longest a steady trickle of changes may hold an update back
+ */
+#define BOOT_MANAGER_WATCH_MAX_DELAY_MS 120000
+
+/**
+ * A directory whose contents an update depends on
+ */
+typedef struct BootManagerWatch {
+        const char *path;   /**<Directory, relative to the root */
+        unsigned int stale; /**<What changes within it make stale */
+        bool parent;        /**<Contains other watched directories */
+        bool conf;          /**<KERNEL_CONF_DIRECTORY, told apart by file name */
+} BootManagerWatch;
+
+/**
+ * Changes to the watched directories that no update has applied yet. Times
+ * are in milliseconds on a monotonic clock.
+ */
+typedef struct BootManagerChanges {
+        unsigned int stale;   /**<BootManagerStale mask accumulated since the last update */
+        bool pending;         /**<Whether an update is due */
+        bool requested;       /**<Asked for outright, so due without waiting */
+        int64_t first_change; /**<When the pending update was first asked for */
+        int64_t last_change;  /**<When the pending update was last asked for */
+} BootManagerChanges;
+
 /**
  * Maximum length for each component in a kernel identifier
  */
 #define CBM_KELEM_LEN 31
 
+/**
+ * Concatenated initrd archives each start on this boundary, zero padded, as
+ * the kernel's cpio parser expects
+ */
+#define CBM_INITRD_ALIGN 4
+
 /**
  * Represents the currently running system kernel
  */
@@ -84,20 +139,38 @@ typedef struct Kernel {
                 char *path;        /**<Basename path of the kernel for the target */
                 char *legacy_path; /**<Old path prior to namespacing (basename) */
                 char *initrd_path; /**<Basename path of initrd for the target */
+                char *bundle_path; /**<Basename path of the merged initrd bundle */
         } target;
 } Kernel;
 
 typedef NcArray KernelArray;
 
+/**
+ * State of the bootloader, as reported by boot_manager_get_status
+ */
+typedef struct BootManagerStatus {
+        const char *bootloader;  /**<Name of the selected bootloader */
+        char *installed_version; /**<Version on the boot partition, or NULL if unknown */
+        char *available_version; /**<Version shipped by the OS, or NULL if unknown */
+        bool needs_install;      /**<Bootloader is missing from the boot partition */
+        bool needs_update;       /**<Installed bootloader differs from the OS copy */
+        int kernel_files;        /**<Kernels, initrds, blobs and UKIs on the boot partition */
+        int fragmented_files;    /**<Of those, split over several extents, or -1 if unknown */
+} BootManagerStatus;
+
 /**
  * Represenative of the system configuration of a given target prefix.
- * This is populated upon examination by @boot_manager_set_prefix.
+ * This is populated when the root set by @boot_manager_set_prefix is first
+ * examined.
  */
 typedef struct SystemConfig {
         char *prefix;                /**<Prefix for all operations */
         CbmDeviceProbe *root_device; /**<The physical root device */
         char *boot_device;           /**<The physical boot device */
         int wanted_boot_mask;        /**<The required bootloader mask */
+        char *key;                   /**<Devices and settings the inspection holds for */
+        dev_t boot_devno;            /**<Device number of boot_device when inspected */
+        char *boot_identity;         /**<Disk behind boot_devno when inspected */
 } SystemConfig;
 
 /**
@@ -126,6 +199,24 @@ void boot_manager_free(BootManager *manager);
  */
 char **boot_manager_list_kernels(BootManager *manager);
 
+/**
+ * Inspect the installed bootloader, mounting the boot partition if needed.
+ * Strings in @status must be released with boot_manager_status_free()
+ */
+bool boot_manager_get_status(BootManager *manager, BootManagerStatus *status);
+
+/**
+ * Release the contents of a BootManagerStatus
+ */
+void boot_manager_status_free(BootManagerStatus *status);
+
+/**
+ * Rewrite every fragmented file within the kernel destination, mounting
+ * the boot partition if needed. Firmware FAT drivers read contiguous files
+ * considerably faster.
+ */
+bool boot_manager_defrag(BootManager *manager);
+
 /**
  * Main actor of the operation, apply all relevant update and GC operations
  *
@@ -150,7 +241,8 @@ bool boot_manager_set_uname(BootManager *manager, const char *uname);
 /**
  * Set the prefix to apply to all filesystem paths
  *
- * @note The path must exist for this function call to work
+ * @note The path must exist for this function call to work. The root is
+ * only inspected, and the bootloader selected, once something needs them.
  *
  * @param prefix Path to use for prefix operations
  *
@@ -158,6 +250,56 @@ bool boot_manager_set_uname(BootManager *manager, const char *uname);
  */
 bool boot_manager_set_prefix(BootManager *manager, char *prefix);
 
+/**
+ * Prepare a BootManager that is kept around between updates for the next
+ * one, dropping whatever the @stale mask of BootManagerStale says changed.
+ *
+ * The inspected root is kept unless BOOT_MANAGER_STALE_CONFIG is set or its
+ * devices changed since, so they aren't probed again. Partition tables, where
+ * the boot partition is mounted, and so the bootloader, are always looked up
+ * afresh.
+ *
+ * @note Freestanding initrds dropped here must be enumerated again
+ */
+void boot_manager_invalidate(BootManager *manager, unsigned int stale);
+
+/**
+ * Return the directories to watch for changes, setting @n_watches to their
+ * number
+ */
+const BootManagerWatch *boot_manager_get_watches(size_t *n_watches);
+
+/**
+ * Work out what a change to @name within @watch makes stale, as a
+ * BootManagerStale mask. @name is NULL for changes to @watch itself, and
+ * @is_dir tells whether it is a directory.
+ */
+unsigned int boot_manager_watch_stale(const BootManagerWatch *watch, const char *name,
+                                      bool is_dir);
+
+/**
+ * Note at @now that a change making @stale stale was seen, which becomes due
+ * once things have settled
+ */
+void boot_manager_changes_mark(BootManagerChanges *changes, unsigned int stale, int64_t now);
+
+/**
+ * Note at @now that an update was asked for, which is due right away
+ */
+void boot_manager_changes_request(BootManagerChanges *changes, int64_t now);
+
+/**
+ * Return how many milliseconds after @now the pending update is due, or -1
+ * if there is none
+ */
+int boot_manager_changes_timeout(const BootManagerChanges *changes, int64_t now);
+
+/**
+ * Take everything noted so far for an update, returning the BootManagerStale
+ * mask to pass to boot_manager_invalidate()
+ */
+unsigned int boot_manager_changes_take(BootManagerChanges *changes);
+
 /**
  * Override the internal boot directory, forcing a reconfiguration.
  * This should only be used if the client has no need to mount the configured
@@ -172,6 +314,13 @@ bool boot_manager_set_boot_dir(BootManager *manager, const char *bootdir);
  */
 int boot_manager_get_wanted_boot_mask(BootManager *self);
 
+/**
+ * Select the bootloader for the root, unless that already happened
+ *
+ * @return true if a bootloader suits the system and could be initialised
+ */
+bool boot_manager_has_bootloader(BootManager *self);
+
 /**
  * Get the current filesystem prefix
  *
@@ -265,6 +414,17 @@ bool boot_manager_install_kernel(BootManager *manager, const Kernel *kernel);
  */
 char *boot_manager_get_boot_dir(BootManager *manager);
 
+/**
+ * Open handle on the boot directory, valid until it is mounted, unmounted
+ * or changed. For --path roots lookups beneath it cannot leave the root.
+ *
+ * Kernels, initrds, blobs and unified kernel images are written through
+ * it. Bootloader binaries and configuration are still written by path.
+ *
+ * @return the handle, owned by the manager, or NULL if it cannot be opened
+ */
+const CbmDir *boot_manager_get_boot_handle(BootManager *manager);
+
 /**
  * Return the bootloader private data
  */
@@ -315,8 +475,9 @@ int boot_manager_detect_and_mount_boot(BootManager *self, char **boot_dir);
 /**
  * Return the CbmDeviceProbe for the root partition
  *
- * @note This struct belongs to BootManager and should not be freed. Also
- * note that it is only initialised during @boot_manager_set_prefix
+ * @note This struct belongs to BootManager and should not be freed. The
+ * root is probed on the first call after @boot_manager_set_prefix, and NULL
+ * is returned if it cannot be.
  */
 const CbmDeviceProbe *boot_manager_get_root_device(BootManager *manager);
 
@@ -346,6 +507,30 @@ void boot_manager_set_update_efi_vars(BootManager *self, bool update_efi_vars);
  */
 bool boot_manager_is_update_efi_vars(BootManager *self);
 
+/**
+ * Mark the boot manager as only ever reading the system, as for get-timeout,
+ * so that nothing is cached beneath the prefix on its behalf
+ */
+void boot_manager_set_read_only(BootManager *self, bool read_only);
+
+/**
+ * Require the boot partition to be mounted at the boot directory, as for
+ * mount-boot, where the mount has to outlive us. Detached mounts are never
+ * used then.
+ */
+void boot_manager_set_attach_boot(BootManager *self, bool attach_boot);
+
+/**
+ * Set whether efi variables should be left alone when the fallback bootloader
+ * (i.e. \EFI\Boot\BOOTX64.EFI) is already installed and current
+ */
+void boot_manager_set_no_efi_writes_if_bootable(BootManager *self, bool no_writes);
+
+/**
+ * Returns the boot manager's no_efi_writes_if_bootable flag
+ */
+bool boot_manager_is_no_efi_writes_if_bootable(BootManager *self);
+
 /**
  * Determine the default timeout based on the contents of
  * SYSCONFDIR/boot_timeout
@@ -366,6 +551,62 @@ char *boot_manager_get_console_mode(BootManager *manager);
  */
 bool boot_manager_set_console_mode(BootManager *manager, const char *mode);
 
+/**
+ * Determine whether kernels should be assembled into Unified Kernel Images,
+ * based on the contents of SYSCONFDIR/uki
+ */
+bool boot_manager_get_uki_enabled(BootManager *manager);
+
+/**
+ * Determine whether each kernel's initrds should be merged into a single
+ * bundle on the boot partition, based on the contents of
+ * SYSCONFDIR/initrd_bundle
+ */
+bool boot_manager_get_initrd_bundle_enabled(BootManager *manager);
+
+/**
+ * Determine whether initrds shared between kernels should be stored on the
+ * ESP by content hash, based on the contents of SYSCONFDIR/initrd_blobs
+ */
+bool boot_manager_get_initrd_blobs_enabled(BootManager *manager);
+
+/**
+ * Determine whether files copied to the boot partition should bypass the
+ * page cache, based on the contents of SYSCONFDIR/direct_io
+ */
+bool boot_manager_get_direct_io_enabled(BootManager *manager);
+
+/**
+ * Determine whether kernels and initrds should be read back and checked
+ * against the digest taken while copying them, based on the contents of
+ * SYSCONFDIR/verify_copies
+ */
+bool boot_manager_get_verify_copies_enabled(BootManager *manager);
+
+/**
+ * Determine whether the boot partition should be mounted without attaching
+ * it to the boot directory, based on the contents of SYSCONFDIR/detached_mount
+ */
+bool boot_manager_get_detached_mount_enabled(BootManager *manager);
+
+/**
+ * Determine which ESPs mirror the boot device, based on the contents of
+ * SYSCONFDIR/esp_mirrors: "auto", "no", or a list of device nodes.
+ *
+ * @return a newly allocated string, or NULL if unset
+ */
+char *boot_manager_get_esp_mirrors(BootManager *manager);
+
+/**
+ * Determine how initrds should be recompressed before they are installed,
+ * based on the contents of SYSCONFDIR/initrd_compression, i.e. "zstd:19".
+ * A @level of 0 selects the compressor's default.
+ *
+ * @return true if recompression is enabled
+ */
+bool boot_manager_get_initrd_compression(BootManager *manager, CbmCompression *compression,
+                                         int *level);
+
 /**
  * Determine the default kernel for the given type if it is in the set
  * This does not create a new instance, simply a pointer to the existing
@@ -431,15 +672,23 @@ bool cbm_parse_system_kernel(const char *inp, SystemKernel *kernel);
 void cbm_free_sysconfig(SystemConfig *config);
 
 /**
- * Inspect a given root path and return a new SystemConfig for it
+ * Inspect a given root path and return a new SystemConfig for it. The
+ * result is only cached for next time if @update_cache is set.
  */
-SystemConfig *cbm_inspect_root(const char *path, bool image_mode);
+SystemConfig *cbm_inspect_root(const char *path, bool image_mode, bool update_cache);
 
 /**
  * Determine if the given SystemConfig is sane for use
  */
 bool cbm_is_sysconfig_sane(SystemConfig *config);
 
+/**
+ * Check whether the devices @config was inspected from are still the same
+ * ones, by device number and sysfs identity, as block devices can come and
+ * go underneath a long-lived BootManager
+ */
+bool cbm_is_sysconfig_current(const SystemConfig *config, bool image_mode);
+
 /**
  * Free a kernel type
  */
@@ -486,6 +735,63 @@ void boot_manager_initrd_iterator_init(const BootManager *manager, NcHashmapIter
  */
 bool boot_manager_initrd_iterator_next(NcHashmapIter *iter, char **name);
 
+/**
+ * Get the source paths of every initrd to be loaded with @kernel, in load
+ * order: the microcode initrd, the kernel's own initrd and its extras, then
+ * the remaining freestanding initrds.
+ *
+ * @return a newly allocated array of strings, free with nc_array_free(&a, free)
+ */
+NcArray *boot_manager_get_initrd_sources(const BootManager *manager, const Kernel *kernel);
+
+/**
+ * Determine whether @kernel installs produce a Unified Kernel Image rather
+ * than separate kernel and initrd files. This requires UKI mode to be enabled
+ * and the bootloader to be able to assemble one.
+ */
+bool boot_manager_use_uki(const BootManager *manager);
+
+/**
+ * Determine whether the initrds of each kernel are merged into a single
+ * bundle on the boot partition. UKI mode takes precedence, as the initrds are
+ * then embedded in the image itself.
+ */
+bool boot_manager_use_initrd_bundle(const BootManager *manager);
+
+/**
+ * Get the basename of the initrd bundle that bootloader entries for @kernel
+ * should reference instead of the individual initrds.
+ *
+ * @return the bundle name, or NULL if bundles are not in use or @kernel has
+ * no initrds at all
+ */
+const char *boot_manager_get_initrd_bundle(const BootManager *manager, const Kernel *kernel);
+
+/**
+ * Determine whether the microcode, extra and freestanding initrds are stored
+ * once on the ESP by content hash and shared between kernels. Only the
+ * kernel's own initrd is then installed as a separate file. Requires a UEFI
+ * bootloader, and neither UKI nor bundle mode.
+ */
+bool boot_manager_use_initrd_blobs(const BootManager *manager);
+
+/**
+ * Get the name of the content addressed blob for the initrd at @source,
+ * relative to the kernel destination directory, i.e. "blobs/$sha256.cpio"
+ *
+ * @return the blob name, owned by the manager, or NULL if @source is unreadable
+ */
+const char *boot_manager_get_initrd_blob(const BootManager *manager, const char *source);
+
+/**
+ * Get the path of the file to install in place of the initrd at @source.
+ * With recompression enabled this is a cached copy of @source in the
+ * configured format, provided it came out smaller; otherwise @source itself.
+ *
+ * @return the path to install from, owned by the manager or @source
+ */
+const char *boot_manager_transcode_initrd(const BootManager *manager, const char *source);
+
 DEF_AUTOFREE(BootManager, boot_manager_free)
 DEF_AUTOFREE(KernelArray, kernel_array_free)
 DEF_AUTOFREE(Kernel, free_kernel)
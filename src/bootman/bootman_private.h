@@ -22,41 +22,204 @@
 
 #include "bootloader.h"
 #include "bootman.h"
+#include "dirfd.h"
+#include "manifest.h"
 #include "os-release.h"
 
+/**
+ * Shared initrd payloads live in a directory next to the kernels, named for
+ * the SHA-256 of their contents:
+ *
+ *      $kernel_dest/blobs/$sha256.cpio
+ *
+ * The contents of a blob never change, as identical contents always map to
+ * the same name. Loader entries reference the blobs directly, and any
+ * blob no longer referenced by an entry is dropped by
+ * boot_manager_gc_initrd_blobs().
+ */
+#define BLOBS_DIR "blobs"
+#define BLOB_SUFFIX ".cpio"
+
 struct BootManager {
+        char *prefix;                  /**<Resolved root of the target system */
         char *kernel_dir;              /**<Kernel directory */
         const BootLoader *bootloader;  /**<Selected bootloader */
+        bool bootloader_failed;        /**<Selection failed and was reported */
         CbmOsRelease *os_release;      /**<Parsed os-release file */
         NcHashmap *vconsole;           /**<Parsed /etc/vconsole.conf */
         char *abs_bootdir;             /**<Real boot dir */
+        CbmDir *root_handle;           /**<Open handle on the prefix */
+        CbmDir *boot_handle;           /**<Open handle on the boot dir */
+        CbmDir *kernel_handle;         /**<Open handle on the kernel destination */
+        CbmManifest *manifest;         /**<Manifest of the kernel destination */
+        int boot_mount_fd;             /**<Detached mount of the boot partition, or -1 */
+        char *boot_mount_restore;      /**<Boot dir to go back to once it is released */
         SystemKernel sys_kernel;       /**<Native kernel info, if any */
         bool have_sys_kernel;          /**<Whether sys_kernel is set */
         bool image_mode;               /**<Are we in image mode? */
         bool update_efi_vars;          /**<Should we update efi variables? */
+        bool read_only;                /**<Leave caches beneath the prefix alone */
+        bool attach_boot;              /**<Only mount the boot partition where others see it */
+        bool no_efi_writes_if_bootable; /**<Skip efi variables if the fallback boots */
         SystemConfig *sysconfig;       /**<System configuration */
         char *cmdline;                 /**<Additional cmdline to append */
+        bool cmdline_loaded;           /**<Whether cmdline.d has been merged */
         char *initrd_freestanding_dir; /**<Initrd without kernel deps directory */
         char *user_initrd_freestanding_dir; /**<User's initrd without kernel deps directory */
         NcHashmap *initrd_freestanding;/**<Array of initrds without kernel deps */
         char *ucode_initrd;            /**<initrd containing microcode for early loading */
+        KernelArray *batch_installed;  /**<Kernels installed while entries are batched */
+        NcHashmap *initrd_blobs;       /**<Initrd source path to content addressed blob name */
+        NcHashmap *initrd_transcoded;  /**<Initrd source path to the path to install from */
+        NcHashmap *initrd_cache_used;  /**<Names within the recompressed initrd cache in use */
         void *data; /**<Bootloaders private data */
 };
 
+/**
+ * The root is only inspected, and the bootloader only selected, when first
+ * needed. Trivial commands like get-timeout therefore never probe a device.
+ *
+ * @return the inspected system configuration, or NULL if the root could
+ * not be inspected
+ */
+SystemConfig *boot_manager_get_sysconfig(BootManager *self);
+
+/**
+ * Select and initialise the bootloader on first use
+ *
+ * @return the selected bootloader, or NULL if none fits the system
+ */
+const BootLoader *boot_manager_get_bootloader(BootManager *self);
+
+/**
+ * Merge the cmdline.d files of the root on first use
+ *
+ * @return the additional cmdline, or NULL if there is none
+ */
+const char *boot_manager_get_cmdline(BootManager *self);
+
+/**
+ * Open handle on the root of the target system. For --path roots every
+ * lookup beneath it is confined to the root, symlinks included.
+ *
+ * @return the handle, owned by the manager, or NULL if it cannot be opened
+ */
+const CbmDir *boot_manager_get_root_handle(BootManager *self);
+
+/**
+ * Open handle on the directory kernels are installed to, which is the boot
+ * directory itself for legacy bootloaders
+ */
+const CbmDir *boot_manager_get_kernel_handle(BootManager *self);
+
+/**
+ * Manifest of the files we copied to the kernel destination, loaded on
+ * first use and written back when the handles are closed
+ *
+ * @return the manifest, owned by the manager, or NULL if the kernel
+ * destination cannot be opened
+ */
+CbmManifest *boot_manager_get_manifest(BootManager *self);
+
+/**
+ * Close all directory handles, so they don't keep the boot partition busy
+ * or outlive a change of the boot directory
+ */
+void boot_manager_close_handles(BootManager *self);
+
+/**
+ * The bootloader already selected for @self, without selecting one. This is
+ * for const paths, which are only reached from the bootloader itself or
+ * after boot_manager_get_bootloader() succeeded.
+ */
+static inline const BootLoader *boot_manager_selected_bootloader(const BootManager *self)
+{
+        return self->bootloader;
+}
+
 /**
  * Internal function to install the kernel blob itself
  */
-bool boot_manager_install_kernel_internal(const BootManager *manager, const Kernel *kernel);
+bool boot_manager_install_kernel_internal(BootManager *manager, const Kernel *kernel);
 
 /**
  * Internal function to remove the kernel blob itself
  */
-bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kernel *kernel);
+bool boot_manager_remove_kernel_internal(BootManager *manager, const Kernel *kernel);
+
+/**
+ * Start batching kernel entries. While batched, installing or removing a
+ * kernel only touches the kernel blobs, and the bootloader writes all of
+ * its entries at once in boot_manager_end_kernel_batch().
+ *
+ * This is a no-op for bootloaders without reconcile_kernels support.
+ */
+void boot_manager_begin_kernel_batch(BootManager *self);
+
+/**
+ * Hand all kernels installed since boot_manager_begin_kernel_batch() to the
+ * bootloader for reconciliation. Entries for kernels in neither @known nor
+ * the installed set are removed.
+ *
+ * @return true if there was no batch, or the bootloader succeeded
+ */
+bool boot_manager_end_kernel_batch(BootManager *self, const KernelArray *known);
+
+/**
+ * Install the content addressed blobs for every shared initrd of @kernel,
+ * writing only those not already present on the ESP
+ */
+bool boot_manager_install_initrd_blobs(BootManager *manager, const Kernel *kernel);
+
+/**
+ * Remove every initrd blob that is not referenced by the entries of
+ * @kernels. When blobs are disabled, all of them are removed.
+ */
+bool boot_manager_gc_initrd_blobs(BootManager *self, KernelArray *kernels);
+
+/**
+ * Remove every recompressed initrd, and skip marker, that none of @kernels
+ * uses from the cache on the root filesystem
+ */
+bool boot_manager_gc_transcoded_initrds(BootManager *self, KernelArray *kernels);
+
+/**
+ * Make @name within @dir hold the concatenation of @sources, each starting
+ * on an @align boundary if it is set. Copies we made
+ * ourselves are known to be current from the manifest without reading
+ * anything. A single source that was merely reinstalled is checked against
+ * the manifest by its cached digest. Otherwise the sources are hashed as
+ * they are compared or copied, so they are read once either way.
+ */
+bool boot_manager_copy_to_kernel_dest(const BootManager *manager, const CbmDir *dir,
+                                      const char *name, const char *const *sources, size_t align);
+
+/**
+ * Bring every ESP mirroring the boot device in line with it, in parallel,
+ * and give each an EFI boot entry. Only the directories the bootloader
+ * and kernels are installed to are mirrored. The mirrors are either
+ * configured or discovered on the disks of the root's RAID set.
+ *
+ * @return true if there are no mirrors, or all of them now match
+ */
+bool boot_manager_sync_mirrors(BootManager *self);
+
+/**
+ * Count the files within the kernel destination, its blobs and the Unified
+ * Kernel Images, and how many of them are split over several extents. With
+ * @rewrite, fragmented files are copied afresh in a single preallocated
+ * extent.
+ *
+ * @return false if the destination cannot be read, @fragmented is -1 if
+ * the filesystem cannot report extents
+ */
+bool boot_manager_scan_fragmentation(BootManager *self, bool rewrite, int *files,
+                                     int *fragmented);
 
 /**
  * Internal function to unmount boot directory
  */
-void umount_boot(char *boot_dir);
+void umount_boot(BootManager *self, char *boot_dir);
 
 /**
  * Internal function to mount the boot directory
@@ -84,6 +247,12 @@ int kernel_compare_reverse(const void *a, const void *b);
  */
 const char *cbm_get_fstype_name(const char *boot_device);
 
+/**
+ * Given a boot_device returns the options to mount it with when detached,
+ * or NULL if there are none
+ */
+const char *cbm_get_fstype_mount_options(const char *boot_device);
+
 /**
  * Check if the system supports a "partitionless" (the system has no /boot partition) boot.
  * Conditions are:
@@ -91,7 +260,7 @@ const char *cbm_get_fstype_name(const char *boot_device);
  * - The system is not UEFI.
  * - The /boot folder is not empty.
  */
-bool check_partitionless_boot(const BootManager *self, const char *boot_dir);
+bool check_partitionless_boot(BootManager *self, const char *boot_dir);
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
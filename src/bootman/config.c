@@ -26,20 +26,20 @@
 static bool write_sysconf_file(BootManager *self, const char *filename, const char *contents)
 {
         assert(self != NULL);
-        assert(self->sysconfig != NULL);
+        assert(self->prefix != NULL);
 
         autofree(FILE) *fp = NULL;
         autofree(char) *path = NULL;
         autofree(char) *dir = NULL;
 
-        dir = string_printf("%s%s", self->sysconfig->prefix, KERNEL_CONF_DIRECTORY);
+        dir = string_printf("%s%s", self->prefix, KERNEL_CONF_DIRECTORY);
 
         if (!nc_mkdir_p(dir, 00755)) {
                 LOG_ERROR("Failed to create directory %s: %s", dir, strerror(errno));
                 return false;
         }
 
-        path = string_printf("%s%s/%s", self->sysconfig->prefix, KERNEL_CONF_DIRECTORY, filename);
+        path = string_printf("%s%s/%s", self->prefix, KERNEL_CONF_DIRECTORY, filename);
 
         if (contents == NULL) {
                 /* Nothing to be done here. */
@@ -85,14 +85,14 @@ bool boot_manager_set_console_mode(BootManager *self, const char *mode)
 static char *read_sysconf_value(BootManager *self, const char *filename)
 {
         assert(self != NULL);
-        assert(self->sysconfig != NULL);
+        assert(self->prefix != NULL);
 
         autofree(FILE) *fp = NULL;
         autofree(char) *path = NULL;
         autofree(char) *line = NULL;
         size_t size = 0;
 
-        path = string_printf("%s%s/%s", self->sysconfig->prefix, KERNEL_CONF_DIRECTORY, filename);
+        path = string_printf("%s%s/%s", self->prefix, KERNEL_CONF_DIRECTORY, filename);
         if (!nc_file_exists(path)) {
                 return NULL;
         }
@@ -135,6 +135,110 @@ char *boot_manager_get_console_mode(BootManager *self)
         return read_sysconf_value(self, "console_mode");
 }
 
+bool boot_manager_get_uki_enabled(BootManager *self)
+{
+        autofree(char) *value = read_sysconf_value(self, "uki");
+        if (value == NULL) {
+                return false;
+        }
+
+        return streq(value, "yes") || streq(value, "true") || streq(value, "1");
+}
+
+bool boot_manager_get_initrd_bundle_enabled(BootManager *self)
+{
+        autofree(char) *value = read_sysconf_value(self, "initrd_bundle");
+        if (value == NULL) {
+                return false;
+        }
+
+        return streq(value, "yes") || streq(value, "true") || streq(value, "1");
+}
+
+bool boot_manager_get_initrd_blobs_enabled(BootManager *self)
+{
+        autofree(char) *value = read_sysconf_value(self, "initrd_blobs");
+        if (value == NULL) {
+                return false;
+        }
+
+        return streq(value, "yes") || streq(value, "true") || streq(value, "1");
+}
+
+bool boot_manager_get_direct_io_enabled(BootManager *self)
+{
+        autofree(char) *value = read_sysconf_value(self, "direct_io");
+        if (value == NULL) {
+                return false;
+        }
+
+        return streq(value, "yes") || streq(value, "true") || streq(value, "1");
+}
+
+bool boot_manager_get_verify_copies_enabled(BootManager *self)
+{
+        autofree(char) *value = read_sysconf_value(self, "verify_copies");
+        if (value == NULL) {
+                return false;
+        }
+
+        return streq(value, "yes") || streq(value, "true") || streq(value, "1");
+}
+
+bool boot_manager_get_detached_mount_enabled(BootManager *self)
+{
+        autofree(char) *value = read_sysconf_value(self, "detached_mount");
+        if (value == NULL) {
+                return false;
+        }
+
+        return streq(value, "yes") || streq(value, "true") || streq(value, "1");
+}
+
+char *boot_manager_get_esp_mirrors(BootManager *self)
+{
+        return read_sysconf_value(self, "esp_mirrors");
+}
+
+bool boot_manager_get_initrd_compression(BootManager *self, CbmCompression *compression,
+                                         int *level)
+{
+        autofree(char) *value = read_sysconf_value(self, "initrd_compression");
+        char *sep = NULL;
+        char *end = NULL;
+        long lvl = 0;
+
+        assert(compression != NULL);
+        assert(level != NULL);
+
+        *compression = CBM_COMPRESS_UNKNOWN;
+        *level = 0;
+
+        if (value == NULL || value[0] == '\0' || streq(value, "none")) {
+                return false;
+        }
+
+        sep = strchr(value, ':');
+        if (sep) {
+                *sep = '\0';
+                errno = 0;
+                lvl = strtol(sep + 1, &end, 10);
+                if (errno != 0 || end == sep + 1 || *end != '\0' || lvl < 0 || lvl > 22) {
+                        LOG_ERROR("Invalid initrd compression level: %s", sep + 1);
+                        return false;
+                }
+        }
+
+        *compression = cbm_compression_from_name(value);
+        if (*compression <= CBM_COMPRESS_NONE) {
+                LOG_ERROR("Unsupported initrd compression: %s", value);
+                return false;
+        }
+        *level = (int)lvl;
+
+        return true;
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
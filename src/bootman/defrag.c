@@ -0,0 +1,249 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "esp-index.h"
+#include "files.h"
+#include "log.h"
+#include "nica/array.h"
+
+/**
+ * Left behind by an interrupted copy_file_atomic(), never worth rewriting
+ */
+#define TMP_WRITE_SUFFIX ".TmpWrite"
+
+/**
+ * Extents of the regular file @name within @dest, -1 if unknown and 0 if
+ * it isn't a regular file
+ *
+ * @param sync Flush the file first, only worth it before a rewrite
+ */
+static int boot_manager_file_extents(const CbmDir *dest, const char *name, bool sync)
+{
+        struct stat st = { 0 };
+        int extents;
+        int fd;
+
+        fd = cbm_dir_openat(dest, name, O_RDONLY | O_NOFOLLOW, 0);
+        if (fd < 0) {
+                return 0;
+        }
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+                close(fd);
+                return 0;
+        }
+        extents = cbm_file_extents(fd, sync);
+        close(fd);
+
+        return extents;
+}
+
+/**
+ * Names of the files directly within @subdir of @dest, relative to @dest.
+ * They are all collected up front, as rewriting a file replaces its
+ * directory entry and readdir() could then see it twice or not at all.
+ *
+ * @return the names, or NULL with errno set if @subdir cannot be read
+ */
+static NcArray *boot_manager_list_files(const CbmDir *dest, const char *subdir)
+{
+        struct dirent *ent = NULL;
+        NcArray *ret = NULL;
+        DIR *dir = NULL;
+        int fd;
+
+        fd = cbm_dir_openat(dest, subdir, O_RDONLY | O_DIRECTORY, 0);
+        if (fd < 0 || !(dir = fdopendir(fd))) {
+                if (fd >= 0) {
+                        close(fd);
+                }
+                return NULL;
+        }
+
+        ret = nc_array_new();
+        OOM_CHECK(ret);
+
+        while ((ent = readdir(dir)) != NULL) {
+                size_t len = strlen(ent->d_name);
+                char *name = NULL;
+
+                if (ent->d_name[0] == '.' ||
+                    (len > strlen(TMP_WRITE_SUFFIX) &&
+                     streq(ent->d_name + len - strlen(TMP_WRITE_SUFFIX), TMP_WRITE_SUFFIX))) {
+                        continue;
+                }
+
+                if (streq(subdir, ".")) {
+                        name = strdup(ent->d_name);
+                        OOM_CHECK(name);
+                } else {
+                        name = string_printf("%s/%s", subdir, ent->d_name);
+                }
+                OOM_CHECK(nc_array_add(ret, name));
+        }
+        closedir(dir);
+
+        return ret;
+}
+
+/**
+ * Count, and with @rewrite defragment, the files directly within @subdir
+ * of @dest. A missing @subdir holds nothing to count.
+ */
+static bool boot_manager_scan_dir(const CbmDir *dest, const char *subdir, bool rewrite,
+                                  int *files, int *fragmented)
+{
+        NcArray *names = NULL;
+        bool ret = true;
+
+        names = boot_manager_list_files(dest, subdir);
+        if (!names) {
+                return errno == ENOENT;
+        }
+
+        for (int i = 0; i < names->len; i++) {
+                const char *name = nc_array_get(names, i);
+                autofree(char) *path = NULL;
+                int extents;
+
+                extents = boot_manager_file_extents(dest, name, rewrite);
+                if (extents == 0) {
+                        continue;
+                }
+                (*files)++;
+
+                if (extents < 0) {
+                        *fragmented = -1;
+                        continue;
+                }
+                if (extents == 1) {
+                        continue;
+                }
+                if (*fragmented >= 0) {
+                        (*fragmented)++;
+                }
+
+                path = cbm_dir_path(dest, name);
+                LOG_DEBUG("%s is split over %d extents", path, extents);
+                if (!rewrite) {
+                        continue;
+                }
+
+                /* A fresh copy is preallocated in full before it is written */
+                if (!copy_file_atomic_at(dest, name, path, 00644)) {
+                        LOG_ERROR("Failed to rewrite %s: %s", path, strerror(errno));
+                        ret = false;
+                        continue;
+                }
+                LOG_INFO("Rewrote %s (%d extents, now %d)",
+                         path,
+                         extents,
+                         boot_manager_file_extents(dest, name, true));
+        }
+        nc_array_free(&names, free);
+
+        return ret;
+}
+
+bool boot_manager_scan_fragmentation(BootManager *self, bool rewrite, int *files,
+                                     int *fragmented)
+{
+        autofree(char) *uki_dir = NULL;
+        const CbmDir *dest = NULL;
+        const CbmDir *boot = NULL;
+        bool ret = true;
+
+        assert(self != NULL);
+
+        *files = 0;
+        *fragmented = 0;
+
+        dest = boot_manager_get_kernel_handle(self);
+        boot = boot_manager_get_boot_handle(self);
+        if (!dest || !boot) {
+                return false;
+        }
+
+        /* Kernels and initrds, the blobs shared between them, and the UKIs */
+        if (!boot_manager_scan_dir(dest, ".", rewrite, files, fragmented) ||
+            !boot_manager_scan_dir(dest, BLOBS_DIR, rewrite, files, fragmented)) {
+                ret = false;
+        }
+        if (dest == boot) {
+                return ret;
+        }
+        uki_dir = cbm_esp_build_path(boot->path, "EFI", "Linux", NULL);
+        if (!uki_dir ||
+            !boot_manager_scan_dir(boot,
+                                   uki_dir + strlen(boot->path),
+                                   rewrite,
+                                   files,
+                                   fragmented)) {
+                ret = false;
+        }
+
+        return ret;
+}
+
+bool boot_manager_defrag(BootManager *self)
+{
+        autofree(char) *boot_dir = NULL;
+        int did_mount = -1;
+        int files = 0;
+        int fragmented = 0;
+        bool ret;
+
+        assert(self != NULL);
+
+        CHECK_DBG_RET_VAL(!boot_manager_get_bootloader(self), false, "Invalid boot loader: null");
+
+        did_mount = boot_manager_detect_and_mount_boot(self, &boot_dir);
+        CHECK_DBG_RET_VAL(did_mount < 0, false, "Boot was not mounted");
+
+        cbm_set_direct_io(boot_manager_get_direct_io_enabled(self));
+        ret = boot_manager_scan_fragmentation(self, true, &files, &fragmented);
+        if (!ret) {
+                LOG_ERROR("Unable to defragment the kernel destination");
+        } else if (fragmented < 0) {
+                LOG_WARNING("The boot partition cannot report fragmentation");
+        } else {
+                LOG_SUCCESS("Rewrote %d of %d files", fragmented, files);
+        }
+
+        if (did_mount > 0) {
+                umount_boot(self, boot_dir);
+        }
+
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
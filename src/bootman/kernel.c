@@ -22,8 +22,11 @@
 #include "bootman.h"
 #include "bootman_private.h"
 #include "cmdline.h"
+#include "digest.h"
+#include "esp-index.h"
 #include "files.h"
 #include "log.h"
+#include "manifest.h"
 #include "nica/files.h"
 
 #include "config.h"
@@ -60,7 +63,7 @@ __cbm_inline__ static inline char *boot_manager_get_kboot_file(BootManager *self
         char *p = NULL;
         /* /var/lib/kernel/k_booted_4.4.0-120.lts - new */
         p = string_printf("%s/var/lib/kernel/k_booted_%s-%d.%s",
-                          self->sysconfig->prefix,
+                          self->prefix,
                           k->meta.version,
                           k->meta.release,
                           k->meta.ktype);
@@ -98,6 +101,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
         autofree(char) *headers_dir = NULL;
         ssize_t r = 0;
         char *bcp = NULL;
+        const char *global_cmdline = NULL;
 
         if (!self || !path) {
                 return NULL;
@@ -146,7 +150,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
 
         /* Check local modules */
         module_dir = string_printf("%s/%s/%s-%d.%s",
-                                   self->sysconfig->prefix,
+                                   self->prefix,
                                    KERNEL_MODULES_DIRECTORY,
                                    version,
                                    release,
@@ -165,7 +169,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
         if (!nc_file_exists(module_dir)) {
                 free(module_dir);
                 module_dir = string_printf("%s/%s/%s-%d",
-                                           self->sysconfig->prefix,
+                                           self->prefix,
                                            KERNEL_MODULES_DIRECTORY,
                                            version,
                                            release);
@@ -179,7 +183,7 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
 
         /* Check headers directory, standardised path on all distros */
         headers_dir = string_printf("%s/usr/src/linux-headers-%s-%d.%s",
-                                    self->sysconfig->prefix,
+                                    self->prefix,
                                     version,
                                     release,
                                     type);
@@ -258,6 +262,9 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
                 kern->target.initrd_path =
                     string_printf("initrd-%s.%s.%s-%d", KERNEL_NAMESPACE, type, version, release);
         }
+        /* The bundle may consist of freestanding initrds alone */
+        kern->target.bundle_path =
+            string_printf("initrd-bundle-%s.%s.%s-%d", KERNEL_NAMESPACE, type, version, release);
 
         kern->meta.release = (int16_t)release;
 
@@ -270,13 +277,14 @@ Kernel *boot_manager_inspect_kernel(BootManager *self, char *path)
         }
 
         /* Merge global cmdline if we have one */
-        if (self->cmdline) {
-                char *cm = string_printf("%s %s", kern->meta.cmdline, self->cmdline);
+        global_cmdline = boot_manager_get_cmdline(self);
+        if (global_cmdline) {
+                char *cm = string_printf("%s %s", kern->meta.cmdline, global_cmdline);
                 free(kern->meta.cmdline);
                 kern->meta.cmdline = cm;
         }
 
-        cbm_parse_cmdline_removal_files_directory(self->sysconfig->prefix, kern->meta.cmdline);
+        cbm_parse_cmdline_removal_files_directory(self->prefix, kern->meta.cmdline);
 
         kern->source.cmdline_file = strdup(cmdline);
 
@@ -363,6 +371,7 @@ void free_kernel(Kernel *t)
         free(t->source.initrd_file);
         free(t->source.user_initrd_file);
         free(t->target.initrd_path);
+        free(t->target.bundle_path);
         free(t->target.path);
         free(t);
 }
@@ -434,79 +443,6 @@ oom:
         return NULL;
 }
 
-bool cbm_parse_system_kernel(const char *inp, SystemKernel *kernel)
-{
-        if (!kernel || !inp) {
-                return false;
-        }
-
-        /* Re-entrant, we might've mangled the kernel obj */
-        memset(kernel, 0, sizeof(struct SystemKernel));
-
-        char krelease[CBM_KELEM_LEN + 1] = { 0 };
-        long release = 0;
-        ssize_t len;
-        char *c, *c2, *junk = NULL;
-
-        c = strchr(inp, '-');
-        if (!c) {
-                return false;
-        }
-        if (c - inp >= CBM_KELEM_LEN) {
-                return false;
-        }
-        if (*(c + 1) == '\0') {
-                return false;
-        }
-        c2 = strchr(c + 1, '.');
-        if (!c2) {
-                return false;
-        }
-        /* Check length */
-        if (c2 - c >= CBM_KELEM_LEN) {
-                return false;
-        }
-
-        /* Copy version */
-        len = c - inp;
-        if (len < 1) {
-                return false;
-        }
-        strncpy(kernel->version, inp, (size_t)len);
-        kernel->version[len + 1] = '\0';
-
-        /* Copy release */
-        len = c2 - c - 1;
-        if (len < 1) {
-                return false;
-        }
-        strncpy(krelease, c + 1, (size_t)len);
-        krelease[len + 1] = '\0';
-
-        /* Sane release? */
-        release = strtol(krelease, &junk, 10);
-        if (junk == krelease) {
-                return false;
-        }
-        kernel->release = (int16_t)release;
-
-        /* Wind the type size **/
-        len = 0;
-        for (char *j = c2 + 1; *j; ++j) {
-                ++len;
-        }
-
-        if (len < 1 || len + 1 > CBM_KELEM_LEN) {
-                return false;
-        }
-
-        /* Kernel type */
-        strncpy(kernel->ktype, c2 + 1, (size_t)len);
-        kernel->ktype[len + 1] = '\0';
-
-        return true;
-}
-
 const SystemKernel *boot_manager_get_system_kernel(BootManager *self)
 {
         if (!self || !self->have_sys_kernel) {
@@ -594,9 +530,9 @@ Kernel *boot_manager_get_last_booted(BootManager *self, KernelArray *kernels)
  */
 static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, const Kernel *kernel)
 {
-        autofree(char) *base_path = NULL;
         autofree(char) *initrd_target = NULL;
         autofree(char) *kfile_target = NULL;
+        const CbmDir *boot = NULL;
         bool ret = true;
         bool migrated = false;
 
@@ -604,14 +540,17 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         assert(kernel != NULL);
 
         /* Boot path */
-        base_path = boot_manager_get_boot_dir((BootManager *)manager);
+        boot = boot_manager_get_boot_handle((BootManager *)manager);
+        if (!boot) {
+                return false;
+        }
 
-        kfile_target = string_printf("%s/%s", base_path, kernel->target.legacy_path);
-        initrd_target = string_printf("%s/%s", base_path, kernel->target.initrd_path);
+        kfile_target = cbm_dir_path(boot, kernel->target.legacy_path);
+        initrd_target = cbm_dir_path(boot, kernel->target.initrd_path);
 
         /* Remove old kernel */
-        if (nc_file_exists(kfile_target)) {
-                if (unlink(kfile_target) < 0) {
+        if (cbm_esp_exists(kfile_target)) {
+                if (!cbm_dir_unlink(boot, kernel->target.legacy_path)) {
                         LOG_ERROR("Failed to remove legacy-path UEFI kernel %s: %s",
                                   kfile_target,
                                   strerror(errno));
@@ -622,8 +561,8 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         }
 
         /* Remove old initrd */
-        if (nc_file_exists(initrd_target)) {
-                if (unlink(initrd_target) < 0) {
+        if (cbm_esp_exists(initrd_target)) {
+                if (!cbm_dir_unlink(boot, kernel->target.initrd_path)) {
                         LOG_ERROR("Failed to remove legacy-path UEFI initrd %s: %s",
                                   initrd_target,
                                   strerror(errno));
@@ -642,15 +581,17 @@ static bool boot_manager_remove_legacy_uefi_kernel(const BootManager *manager, c
         return ret;
 }
 
-bool _copy_glob_result(const glob_t files, const char *target_dir) {
+bool _copy_glob_result(const BootManager *manager, const glob_t files, const CbmDir *target_dir) {
         for(size_t i = 0; i < files.gl_pathc; i++) {
-                char *initrd_source = files.gl_pathv[i];
-                autofree(char) *initrd_target = string_printf("%s/%s", target_dir, basename(files.gl_pathv[i]));
+                const char *initrd_source =
+                    boot_manager_transcode_initrd(manager, files.gl_pathv[i]);
+                const char *initrd_name = basename(files.gl_pathv[i]);
+                autofree(char) *initrd_target = cbm_dir_path(target_dir, initrd_name);
 
                 LOG_DEBUG("installing extra initrd: %s", files.gl_pathv[i]);
 
                 if (!cbm_files_match(initrd_source, initrd_target)) {
-                        if (!copy_file_atomic(initrd_source, initrd_target, 00644)) {
+                        if (!copy_file_atomic_at(target_dir, initrd_name, initrd_source, 00644)) {
                                 return false;
                         }
                 }
@@ -659,14 +600,15 @@ bool _copy_glob_result(const glob_t files, const char *target_dir) {
         return true;
 }
 
-bool _copy_extra_initrds(const char *initrd_base, const char *target_dir) {
+bool _copy_extra_initrds(const BootManager *manager, const char *initrd_base,
+                         const CbmDir *target_dir) {
         autofree(char) *initrd_glob = string_printf("%s.*", initrd_base);
         glob_t files;
 
         int res = glob(initrd_glob, 0, NULL, &files);
         bool ret = (res == GLOB_NOMATCH);
         if (res == 0) {
-                ret = _copy_glob_result(files, target_dir);
+                ret = _copy_glob_result(manager, files, target_dir);
         }
 
         globfree(&files);
@@ -674,46 +616,170 @@ bool _copy_extra_initrds(const char *initrd_base, const char *target_dir) {
 }
 
 /**
- * Internal function to install the kernel blob itself
+ * Remove every globbed file, beneath @dir when set. Each of them starts
+ * with the path of @dir, as they were globbed from a path built by it.
  */
-bool boot_manager_install_kernel_internal(const BootManager *manager, const Kernel *kernel)
+bool _remove_glob_result(const CbmDir *dir, const glob_t files) {
+        size_t prefix = dir ? strlen(dir->path) : 0;
+        bool ret = true;
+
+        for(size_t i = 0; i < files.gl_pathc; i++) {
+                const char *path = files.gl_pathv[i];
+                bool removed;
+
+                LOG_DEBUG("removing extra initrd: %s", path);
+
+                if (dir) {
+                        removed = cbm_dir_unlink(dir, path + prefix);
+                } else {
+                        removed = cbm_unlink(path);
+                }
+                if (!removed) {
+                        ret = false;
+                }
+        }
+
+        return ret;
+}
+
+bool _remove_extra_initrds(const CbmDir *dir, const char *initrd_base) {
+        autofree(char) *initrd_glob = string_printf("%s.*", initrd_base);
+        glob_t files;
+
+        int res = glob(initrd_glob, 0, NULL, &files);
+        bool ret = (res == GLOB_NOMATCH);
+        if (res == 0) {
+                ret = _remove_glob_result(dir, files);
+        }
+
+        globfree(&files);
+        return ret;
+}
+
+/**
+ * Remove the separate kernel and initrd copies of @kernel from the ESP, as
+ * they are superseded by its Unified Kernel Image
+ */
+static bool boot_manager_remove_kernel_copies(const Kernel *kernel, const CbmDir *dest,
+                                              const char *kfile_target)
 {
-        autofree(char) *kfile_target = NULL;
-        autofree(char) *base_path = NULL;
         autofree(char) *initrd_target = NULL;
-        autofree(char) *initrd_target_dir = NULL;
-        const char *initrd_source = NULL;
-        bool is_uefi = ((manager->bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? manager->bootloader->get_kernel_destination(manager) : NULL;
+        autofree(char) *bundle_target = NULL;
+        bool changed = false;
 
-        assert(manager != NULL);
-        assert(kernel != NULL);
+        if (cbm_esp_exists(kfile_target)) {
+                if (!cbm_dir_unlink(dest, kernel->target.path)) {
+                        LOG_ERROR("Failed to remove kernel %s: %s", kfile_target, strerror(errno));
+                } else {
+                        changed = true;
+                }
+        }
 
-        if (is_uefi && !efi_boot_dir) {
-                return false;
+        if (kernel->target.initrd_path) {
+                initrd_target = cbm_dir_path(dest, kernel->target.initrd_path);
+                if (cbm_esp_exists(initrd_target)) {
+                        if (!cbm_dir_unlink(dest, kernel->target.initrd_path) ||
+                            !_remove_extra_initrds(dest, initrd_target)) {
+                                LOG_ERROR("Failed to remove initrd %s: %s",
+                                          initrd_target,
+                                          strerror(errno));
+                        } else {
+                                changed = true;
+                        }
+                }
         }
 
-        /* Boot path */
-        base_path = boot_manager_get_boot_dir((BootManager *)manager);
-        OOM_CHECK_RET(base_path, false);
+        bundle_target = cbm_dir_path(dest, kernel->target.bundle_path);
+        if (cbm_esp_exists(bundle_target)) {
+                if (!cbm_dir_unlink(dest, kernel->target.bundle_path)) {
+                        LOG_ERROR("Failed to remove initrd bundle %s: %s",
+                                  bundle_target,
+                                  strerror(errno));
+                } else {
+                        changed = true;
+                }
+        }
 
-        /* for UEFI, the kernel location is prefixed with efi_boot_dir which is
-         * guaranteed to start with '/' since it's its absolute path on ESP. */
-        kfile_target = string_printf("%s%s/%s",
-                                     base_path,
-                                     (is_uefi ? efi_boot_dir : ""),
-                                     (is_uefi ? kernel->target.path : kernel->target.legacy_path));
+        if (changed) {
+                cbm_sync();
+        }
+        return true;
+}
 
-        /* Now copy the kernel file to it's new location */
-        if (!cbm_files_match(kernel->source.path, kfile_target)) {
-                if (!copy_file_atomic(kernel->source.path, kfile_target, 00644)) {
-                        LOG_FATAL("Failed to install kernel %s: %s", kfile_target, strerror(errno));
+bool boot_manager_copy_to_kernel_dest(const BootManager *manager, const CbmDir *dir,
+                                      const char *name, const char *const *sources, size_t align)
+{
+        CbmManifest *manifest = boot_manager_get_manifest((BootManager *)manager);
+        autofree(char) *source = cbm_manifest_source_key(sources);
+        autofree(char) *target = cbm_dir_path(dir, name);
+        const CbmManifestEntry *entry = NULL;
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE] = { 0 };
+        uint8_t check[CBM_SHA256_DIGEST_SIZE] = { 0 };
+        char hex[CBM_SHA256_HEX_SIZE];
+        bool differs = false;
+
+        /* Unpadded copies recorded before must not pass for padded ones */
+        if (source && align && sources[1]) {
+                char *aligned = string_printf("%s@%zu", source, align);
+                free(source);
+                source = aligned;
+        }
+
+        if (manifest && cbm_manifest_lookup(manifest, dir, name, source)) {
+                LOG_DEBUG("%s is unchanged since it was copied", target);
+                return true;
+        }
+
+        /* The copy is as we left it, so its digest tells us whether it differs */
+        if (manifest && source && !sources[1]) {
+                entry = cbm_manifest_lookup(manifest, dir, name, NULL);
+        }
+        if (entry && cbm_file_digest(sources[0], digest)) {
+                cbm_sha256_to_hex(digest, hex);
+                if (streq(hex, entry->digest)) {
+                        LOG_DEBUG("%s already holds the contents of %s", target, sources[0]);
+                        cbm_manifest_record(manifest, dir, name, source, digest);
+                        return true;
+                }
+                differs = true;
+        }
+
+        if (differs || !cbm_files_concat_match_digest(sources, target, align, digest)) {
+                if (!copy_files_atomic_at_digest(dir, name, sources, align, 00644, digest)) {
+                        if (manifest) {
+                                cbm_manifest_forget(manifest, name);
+                        }
+                        return false;
+                }
+
+                /* Checked against what we hashed, not by reading the sources again */
+                if (boot_manager_get_verify_copies_enabled((BootManager *)manager) &&
+                    (!cbm_sha256_file(target, check) || memcmp(check, digest, sizeof(digest)))) {
+                        LOG_ERROR("%s does not match what was written to it", target);
+                        if (manifest) {
+                                cbm_manifest_forget(manifest, name);
+                        }
+                        errno = EIO;
                         return false;
                 }
         }
 
+        if (manifest) {
+                cbm_manifest_record(manifest, dir, name, source, digest);
+        }
+        return true;
+}
+
+/**
+ * Copy the initrd of @kernel, and any extras, to @target_dir as separate files
+ */
+static bool boot_manager_install_initrd_copies(const BootManager *manager, const Kernel *kernel,
+                                               const CbmDir *target_dir)
+{
+        autofree(char) *initrd_target = NULL;
+        const char *initrd_source = NULL;
+        const char *initrd_install = NULL;
+
         /* Install user initrd if it exists, otherwise system initrd */
         if (kernel->source.user_initrd_file) {
                 initrd_source = kernel->source.user_initrd_file;
@@ -724,108 +790,251 @@ bool boot_manager_install_kernel_internal(const BootManager *manager, const Kern
                 return true;
         }
 
-        initrd_target_dir = string_printf("%s%s", base_path, (is_uefi ? efi_boot_dir : ""));
-        initrd_target = string_printf("%s/%s", initrd_target_dir, kernel->target.initrd_path);
+        initrd_target = cbm_dir_path(target_dir, kernel->target.initrd_path);
+        initrd_install = boot_manager_transcode_initrd(manager, initrd_source);
 
-        if (!cbm_files_match(initrd_source, initrd_target)) {
-                if (!copy_file_atomic(initrd_source, initrd_target, 00644)) {
-                        LOG_FATAL("Failed to install initrd %s: %s",
+        if (!boot_manager_copy_to_kernel_dest(manager,
+                                              target_dir,
+                                              kernel->target.initrd_path,
+                                              (const char *[]){ initrd_install, NULL },
+                                              0)) {
+                LOG_FATAL("Failed to install initrd %s: %s", initrd_target, strerror(errno));
+                return false;
+        }
+
+        /* Extras are shared between kernels as blobs instead */
+        if (boot_manager_use_initrd_blobs(manager)) {
+                if (!_remove_extra_initrds(target_dir, initrd_target)) {
+                        LOG_ERROR("Failed to remove extra initrds %s.*: %s",
                                   initrd_target,
                                   strerror(errno));
-                        return false;
                 }
+                return true;
         }
 
-        if (!_copy_extra_initrds(initrd_source, initrd_target_dir)) {
+        if (!_copy_extra_initrds(manager, initrd_source, target_dir)) {
                 LOG_FATAL("Failed to install extra initrds %s: %s",
                           initrd_source,
                           strerror(errno));
                 return false;
         }
 
-        /* Our portion is complete, remove any legacy uefi bits we might have
-         * from previous runs, and then continue and let the bootloader configure
-         * as appropriate.
-         */
-        if (is_uefi && !boot_manager_remove_legacy_uefi_kernel(manager, kernel)) {
-                LOG_WARNING("Failed to remove legacy kernel on ESP: %s",
-                            kernel->target.legacy_path);
-        }
-
         return true;
 }
 
-bool _remove_glob_result(const glob_t files) {
+/**
+ * Merge every initrd of @kernel into a single bundle within @target_dir,
+ * rewriting it only when the contents of a member changed, and drop the
+ * separate copies left over from before bundle mode.
+ */
+static bool boot_manager_install_initrd_bundle(const BootManager *manager, const Kernel *kernel,
+                                               const CbmDir *target_dir)
+{
+        autofree(char) *bundle_target = NULL;
+        autofree(char) *initrd_target = NULL;
+        const char **files = NULL;
+        NcArray *sources = NULL;
         bool ret = true;
 
-        for(size_t i = 0; i < files.gl_pathc; i++) {
-                LOG_DEBUG("removing extra initrd: %s", files.gl_pathv[i]);
+        bundle_target = cbm_dir_path(target_dir, kernel->target.bundle_path);
+        sources = boot_manager_get_initrd_sources(manager, kernel);
 
-                if (unlink(files.gl_pathv[i]) < 0) {
-                        ret = false;
+        if (sources->len == 0) {
+                if (cbm_esp_exists(bundle_target) &&
+                    !cbm_dir_unlink(target_dir, kernel->target.bundle_path)) {
+                        LOG_ERROR("Failed to remove initrd bundle %s: %s",
+                                  bundle_target,
+                                  strerror(errno));
                 }
+                goto cleanup;
         }
 
+        files = calloc((size_t)sources->len + 1, sizeof(char *));
+        OOM_CHECK(files);
+        for (uint16_t i = 0; i < sources->len; i++) {
+                files[i] = boot_manager_transcode_initrd(manager, nc_array_get(sources, i));
+        }
+
+        if (!boot_manager_copy_to_kernel_dest(manager,
+                                              target_dir,
+                                              kernel->target.bundle_path,
+                                              files,
+                                              CBM_INITRD_ALIGN)) {
+                LOG_FATAL("Failed to install initrd bundle %s: %s",
+                          bundle_target,
+                          strerror(errno));
+                ret = false;
+                goto cleanup;
+        }
+
+        if (kernel->target.initrd_path) {
+                initrd_target = cbm_dir_path(target_dir, kernel->target.initrd_path);
+                if (cbm_esp_exists(initrd_target) &&
+                    !cbm_dir_unlink(target_dir, kernel->target.initrd_path)) {
+                        LOG_ERROR("Failed to remove initrd %s: %s",
+                                  initrd_target,
+                                  strerror(errno));
+                }
+                if (!_remove_extra_initrds(target_dir, initrd_target)) {
+                        LOG_ERROR("Failed to remove extra initrds %s.*: %s",
+                                  initrd_target,
+                                  strerror(errno));
+                }
+        }
+
+cleanup:
+        free(files);
+        nc_array_free(&sources, free);
         return ret;
 }
 
-bool _remove_extra_initrds(const char *initrd_base) {
-        autofree(char) *initrd_glob = string_printf("%s.*", initrd_base);
-        glob_t files;
+/**
+ * Internal function to install the kernel blob itself
+ */
+bool boot_manager_install_kernel_internal(BootManager *manager, const Kernel *kernel)
+{
+        autofree(char) *kfile_target = NULL;
+        autofree(char) *bundle_target = NULL;
+        const BootLoader *bootloader = NULL;
+        const CbmDir *dest = NULL;
+        const char *kfile_name = NULL;
+        const char *efi_boot_dir = NULL;
+        bool is_uefi;
 
-        int res = glob(initrd_glob, 0, NULL, &files);
-        bool ret = (res == GLOB_NOMATCH);
-        if (res == 0) {
-                ret = _remove_glob_result(files);
+        assert(manager != NULL);
+        assert(kernel != NULL);
+
+        bootloader = boot_manager_get_bootloader(manager);
+        if (!bootloader) {
+                return false;
         }
+        is_uefi = ((bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
+                   BOOTLOADER_CAP_UEFI);
+        efi_boot_dir = is_uefi ? bootloader->get_kernel_destination(manager) : NULL;
 
-        globfree(&files);
-        return ret;
+        if (is_uefi && !efi_boot_dir) {
+                return false;
+        }
+
+        /* For UEFI this is efi_boot_dir within the ESP, otherwise the boot
+         * directory itself. Everything is written relative to it. */
+        dest = boot_manager_get_kernel_handle(manager);
+        if (!dest) {
+                LOG_FATAL("Cannot open the kernel destination: %s", strerror(errno));
+                return false;
+        }
+
+        kfile_name = is_uefi ? kernel->target.path : kernel->target.legacy_path;
+        kfile_target = cbm_dir_path(dest, kfile_name);
+
+        /* The bootloader assembles kernel and initrds into a single image, so
+         * drop any separate copies left over from before UKI mode */
+        if (is_uefi && boot_manager_use_uki(manager)) {
+                return boot_manager_remove_kernel_copies(kernel, dest, kfile_target);
+        }
+
+        /* Now copy the kernel file to it's new location */
+        if (!boot_manager_copy_to_kernel_dest(manager,
+                                              dest,
+                                              kfile_name,
+                                              (const char *[]){ kernel->source.path, NULL },
+                                              0)) {
+                LOG_FATAL("Failed to install kernel %s: %s", kfile_target, strerror(errno));
+                return false;
+        }
+
+        bundle_target = cbm_dir_path(dest, kernel->target.bundle_path);
+
+        if (boot_manager_use_initrd_bundle(manager)) {
+                if (!boot_manager_install_initrd_bundle(manager, kernel, dest)) {
+                        return false;
+                }
+        } else {
+                if (!boot_manager_install_initrd_copies(manager, kernel, dest)) {
+                        return false;
+                }
+                if (boot_manager_use_initrd_blobs(manager) &&
+                    !boot_manager_install_initrd_blobs(manager, kernel)) {
+                        return false;
+                }
+                /* Left over from bundle mode */
+                if (cbm_esp_exists(bundle_target) &&
+                    !cbm_dir_unlink(dest, kernel->target.bundle_path)) {
+                        LOG_ERROR("Failed to remove initrd bundle %s: %s",
+                                  bundle_target,
+                                  strerror(errno));
+                }
+        }
+
+        /* Our portion is complete, remove any legacy uefi bits we might have
+         * from previous runs, and then continue and let the bootloader configure
+         * as appropriate.
+         */
+        if (is_uefi && !boot_manager_remove_legacy_uefi_kernel(manager, kernel)) {
+                LOG_WARNING("Failed to remove legacy kernel on ESP: %s",
+                            kernel->target.legacy_path);
+        }
+
+        return true;
 }
 
 /**
  * Internal function to remove the kernel blob itself
  */
-bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kernel *kernel)
+bool boot_manager_remove_kernel_internal(BootManager *manager, const Kernel *kernel)
 {
         autofree(char) *kfile_target = NULL;
-        autofree(char) *base_path = NULL;
         autofree(char) *initrd_target = NULL;
-        bool is_uefi = ((manager->bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
-                        BOOTLOADER_CAP_UEFI);
-        const char *efi_boot_dir =
-            is_uefi ? manager->bootloader->get_kernel_destination(manager) : NULL;
+        autofree(char) *bundle_target = NULL;
+        const BootLoader *bootloader = NULL;
+        const CbmDir *dest = NULL;
+        const char *kfile_name = NULL;
+        const char *efi_boot_dir = NULL;
+        bool is_uefi;
 
         assert(manager != NULL);
         assert(kernel != NULL);
 
+        bootloader = boot_manager_get_bootloader(manager);
+        if (!bootloader) {
+                return false;
+        }
+        is_uefi = ((bootloader->get_capabilities(manager) & BOOTLOADER_CAP_UEFI) ==
+                   BOOTLOADER_CAP_UEFI);
+        efi_boot_dir = is_uefi ? bootloader->get_kernel_destination(manager) : NULL;
+
         /* if it's UEFI, then bootloader->get_kernel_dst() must return a value. */
         if (is_uefi && !efi_boot_dir) {
                 return false;
         }
 
-        /* Boot path */
-        base_path = boot_manager_get_boot_dir((BootManager *)manager);
-        OOM_CHECK_RET(base_path, false);
-
-        /* Remove old blobs */
-        kfile_target = string_printf("%s%s/%s",
-                                     base_path,
-                                     (is_uefi ? efi_boot_dir : ""),
-                                     (is_uefi ? kernel->target.path : kernel->target.legacy_path));
-
-        if (kernel->source.initrd_file) {
-                initrd_target = string_printf("%s%s/%s",
-                                              base_path,
-                                              (is_uefi ? efi_boot_dir : ""),
-                                              kernel->target.initrd_path);
+        /* Without a kernel destination there is nothing on the ESP to remove */
+        dest = boot_manager_get_kernel_handle(manager);
+        if (dest) {
+                kfile_name = is_uefi ? kernel->target.path : kernel->target.legacy_path;
+                kfile_target = cbm_dir_path(dest, kfile_name);
+                bundle_target = cbm_dir_path(dest, kernel->target.bundle_path);
+                if (kernel->source.initrd_file) {
+                        initrd_target = cbm_dir_path(dest, kernel->target.initrd_path);
+                }
         }
 
         /* Remove the kernel from the ESP */
-        if (nc_file_exists(kfile_target) && unlink(kfile_target) < 0) {
-                LOG_ERROR("Failed to remove kernel %s: %s", kfile_target, strerror(errno));
-        } else {
-                cbm_sync();
+        if (kfile_target) {
+                if (cbm_esp_exists(kfile_target) && !cbm_dir_unlink(dest, kfile_name)) {
+                        LOG_ERROR("Failed to remove kernel %s: %s", kfile_target, strerror(errno));
+                } else {
+                        cbm_sync();
+                }
+        }
+
+        if (bundle_target) {
+                if (cbm_esp_exists(bundle_target) &&
+                    !cbm_dir_unlink(dest, kernel->target.bundle_path)) {
+                        LOG_ERROR("Failed to remove initrd bundle %s: %s",
+                                  bundle_target,
+                                  strerror(errno));
+                }
         }
 
         /* Purge the kernel modules from disk */
@@ -908,7 +1117,8 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
                                   kernel->source.initrd_file,
                                   strerror(errno));
                 }
-                if (nc_file_exists(initrd_target) && unlink(initrd_target) < 0) {
+                if (initrd_target && cbm_esp_exists(initrd_target) &&
+                    !cbm_dir_unlink(dest, kernel->target.initrd_path)) {
                         LOG_ERROR("Failed to remove initrd blob %s: %s",
                                   initrd_target,
                                   strerror(errno));
@@ -916,13 +1126,13 @@ bool boot_manager_remove_kernel_internal(const BootManager *manager, const Kerne
         }
 
         /* Remove additional initrds */
-        if (!_remove_extra_initrds(kernel->source.initrd_file)) {
+        if (!_remove_extra_initrds(NULL, kernel->source.initrd_file)) {
                 LOG_ERROR("Failed to remove extra initrds %s.*: %s",
                           kernel->source.initrd_file,
                           strerror(errno));
                 return false;
         }
-        if (!_remove_extra_initrds(initrd_target)) {
+        if (initrd_target && !_remove_extra_initrds(dest, initrd_target)) {
                 LOG_ERROR("Failed to remove extra initrds %s.*: %s",
                           initrd_target,
                           strerror(errno));
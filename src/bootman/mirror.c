@@ -0,0 +1,719 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "config.h"
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+#include "bootvar.h"
+#endif
+#include "esp.h"
+#include "files.h"
+#include "log.h"
+#include "manifest.h"
+#include "nica/files.h"
+#include "stats.h"
+#include "system_stub.h"
+
+/**
+ * Records what we copied to an ESP, by path relative to its root. On the
+ * primary ESP it caches the digests the mirrors are compared against.
+ */
+#define CBM_MIRROR_MANIFEST_NAME ".clr-boot-manager.mirror"
+
+/**
+ * Mirrors nobody mounted are mounted beneath here for the update
+ */
+#define CBM_MIRROR_MOUNT_DIR "/run/clr-boot-manager"
+
+/**
+ * Source key recorded for files of the primary ESP, which we didn't copy
+ */
+#define CBM_MIRROR_PRIMARY_SOURCE "primary"
+
+/**
+ * How deep directories on the ESP are followed
+ */
+#define CBM_MIRROR_MAX_DEPTH 16
+
+typedef struct CbmMirrorFile {
+        char *name;                       /**<Path relative to the root of the ESP */
+        char digest[CBM_SHA256_HEX_SIZE]; /**<SHA-256 of the primary copy, as hex */
+} CbmMirrorFile;
+
+/**
+ * The state of the primary ESP every mirror is brought in line with
+ */
+typedef struct CbmMirrorPlan {
+        const CbmDir *primary; /**<Root of the primary ESP */
+        CbmMirrorFile *files;
+        size_t count;
+        size_t size;           /**<Allocated length of @files */
+        NcHashmap *names;      /**<Names of @files, to spot copies gone from the primary */
+        NcArray *roots;        /**<Directories of the ESP we write to, relative to its root */
+        bool verify;           /**<Read every copy on the mirrors back */
+        bool detached;         /**<Mount mirrors without attaching them anywhere */
+} CbmMirrorPlan;
+
+typedef struct CbmMirror {
+        const CbmMirrorPlan *plan;
+        char *device;          /**<Device node of the mirror */
+        const char *fs_name;   /**<Filesystem to mount it as */
+        const char *options;   /**<Options for a detached mount */
+        char *mount;           /**<Where it is mounted */
+        int mount_fd;          /**<Detached mount, or -1 */
+        bool did_mount;        /**<Whether we mounted it */
+        bool ok;               /**<Whether it now holds everything the primary does */
+        CbmManifest *manifest; /**<What was copied to it */
+        pthread_t thread;
+        bool started;
+} CbmMirror;
+
+static void mirror_plan_clear(CbmMirrorPlan *plan)
+{
+        for (size_t i = 0; i < plan->count; i++) {
+                free(plan->files[i].name);
+        }
+        free(plan->files);
+        if (plan->names) {
+                nc_hashmap_free(plan->names);
+        }
+        if (plan->roots) {
+                nc_array_free(&plan->roots, free);
+        }
+        memset(plan, 0, sizeof(*plan));
+}
+
+static void mirror_plan_add(CbmMirrorPlan *plan, const char *name, const char *digest)
+{
+        CbmMirrorFile *file = NULL;
+
+        if (plan->count == plan->size) {
+                plan->size = plan->size ? plan->size * 2 : 64;
+                plan->files = realloc(plan->files, plan->size * sizeof(CbmMirrorFile));
+                OOM_CHECK(plan->files);
+        }
+        file = &plan->files[plan->count++];
+        file->name = strdup(name);
+        OOM_CHECK(file->name);
+        snprintf(file->digest, sizeof(file->digest), "%s", digest);
+
+        OOM_CHECK(nc_hashmap_put(plan->names, file->name, file->name));
+}
+
+/**
+ * Add the ESP directory @path, as a bootloader reports it, to the roots of
+ * @plan
+ */
+static void mirror_plan_add_root(CbmMirrorPlan *plan, const char *path)
+{
+        char *root = NULL;
+        size_t len;
+
+        if (!path) {
+                return;
+        }
+        while (*path == '/' || *path == '\\') {
+                path++;
+        }
+        root = strdup(path);
+        OOM_CHECK(root);
+        for (char *c = root; *c; c++) {
+                if (*c == '\\') {
+                        *c = '/';
+                }
+        }
+        len = strlen(root);
+        while (len > 0 && root[len - 1] == '/') {
+                root[--len] = '\0';
+        }
+
+        /* The root of the ESP itself would take in everybody else's files */
+        if (len == 0 || streq(root, ".")) {
+                free(root);
+                return;
+        }
+        OOM_CHECK(nc_array_add(plan->roots, root));
+}
+
+/**
+ * Whether @name on the ESP is within one of the roots of @plan. vfat
+ * ignores case, and so does the comparison. Directories leading to a root
+ * count as well when @dir is set, so the scan can get there.
+ */
+static bool mirror_plan_owns(const CbmMirrorPlan *plan, const char *name, bool dir)
+{
+        size_t len = strlen(name);
+
+        for (int i = 0; i < plan->roots->len; i++) {
+                const char *root = nc_array_get(plan->roots, i);
+                size_t root_len = strlen(root);
+
+                if (len >= root_len && strncasecmp(name, root, root_len) == 0 &&
+                    (name[root_len] == '\0' || name[root_len] == '/')) {
+                        return true;
+                }
+                if (dir && len < root_len && strncasecmp(name, root, len) == 0 &&
+                    root[len] == '/') {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Add every file beneath @rel on the primary ESP that clr-boot-manager
+ * looks after to @plan. Dotfiles are our own bookkeeping, or somebody
+ * else's, and stay where they are.
+ */
+static bool mirror_plan_scan(CbmMirrorPlan *plan, CbmManifest *manifest, const char *rel,
+                             int depth)
+{
+        autofree(char) *path = NULL;
+        struct dirent *ent = NULL;
+        bool ret = true;
+        DIR *dir = NULL;
+
+        path = rel ? cbm_dir_path(plan->primary, rel) : strdup(plan->primary->path);
+        OOM_CHECK(path);
+        dir = opendir(path);
+        if (!dir) {
+                LOG_ERROR("Unable to list %s: %s", path, strerror(errno));
+                return false;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *name = NULL;
+                autofree(char) *full = NULL;
+                const CbmManifestEntry *entry = NULL;
+                uint8_t digest[CBM_SHA256_DIGEST_SIZE] = { 0 };
+                char hex[CBM_SHA256_HEX_SIZE];
+                struct stat st = { 0 };
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+
+                name = rel ? string_printf("%s/%s", rel, ent->d_name) : strdup(ent->d_name);
+                OOM_CHECK(name);
+                if (!cbm_dir_stat(plan->primary, name, &st)) {
+                        continue;
+                }
+
+                if (!mirror_plan_owns(plan, name, S_ISDIR(st.st_mode))) {
+                        continue;
+                }
+                if (S_ISDIR(st.st_mode)) {
+                        if (depth < CBM_MIRROR_MAX_DEPTH &&
+                            !mirror_plan_scan(plan, manifest, name, depth + 1)) {
+                                ret = false;
+                        }
+                        continue;
+                } else if (!S_ISREG(st.st_mode)) {
+                        continue;
+                }
+
+                entry = cbm_manifest_lookup(manifest, plan->primary, name, NULL);
+                if (entry) {
+                        mirror_plan_add(plan, name, entry->digest);
+                        continue;
+                }
+
+                full = cbm_dir_path(plan->primary, name);
+                if (!cbm_sha256_file(full, digest)) {
+                        LOG_ERROR("Unable to read %s: %s", full, strerror(errno));
+                        ret = false;
+                        continue;
+                }
+                cbm_manifest_record(manifest, plan->primary, name, CBM_MIRROR_PRIMARY_SOURCE,
+                                    digest);
+                cbm_sha256_to_hex(digest, hex);
+                mirror_plan_add(plan, name, hex);
+        }
+        closedir(dir);
+
+        return ret;
+}
+
+/**
+ * Mount @mirror, unless somebody else already did
+ */
+static bool mirror_mount(CbmMirror *mirror)
+{
+        autofree(char) *mount = NULL;
+
+        if (mirror->mount) {
+                return true;
+        }
+
+        if (mirror->plan->detached) {
+                mirror->mount_fd =
+                    cbm_system_mount_detached(mirror->device, mirror->fs_name, mirror->options);
+                if (mirror->mount_fd >= 0) {
+                        mirror->mount = string_printf("/proc/self/fd/%d", mirror->mount_fd);
+                        mirror->did_mount = true;
+                        return true;
+                }
+                LOG_DEBUG("Cannot mount %s detached: %s", mirror->device, strerror(errno));
+        }
+
+        if (!nc_mkdir_p(CBM_MIRROR_MOUNT_DIR, 00700)) {
+                LOG_ERROR("Unable to create %s: %s", CBM_MIRROR_MOUNT_DIR, strerror(errno));
+                return false;
+        }
+        mount = string_printf("%s/mirror-XXXXXX", CBM_MIRROR_MOUNT_DIR);
+        if (!mkdtemp(mount)) {
+                LOG_ERROR("Unable to create a mountpoint for %s: %s",
+                          mirror->device,
+                          strerror(errno));
+                return false;
+        }
+
+        if (cbm_system_mount(mirror->device, mount, mirror->fs_name, MS_MGC_VAL, "") < 0) {
+                LOG_ERROR("Cannot mount mirrored ESP %s on %s: %s",
+                          mirror->device,
+                          mount,
+                          strerror(errno));
+                (void)rmdir(mount);
+                return false;
+        }
+
+        mirror->mount = mount;
+        mount = NULL;
+        mirror->did_mount = true;
+        return true;
+}
+
+/**
+ * Bring @file on @mirror in line with the primary copy
+ */
+static bool mirror_copy_file(const CbmMirror *mirror, const CbmDir *dir,
+                             const CbmMirrorFile *file)
+{
+        const CbmMirrorPlan *plan = mirror->plan;
+        autofree(char) *source = cbm_dir_path(plan->primary, file->name);
+        autofree(char) *target = cbm_dir_path(dir, file->name);
+        autofree(char) *parent = NULL;
+        const char *sources[] = { source, NULL };
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE] = { 0 };
+        char hex[CBM_SHA256_HEX_SIZE];
+
+        parent = strdup(target);
+        OOM_CHECK(parent);
+        if (!nc_mkdir_p(dirname(parent), 00755)) {
+                LOG_ERROR("Unable to create the directory for %s: %s", target, strerror(errno));
+                return false;
+        }
+
+        /* Already there, just not recorded yet */
+        if (cbm_files_concat_match_digest(sources, target, 0, digest)) {
+                cbm_sha256_to_hex(digest, hex);
+                if (streq(hex, file->digest)) {
+                        cbm_manifest_record(mirror->manifest, dir, file->name, file->digest,
+                                            digest);
+                        cbm_stats_inc(CBM_STAT_MIRROR_REUSED);
+                        return true;
+                }
+        }
+
+        if (!copy_files_atomic_at_digest(dir, file->name, sources, 0, 00644, digest)) {
+                LOG_ERROR("Failed to copy %s to %s: %s", source, target, strerror(errno));
+                cbm_manifest_forget(mirror->manifest, file->name);
+                return false;
+        }
+        cbm_stats_inc(CBM_STAT_MIRROR_COPIED);
+
+        cbm_sha256_to_hex(digest, hex);
+        if (!streq(hex, file->digest)) {
+                LOG_ERROR("%s changed while it was copied to %s", source, mirror->device);
+                cbm_manifest_forget(mirror->manifest, file->name);
+                return false;
+        }
+
+        cbm_manifest_record(mirror->manifest, dir, file->name, file->digest, digest);
+        return true;
+}
+
+/**
+ * Check that @mirror holds every file of the plan. The manifest of the
+ * mirror is trusted as long as the copies look unchanged, unless copies are
+ * verified, when every file is read back. Anything that differs from the
+ * primary is forgotten, so the next update copies it again.
+ */
+static bool mirror_agrees(CbmMirror *mirror, const CbmDir *dir)
+{
+        const CbmMirrorPlan *plan = mirror->plan;
+        bool ret = true;
+
+        for (size_t i = 0; i < plan->count; i++) {
+                const CbmMirrorFile *file = &plan->files[i];
+                const CbmManifestEntry *entry = NULL;
+                uint8_t digest[CBM_SHA256_DIGEST_SIZE] = { 0 };
+                char hex[CBM_SHA256_HEX_SIZE];
+
+                if (!plan->verify) {
+                        entry = cbm_manifest_lookup(mirror->manifest, dir, file->name,
+                                                    file->digest);
+                        if (entry && streq(entry->digest, file->digest)) {
+                                continue;
+                        }
+                } else {
+                        autofree(char) *path = cbm_dir_path(dir, file->name);
+
+                        if (cbm_sha256_file(path, digest)) {
+                                cbm_sha256_to_hex(digest, hex);
+                                if (streq(hex, file->digest)) {
+                                        continue;
+                                }
+                        }
+                }
+                LOG_ERROR("%s on mirrored ESP %s differs from the primary ESP",
+                          file->name,
+                          mirror->device);
+                cbm_manifest_forget(mirror->manifest, file->name);
+                ret = false;
+        }
+        return ret;
+}
+
+/**
+ * Copy everything that changed on the primary ESP to @mirror, and remove
+ * what we copied before that the primary no longer has
+ */
+static bool mirror_sync(CbmMirror *mirror)
+{
+        const CbmMirrorPlan *plan = mirror->plan;
+        autofree(CbmDir) *dir = NULL;
+        NcHashmapIter iter = { 0 };
+        NcArray *stale = NULL;
+        void *key = NULL;
+        bool ret = true;
+
+        dir = cbm_dir_open(NULL, mirror->mount, false);
+        if (!dir) {
+                LOG_ERROR("Unable to open %s: %s", mirror->mount, strerror(errno));
+                return false;
+        }
+        mirror->manifest = cbm_manifest_load_named(dir, CBM_MIRROR_MANIFEST_NAME);
+
+        for (size_t i = 0; i < plan->count; i++) {
+                const CbmMirrorFile *file = &plan->files[i];
+
+                if (cbm_manifest_lookup(mirror->manifest, dir, file->name, file->digest)) {
+                        cbm_stats_inc(CBM_STAT_MIRROR_REUSED);
+                        continue;
+                }
+                if (!mirror_copy_file(mirror, dir, file)) {
+                        ret = false;
+                }
+        }
+
+        /* Collected first, as forgetting them changes the manifest */
+        stale = nc_array_new();
+        OOM_CHECK(stale);
+        nc_hashmap_iter_init(mirror->manifest->entries, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, NULL)) {
+                char *name = NULL;
+
+                if (nc_hashmap_get(plan->names, key)) {
+                        continue;
+                }
+                name = strdup(key);
+                OOM_CHECK(name);
+                OOM_CHECK(nc_array_add(stale, name));
+        }
+        for (int i = 0; i < stale->len; i++) {
+                const char *name = nc_array_get(stale, i);
+
+                LOG_DEBUG("Removing %s from mirrored ESP %s", name, mirror->device);
+                if (!cbm_dir_unlink(dir, name) && errno != ENOENT) {
+                        LOG_ERROR("Unable to remove %s from %s: %s",
+                                  name,
+                                  mirror->device,
+                                  strerror(errno));
+                        ret = false;
+                        continue;
+                }
+                cbm_manifest_forget(mirror->manifest, name);
+        }
+        nc_array_free(&stale, free);
+
+        if (!mirror_agrees(mirror, dir)) {
+                ret = false;
+        }
+
+        if (!cbm_manifest_save(mirror->manifest, dir)) {
+                LOG_ERROR("Unable to write the manifest of %s: %s",
+                          mirror->device,
+                          strerror(errno));
+                ret = false;
+        }
+
+        return ret;
+}
+
+static void *mirror_worker(void *data)
+{
+        CbmMirror *mirror = data;
+
+        mirror->ok = mirror_mount(mirror) && mirror_sync(mirror);
+        return NULL;
+}
+
+/**
+ * Parse the explicitly configured mirrors, skipping the primary ESP itself
+ */
+static NcArray *mirror_parse_devices(char *setting, const char *boot_device)
+{
+        struct stat boot_st = { 0 };
+        NcArray *ret = NULL;
+        char *saveptr = NULL;
+
+        if (stat(boot_device, &boot_st) != 0) {
+                return NULL;
+        }
+
+        for (char *dev = strtok_r(setting, " \t", &saveptr); dev;
+             dev = strtok_r(NULL, " \t", &saveptr)) {
+                struct stat st = { 0 };
+                char *device = NULL;
+
+                if (stat(dev, &st) != 0 || !S_ISBLK(st.st_mode)) {
+                        LOG_WARNING("Ignoring mirrored ESP %s: not a block device", dev);
+                        continue;
+                }
+                if (st.st_rdev == boot_st.st_rdev) {
+                        continue;
+                }
+
+                if (!ret) {
+                        ret = nc_array_new();
+                        OOM_CHECK(ret);
+                }
+                device = strdup(dev);
+                OOM_CHECK(device);
+                OOM_CHECK(nc_array_add(ret, device));
+        }
+
+        return ret;
+}
+
+/**
+ * Add a boot entry for every mirror behind those the firmware already has,
+ * so each disk can boot on its own
+ */
+static void mirror_register_boot_entries(BootManager *self, CbmMirror *mirrors, int count)
+{
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+        const BootLoader *bootloader = boot_manager_get_bootloader(self);
+        const char *efi_path = NULL;
+
+        if (!bootloader || !bootloader->get_efi_path || !boot_manager_is_update_efi_vars(self)) {
+                return;
+        }
+        efi_path = bootloader->get_efi_path(self);
+        if (!efi_path) {
+                return;
+        }
+
+        if (bootvar_init()) {
+                LOG_ERROR("Cannot parse EFI variables, mirrored ESPs have no boot entries");
+                return;
+        }
+        for (int i = 0; i < count; i++) {
+                if (!mirrors[i].ok) {
+                        continue;
+                }
+                if (bootvar_append(mirrors[i].mount, efi_path)) {
+                        LOG_ERROR("Cannot create an EFI boot entry for mirrored ESP %s",
+                                  mirrors[i].device);
+                }
+        }
+        bootvar_destroy();
+#else
+        /* Without EFI variable support there's nothing to register them with */
+        (void)self;
+        (void)mirrors;
+        (void)count;
+#endif
+}
+
+bool boot_manager_sync_mirrors(BootManager *self)
+{
+        assert(self != NULL);
+
+        autofree(char) *setting = NULL;
+        const BootLoader *bootloader = NULL;
+        const SystemConfig *config = NULL;
+        CbmManifest *primary_manifest = NULL;
+        CbmMirrorPlan plan = { 0 };
+        CbmMirror *mirrors = NULL;
+        NcArray *devices = NULL;
+        bool ret = true;
+        int count = 0;
+
+        config = boot_manager_get_sysconfig(self);
+        bootloader = boot_manager_get_bootloader(self);
+        if (!config || !config->boot_device || !bootloader ||
+            !(bootloader->get_capabilities(self) & BOOTLOADER_CAP_UEFI)) {
+                return true;
+        }
+
+        setting = boot_manager_get_esp_mirrors(self);
+        if (setting && (streq(setting, "no") || streq(setting, "none") ||
+                        streq(setting, "false") || streq(setting, "0"))) {
+                return true;
+        } else if (!setting || !setting[0] || streq(setting, "auto")) {
+                devices = cbm_esp_discover_mirrors(self->prefix, config->boot_device);
+        } else {
+                devices = mirror_parse_devices(setting, config->boot_device);
+        }
+        if (!devices) {
+                return true;
+        }
+
+        plan.primary = boot_manager_get_boot_handle(self);
+        if (!plan.primary) {
+                LOG_ERROR("Unable to open the boot directory to mirror it");
+                nc_array_free(&devices, free);
+                return false;
+        }
+        plan.names = nc_hashmap_new(nc_string_hash, nc_string_compare);
+        OOM_CHECK(plan.names);
+        plan.roots = nc_array_new();
+        OOM_CHECK(plan.roots);
+
+        /* Only what we install is mirrored, other systems look after their own */
+        if (bootloader->get_kernel_destination) {
+                mirror_plan_add_root(&plan, bootloader->get_kernel_destination(self));
+        }
+        if (bootloader->get_efi_path) {
+                autofree(char) *efi_dir = NULL;
+                const char *efi_path = bootloader->get_efi_path(self);
+
+                if (efi_path) {
+                        efi_dir = strdup(efi_path);
+                        OOM_CHECK(efi_dir);
+                        mirror_plan_add_root(&plan, dirname(efi_dir));
+                }
+        }
+        mirror_plan_add_root(&plan, "EFI/Boot");
+        mirror_plan_add_root(&plan, "EFI/Linux");
+        mirror_plan_add_root(&plan, "loader");
+        plan.verify = boot_manager_get_verify_copies_enabled(self);
+        plan.detached = boot_manager_get_detached_mount_enabled(self);
+
+        primary_manifest = cbm_manifest_load_named(plan.primary, CBM_MIRROR_MANIFEST_NAME);
+        if (!mirror_plan_scan(&plan, primary_manifest, NULL, 0)) {
+                LOG_ERROR("Unable to read the primary ESP, not updating its mirrors");
+                ret = false;
+                goto end;
+        }
+        (void)cbm_manifest_save(primary_manifest, plan.primary);
+
+        count = devices->len;
+        mirrors = calloc((size_t)count, sizeof(CbmMirror));
+        OOM_CHECK(mirrors);
+
+        /* Topology lookups aren't thread safe, so resolve everything up front */
+        for (int i = 0; i < count; i++) {
+                CbmMirror *mirror = &mirrors[i];
+
+                mirror->plan = &plan;
+                mirror->device = nc_array_get(devices, i);
+                mirror->mount_fd = -1;
+                mirror->mount = cbm_system_get_mountpoint_for_device(mirror->device);
+                mirror->fs_name = cbm_get_fstype_name(mirror->device);
+                mirror->options = cbm_get_fstype_mount_options(mirror->device);
+                if (!mirror->mount && !mirror->fs_name) {
+                        LOG_ERROR("Could not determine the fstype of %s", mirror->device);
+                        continue;
+                }
+                LOG_INFO("Updating mirrored ESP %s", mirror->device);
+
+                mirror->started =
+                    pthread_create(&mirror->thread, NULL, mirror_worker, mirror) == 0;
+                if (!mirror->started) {
+                        mirror_worker(mirror);
+                }
+        }
+
+        for (int i = 0; i < count; i++) {
+                CbmMirror *mirror = &mirrors[i];
+
+                if (mirror->started) {
+                        pthread_join(mirror->thread, NULL);
+                }
+                if (mirror->ok) {
+                        LOG_SUCCESS("Mirrored ESP %s is up to date", mirror->device);
+                } else {
+                        LOG_ERROR("Failed to update mirrored ESP %s", mirror->device);
+                        ret = false;
+                }
+        }
+
+        mirror_register_boot_entries(self, mirrors, count);
+
+        for (int i = 0; i < count; i++) {
+                CbmMirror *mirror = &mirrors[i];
+
+                cbm_manifest_free(mirror->manifest);
+                if (mirror->mount_fd >= 0) {
+                        if (syncfs(mirror->mount_fd) != 0) {
+                                LOG_WARNING("Could not flush mirrored ESP %s", mirror->device);
+                        }
+                        close(mirror->mount_fd);
+                } else if (mirror->did_mount) {
+                        if (cbm_system_umount(mirror->mount) < 0) {
+                                LOG_WARNING("Could not unmount mirrored ESP %s",
+                                            mirror->device);
+                        } else {
+                                (void)rmdir(mirror->mount);
+                        }
+                }
+                free(mirror->mount);
+        }
+        free(mirrors);
+
+end:
+        cbm_manifest_free(primary_manifest);
+        mirror_plan_clear(&plan);
+        nc_array_free(&devices, free);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
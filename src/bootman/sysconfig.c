@@ -11,32 +11,56 @@
 
 #define _GNU_SOURCE
 
+#include <dirent.h>
 #include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <blkid/blkid.h>
-
+#include "blkid_stub.h"
 #include "bootman.h"
 #include "bootman_private.h"
+#include "config.h"
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
 #include "system_stub.h"
+#include "topology.h"
 
 #define CBM_BOOTVAR_TEST_MODE_VAR "CBM_BOOTVAR_TEST_MODE"
 
+/**
+ * Inspecting the root probes it, resolves LUKS slaves, asks btrfs for the
+ * subvolume and hunts down the boot device, which is the bulk of the work
+ * for commands such as get-timeout. The result is remembered beneath the
+ * root along with a key built from stat() and a handful of sysfs reads, and
+ * we only inspect again when the key no longer matches.
+ */
+#define SYSCONFIG_CACHE_FILE "sysconfig"
+
+/**
+ * Bump whenever the layout of the cache file changes
+ */
+#define SYSCONFIG_CACHE_VERSION 2
+
 struct FilesystemMap {
         char *name;
         int id;
+        const char *mount_options; /**<Tuning for detached mounts */
 };
 
 static const struct FilesystemMap _fsmap[] = {
     {
         .id = FSTYPE_VFAT,
         .name = "vfat",
+        /* Short names in the firmware's codepage, written back promptly */
+        .mount_options = "codepage=437,flush",
     },
     {
         .id = FSTYPE_EXT2,
@@ -59,6 +83,8 @@ void cbm_free_sysconfig(SystemConfig *config)
         }
         free(config->prefix);
         free(config->boot_device);
+        free(config->key);
+        free(config->boot_identity);
         cbm_probe_free(config->root_device);
         free(config);
 }
@@ -88,37 +114,23 @@ static const struct FilesystemMap *cbm_get_fstype(const char *boot_device)
         if (fsname) {
                 fsname = strdup(fsname);
         } else {
-                int rc;
-                blkid_probe pr;
-                const char *tmp;
-
-                pr = blkid_new_probe_from_filename(boot_device);
-                if (!pr) {
-                        LOG_ERROR("%s: failed to create a new libblkid probe",
-                                  boot_device);
-                        exit(EXIT_FAILURE);
-                }
+                const CbmDeviceInfo *info = cbm_topology_get_device(boot_device);
 
-                blkid_probe_set_superblocks_flags(pr, BLKID_SUBLKS_TYPE);
-                rc = blkid_do_safeprobe(pr);
-                if (rc != 0) {
-                        LOG_ERROR("%s: blkid_do_safeprobe() failed", boot_device);
+                if (!info) {
+                        LOG_ERROR("%s: failed to probe the device", boot_device);
                         exit(EXIT_FAILURE);
                 }
 
-                rc = blkid_probe_lookup_value(pr, "TYPE", &tmp, NULL);
-                if (rc != 0 || tmp == NULL || strlen(tmp) == 0) {
-                        LOG_ERROR("%s: blkid_probe_lookup_value() failed", boot_device);
+                if (!info->type || strlen(info->type) == 0) {
+                        LOG_ERROR("%s: unable to determine the filesystem type", boot_device);
                         exit(EXIT_FAILURE);
                 }
 
-                fsname = strdup(tmp);
+                fsname = strdup(info->type);
                 if (fsname == NULL) {
                         DECLARE_OOM();
                         exit(EXIT_FAILURE);
                 }
-
-                blkid_free_probe(pr);
         }
 
         fs = cbm_find_fstype(fsname);
@@ -134,6 +146,12 @@ const char *cbm_get_fstype_name(const char *boot_device)
         return fs->name;
 }
 
+const char *cbm_get_fstype_mount_options(const char *boot_device)
+{
+        const struct FilesystemMap *fs = cbm_get_fstype(boot_device);
+        return fs ? fs->mount_options : NULL;
+}
+
 int cbm_get_filesystem_cap(const char *boot_device)
 {
         const struct FilesystemMap *fs = NULL;
@@ -170,7 +188,7 @@ static void cmb_inspect_root_native(SystemConfig *c, char *realp) {
          * a legacy bios system.
          */
         if (native_uefi && !getenv("CBM_FORCE_LEGACY")) {
-                boot = get_boot_device();
+                boot = get_boot_device(realp);
                 c->wanted_boot_mask |= BOOTLOADER_CAP_UEFI;
 
                 if (boot) {
@@ -199,7 +217,7 @@ static void cmb_inspect_root_image(SystemConfig *c, char *realp) {
         int mask = 0;
 
         legacy_boot = get_legacy_boot_device(realp);
-        uefi_boot = get_boot_device();
+        uefi_boot = get_image_boot_device(realp);
         force_legacy = getenv("CBM_FORCE_LEGACY");
 
         /*
@@ -220,7 +238,401 @@ static void cmb_inspect_root_image(SystemConfig *c, char *realp) {
         c->wanted_boot_mask = mask;
 }
 
-SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
+/**
+ * Read the sysfs attribute @name of the device at @dir, or NULL if it has
+ * no such attribute
+ */
+static char *sysconfig_read_attr(const char *dir, const char *name)
+{
+        autofree(char) *path = NULL;
+        char *ret = NULL;
+
+        path = string_printf("%s/%s", dir, name);
+        if (!file_get_attribute(path, &ret)) {
+                return NULL;
+        }
+        return ret;
+}
+
+/**
+ * Identify the disk holding the sysfs device @sysdir, and where on it the
+ * partition lives, so a disk swapped into the same slot isn't mistaken for
+ * the one we inspected.
+ */
+static char *sysconfig_disk_identity(const char *sysdir)
+{
+        autofree(char) *partition = NULL;
+        autofree(char) *disk_dir = NULL;
+        autofree(char) *serial = NULL;
+        autofree(char) *start = NULL;
+        autofree(char) *size = NULL;
+
+        partition = sysconfig_read_attr(sysdir, "partition");
+        if (partition) {
+                disk_dir = strdup(sysdir);
+                OOM_CHECK(disk_dir);
+                dirname(disk_dir);
+                start = sysconfig_read_attr(sysdir, "start");
+        } else {
+                disk_dir = strdup(sysdir);
+                OOM_CHECK(disk_dir);
+        }
+        size = sysconfig_read_attr(sysdir, "size");
+
+        serial = sysconfig_read_attr(disk_dir, "device/wwid");
+        if (!serial) {
+                serial = sysconfig_read_attr(disk_dir, "device/serial");
+        }
+
+        return string_printf("%s@%s+%s",
+                             serial ? serial : "-",
+                             start ? start : "-",
+                             size ? size : "-");
+}
+
+/**
+ * Identify the device-mapper table behind @sysdir. sysfs has no notion of
+ * a table generation, but reloading a table onto other devices changes its
+ * slaves, and a reformatted LUKS volume changes its uuid.
+ */
+static char *sysconfig_dm_identity(const char *sysdir)
+{
+        autofree(char) *uuid = NULL;
+        autofree(char) *slaves_dir = NULL;
+        struct dirent *ent = NULL;
+        char *ret = NULL;
+        DIR *dir = NULL;
+
+        uuid = sysconfig_read_attr(sysdir, "dm/uuid");
+        if (!uuid) {
+                return NULL;
+        }
+        ret = string_printf("%s", uuid);
+
+        slaves_dir = string_printf("%s/slaves", sysdir);
+        dir = opendir(slaves_dir);
+        if (!dir) {
+                return ret;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                char *next = NULL;
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+                next = string_printf("%s,%s", ret, ent->d_name);
+                free(ret);
+                ret = next;
+        }
+        closedir(dir);
+
+        return ret;
+}
+
+/**
+ * Build the key the cached inspection of @realp is only valid for
+ */
+static char *sysconfig_cache_key(const char *realp, bool image_mode)
+{
+        struct stat st = { 0 };
+        autofree(char) *devnode = NULL;
+        autofree(char) *sys_link = NULL;
+        autofree(char) *sysdir = NULL;
+        autofree(char) *disk = NULL;
+        autofree(char) *dm = NULL;
+        const char *fstype = getenv("CBM_TEST_FSTYPE");
+
+        if (stat(realp, &st) != 0) {
+                return NULL;
+        }
+
+        devnode = cbm_system_get_device_for_mountpoint(realp);
+
+        sys_link = string_printf("%s/dev/block/%u:%u",
+                                 cbm_system_get_sysfs_path(),
+                                 major(st.st_dev),
+                                 minor(st.st_dev));
+        sysdir = realpath(sys_link, NULL);
+        if (sysdir) {
+                disk = sysconfig_disk_identity(sysdir);
+                dm = sysconfig_dm_identity(sysdir);
+        }
+
+        return string_printf("%d %d %d %d %s %u:%u %s %s %s %s",
+                             SYSCONFIG_CACHE_VERSION,
+                             image_mode,
+                             getenv("CBM_FORCE_LEGACY") != NULL,
+                             cbm_system_has_uefi(),
+                             fstype ? fstype : "-",
+                             major(st.st_dev),
+                             minor(st.st_dev),
+                             devnode ? devnode : "-",
+                             sysdir ? sysdir : "-",
+                             disk ? disk : "-",
+                             dm ? dm : "-");
+}
+
+static char *sysconfig_cache_path(const char *realp)
+{
+        return string_printf("%s%s/" SYSCONFIG_CACHE_FILE,
+                             streq(realp, "/") ? "" : realp,
+                             CACHE_DIRECTORY);
+}
+
+/**
+ * Duplicate a cached value, where an empty value stands for NULL
+ */
+static char *sysconfig_cache_value(const char *value)
+{
+        char *ret = NULL;
+
+        if (!value[0]) {
+                return NULL;
+        }
+        ret = strdup(value);
+        OOM_CHECK(ret);
+        return ret;
+}
+
+/**
+ * Identify the boot device with device number @devno beyond the number
+ * itself, which the kernel may well hand to another device next boot
+ */
+static char *sysconfig_boot_identity(dev_t devno)
+{
+        autofree(char) *sys_link = NULL;
+        autofree(char) *sysdir = NULL;
+
+        sys_link = string_printf("%s/dev/block/%u:%u",
+                                 cbm_system_get_sysfs_path(),
+                                 major(devno),
+                                 minor(devno));
+        sysdir = realpath(sys_link, NULL);
+        if (!sysdir) {
+                return string_printf("-");
+        }
+        return sysconfig_disk_identity(sysdir);
+}
+
+/**
+ * Every field a cache entry must carry
+ */
+enum {
+        SYSCONFIG_FIELD_KEY = 1 << 0,
+        SYSCONFIG_FIELD_BOOT_DEVICE = 1 << 1,
+        SYSCONFIG_FIELD_BOOT_DEVNO = 1 << 2,
+        SYSCONFIG_FIELD_BOOT_IDENTITY = 1 << 3,
+        SYSCONFIG_FIELD_MASK = 1 << 4,
+        SYSCONFIG_FIELD_UUID = 1 << 5,
+        SYSCONFIG_FIELD_PART_UUID = 1 << 6,
+        SYSCONFIG_FIELD_LUKS_UUID = 1 << 7,
+        SYSCONFIG_FIELD_BTRFS_SUB = 1 << 8,
+        SYSCONFIG_FIELD_GPT = 1 << 9,
+        SYSCONFIG_FIELD_ALL = (1 << 10) - 1,
+};
+
+/**
+ * Fill in @c from the cache, provided it was written for @key, is complete
+ * and the boot device is still the one we found last time
+ */
+static bool sysconfig_cache_load(SystemConfig *c, const char *key)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+        autofree(char) *boot_identity = NULL;
+        autofree(char) *identity = NULL;
+        CbmDeviceProbe *probe = NULL;
+        struct stat st = { 0 };
+        unsigned int boot_major = 0, boot_minor = 0;
+        unsigned int fields = 0;
+        char *saveptr = NULL;
+        char *end = NULL;
+        long mask;
+
+        /* Read rather than mapped, the file may be empty or cut short */
+        path = sysconfig_cache_path(c->prefix);
+        if (!file_get_attribute(path, &text)) {
+                return false;
+        }
+
+        probe = calloc(1, sizeof(CbmDeviceProbe));
+        OOM_CHECK(probe);
+
+        for (char *line = strtok_r(text, "\n", &saveptr); line;
+             line = strtok_r(NULL, "\n", &saveptr)) {
+                char *value = strchr(line, '=');
+
+                if (!value) {
+                        goto mismatch;
+                }
+                *value++ = '\0';
+
+                if (streq(line, "key")) {
+                        if (!streq(value, key)) {
+                                goto mismatch;
+                        }
+                        fields |= SYSCONFIG_FIELD_KEY;
+                } else if (streq(line, "boot_device")) {
+                        c->boot_device = sysconfig_cache_value(value);
+                        fields |= SYSCONFIG_FIELD_BOOT_DEVICE;
+                } else if (streq(line, "boot_devno")) {
+                        if (sscanf(value, "%u:%u", &boot_major, &boot_minor) != 2) {
+                                goto mismatch;
+                        }
+                        fields |= SYSCONFIG_FIELD_BOOT_DEVNO;
+                } else if (streq(line, "boot_identity")) {
+                        boot_identity = sysconfig_cache_value(value);
+                        fields |= SYSCONFIG_FIELD_BOOT_IDENTITY;
+                } else if (streq(line, "wanted_boot_mask")) {
+                        errno = 0;
+                        mask = strtol(value, &end, 10);
+                        if (errno != 0 || end == value || *end || mask < 0 || mask > INT_MAX) {
+                                goto mismatch;
+                        }
+                        c->wanted_boot_mask = (int)mask;
+                        fields |= SYSCONFIG_FIELD_MASK;
+                } else if (streq(line, "uuid")) {
+                        probe->uuid = sysconfig_cache_value(value);
+                        fields |= SYSCONFIG_FIELD_UUID;
+                } else if (streq(line, "part_uuid")) {
+                        probe->part_uuid = sysconfig_cache_value(value);
+                        fields |= SYSCONFIG_FIELD_PART_UUID;
+                } else if (streq(line, "luks_uuid")) {
+                        probe->luks_uuid = sysconfig_cache_value(value);
+                        fields |= SYSCONFIG_FIELD_LUKS_UUID;
+                } else if (streq(line, "btrfs_sub")) {
+                        probe->btrfs_sub = sysconfig_cache_value(value);
+                        fields |= SYSCONFIG_FIELD_BTRFS_SUB;
+                } else if (streq(line, "gpt")) {
+                        if (!streq(value, "0") && !streq(value, "1")) {
+                                goto mismatch;
+                        }
+                        probe->gpt = streq(value, "1");
+                        fields |= SYSCONFIG_FIELD_GPT;
+                } else {
+                        goto mismatch;
+                }
+        }
+
+        /* Anything short of a complete entry is a partial write or damage */
+        if (fields != SYSCONFIG_FIELD_ALL || (!probe->uuid && !probe->part_uuid)) {
+                goto mismatch;
+        }
+
+        /* Whatever we inspected settled on exactly one way of booting */
+        if ((c->wanted_boot_mask & (BOOTLOADER_CAP_UEFI | BOOTLOADER_CAP_LEGACY)) == 0) {
+                goto mismatch;
+        }
+
+        if (c->boot_device) {
+                if (!boot_identity || stat(c->boot_device, &st) != 0 ||
+                    st.st_rdev != makedev(boot_major, boot_minor) ||
+                    (c->wanted_boot_mask & BOOTLOADER_CAP_GPT) == 0) {
+                        goto mismatch;
+                }
+                identity = sysconfig_boot_identity(st.st_rdev);
+                if (!streq(identity, boot_identity)) {
+                        goto mismatch;
+                }
+        }
+
+        /* The key already pins st_dev of the root */
+        if (stat(c->prefix, &st) != 0) {
+                goto mismatch;
+        }
+        probe->dev = st.st_dev;
+        c->root_device = probe;
+
+        return true;
+
+mismatch:
+        cbm_probe_free(probe);
+        free(c->boot_device);
+        c->boot_device = NULL;
+        c->wanted_boot_mask = 0;
+        return false;
+}
+
+static void sysconfig_cache_store(const SystemConfig *c, const char *key)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *dir = NULL;
+        autofree(char) *text = NULL;
+        autofree(char) *boot_identity = NULL;
+        const CbmDeviceProbe *probe = c->root_device;
+        struct stat st = { 0 };
+
+        if (c->boot_device) {
+                if (stat(c->boot_device, &st) != 0) {
+                        return;
+                }
+                boot_identity = sysconfig_boot_identity(st.st_rdev);
+        }
+
+        text = string_printf("key=%s\n"
+                             "boot_device=%s\n"
+                             "boot_devno=%u:%u\n"
+                             "boot_identity=%s\n"
+                             "wanted_boot_mask=%d\n"
+                             "uuid=%s\n"
+                             "part_uuid=%s\n"
+                             "luks_uuid=%s\n"
+                             "btrfs_sub=%s\n"
+                             "gpt=%d\n",
+                             key,
+                             c->boot_device ? c->boot_device : "",
+                             major(st.st_rdev),
+                             minor(st.st_rdev),
+                             boot_identity ? boot_identity : "",
+                             c->wanted_boot_mask,
+                             probe->uuid ? probe->uuid : "",
+                             probe->part_uuid ? probe->part_uuid : "",
+                             probe->luks_uuid ? probe->luks_uuid : "",
+                             probe->btrfs_sub ? probe->btrfs_sub : "",
+                             probe->gpt);
+
+        /* Read back with a single read(), don't store what won't fit */
+        if (strlen(text) >= 4096) {
+                LOG_DEBUG("System configuration is too large to cache");
+                return;
+        }
+
+        path = sysconfig_cache_path(c->prefix);
+        dir = strdup(path);
+        OOM_CHECK(dir);
+        if (!nc_mkdir_p(dirname(dir), 00755) || !file_set_text_atomic(path, text)) {
+                LOG_DEBUG("Unable to cache the system configuration in %s", path);
+        }
+}
+
+/**
+ * Whether the inspection may be cached. Anything mocked out can't be
+ * trusted to describe the next run, unless the test suite asks for it.
+ */
+static bool sysconfig_cache_enabled(void)
+{
+        if (getenv("CBM_TEST_SYSCONFIG_CACHE")) {
+                return true;
+        }
+        return cbm_system_is_native() && cbm_blkid_is_native();
+}
+
+/**
+ * Remember which boot device @c was inspected with, for
+ * cbm_is_sysconfig_current()
+ */
+static void sysconfig_pin_boot_device(SystemConfig *c)
+{
+        struct stat st = { 0 };
+
+        if (!c->boot_device || stat(c->boot_device, &st) != 0) {
+                return;
+        }
+        c->boot_devno = st.st_rdev;
+        c->boot_identity = sysconfig_boot_identity(st.st_rdev);
+}
+
+SystemConfig *cbm_inspect_root(const char *path, bool image_mode, bool update_cache)
 {
         SystemConfig *c = NULL;
         char *realp = NULL;
@@ -237,6 +649,13 @@ SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
         c->prefix = realp;
         c->wanted_boot_mask = 0;
 
+        c->key = sysconfig_cache_key(realp, image_mode);
+        if (c->key && sysconfig_cache_enabled() && sysconfig_cache_load(c, c->key)) {
+                LOG_DEBUG("Using the cached system configuration for %s", realp);
+                sysconfig_pin_boot_device(c);
+                return c;
+        }
+
         if (image_mode) {
                 cmb_inspect_root_image(c, realp);
         } else {
@@ -262,6 +681,10 @@ SystemConfig *cbm_inspect_root(const char *path, bool image_mode)
         }
 
         c->root_device = cbm_probe_path(realp);
+        sysconfig_pin_boot_device(c);
+        if (c->key && sysconfig_cache_enabled() && update_cache && c->root_device) {
+                sysconfig_cache_store(c, c->key);
+        }
 
         return c;
 
@@ -279,6 +702,36 @@ bool cbm_is_sysconfig_sane(SystemConfig *config)
         return true;
 }
 
+bool cbm_is_sysconfig_current(const SystemConfig *config, bool image_mode)
+{
+        autofree(char) *key = NULL;
+        autofree(char) *identity = NULL;
+        struct stat st = { 0 };
+
+        if (!config || !config->key) {
+                return false;
+        }
+
+        key = sysconfig_cache_key(config->prefix, image_mode);
+        if (!key || !streq(key, config->key)) {
+                return false;
+        }
+
+        /* The same number may since have been handed to another disk */
+        if (config->boot_device) {
+                if (!config->boot_identity || stat(config->boot_device, &st) != 0 ||
+                    st.st_rdev != config->boot_devno) {
+                        return false;
+                }
+                identity = sysconfig_boot_identity(st.st_rdev);
+                if (!streq(identity, config->boot_identity)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
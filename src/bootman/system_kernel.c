@@ -0,0 +1,108 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2016-2018 Intel Corporation
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bootman.h"
+
+/**
+ * Kept apart from the rest of the kernel handling, as the boot time helper
+ * needs it without pulling in the library.
+ */
+bool cbm_parse_system_kernel(const char *inp, SystemKernel *kernel)
+{
+        if (!kernel || !inp) {
+                return false;
+        }
+
+        /* Re-entrant, we might've mangled the kernel obj */
+        memset(kernel, 0, sizeof(struct SystemKernel));
+
+        char krelease[CBM_KELEM_LEN + 1] = { 0 };
+        long release = 0;
+        ssize_t len;
+        char *c, *c2, *junk = NULL;
+
+        c = strchr(inp, '-');
+        if (!c) {
+                return false;
+        }
+        if (c - inp >= CBM_KELEM_LEN) {
+                return false;
+        }
+        if (*(c + 1) == '\0') {
+                return false;
+        }
+        c2 = strchr(c + 1, '.');
+        if (!c2) {
+                return false;
+        }
+        /* Check length */
+        if (c2 - c >= CBM_KELEM_LEN) {
+                return false;
+        }
+
+        /* Copy version */
+        len = c - inp;
+        if (len < 1) {
+                return false;
+        }
+        strncpy(kernel->version, inp, (size_t)len);
+        kernel->version[len + 1] = '\0';
+
+        /* Copy release */
+        len = c2 - c - 1;
+        if (len < 1) {
+                return false;
+        }
+        strncpy(krelease, c + 1, (size_t)len);
+        krelease[len + 1] = '\0';
+
+        /* Sane release? */
+        release = strtol(krelease, &junk, 10);
+        if (junk == krelease) {
+                return false;
+        }
+        kernel->release = (int16_t)release;
+
+        /* Wind the type size **/
+        len = 0;
+        for (char *j = c2 + 1; *j; ++j) {
+                ++len;
+        }
+
+        if (len < 1 || len + 1 > CBM_KELEM_LEN) {
+                return false;
+        }
+
+        /* Kernel type */
+        strncpy(kernel->ktype, c2 + 1, (size_t)len);
+        kernel->ktype[len + 1] = '\0';
+
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,364 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "bootman_private.h"
+#include "compress.h"
+#include "config.h"
+#include "digest.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "stats.h"
+#include "system_stub.h"
+
+/**
+ * Recompressed initrds are kept on the root filesystem, keyed by the hash of
+ * the source and the target format, so each one is only ever produced once:
+ *
+ *      CACHE_DIRECTORY/initrd/$sha256.$format-$level.cpio
+ *
+ * When a format does not beat the source, an empty ".skip" marker is left in
+ * its place so the work isn't repeated on the next run either. Anything no
+ * installed kernel uses is dropped by boot_manager_gc_transcoded_initrds().
+ */
+#define TRANSCODE_DIR "initrd"
+
+/**
+ * External tools used to convert between formats. Only formats the kernel
+ * can unpack are offered as targets; zstd's long distance matching is not
+ * used as the kernel decompressor can't handle the larger window.
+ */
+static const struct {
+        const char *decompress;
+        const char *compress;
+        int default_level;
+        int max_level;
+} codecs[CBM_COMPRESS_MAX] = {
+        [CBM_COMPRESS_NONE] = { "cat", NULL, 0, 0 },
+        [CBM_COMPRESS_GZIP] = { "gzip -dc", "gzip -n -%d -c", 9, 9 },
+        [CBM_COMPRESS_BZIP2] = { "bzip2 -dc", NULL, 0, 0 },
+        [CBM_COMPRESS_LZMA] = { "xz --format=lzma -dc", NULL, 0, 0 },
+        [CBM_COMPRESS_XZ] = { "xz -dc", "xz --check=crc32 -T1 -%d -c", 6, 9 },
+        [CBM_COMPRESS_LZ4] = { "lz4 -q -dc", "lz4 -q -l -%d -c", 9, 12 },
+        [CBM_COMPRESS_ZSTD] = { "zstd -q -dc", "zstd -q -T0 -%d -c", 19, 19 },
+};
+
+/**
+ * The commands are run through the shell with single quoted paths
+ */
+static inline bool is_shell_safe(const char *path)
+{
+        return strchr(path, '\'') == NULL;
+}
+
+static bool run_filter(const char *filter, const char *source, const char *target)
+{
+        autofree(char) *command = NULL;
+        int ret;
+
+        command = string_printf("%s < '%s' > '%s'", filter, source, target);
+        LOG_DEBUG("Running: %s", command);
+
+        ret = cbm_system_system(command);
+        if (ret != 0) {
+                LOG_ERROR("Command failed with status %d: %s", ret, command);
+                return false;
+        }
+
+        return true;
+}
+
+static off_t file_size(const char *path)
+{
+        struct stat st = { 0 };
+
+        if (stat(path, &st) != 0) {
+                return -1;
+        }
+        return st.st_size;
+}
+
+/**
+ * Produce @target from @source, returning false if the result isn't usable.
+ * The uncompressed archive goes through an intermediate file, as a pipeline
+ * would hide a failing decompressor.
+ */
+static bool transcode_file(CbmCompression from, CbmCompression to, int level, const char *source,
+                           const char *target)
+{
+        autofree(char) *compress = NULL;
+        autofree(char) *raw = NULL;
+        autofree(char) *tmp = NULL;
+        const char *input = source;
+        bool ret = false;
+
+        compress = string_printf(codecs[to].compress, level);
+        raw = string_printf("%s.raw", target);
+        tmp = string_printf("%s.TmpWrite", target);
+
+        if (from != CBM_COMPRESS_NONE) {
+                if (!run_filter(codecs[from].decompress, source, raw)) {
+                        goto cleanup;
+                }
+                input = raw;
+        }
+
+        if (!run_filter(compress, input, tmp) || file_size(tmp) <= 0) {
+                goto cleanup;
+        }
+
+        if (rename(tmp, target) != 0) {
+                LOG_ERROR("Failed to rename %s -> %s: %s", tmp, target, strerror(errno));
+                goto cleanup;
+        }
+        ret = true;
+
+cleanup:
+        unlink(raw);
+        unlink(tmp);
+        return ret;
+}
+
+/**
+ * Note that @name within the cache is in use, so it survives the next cleanup
+ */
+static void transcode_mark_used(BootManager *self, const char *name)
+{
+        char *key = NULL;
+
+        if (!self->initrd_cache_used) {
+                self->initrd_cache_used = nc_hashmap_new_full(nc_string_hash,
+                                                              nc_string_compare,
+                                                              free,
+                                                              NULL);
+                OOM_CHECK(self->initrd_cache_used);
+        }
+        if (nc_hashmap_contains(self->initrd_cache_used, name)) {
+                return;
+        }
+        key = strdup(name);
+        OOM_CHECK(key);
+        OOM_CHECK(nc_hashmap_put(self->initrd_cache_used, key, (void *)1));
+}
+
+/**
+ * Determine the path to install in place of @source, returning a newly
+ * allocated string
+ */
+static char *boot_manager_transcode_initrd_internal(BootManager *self, const char *source)
+{
+        autofree(char) *cache_dir = NULL;
+        autofree(char) *name = NULL;
+        autofree(char) *skip = NULL;
+        char *target = NULL;
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        CbmCompression from, to;
+        off_t source_size, target_size;
+        bool transcoded = false;
+        int level;
+
+        if (!boot_manager_get_initrd_compression(self, &to, &level)) {
+                return NULL;
+        }
+        if (!codecs[to].compress) {
+                LOG_ERROR("Initrds cannot be recompressed as %s", cbm_compression_name(to));
+                return NULL;
+        }
+        if (level == 0 || level > codecs[to].max_level) {
+                level = codecs[to].default_level;
+        }
+
+        from = cbm_compression_detect(source);
+        if (from == CBM_COMPRESS_UNKNOWN || from == to) {
+                LOG_DEBUG("Not recompressing %s (%s)", source, cbm_compression_name(from));
+                return NULL;
+        }
+
+        source_size = file_size(source);
+        if (source_size <= 0 || !is_shell_safe(source)) {
+                return NULL;
+        }
+
+        if (!cbm_file_digest(source, digest)) {
+                LOG_ERROR("Failed to hash initrd %s: %s", source, strerror(errno));
+                return NULL;
+        }
+        cbm_sha256_to_hex(digest, hex);
+
+        cache_dir = string_printf("%s%s/" TRANSCODE_DIR, self->prefix, CACHE_DIRECTORY);
+        if (!is_shell_safe(cache_dir)) {
+                return NULL;
+        }
+        name = string_printf("%s.%s-%d.cpio", hex, cbm_compression_name(to), level);
+        target = string_printf("%s/%s", cache_dir, name);
+        skip = string_printf("%s.skip", target);
+        transcode_mark_used(self, name);
+
+        if (nc_file_exists(skip)) {
+                free(target);
+                return NULL;
+        }
+
+        if (!nc_file_exists(target)) {
+                if (!nc_mkdir_p(cache_dir, 00755)) {
+                        LOG_ERROR("Failed to create %s: %s", cache_dir, strerror(errno));
+                        free(target);
+                        return NULL;
+                }
+
+                LOG_INFO("Recompressing %s as %s", source, cbm_compression_name(to));
+                if (!transcode_file(from, to, level, source, target)) {
+                        free(target);
+                        return NULL;
+                }
+                cbm_stats_inc(CBM_STAT_INITRD_TRANSCODED);
+                transcoded = true;
+        }
+
+        target_size = file_size(target);
+        if (target_size <= 0 || target_size >= source_size) {
+                LOG_DEBUG("Recompressed %s is no smaller, keeping the original", source);
+                unlink(target);
+                if (!file_set_text(skip, (char *)"")) {
+                        LOG_WARNING("Failed to write %s: %s", skip, strerror(errno));
+                }
+                free(target);
+                return NULL;
+        }
+
+        /* Reusing an earlier result saves nothing on this run */
+        if (transcoded) {
+                cbm_stats_add(CBM_STAT_INITRD_BYTES_SAVED, (uint64_t)(source_size - target_size));
+        }
+        return target;
+}
+
+const char *boot_manager_transcode_initrd(const BootManager *manager, const char *source)
+{
+        BootManager *self = (BootManager *)manager;
+        char *target = NULL;
+        char *key = NULL;
+
+        assert(manager != NULL);
+        assert(source != NULL);
+
+        if (!self->initrd_transcoded) {
+                self->initrd_transcoded =
+                    nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, free);
+                OOM_CHECK(self->initrd_transcoded);
+        }
+
+        target = nc_hashmap_get(self->initrd_transcoded, source);
+        if (target) {
+                return target;
+        }
+
+        /* Remember unchanged sources too, so each is only considered once */
+        target = boot_manager_transcode_initrd_internal(self, source);
+        if (!target) {
+                target = strdup(source);
+                OOM_CHECK(target);
+        }
+        key = strdup(source);
+        OOM_CHECK(key);
+        OOM_CHECK(nc_hashmap_put(self->initrd_transcoded, key, target));
+
+        return target;
+}
+
+bool boot_manager_gc_transcoded_initrds(BootManager *self, KernelArray *kernels)
+{
+        autofree(char) *cache_dir = NULL;
+        autofree(DIR) *dir = NULL;
+        struct dirent *ent = NULL;
+        bool ret = true;
+
+        assert(self != NULL);
+
+        if (!kernels || !self->prefix) {
+                return true;
+        }
+
+        cache_dir = string_printf("%s%s/" TRANSCODE_DIR, self->prefix, CACHE_DIRECTORY);
+        if (!nc_file_exists(cache_dir)) {
+                return true;
+        }
+
+        /* Mark what every installed kernel uses, already known for most */
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                NcArray *sources = boot_manager_get_initrd_sources(self, nc_array_get(kernels, i));
+
+                for (uint16_t j = 0; j < sources->len; j++) {
+                        (void)boot_manager_transcode_initrd(self, nc_array_get(sources, j));
+                }
+                nc_array_free(&sources, free);
+        }
+
+        dir = opendir(cache_dir);
+        if (!dir) {
+                LOG_ERROR("Error opening %s: %s", cache_dir, strerror(errno));
+                return false;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *name = NULL;
+                autofree(char) *path = NULL;
+                size_t len = strlen(ent->d_name);
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+
+                /* A skip marker lives and dies with its result */
+                name = strdup(ent->d_name);
+                OOM_CHECK(name);
+                if (len > strlen(".skip") && streq(name + len - strlen(".skip"), ".skip")) {
+                        name[len - strlen(".skip")] = '\0';
+                }
+                if (self->initrd_cache_used && nc_hashmap_contains(self->initrd_cache_used, name)) {
+                        continue;
+                }
+
+                path = string_printf("%s/%s", cache_dir, ent->d_name);
+                LOG_DEBUG("Removing unused recompressed initrd %s", path);
+                if (unlink(path) < 0) {
+                        LOG_ERROR("Failed to remove %s: %s", path, strerror(errno));
+                        ret = false;
+                }
+        }
+
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -22,11 +22,14 @@
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "stats.h"
 #include "system_stub.h"
 
 static bool boot_manager_update_image(BootManager *self);
 static bool boot_manager_update_native(BootManager *self);
 static bool boot_manager_update_bootloader(BootManager *self);
+static KernelArray *kernels_without_removed(KernelArray *kernels, NcArray *removals,
+                                            uint16_t n_removed);
 
 bool boot_manager_update(BootManager *self)
 {
@@ -35,22 +38,30 @@ bool boot_manager_update(BootManager *self)
         autofree(char) *boot_dir = NULL;
         int did_mount = -1;
 
+        cbm_set_direct_io(boot_manager_get_direct_io_enabled(self));
+
         /* Image mode is very simple, no prep/cleanup */
         if (boot_manager_is_image_mode(self)) {
                 LOG_DEBUG("Skipping to image-update");
-                return boot_manager_update_image(self);
+                ret = boot_manager_update_image(self);
+                cbm_stats_report();
+                return ret;
         }
 
         did_mount = boot_manager_detect_and_mount_boot(self, &boot_dir);
         if (did_mount >= 0) {
-                /* Do a native update */
+                /* Do a native update, and only then carry it over to the mirrors */
                 ret = boot_manager_update_native(self);
+                if (ret) {
+                        ret = boot_manager_sync_mirrors(self);
+                }
                 if (did_mount > 0) {
-                        umount_boot(boot_dir);
+                        umount_boot(self, boot_dir);
                 }
         }
 
         /* Done */
+        cbm_stats_report();
         return ret;
 }
 
@@ -119,16 +130,28 @@ static bool boot_manager_update_image(BootManager *self)
                 return false;
         }
 
-        /* Go ahead and install the kernels */
+        /* Go ahead and install the kernels, writing their entries in one go */
+        boot_manager_begin_kernel_batch(self);
         for (uint16_t i = 0; i < kernels->len; i++) {
                 const Kernel *k = nc_array_get(kernels, i);
                 LOG_DEBUG("update_image: Attempting install of %s", k->source.path);
                 if (!boot_manager_install_kernel(self, k)) {
                         LOG_FATAL("Cannot install kernel %s", k->source.path);
+                        boot_manager_end_kernel_batch(self, kernels);
                         return false;
                 }
                 LOG_SUCCESS("update_image: Successfully installed %s", k->source.path);
         }
+        if (!boot_manager_end_kernel_batch(self, kernels)) {
+                LOG_FATAL("Failed to write kernel entries");
+                return false;
+        }
+        if (!boot_manager_gc_initrd_blobs(self, kernels)) {
+                LOG_ERROR("Failed to remove unused initrd blobs");
+        }
+        if (!boot_manager_gc_transcoded_initrds(self, kernels)) {
+                LOG_ERROR("Failed to remove unused recompressed initrds");
+        }
 
         /* Set the default to the highest release kernel */
         default_kernel = nc_array_get(kernels, 0);
@@ -156,10 +179,13 @@ static bool boot_manager_update_native(BootManager *self)
         const char *kernel_type = NULL;
         KernelArray *typed_kernels = NULL;
         NcArray *removals = NULL;
+        KernelArray *known = NULL;
         Kernel *new_default = NULL;
         const SystemKernel *system_kernel = NULL;
         bool ret = false;
         bool bootloader_updated = false;
+        bool removal_failed = false;
+        uint16_t n_removed = 0;
 
         LOG_DEBUG("Now beginning update_native");
 
@@ -211,6 +237,9 @@ static bool boot_manager_update_native(BootManager *self)
                 return false;
         }
 
+        /* Entries are reconciled in one pass once the kernel set is final */
+        boot_manager_begin_kernel_batch(self);
+
         /* This is mostly to allow a repair-situation */
         if (running) {
                 /* Not necessarily fatal. */
@@ -317,6 +346,28 @@ static bool boot_manager_update_native(BootManager *self)
                 }
         }
 
+        /* Now remove the older kernels */
+        for (uint16_t i = 0; removals && i < removals->len; i++) {
+                Kernel *k = nc_array_get(removals, i);
+                LOG_INFO("update_native: Garbage collecting %s: %s", k->meta.ktype, k->source.path);
+                if (!boot_manager_remove_kernel(self, k)) {
+                        LOG_ERROR("Failed to remove kernel: %s", k->source.path);
+                        removal_failed = true;
+                        break;
+                }
+                n_removed++;
+        }
+        if (!removals) {
+                LOG_DEBUG("No kernel removals found");
+        }
+
+        /* Write out all entries, and drop those of removed kernels */
+        known = kernels_without_removed(kernels, removals, n_removed);
+        if (!boot_manager_end_kernel_batch(self, known)) {
+                LOG_FATAL("Failed to write kernel entries");
+                goto cleanup;
+        }
+
         /* Might return NULL */
         if (!running) {
                 /* Attempt to get it based on the current uname anyway */
@@ -344,35 +395,66 @@ static bool boot_manager_update_native(BootManager *self)
                 LOG_INFO("No kernel available for any type");
         }
 
-        if (bootloader_updated) {
+        if (bootloader_updated && !removal_failed) {
                 ret = true;
         }
 
-        if (!removals) {
-                /* We're done. */
-                LOG_DEBUG("No kernel removals found");
-                goto cleanup;
+cleanup:
+        /* On failure the batch is still pending, so keep every entry we can */
+        if (!known) {
+                known = kernels_without_removed(kernels, removals, n_removed);
         }
-
-        /* Now remove the older kernels */
-        for (uint16_t i = 0; i < removals->len; i++) {
-                Kernel *k = nc_array_get(removals, i);
-                LOG_INFO("update_native: Garbage collecting %s: %s", k->meta.ktype, k->source.path);
-                if (!boot_manager_remove_kernel(self, k)) {
-                        LOG_ERROR("Failed to remove kernel: %s", k->source.path);
-                        ret = false;
-                        goto cleanup;
-                }
+        if (!boot_manager_end_kernel_batch(self, known)) {
+                ret = false;
+                LOG_ERROR("Failed to write kernel entries");
         }
-
-cleanup:
         if (!boot_manager_remove_initrd_freestanding(self)) {
                 ret = false;
                 LOG_ERROR("Failed to remove old freestanding initrd");
         }
+        if (!boot_manager_gc_initrd_blobs(self, known)) {
+                ret = false;
+                LOG_ERROR("Failed to remove unused initrd blobs");
+        }
+        if (!boot_manager_gc_transcoded_initrds(self, known)) {
+                ret = false;
+                LOG_ERROR("Failed to remove unused recompressed initrds");
+        }
         if (removals) {
                 nc_array_free(&removals, NULL);
         }
+        if (known) {
+                nc_array_free(&known, NULL);
+        }
+        return ret;
+}
+
+/**
+ * Build the set of kernels still present after the first @n_removed
+ * entries of @removals were garbage collected.
+ */
+static KernelArray *kernels_without_removed(KernelArray *kernels, NcArray *removals,
+                                            uint16_t n_removed)
+{
+        KernelArray *ret = nc_array_new();
+        OOM_CHECK(ret);
+
+        for (uint16_t i = 0; i < kernels->len; i++) {
+                Kernel *k = nc_array_get(kernels, i);
+                bool removed = false;
+
+                for (uint16_t j = 0; removals && j < n_removed; j++) {
+                        if (nc_array_get(removals, j) == k) {
+                                removed = true;
+                                break;
+                        }
+                }
+                if (!removed && !nc_array_add(ret, k)) {
+                        DECLARE_OOM();
+                        abort();
+                }
+        }
+
         return ret;
 }
 
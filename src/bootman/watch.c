@@ -0,0 +1,123 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <string.h>
+
+#include "bootman.h"
+#include "config.h"
+#include "util.h"
+
+static const BootManagerWatch watches[] = {
+        { KERNEL_DIRECTORY, BOOT_MANAGER_STALE_KERNELS, false, false },
+        { INITRD_DIRECTORY, BOOT_MANAGER_STALE_INITRDS, false, false },
+        { USER_INITRD_DIRECTORY, BOOT_MANAGER_STALE_INITRDS, false, false },
+        { KERNEL_CONF_DIRECTORY, BOOT_MANAGER_STALE_CONFIG, true, true },
+        { KERNEL_CONF_DIRECTORY "/cmdline.d", BOOT_MANAGER_STALE_CMDLINE, false, false },
+        { KERNEL_CONF_DIRECTORY "/cmdline-removal.d", BOOT_MANAGER_STALE_CMDLINE, false, false },
+        { VENDOR_KERNEL_CONF_DIRECTORY, 0, true, false },
+        { VENDOR_KERNEL_CONF_DIRECTORY "/cmdline.d", BOOT_MANAGER_STALE_CMDLINE, false, false },
+};
+
+const BootManagerWatch *boot_manager_get_watches(size_t *n_watches)
+{
+        assert(n_watches != NULL);
+
+        *n_watches = ARRAY_SIZE(watches);
+        return watches;
+}
+
+unsigned int boot_manager_watch_stale(const BootManagerWatch *watch, const char *name,
+                                      bool is_dir)
+{
+        assert(watch != NULL);
+
+        /* A directory we watch may have come or gone */
+        if (watch->parent && is_dir) {
+                return BOOT_MANAGER_STALE_INITRDS | BOOT_MANAGER_STALE_CMDLINE;
+        }
+        if (!watch->conf || !name) {
+                return watch->stale;
+        }
+
+        /* Everything else in there is configuration, or unknown to us */
+        if (streq(name, "cmdline")) {
+                return BOOT_MANAGER_STALE_CMDLINE;
+        } else if (strncmp(name, "initrd-", strlen("initrd-")) == 0) {
+                return BOOT_MANAGER_STALE_KERNELS;
+        }
+        return watch->stale;
+}
+
+void boot_manager_changes_mark(BootManagerChanges *changes, unsigned int stale, int64_t now)
+{
+        assert(changes != NULL);
+
+        changes->stale |= stale;
+        if (!changes->pending) {
+                changes->pending = true;
+                changes->first_change = now;
+        }
+        changes->last_change = now;
+}
+
+void boot_manager_changes_request(BootManagerChanges *changes, int64_t now)
+{
+        boot_manager_changes_mark(changes, 0, now);
+        changes->requested = true;
+}
+
+int boot_manager_changes_timeout(const BootManagerChanges *changes, int64_t now)
+{
+        int64_t deadline;
+
+        assert(changes != NULL);
+
+        if (!changes->pending) {
+                return -1;
+        }
+        if (changes->requested) {
+                return 0;
+        }
+
+        deadline = changes->last_change + BOOT_MANAGER_WATCH_DEBOUNCE_MS;
+        if (deadline > changes->first_change + BOOT_MANAGER_WATCH_MAX_DELAY_MS) {
+                deadline = changes->first_change + BOOT_MANAGER_WATCH_MAX_DELAY_MS;
+        }
+
+        return deadline > now ? (int)(deadline - now) : 0;
+}
+
+unsigned int boot_manager_changes_take(BootManagerChanges *changes)
+{
+        unsigned int stale;
+
+        assert(changes != NULL);
+
+        stale = changes->stale;
+        *changes = (BootManagerChanges){ 0 };
+        return stale;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
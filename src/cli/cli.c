@@ -35,6 +35,8 @@ static struct cli_option cli_opts[] = {
         OPTION("image", no_argument, 0, 'i', "Force clr-boot-manager to run in image mode."),
         OPTION("no-efi-update", no_argument, 0, 'n',
                "Don't update efi vars when using shim-systemd backend."),
+        OPTION("no-efi-writes-if-bootable", no_argument, 0, 'b',
+               "Don't write efi vars when the fallback bootloader is already installed."),
         OPTION(0, 0, 0, 0, NULL),
 };
 
@@ -68,7 +70,7 @@ void cli_print_default_args_help(void)
 }
 
 bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image,
-                           bool *update_efi_vars)
+                           bool *update_efi_vars, bool *no_efi_writes_if_bootable)
 {
         int o_in = 0;
         int c;
@@ -92,7 +94,7 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
 
         /* Allow setting the root */
         while (true) {
-                c = getopt_long(*argc, *argv, "nip:", default_opts, &o_in);
+                c = getopt_long(*argc, *argv, "nbip:", default_opts, &o_in);
                 if (c == -1) {
                         break;
                 }
@@ -117,6 +119,11 @@ bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_im
                                 *update_efi_vars = false;
                         }
                         break;
+                case 'b':
+                        if (no_efi_writes_if_bootable) {
+                                *no_efi_writes_if_bootable = true;
+                        }
+                        break;
                 case '?':
                         goto bail;
                         break;
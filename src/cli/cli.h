@@ -25,7 +25,7 @@ typedef struct SubCommand {
 } SubCommand;
 
 bool cli_default_args_init(int *argc, char ***argv, char **root, bool *forced_image,
-                           bool *update_efi_vars);
+                           bool *update_efi_vars, bool *no_efi_writes_if_bootable);
 void cli_print_default_args_help(void);
 
 /*
@@ -19,12 +19,16 @@
 #include "nica/hashmap.h"
 #include "util.h"
 
+#include "ops/boot_stats.h"
+#include "ops/daemon.h"
+#include "ops/defrag.h"
 #include "ops/report_booted.h"
 #include "ops/timeout.h"
 #include "ops/console_mode.h"
 #include "ops/update.h"
 #include "ops/kernels.h"
 #include "ops/mount.h"
+#include "ops/status.h"
 
 static SubCommand cmd_update;
 static SubCommand cmd_help;
@@ -34,10 +38,14 @@ static SubCommand cmd_get_timeout;
 static SubCommand cmd_set_console_mode;
 static SubCommand cmd_get_console_mode;
 static SubCommand cmd_report_booted;
+static SubCommand cmd_boot_stats;
 static SubCommand cmd_list_kernels;
 static SubCommand cmd_set_kernel;
 static SubCommand cmd_remove_kernel;
 static SubCommand cmd_mount_boot;
+static SubCommand cmd_status;
+static SubCommand cmd_defrag;
+static SubCommand cmd_daemon;
 static char *binary_name = NULL;
 static NcHashmap *g_commands = NULL;
 static bool explicit_help = false;
@@ -123,9 +131,13 @@ and register them with the UEFI boot manager. Older, unused kernels will\n\
 be automatically garbage collected.\n\
 \n\
 If necessary, the bootloader will be updated and/or installed during this\n\
-time.",
+time.\n\
+\n\
+With --via-daemon the update is left to a running daemon, waiting for it to\n\
+finish. It is done directly when no daemon is listening, or when -n or -b\n\
+are given, as the daemon applies its own.",
                 .callback = cbm_command_update,
-                .usage = " [--path=/path/to/filesystem/root]",
+                .usage = " [--path=/path/to/filesystem/root] [--via-daemon]",
                 .requires_root = true
         };
 
@@ -224,6 +236,23 @@ See `console-mode` in `man loader.conf` for possible values.",
                 return EXIT_FAILURE;
         }
 
+        /* Show the boot times recorded by report-booted */
+        cmd_boot_stats = (SubCommand){
+                .name = "boot-stats",
+                .blurb = "Show how long recent boots took for each kernel",
+                .help = "This command will show the average firmware, loader, kernel and\n\
+userspace time of the boots recorded by \"report-booted\" for each kernel.\n\
+Loader times are only available when booting with systemd-boot.",
+                .callback = cbm_command_boot_stats,
+                .usage = " [--path=/path/to/filesystem/root]",
+                .requires_root = false
+        };
+
+        if (!nc_hashmap_put(commands, cmd_boot_stats.name, &cmd_boot_stats)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
         /* Display currently available kernels */
         cmd_list_kernels = (SubCommand){
                 .name = "list-kernels",
@@ -286,6 +315,57 @@ kernel for the next time the system boots.",
                 return EXIT_FAILURE;
         }
 
+        /* Show bootloader state */
+        cmd_status = (SubCommand){
+                .name = "status",
+                .blurb = "Show the installed and available bootloader versions",
+                .help = "This command will report the bootloader in use, the version installed\n\
+on the boot partition and the version shipped by the OS.",
+                .callback = cbm_command_status,
+                .usage = " [--path=/path/to/filesystem/root]",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_status.name, &cmd_status)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
+        /* Rewrite fragmented kernels */
+        cmd_defrag = (SubCommand){
+                .name = "defrag",
+                .blurb = "Rewrite fragmented kernels on the boot partition",
+                .help = "This command rewrites every kernel, initrd and image on the boot\n\
+partition that is split over several extents, so the firmware can read it\n\
+contiguously.",
+                .callback = cbm_command_defrag,
+                .usage = " [--path=/path/to/filesystem/root]",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_defrag.name, &cmd_defrag)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
+        /* Update whenever kernels change */
+        cmd_daemon = (SubCommand){
+                .name = "daemon",
+                .blurb = "Update the boot partition whenever kernels change",
+                .help = "This command stays resident, watching the kernel, initrd and kernel\n\
+configuration directories. Changes made in quick succession are applied\n\
+together in a single update, reusing what is already known about the\n\
+system. Requests from 'update --via-daemon' are answered once applied.",
+                .callback = cbm_command_daemon,
+                .usage = " [--path=/path/to/filesystem/root]",
+                .requires_root = true
+        };
+
+        if (!nc_hashmap_put(commands, cmd_daemon.name, &cmd_daemon)) {
+                DECLARE_OOM();
+                return EXIT_FAILURE;
+        }
+
         /* Version */
         cmd_version = (SubCommand){
                 .name = "version",
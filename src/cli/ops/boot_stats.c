@@ -0,0 +1,147 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boot_stats.h"
+#include "cli.h"
+#include "ledger.h"
+#include "log.h"
+#include "nica/util.h"
+#include "util.h"
+
+typedef enum {
+        BOOT_STAGE_FIRMWARE = 0,
+        BOOT_STAGE_LOADER,
+        BOOT_STAGE_KERNEL,
+        BOOT_STAGE_USERSPACE,
+        BOOT_STAGE_MAX
+} BootStage;
+
+/**
+ * Averages are only taken over the boots where a stage could be measured,
+ * i.e. loader times are missing when booted via another loader.
+ */
+typedef struct KernelBootStats {
+        const char *kernel;
+        unsigned int boots;
+        uint64_t total[BOOT_STAGE_MAX];
+        unsigned int samples[BOOT_STAGE_MAX];
+} KernelBootStats;
+
+static KernelBootStats *get_kernel_stats(NcArray *stats, const char *kernel)
+{
+        KernelBootStats *entry = NULL;
+
+        for (uint16_t i = 0; i < stats->len; i++) {
+                entry = nc_array_get(stats, i);
+                if (streq(entry->kernel, kernel)) {
+                        return entry;
+                }
+        }
+
+        entry = calloc(1, sizeof(KernelBootStats));
+        OOM_CHECK(entry);
+        entry->kernel = kernel;
+        OOM_CHECK(nc_array_add(stats, entry));
+
+        return entry;
+}
+
+static void print_stage(const KernelBootStats *entry, BootStage stage)
+{
+        if (entry->samples[stage] == 0) {
+                printf(" %10s", "-");
+                return;
+        }
+        printf(" %7.1f ms", (double)entry->total[stage] / entry->samples[stage] / 1000.0);
+}
+
+bool cbm_command_boot_stats(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(char) *path = NULL;
+        NcArray *records = NULL;
+        NcArray *stats = NULL;
+
+        if (!cli_default_args_init(&argc, &argv, &root, NULL, NULL, NULL)) {
+                return false;
+        }
+
+        path = string_printf("%s%s", root ? root : "", CBM_LEDGER_PATH);
+        records = cbm_ledger_load(path);
+        if (!records) {
+                fprintf(stderr, "No boot statistics have been recorded yet\n");
+                return false;
+        }
+
+        stats = nc_array_new();
+        OOM_CHECK_RET(stats, false);
+
+        for (uint16_t i = 0; i < records->len; i++) {
+                const CbmBootRecord *record = nc_array_get(records, i);
+                KernelBootStats *entry = get_kernel_stats(stats, record->kernel);
+                const uint64_t times[BOOT_STAGE_MAX] = {
+                        [BOOT_STAGE_FIRMWARE] = record->firmware_usec,
+                        [BOOT_STAGE_LOADER] = record->loader_usec,
+                        [BOOT_STAGE_KERNEL] = record->kernel_usec,
+                        [BOOT_STAGE_USERSPACE] = record->userspace_usec,
+                };
+
+                entry->boots++;
+                for (int stage = 0; stage < BOOT_STAGE_MAX; stage++) {
+                        if (times[stage] == 0) {
+                                continue;
+                        }
+                        entry->total[stage] += times[stage];
+                        entry->samples[stage]++;
+                }
+        }
+
+        printf("%-32s %5s %10s %10s %10s %10s\n",
+               "Kernel",
+               "Boots",
+               "Firmware",
+               "Loader",
+               "Kernel",
+               "Userspace");
+        for (uint16_t i = 0; i < stats->len; i++) {
+                const KernelBootStats *entry = nc_array_get(stats, i);
+
+                printf("%-32s %5u", entry->kernel, entry->boots);
+                for (int stage = 0; stage < BOOT_STAGE_MAX; stage++) {
+                        print_stage(entry, (BootStage)stage);
+                }
+                printf("\n");
+        }
+
+        nc_array_free(&stats, free);
+        nc_array_free(&records, free);
+
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -36,7 +36,7 @@ bool cbm_command_set_console_mode(int argc, char **argv)
         autofree(BootManager) *manager = NULL;
         bool update_efi_vars = false;
 
-        if (!cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars, NULL)) {
                 return false;
         }
 
@@ -99,7 +99,7 @@ bool cbm_command_get_console_mode(int argc, char **argv)
         autofree(char) *console_mode = NULL;
         bool update_efi_vars = false;
 
-        cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars);
+        cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars, NULL);
 
         manager = boot_manager_new();
         if (!manager) {
@@ -108,6 +108,7 @@ bool cbm_command_get_console_mode(int argc, char **argv)
         }
 
         boot_manager_set_update_efi_vars(manager, update_efi_vars);
+        boot_manager_set_read_only(manager, true);
 
         /* Use specified root if required */
         if (root) {
@@ -0,0 +1,545 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bootman.h"
+#include "cli.h"
+#include "config.h"
+#include "daemon.h"
+#include "log.h"
+#include "nica/files.h"
+#include "stats.h"
+#include "update.h"
+#include "util.h"
+
+/**
+ * Clients waiting on the same update, the rest wait in the listen backlog
+ */
+#define CBM_DAEMON_MAX_CLIENTS 64
+
+/**
+ * First descriptor handed over by systemd socket activation
+ */
+#define CBM_DAEMON_LISTEN_FDS_START 3
+
+#define CBM_DAEMON_REPLY_OK "ok\n"
+#define CBM_DAEMON_REPLY_FAILED "failed\n"
+
+#define CBM_DAEMON_WATCH_MASK                                                                      \
+        (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |        \
+         IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct DaemonWatch {
+        const BootManagerWatch *spec;
+        char *path; /**<Absolute path of the directory */
+        int wd;     /**<Inotify watch, or -1 while the directory is missing */
+} DaemonWatch;
+
+typedef struct CbmDaemon {
+        BootManager *manager;
+        char *root;           /**<Root given with --path, or NULL */
+        DaemonWatch *watches;
+        size_t n_watches;
+        int inotify_fd;
+        int listen_fd;
+        bool listen_owned;    /**<Bound by us rather than systemd */
+        int signal_fd;
+        int clients[CBM_DAEMON_MAX_CLIENTS]; /**<Connections waiting on the next update */
+        size_t n_clients;
+        BootManagerChanges changes; /**<Noted since the last update */
+        bool stopping;
+} CbmDaemon;
+
+static int64_t daemon_now(void)
+{
+        struct timespec ts = { 0 };
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Watch every directory we don't already, as some may only have appeared
+ * since the last attempt
+ */
+static void daemon_watch(CbmDaemon *self)
+{
+        for (size_t i = 0; i < self->n_watches; i++) {
+                DaemonWatch *watch = &self->watches[i];
+
+                if (watch->wd >= 0) {
+                        continue;
+                }
+                watch->wd = inotify_add_watch(self->inotify_fd, watch->path,
+                                              CBM_DAEMON_WATCH_MASK);
+                if (watch->wd >= 0) {
+                        LOG_DEBUG("Watching %s", watch->path);
+                } else if (errno != ENOENT && errno != ENOTDIR) {
+                        LOG_WARNING("Cannot watch %s: %s", watch->path, strerror(errno));
+                }
+        }
+}
+
+/**
+ * Drain the inotify queue without blocking
+ */
+static void daemon_read_events(CbmDaemon *self)
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *event = NULL;
+        ssize_t len;
+
+        while (true) {
+                len = read(self->inotify_fd, buf, sizeof(buf));
+                if (len < 0 && errno == EINTR) {
+                        continue;
+                } else if (len <= 0) {
+                        break;
+                }
+
+                for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+                        DaemonWatch *watch = NULL;
+                        unsigned int stale;
+
+                        event = (const struct inotify_event *)p;
+
+                        /* Lost track, so assume the worst */
+                        if ((event->mask & IN_Q_OVERFLOW) == IN_Q_OVERFLOW) {
+                                LOG_WARNING("Inotify queue overflowed");
+                                boot_manager_changes_mark(&self->changes,
+                                                          BOOT_MANAGER_STALE_ALL,
+                                                          daemon_now());
+                                continue;
+                        }
+
+                        for (size_t i = 0; i < self->n_watches; i++) {
+                                if (self->watches[i].wd == event->wd) {
+                                        watch = &self->watches[i];
+                                        break;
+                                }
+                        }
+                        if (!watch) {
+                                continue;
+                        }
+                        if ((event->mask & IN_IGNORED) == IN_IGNORED) {
+                                watch->wd = -1;
+                        }
+
+                        stale = boot_manager_watch_stale(watch->spec,
+                                                         event->len > 0 ? event->name : NULL,
+                                                         (event->mask & IN_ISDIR) == IN_ISDIR);
+                        if (stale != 0) {
+                                LOG_DEBUG("Change in %s: %s",
+                                          watch->path,
+                                          event->len > 0 ? event->name : "(itself)");
+                                boot_manager_changes_mark(&self->changes, stale, daemon_now());
+                        }
+                }
+        }
+}
+
+/**
+ * Take on the clients waiting in the listen backlog, each of which asks
+ * for an update
+ */
+static void daemon_accept(CbmDaemon *self)
+{
+        int fd;
+
+        while (self->n_clients < CBM_DAEMON_MAX_CLIENTS) {
+                fd = accept4(self->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd < 0 && errno == EINTR) {
+                        continue;
+                } else if (fd < 0) {
+                        break;
+                }
+                self->clients[self->n_clients++] = fd;
+                boot_manager_changes_request(&self->changes, daemon_now());
+        }
+}
+
+/**
+ * Apply one update for everything that changed since the last, then let
+ * the waiting clients know how it went
+ */
+static void daemon_update(CbmDaemon *self)
+{
+        const char *reply = NULL;
+        unsigned int stale;
+        bool ret = true;
+
+        /* Whatever happened up to now is covered by this update */
+        daemon_read_events(self);
+        daemon_accept(self);
+        stale = boot_manager_changes_take(&self->changes);
+
+        LOG_INFO("Updating for changes 0x%x with %zu waiting clients", stale, self->n_clients);
+
+        boot_manager_invalidate(self->manager, stale);
+        cbm_stats_reset();
+        if (boot_manager_detect_kernel_dir(self->root)) {
+                ret = boot_manager_enumerate_initrds_freestanding(self->manager) &&
+                      boot_manager_update(self->manager);
+        }
+
+        if (ret) {
+                LOG_SUCCESS("Update complete");
+        } else {
+                /* In case we held on to whatever made it fail */
+                LOG_ERROR("Update failed, starting afresh next time");
+                self->changes.stale = BOOT_MANAGER_STALE_ALL;
+        }
+
+        /* Directories may have appeared with the update */
+        daemon_watch(self);
+
+        reply = ret ? CBM_DAEMON_REPLY_OK : CBM_DAEMON_REPLY_FAILED;
+        for (size_t i = 0; i < self->n_clients; i++) {
+                if (send(self->clients[i], reply, strlen(reply), MSG_NOSIGNAL) < 0) {
+                        LOG_DEBUG("Client went away: %s", strerror(errno));
+                }
+                close(self->clients[i]);
+        }
+        self->n_clients = 0;
+}
+
+/**
+ * Connect to DAEMON_SOCKET
+ *
+ * @return the connected socket, or -1 with errno set
+ */
+static int daemon_connect(void)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        int saved_errno;
+        int fd;
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                return -1;
+        }
+        strncpy(addr.sun_path, DAEMON_SOCKET, sizeof(addr.sun_path) - 1);
+
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                saved_errno = errno;
+                close(fd);
+                errno = saved_errno;
+                return -1;
+        }
+
+        return fd;
+}
+
+/**
+ * Use the socket systemd passed us, or bind DAEMON_SOCKET ourselves
+ */
+static bool daemon_listen(CbmDaemon *self)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        autofree(char) *dir = NULL;
+        const char *listen_pid = getenv("LISTEN_PID");
+        const char *listen_fds = getenv("LISTEN_FDS");
+        mode_t mask;
+        int fd;
+
+        if (listen_pid && listen_fds && strtol(listen_pid, NULL, 10) == (long)getpid() &&
+            strtol(listen_fds, NULL, 10) >= 1) {
+                unsetenv("LISTEN_PID");
+                unsetenv("LISTEN_FDS");
+                unsetenv("LISTEN_FDNAMES");
+
+                fd = CBM_DAEMON_LISTEN_FDS_START;
+                if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+                    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+                        LOG_FATAL("Invalid socket passed by systemd: %s", strerror(errno));
+                        return false;
+                }
+                self->listen_fd = fd;
+                LOG_DEBUG("Using the socket passed by systemd");
+                return true;
+        }
+
+        dir = strdup(DAEMON_SOCKET);
+        OOM_CHECK(dir);
+        if (!nc_mkdir_p(dirname(dir), 00755)) {
+                LOG_FATAL("Cannot create %s: %s", dir, strerror(errno));
+                return false;
+        }
+
+        /* Only a leftover if nobody answers on it */
+        fd = daemon_connect();
+        if (fd >= 0) {
+                close(fd);
+                LOG_FATAL("Another daemon is already listening on %s", DAEMON_SOCKET);
+                return false;
+        }
+        (void)unlink(DAEMON_SOCKET);
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (fd < 0) {
+                LOG_FATAL("Cannot create socket: %s", strerror(errno));
+                return false;
+        }
+        strncpy(addr.sun_path, DAEMON_SOCKET, sizeof(addr.sun_path) - 1);
+
+        mask = umask(0177);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+                LOG_FATAL("Cannot listen on %s: %s", DAEMON_SOCKET, strerror(errno));
+                umask(mask);
+                close(fd);
+                return false;
+        }
+        umask(mask);
+
+        self->listen_fd = fd;
+        self->listen_owned = true;
+        return true;
+}
+
+static bool daemon_init(CbmDaemon *self)
+{
+        const char *prefix = boot_manager_get_prefix(self->manager);
+        const BootManagerWatch *specs = NULL;
+        sigset_t signals;
+
+        self->inotify_fd = -1;
+        self->listen_fd = -1;
+        self->signal_fd = -1;
+
+        specs = boot_manager_get_watches(&self->n_watches);
+        self->watches = calloc(self->n_watches, sizeof(DaemonWatch));
+        OOM_CHECK(self->watches);
+        for (size_t i = 0; i < self->n_watches; i++) {
+                self->watches[i].spec = &specs[i];
+                self->watches[i].path = string_printf("%s%s",
+                                                      streq(prefix, "/") ? "" : prefix,
+                                                      specs[i].path);
+                self->watches[i].wd = -1;
+        }
+
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGHUP);
+        if (sigprocmask(SIG_BLOCK, &signals, NULL) != 0) {
+                LOG_FATAL("Cannot block signals: %s", strerror(errno));
+                return false;
+        }
+        self->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (self->signal_fd < 0) {
+                LOG_FATAL("Cannot create signalfd: %s", strerror(errno));
+                return false;
+        }
+
+        self->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (self->inotify_fd < 0) {
+                LOG_FATAL("Cannot initialise inotify: %s", strerror(errno));
+                return false;
+        }
+        daemon_watch(self);
+
+        return daemon_listen(self);
+}
+
+static void daemon_close(CbmDaemon *self)
+{
+        for (size_t i = 0; i < self->n_clients; i++) {
+                close(self->clients[i]);
+        }
+        for (size_t i = 0; i < self->n_watches; i++) {
+                free(self->watches[i].path);
+        }
+        free(self->watches);
+        if (self->listen_fd >= 0) {
+                close(self->listen_fd);
+                if (self->listen_owned) {
+                        (void)unlink(DAEMON_SOCKET);
+                }
+        }
+        if (self->inotify_fd >= 0) {
+                close(self->inotify_fd);
+        }
+        if (self->signal_fd >= 0) {
+                close(self->signal_fd);
+        }
+}
+
+static void daemon_read_signals(CbmDaemon *self)
+{
+        struct signalfd_siginfo info = { 0 };
+
+        while (read(self->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGHUP) {
+                        LOG_INFO("Reloading everything");
+                        boot_manager_changes_mark(&self->changes,
+                                                  BOOT_MANAGER_STALE_ALL,
+                                                  daemon_now());
+                        boot_manager_changes_request(&self->changes, daemon_now());
+                } else {
+                        self->stopping = true;
+                }
+        }
+}
+
+static bool daemon_run(CbmDaemon *self)
+{
+        struct pollfd fds[3];
+        nfds_t n_fds;
+        int r;
+
+        /* Catch up with whatever happened while we weren't running */
+        boot_manager_changes_request(&self->changes, daemon_now());
+
+        while (!self->stopping) {
+                fds[0] = (struct pollfd){ .fd = self->signal_fd, .events = POLLIN };
+                fds[1] = (struct pollfd){ .fd = self->inotify_fd, .events = POLLIN };
+                fds[2] = (struct pollfd){ .fd = self->listen_fd, .events = POLLIN };
+                n_fds = self->n_clients < CBM_DAEMON_MAX_CLIENTS ? 3 : 2;
+
+                r = poll(fds, n_fds, boot_manager_changes_timeout(&self->changes, daemon_now()));
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                } else if (r < 0) {
+                        LOG_FATAL("Failed to poll: %s", strerror(errno));
+                        return false;
+                }
+
+                if ((fds[0].revents & POLLIN) == POLLIN) {
+                        daemon_read_signals(self);
+                }
+                if ((fds[1].revents & POLLIN) == POLLIN) {
+                        daemon_read_events(self);
+                }
+                if (n_fds > 2 && (fds[2].revents & POLLIN) == POLLIN) {
+                        daemon_accept(self);
+                }
+
+                if (boot_manager_changes_timeout(&self->changes, daemon_now()) == 0) {
+                        daemon_update(self);
+                }
+        }
+
+        /* Don't leave a package transaction half applied */
+        daemon_read_events(self);
+        if (self->changes.pending) {
+                daemon_update(self);
+        }
+
+        return true;
+}
+
+bool cbm_command_daemon(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(BootManager) *manager = NULL;
+        CbmDaemon daemon = { 0 };
+        bool forced_image = false;
+        bool update_efi_vars = true;
+        bool no_efi_writes_if_bootable = false;
+        bool ret = false;
+
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars,
+                                   &no_efi_writes_if_bootable)) {
+                return false;
+        }
+
+        manager = boot_manager_new();
+        if (!manager) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        boot_manager_set_update_efi_vars(manager, update_efi_vars);
+        boot_manager_set_no_efi_writes_if_bootable(manager, no_efi_writes_if_bootable);
+
+        if (!cbm_command_update_set_root(manager, root, forced_image)) {
+                return false;
+        }
+        if (boot_manager_is_image_mode(manager)) {
+                LOG_FATAL("The daemon only manages the running system, not images");
+                return false;
+        }
+
+        daemon.manager = manager;
+        daemon.root = root;
+        if (daemon_init(&daemon)) {
+                LOG_INFO("Listening on %s", DAEMON_SOCKET);
+                ret = daemon_run(&daemon);
+        }
+        daemon_close(&daemon);
+
+        return ret;
+}
+
+int cbm_daemon_request_update(void)
+{
+        char reply[16] = { 0 };
+        size_t n = 0;
+        ssize_t r;
+        int fd;
+
+        /* Connecting is the request, the reply comes once it's done */
+        fd = daemon_connect();
+        if (fd < 0) {
+                LOG_DEBUG("Cannot reach the daemon at %s: %s", DAEMON_SOCKET, strerror(errno));
+                return -1;
+        }
+        LOG_DEBUG("Waiting for the daemon to update");
+
+        while (n < sizeof(reply) - 1 && !memchr(reply, '\n', n)) {
+                r = read(fd, reply + n, sizeof(reply) - 1 - n);
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                } else if (r <= 0) {
+                        break;
+                }
+                n += (size_t)r;
+        }
+        close(fd);
+
+        /* It went away before answering */
+        if (!memchr(reply, '\n', n)) {
+                return -1;
+        }
+
+        return strcmp(reply, CBM_DAEMON_REPLY_OK) == 0 ? 1 : 0;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
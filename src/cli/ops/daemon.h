@@ -0,0 +1,41 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include "cli.h"
+
+/**
+ * Stay resident, updating the boot partition whenever the kernels, initrds
+ * or kernel configuration change, and whenever a client asks on
+ * DAEMON_SOCKET
+ */
+bool cbm_command_daemon(int argc, char **argv);
+
+/**
+ * Ask the daemon for an update and wait for it to finish
+ *
+ * @return 1 if it succeeded, 0 if it failed, and -1 if no daemon answered
+ */
+int cbm_daemon_request_update(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
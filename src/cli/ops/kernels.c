@@ -29,7 +29,7 @@ bool cbm_command_list_kernels(int argc, char **argv)
         char **kernels = NULL;
         bool update_efi_vars = true;
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars, NULL)) {
                 return false;
         }
 
@@ -40,6 +40,7 @@ bool cbm_command_list_kernels(int argc, char **argv)
         }
 
         boot_manager_set_update_efi_vars(manager, update_efi_vars);
+        boot_manager_set_read_only(manager, true);
 
         if (root) {
                 autofree(char) *realp = NULL;
@@ -92,8 +93,10 @@ bool cbm_command_set_kernel(int argc, char **argv)
         int release = 0;
         Kernel kern = { 0 };
         bool update_efi_vars = true;
+        bool no_efi_writes_if_bootable = false;
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars,
+                                   &no_efi_writes_if_bootable)) {
                 return false;
         }
 
@@ -104,6 +107,7 @@ bool cbm_command_set_kernel(int argc, char **argv)
         }
 
         boot_manager_set_update_efi_vars(manager, update_efi_vars);
+        boot_manager_set_no_efi_writes_if_bootable(manager, no_efi_writes_if_bootable);
 
         if (root) {
                 autofree(char) *realp = NULL;
@@ -169,8 +173,10 @@ bool cbm_command_remove_kernel(int argc, char **argv)
         int release = 0;
         Kernel kern = { 0 };
         bool update_efi_vars = true;
+        bool no_efi_writes_if_bootable = false;
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars,
+                                   &no_efi_writes_if_bootable)) {
                 return false;
         }
 
@@ -181,6 +187,7 @@ bool cbm_command_remove_kernel(int argc, char **argv)
         }
 
         boot_manager_set_update_efi_vars(manager, update_efi_vars);
+        boot_manager_set_no_efi_writes_if_bootable(manager, no_efi_writes_if_bootable);
 
         if (root) {
                 autofree(char) *realp = NULL;
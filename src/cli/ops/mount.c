@@ -28,7 +28,7 @@ bool cbm_command_mount_boot(int argc, char **argv)
         autofree(char) *boot_dir = NULL;
         int did_mount = -1;
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars, NULL)) {
                 return false;
         }
 
@@ -68,6 +68,14 @@ bool cbm_command_mount_boot(int argc, char **argv)
                 }
         }
 
+        /* Fail early on systems we have no bootloader for */
+        if (!boot_manager_has_bootloader(manager)) {
+                return false;
+        }
+
+        /* The mount has to stay behind for whoever asked for it */
+        boot_manager_set_attach_boot(manager, true);
+
         /* Let CBM detect and mount the boot directory */
         did_mount = boot_manager_detect_and_mount_boot(manager, &boot_dir);
         return did_mount >= 0;
@@ -2,6 +2,7 @@
  * This file is part of clr-boot-manager.
  *
  * Copyright © 2016-2018 Intel Corporation
+ * Copyright © 2024 Solus Project
  *
  * clr-boot-manager is free software; you can redistribute it and/or
  * modify it under the terms of the GNU Lesser General Public License as
@@ -12,27 +13,140 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
-#include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bootman.h"
 #include "cli.h"
-#include "config.h"
-#include "files.h"
+#include "ledger.h"
 #include "nica/files.h"
 #include "nica/util.h"
 #include "report_booted.h"
 
-bool cbm_command_report_booted(__cbm_unused__ int argc, __cbm_unused__ char **argv)
+/**
+ * Marker files and the boot ledger all live here
+ */
+#define KERNEL_LIB_DIR "/var/lib/kernel"
+
+/**
+ * Read a small file from /proc into @buf without allocating. These report a
+ * size of zero, so can't be mapped like regular files.
+ */
+static bool read_proc_file(const char *path, char *buf, size_t len)
+{
+        ssize_t n;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+        n = read(fd, buf, len - 1);
+        close(fd);
+
+        if (n <= 0) {
+                return false;
+        }
+        buf[n] = '\0';
+        return true;
+}
+
+/**
+ * Determine how long the kernel took to reach userspace, from the start time
+ * of PID 1 in clock ticks since boot
+ */
+static bool get_kernel_usec(uint64_t *usec)
 {
+        char stat[1024];
+        unsigned long long start = 0;
+        const char *fields = NULL;
+        long hz = sysconf(_SC_CLK_TCK);
+
+        if (hz <= 0 || !read_proc_file("/proc/1/stat", stat, sizeof(stat))) {
+                return false;
+        }
+
+        /* The command name may contain anything, skip past it */
+        fields = strrchr(stat, ')');
+        if (!fields || sscanf(fields + 1,
+                              " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d "
+                              "%*d %*d %*d %llu",
+                              &start) != 1) {
+                return false;
+        }
+
+        *usec = (uint64_t)start * 1000000ULL / (uint64_t)hz;
+        return true;
+}
+
+/**
+ * Record how long this boot took for the running kernel. This is purely
+ * informational, so failures are only reported.
+ */
+static void report_boot_times(int lib_fd, const SystemKernel *sys)
+{
+        char boot_id[64];
+        CbmBootRecord record = { 0 };
+        struct timespec now = { 0 };
+
+        if (!read_proc_file("/proc/sys/kernel/random/boot_id", boot_id, sizeof(boot_id))) {
+                return;
+        }
+        boot_id[strcspn(boot_id, "\n")] = '\0';
+        snprintf(record.boot_id, sizeof(record.boot_id), "%s", boot_id);
+        snprintf(record.kernel,
+                 sizeof(record.kernel),
+                 "%s-%d.%s",
+                 sys->version,
+                 sys->release,
+                 sys->ktype);
+        record.timestamp = (uint64_t)time(NULL);
+
+        cbm_boot_record_read_loader(&record, CBM_EFIVARS_DIR);
+
+        if (get_kernel_usec(&record.kernel_usec) &&
+            clock_gettime(CLOCK_BOOTTIME, &now) == 0) {
+                uint64_t boot_usec = (uint64_t)now.tv_sec * 1000000ULL +
+                                     (uint64_t)now.tv_nsec / 1000ULL;
+                if (boot_usec > record.kernel_usec) {
+                        record.userspace_usec = boot_usec - record.kernel_usec;
+                }
+        }
+
+        if (!cbm_ledger_append(lib_fd, CBM_LEDGER_NAME, &record)) {
+                fprintf(stderr, "Failed to record boot times: %s\n", strerror(errno));
+        }
+}
+
+static int open_lib_dir(void)
+{
+        int fd;
+
+        fd = open(KERNEL_LIB_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0 || errno != ENOENT) {
+                return fd;
+        }
+
+        if (!nc_mkdir_p(KERNEL_LIB_DIR, 00755)) {
+                return -1;
+        }
+        return open(KERNEL_LIB_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+bool cbm_report_booted(void)
+{
+        static const char marker[] = "clr-boot-manager file\n";
         SystemKernel sys = { 0 };
         struct utsname uts = { 0 };
-        const char *lib_dir = "/var/lib/kernel";
-        autofree(char) *boot_rep_path = NULL;
+        char name[PATH_MAX];
+        ssize_t n;
+        int lib_fd, fd;
 
         /* Try to parse the currently running kernel */
         if (uname(&uts) < 0) {
@@ -45,30 +159,39 @@ bool cbm_command_report_booted(__cbm_unused__ int argc, __cbm_unused__ char **ar
                 return false;
         }
 
-        /* Disable syncs during boot ! */
-        cbm_set_sync_filesystems(false);
-
-        if (!nc_file_exists(lib_dir)) {
-                if (!nc_mkdir_p(lib_dir, 00755)) {
-                        fprintf(stderr, "Unable to mkdir_p: %s %s\n", lib_dir, strerror(errno));
-                        return false;
-                }
+        lib_fd = open_lib_dir();
+        if (lib_fd < 0) {
+                fprintf(stderr, "Unable to open %s: %s\n", KERNEL_LIB_DIR, strerror(errno));
+                return false;
         }
 
-        /* /var/lib/kernel/k_booted_4.4.0-120.lts - new */
-        boot_rep_path =
-            string_printf("/var/lib/kernel/k_booted_%s-%d.%s", sys.version, sys.release, sys.ktype);
-
-        /* Report ourselves to new path */
-        if (!file_set_text(boot_rep_path, "clr-boot-manager file\n")) {
+        /* /var/lib/kernel/k_booted_4.4.0-120.lts - new. No syncs during boot! */
+        snprintf(name, sizeof(name), "k_booted_%s-%d.%s", sys.version, sys.release, sys.ktype);
+        fd = openat(lib_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                fprintf(stderr, "Failed to set kernel boot status: %s\n", strerror(errno));
+                close(lib_fd);
+                return false;
+        }
+        n = write(fd, marker, sizeof(marker) - 1);
+        if (close(fd) < 0 || n != (ssize_t)(sizeof(marker) - 1)) {
                 fprintf(stderr, "Failed to set kernel boot status: %s\n", strerror(errno));
+                close(lib_fd);
                 return false;
         }
 
+        report_boot_times(lib_fd, &sys);
+        close(lib_fd);
+
         /* Done */
         return true;
 }
 
+bool cbm_command_report_booted(__cbm_unused__ int argc, __cbm_unused__ char **argv)
+{
+        return cbm_report_booted();
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
@@ -15,6 +15,13 @@
 
 bool cbm_command_report_booted(int argc, char **argv);
 
+/**
+ * Mark the running kernel as successfully booted and record its boot times.
+ * This is shared with the boot time helper, so must only rely on the parser
+ * of kernel versions and not the rest of the library.
+ */
+bool cbm_report_booted(void);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
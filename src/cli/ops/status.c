@@ -0,0 +1,112 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bootman.h"
+#include "cli.h"
+#include "log.h"
+
+bool cbm_command_status(int argc, char **argv)
+{
+        autofree(char) *root = NULL;
+        autofree(BootManager) *manager = NULL;
+        bool forced_image = false;
+        bool update_efi_vars = false;
+        BootManagerStatus status = { 0 };
+        const char *state = NULL;
+
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars, NULL)) {
+                return false;
+        }
+
+        manager = boot_manager_new();
+        if (!manager) {
+                DECLARE_OOM();
+                return false;
+        }
+
+        boot_manager_set_update_efi_vars(manager, update_efi_vars);
+        boot_manager_set_read_only(manager, true);
+
+        if (root) {
+                autofree(char) *realp = NULL;
+
+                realp = realpath(root, NULL);
+                if (!realp) {
+                        LOG_FATAL("Path specified does not exist: %s", root);
+                        return false;
+                }
+                /* Anything not / is image mode */
+                if (!streq(realp, "/")) {
+                        boot_manager_set_image_mode(manager, true);
+                } else {
+                        boot_manager_set_image_mode(manager, forced_image);
+                }
+
+                /* CBM will check this again, we just needed to check for
+                 * image mode.. */
+                if (!boot_manager_set_prefix(manager, root)) {
+                        return false;
+                }
+        } else {
+                boot_manager_set_image_mode(manager, forced_image);
+                /* Default to "/", bail if it doesn't work. */
+                if (!boot_manager_set_prefix(manager, "/")) {
+                        return false;
+                }
+        }
+
+        if (!boot_manager_get_status(manager, &status)) {
+                return false;
+        }
+
+        if (status.needs_install) {
+                state = "not installed";
+        } else if (status.needs_update) {
+                state = "update available";
+        } else {
+                state = "up to date";
+        }
+
+        printf("Bootloader:        %s\n", status.bootloader);
+        printf("Installed version: %s\n",
+               status.installed_version ? status.installed_version : "unknown");
+        printf("Available version: %s\n",
+               status.available_version ? status.available_version : "unknown");
+        printf("State:             %s\n", state);
+        if (status.fragmented_files < 0) {
+                printf("Kernel files:      %d (fragmentation unknown)\n", status.kernel_files);
+        } else {
+                printf("Kernel files:      %d (%d fragmented)\n",
+                       status.kernel_files,
+                       status.fragmented_files);
+        }
+
+        boot_manager_status_free(&status);
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
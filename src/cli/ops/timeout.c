@@ -37,7 +37,7 @@ bool cbm_command_set_timeout(int argc, char **argv)
         autofree(BootManager) *manager = NULL;
         bool update_efi_vars = false;
 
-        if (!cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars, NULL)) {
                 return false;
         }
 
@@ -61,6 +61,11 @@ bool cbm_command_set_timeout(int argc, char **argv)
                 }
         }
 
+        /* Fail early on systems we have no bootloader for */
+        if (!boot_manager_has_bootloader(manager)) {
+                return false;
+        }
+
         if (argc != 1) {
                 fprintf(stderr, "set-timeout takes one integer parameter\n");
                 return false;
@@ -102,7 +107,7 @@ bool cbm_command_get_timeout(int argc, char **argv)
         autofree(BootManager) *manager = NULL;
         bool update_efi_vars = false;
 
-        cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars);
+        cli_default_args_init(&argc, &argv, &root, NULL, &update_efi_vars, NULL);
 
         manager = boot_manager_new();
         if (!manager) {
@@ -111,6 +116,7 @@ bool cbm_command_get_timeout(int argc, char **argv)
         }
 
         boot_manager_set_update_efi_vars(manager, update_efi_vars);
+        boot_manager_set_read_only(manager, true);
 
         /* Use specified root if required */
         if (root) {
@@ -18,21 +18,63 @@
 
 #include "bootman.h"
 #include "cli.h"
+#include "config.h"
+#include "daemon.h"
 #include "log.h"
 #include "nica/files.h"
 #include "update.h"
 
+/**
+ * Take --via-daemon out of @argv, as the default arguments don't know it
+ */
+static bool update_take_via_daemon(int *argc, char **argv)
+{
+        bool found = false;
+        int n = 0;
+
+        for (int i = 0; i < *argc; i++) {
+                if (streq(argv[i], "--via-daemon")) {
+                        found = true;
+                        continue;
+                }
+                argv[n++] = argv[i];
+        }
+        argv[n] = NULL;
+        *argc = n;
+
+        return found;
+}
+
 bool cbm_command_update(int argc, char **argv)
 {
         autofree(char) *root = NULL;
         autofree(BootManager) *manager = NULL;
         bool forced_image = false;
         bool update_efi_vars = true;
+        bool no_efi_writes_if_bootable = false;
+        bool via_daemon = update_take_via_daemon(&argc, argv);
 
-        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars)) {
+        if (!cli_default_args_init(&argc, &argv, &root, &forced_image, &update_efi_vars,
+                                   &no_efi_writes_if_bootable)) {
                 return false;
         }
 
+        /* The daemon only looks after the running system, with its own EFI settings */
+        if (via_daemon && (!update_efi_vars || no_efi_writes_if_bootable)) {
+                LOG_INFO("EFI options can't be passed to the daemon, updating directly");
+        } else if (via_daemon && !root && !forced_image) {
+                switch (cbm_daemon_request_update()) {
+                case 1:
+                        return true;
+                case 0:
+                        fprintf(stderr, "The daemon failed to update, see its log for details\n");
+                        return false;
+                default:
+                        LOG_INFO("No daemon listening on %s, updating directly", DAEMON_SOCKET);
+                        break;
+                }
+        }
+
         manager = boot_manager_new();
         if (!manager) {
                 DECLARE_OOM();
@@ -40,6 +82,7 @@ bool cbm_command_update(int argc, char **argv)
         }
 
         boot_manager_set_update_efi_vars(manager, update_efi_vars);
+        boot_manager_set_no_efi_writes_if_bootable(manager, no_efi_writes_if_bootable);
         
         return cbm_command_update_do(manager, root, forced_image);
 }
@@ -51,6 +94,21 @@ bool cbm_command_update_do(BootManager *manager, char *root, bool forced_image)
                 return true;
         }
 
+        if (!cbm_command_update_set_root(manager, root, forced_image)) {
+                return false;
+        }
+
+        /* Grab the available freestanding initrd */
+        if (!boot_manager_enumerate_initrds_freestanding(manager)) {
+                return false;
+        }
+
+        /* Let CBM take care of the rest */
+        return boot_manager_update(manager);
+}
+
+bool cbm_command_update_set_root(BootManager *manager, char *root, bool forced_image)
+{
         if (root) {
                 autofree(char) *realp = NULL;
 
@@ -78,13 +136,13 @@ bool cbm_command_update_do(BootManager *manager, char *root, bool forced_image)
                         return false;
                 }
         }
-        /* Grab the available freestanding initrd */
-        if (!boot_manager_enumerate_initrds_freestanding(manager)) {
+
+        /* Fail early on systems we have no bootloader for */
+        if (!boot_manager_has_bootloader(manager)) {
                 return false;
         }
 
-        /* Let CBM take care of the rest */
-        return boot_manager_update(manager);
+        return true;
 }
 
 /*
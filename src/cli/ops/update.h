@@ -17,6 +17,11 @@
 bool cbm_command_update(int argc, char **argv);
 bool cbm_command_update_do(BootManager *manager, char *root, bool forced_image);
 
+/**
+ * Point @manager at @root, or "/", in image mode where appropriate
+ */
+bool cbm_command_update_set_root(BootManager *manager, char *root, bool forced_image);
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
@@ -10,6 +10,7 @@
  */
 
 #include "blkid_stub.h"
+#include "topology.h"
 
 #include <assert.h>
 #include <stdbool.h>
@@ -48,6 +49,8 @@ static CbmBlkidOps default_blkid_ops = {
         .partlist_get_partition = blkid_partlist_get_partition,
         .partition_get_flags = blkid_partition_get_flags,
         .partition_get_uuid = blkid_partition_get_uuid,
+        .partition_get_partno = blkid_partition_get_partno,
+        .partition_get_type_string = blkid_partition_get_type_string,
 
         /* Partition table functions */
         .partlist_get_table = blkid_partlist_get_table,
@@ -56,6 +59,7 @@ static CbmBlkidOps default_blkid_ops = {
         /* Misc */
         .devno_to_wholedisk = cbm_blkid_devno_to_wholedisk_wrapped,
         .devno_to_devname = blkid_devno_to_devname,
+        .read_partition_table = cbm_part_table_read,
 };
 
 /**
@@ -65,14 +69,22 @@ static CbmBlkidOps *blkid_ops = &default_blkid_ops;
 
 void cbm_blkid_reset_vtable(void)
 {
+        /* Cached probes belong to the outgoing vtable */
+        cbm_topology_reset();
         blkid_ops = &default_blkid_ops;
 }
 
+bool cbm_blkid_is_native(void)
+{
+        return blkid_ops == &default_blkid_ops;
+}
+
 void cbm_blkid_set_vtable(CbmBlkidOps *ops)
 {
         if (!ops) {
                 cbm_blkid_reset_vtable();
         } else {
+                cbm_topology_reset();
                 blkid_ops = ops;
         }
         /* Ensure the vtable is valid at this point. */
@@ -92,6 +104,8 @@ void cbm_blkid_set_vtable(CbmBlkidOps *ops)
         assert(blkid_ops->partlist_get_partition != NULL);
         assert(blkid_ops->partition_get_flags != NULL);
         assert(blkid_ops->partition_get_uuid != NULL);
+        assert(blkid_ops->partition_get_partno != NULL);
+        assert(blkid_ops->partition_get_type_string != NULL);
 
         /* partition table functions */
         assert(blkid_ops->partlist_get_table != NULL);
@@ -100,6 +114,7 @@ void cbm_blkid_set_vtable(CbmBlkidOps *ops)
         /* misc */
         assert(blkid_ops->devno_to_wholedisk != NULL);
         assert(blkid_ops->devno_to_devname != NULL);
+        assert(blkid_ops->read_partition_table != NULL);
 }
 
 /**
@@ -181,6 +196,16 @@ const char *cbm_blkid_partition_get_uuid(blkid_partition par)
         return blkid_ops->partition_get_uuid(par);
 }
 
+int cbm_blkid_partition_get_partno(blkid_partition par)
+{
+        return blkid_ops->partition_get_partno(par);
+}
+
+const char *cbm_blkid_partition_get_type_string(blkid_partition par)
+{
+        return blkid_ops->partition_get_type_string(par);
+}
+
 /**
  * Partition table related wrappers
  */
@@ -207,6 +232,11 @@ char *cbm_blkid_devno_to_devname(dev_t dev)
         return blkid_ops->devno_to_devname(dev);
 }
 
+bool cbm_blkid_read_partition_table(const char *devname, CbmPartTable *table)
+{
+        return blkid_ops->read_partition_table(devname, table);
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
@@ -14,6 +14,8 @@
 #define _GNU_SOURCE
 #include <blkid.h>
 
+#include "parttable.h"
+
 /**
  * Defines the vtable used for all blkid operations within clr-boot-manager.
  * The default internal vtable will pass through all operations to libblkid.
@@ -36,6 +38,8 @@ typedef struct CbmBlkidOps {
         blkid_partition (*partlist_get_partition)(blkid_partlist ls, int n);
         unsigned long long (*partition_get_flags)(blkid_partition par);
         const char *(*partition_get_uuid)(blkid_partition par);
+        int (*partition_get_partno)(blkid_partition par);
+        const char *(*partition_get_type_string)(blkid_partition par);
 
         /* Partition table functions */
         blkid_parttable (*partlist_get_table)(blkid_partlist ls);
@@ -44,6 +48,9 @@ typedef struct CbmBlkidOps {
         /* Misc functions */
         int (*devno_to_wholedisk)(dev_t dev, char *diskname, size_t len, dev_t *diskdevno);
         char *(*devno_to_devname)(dev_t dev);
+
+        /* Native partition table reader, tried before probing with libblkid */
+        bool (*read_partition_table)(const char *devname, CbmPartTable *table);
 } CbmBlkidOps;
 
 /**
@@ -100,6 +107,11 @@ void cbm_blkid_reset_vtable(void);
  */
 void cbm_blkid_set_vtable(CbmBlkidOps *ops);
 
+/**
+ * Whether the default vtable is in use, i.e. probes hit the real libblkid
+ */
+bool cbm_blkid_is_native(void);
+
 /**
  * Probe related wrappers
  */
@@ -121,6 +133,8 @@ int cbm_blkid_partlist_numof_partitions(blkid_partlist ls);
 blkid_partition cbm_blkid_partlist_get_partition(blkid_partlist ls, int n);
 unsigned long long cbm_blkid_partition_get_flags(blkid_partition par);
 const char *cbm_blkid_partition_get_uuid(blkid_partition par);
+int cbm_blkid_partition_get_partno(blkid_partition par);
+const char *cbm_blkid_partition_get_type_string(blkid_partition par);
 
 /**
  * Partition table related wrappers
@@ -133,6 +147,7 @@ const char *cbm_blkid_parttable_get_type(blkid_parttable tab);
  */
 int cbm_blkid_devno_to_wholedisk(dev_t dev, char *diskname, size_t len, dev_t *diskdevno);
 char *cbm_blkid_devno_to_devname(dev_t dev);
+bool cbm_blkid_read_partition_table(const char *devname, CbmPartTable *table);
 
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
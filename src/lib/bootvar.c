@@ -21,7 +21,6 @@
 #define BIG_ENDIAN __BIG_ENDIAN
 
 #include <alloca.h>
-#include <blkid.h>
 #include <ctype.h>
 #include <config.h>
 #include <efi.h>
@@ -30,10 +29,13 @@
 #include <efivar.h>
 #include <errno.h>
 #include <log.h>
+#include <stats.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/sysmacros.h>
+#include <topology.h>
 
 /* 1K is the limit for boot var storage that efivar defines. it should be
  * enough. actual space occupied is normally >2 times less. */
@@ -41,64 +43,131 @@
 
 /* env var to turn on the test mode. if set to "yes", turns off any side-effects
  * functions defined in this file may have: the call will always succeed without
- * side effects. */
+ * side effects. if set to "nvram", the variables live in memory instead of the
+ * firmware, starting out empty, so that the write avoidance can be tested. */
 #define CBM_BOOTVAR_TEST_MODE_VAR "CBM_BOOTVAR_TEST_MODE"
 
-typedef struct boot_rec boot_rec_t;
+#define BOOTVAR_TEST_MODE_NOOP 1
+#define BOOTVAR_TEST_MODE_NVRAM 2
 
-struct boot_rec {
-        char *name;
-        int num;
-        unsigned char *data;
-        boot_rec_t *next;
-};
+/* number of hash buckets used to match load options, must be a power of 2. */
+#define BOOT_REC_BUCKETS 64
 
-static boot_rec_t *boot_recs;
-static int boot_recs_cnt;
+/* a single Boot#### variable as read from the firmware. */
+typedef struct boot_rec {
+        char name[9]; /* variable name, e.g. "BootXXXX". */
+        int num;
+        uint8_t *data; /* NULL if the variable could not be read. */
+        size_t size;
+        uint32_t hash;
+        int hash_next; /* next record in the same bucket, -1 terminates. */
+} boot_rec_t;
+
+/* snapshot of the Boot#### and BootOrder variables. it is loaded once on first
+ * use and only invalidated when we write variables ourselves, so that lookups
+ * do not go back to the (slow) firmware storage. */
+typedef struct boot_snapshot {
+        bool valid;
+        boot_rec_t *recs; /* sorted by number. */
+        size_t n_recs;
+        uint16_t *order;
+        size_t n_order;
+        uint32_t order_attrs;
+        bool has_order;
+        int buckets[BOOT_REC_BUCKETS];
+} boot_snapshot_t;
+
+static boot_snapshot_t snapshot;
 
 static int test_mode = 0;
 
-static void bootvar_free_boot_recs(void)
+/* FNV-1a, good enough to spread load options over the buckets. */
+static uint32_t bootvar_hash(const uint8_t *data, size_t size)
 {
-        boot_rec_t *p, *c;
-        c = boot_recs;
-        if (!c) {
-                return;
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; i++) {
+                hash ^= data[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+static void bootvar_snapshot_invalidate(void)
+{
+        for (size_t i = 0; i < snapshot.n_recs; i++) {
+                free(snapshot.recs[i].data);
         }
-        boot_recs = NULL;
-        do {
-                p = c;
-                c = c->next;
-                free(p);
-        } while (c);
+        free(snapshot.recs);
+        free(snapshot.order);
+        memset(&snapshot, 0, sizeof(snapshot));
 }
 
 static void bootvar_print_boot_recs(void) __attribute__((unused));
 static void bootvar_print_boot_recs(void)
 {
-        boot_rec_t *c = boot_recs;
-        if (!c) {
-                return;
+        for (size_t i = 0; i < snapshot.n_recs; i++) {
+                fprintf(stderr,
+                        "Boot record #%d: %s\n",
+                        snapshot.recs[i].num,
+                        snapshot.recs[i].name);
+        }
+}
+
+static int cmp_boot_rec(const void *a, const void *b)
+{
+        return ((const boot_rec_t *)a)->num - ((const boot_rec_t *)b)->num;
+}
+
+/* (re)builds the hash buckets over the records that could be read. */
+static void bootvar_index_boot_recs(void)
+{
+        for (int i = 0; i < BOOT_REC_BUCKETS; i++) {
+                snapshot.buckets[i] = -1;
+        }
+
+        for (size_t i = 0; i < snapshot.n_recs; i++) {
+                boot_rec_t *c = &snapshot.recs[i];
+                int *bucket;
+
+                if (!c->data) {
+                        continue;
+                }
+                c->hash = bootvar_hash(c->data, c->size);
+                bucket = &snapshot.buckets[c->hash & (BOOT_REC_BUCKETS - 1)];
+                c->hash_next = *bucket;
+                *bucket = (int)i;
         }
-        do {
-                fprintf(stderr, "Boot record #%d: %s\n", c->num, c->name);
-        } while ((c = c->next));
 }
 
-/* enumerates boot recs and initializes boot_recs and boot_recs_cnt. */
+/* enumerates the Boot#### variables and BootOrder, reading each of them exactly
+ * once into the snapshot. */
 static int bootvar_read_boot_recs(void)
 {
         int res;
         efi_guid_t *guid = NULL;
         char *name = NULL;
-        boot_rec_t *p = NULL, *c;
-        int i = 0;
-
-        bootvar_free_boot_recs();
+        size_t alloc = 0;
+        uint8_t *order = NULL;
+        size_t order_size = 0;
+        uint32_t attrs;
+
+        bootvar_snapshot_invalidate();
+
+        /* the emulated store starts out empty, with an empty BootOrder. */
+        if (test_mode == BOOTVAR_TEST_MODE_NVRAM) {
+                snapshot.order_attrs = EFI_VARIABLE_NON_VOLATILE |
+                                       EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                                       EFI_VARIABLE_RUNTIME_ACCESS;
+                snapshot.has_order = true;
+                snapshot.valid = true;
+                return 0;
+        }
 
         while ((res = efi_get_next_variable_name(&guid, &name)) > 0) {
                 char *num_end;
                 int num;
+                boot_rec_t *c;
+
                 if (strncmp(name, "Boot", 4)) {
                         continue;
                 }
@@ -114,137 +183,278 @@ static int bootvar_read_boot_recs(void)
                         continue;
                 }
 
-                c = (boot_rec_t *)malloc(sizeof(boot_rec_t));
+                if (snapshot.n_recs == alloc) {
+                        size_t n = alloc ? alloc * 2 : 32;
+                        boot_rec_t *recs = realloc(snapshot.recs, n * sizeof(boot_rec_t));
+                        if (!recs) {
+                                LOG_ERROR("Unable to allocate boot records: %s", strerror(errno));
+                                bootvar_snapshot_invalidate();
+                                return -EBOOT_VAR_ERR;
+                        }
+                        snapshot.recs = recs;
+                        alloc = n;
+                }
+
+                c = &snapshot.recs[snapshot.n_recs++];
                 memset(c, 0, sizeof(boot_rec_t));
-                c->name = strdup(name);
+                snprintf(c->name, sizeof(c->name), "%s", name);
                 c->num = num;
-                if (!boot_recs) {
-                        boot_recs = p = c;
-                } else {
-                        p->next = c;
-                        p = c;
-                }
-                i++;
+                c->hash_next = -1;
         }
         if (res < 0) {
                 LOG_ERROR("efi_get_next_variable_name() failed: %s", strerror(errno));
+                bootvar_snapshot_invalidate();
                 return -EBOOT_VAR_ERR;
         }
-        boot_recs_cnt = i;
+
+        if (snapshot.n_recs > 1) {
+                qsort(snapshot.recs, snapshot.n_recs, sizeof(boot_rec_t), cmp_boot_rec);
+        }
+
+        for (size_t i = 0; i < snapshot.n_recs; i++) {
+                boot_rec_t *c = &snapshot.recs[i];
+
+                if (efi_get_variable(EFI_GLOBAL_GUID, c->name, &c->data, &c->size, &attrs) < 0) {
+                        LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
+                        c->data = NULL;
+                        c->size = 0;
+                }
+        }
+        bootvar_index_boot_recs();
+
+        if (efi_get_variable(EFI_GLOBAL_GUID,
+                             "BootOrder",
+                             &order,
+                             &order_size,
+                             &snapshot.order_attrs) == 0) {
+                snapshot.order = (uint16_t *)order;
+                /* read as uint16_t, hence twice less the returned size */
+                snapshot.n_order = order_size >> 1;
+                snapshot.has_order = true;
+        }
+
+        snapshot.valid = true;
         return 0;
 }
 
-/* given the record, puts it first in the boot order (via BootOrder EFI
+/* returns the snapshot, loading it from the firmware if needed. */
+static boot_snapshot_t *bootvar_get_snapshot(void)
+{
+        if (!snapshot.valid && bootvar_read_boot_recs() < 0) {
+                return NULL;
+        }
+        return &snapshot;
+}
+
+/* finds the record with the given number in the snapshot, NULL if there is
+ * none. */
+static boot_rec_t *bootvar_find_boot_rec_by_num(boot_snapshot_t *snap, int num)
+{
+        boot_rec_t key = {.num = num };
+
+        if (!snap->n_recs) {
+                return NULL;
+        }
+        return bsearch(&key, snap->recs, snap->n_recs, sizeof(boot_rec_t), cmp_boot_rec);
+}
+
+/* stores a variable in the emulated NVRAM, which is the snapshot itself. */
+static int bootvar_test_store(const char *name, uint8_t *data, size_t size, uint32_t attrs)
+{
+        uint8_t *copy = malloc(size ? size : 1);
+        boot_rec_t *rec;
+
+        if (!copy) {
+                return -EBOOT_VAR_ERR;
+        }
+        if (size) {
+                memcpy(copy, data, size);
+        }
+
+        if (!strcmp(name, "BootOrder")) {
+                free(snapshot.order);
+                snapshot.order = (uint16_t *)copy;
+                snapshot.n_order = size >> 1;
+                snapshot.order_attrs = attrs;
+                snapshot.has_order = true;
+                return 0;
+        }
+
+        rec = bootvar_find_boot_rec_by_num(&snapshot, (int)strtol(name + 4, NULL, 16));
+        if (!rec) {
+                boot_rec_t *recs = realloc(snapshot.recs, (snapshot.n_recs + 1) * sizeof(boot_rec_t));
+                if (!recs) {
+                        free(copy);
+                        return -EBOOT_VAR_ERR;
+                }
+                snapshot.recs = recs;
+                rec = &snapshot.recs[snapshot.n_recs++];
+                memset(rec, 0, sizeof(boot_rec_t));
+                snprintf(rec->name, sizeof(rec->name), "%s", name);
+                rec->num = (int)strtol(name + 4, NULL, 16);
+        }
+        free(rec->data);
+        rec->data = copy;
+        rec->size = size;
+
+        qsort(snapshot.recs, snapshot.n_recs, sizeof(boot_rec_t), cmp_boot_rec);
+        bootvar_index_boot_recs();
+        return 0;
+}
+
+/* writes a global EFI variable unless the snapshot shows it already holds
+ * exactly this value. NVRAM writes are slow and wear the flash, so every
+ * write we do goes through here. */
+static int bootvar_set_variable(const char *name, uint8_t *data, size_t size, uint32_t attrs)
+{
+        boot_snapshot_t *snap = bootvar_get_snapshot();
+        const uint8_t *cur = NULL;
+        size_t cur_size = 0;
+
+        if (snap && !strcmp(name, "BootOrder")) {
+                if (snap->has_order && snap->order_attrs == attrs) {
+                        cur = (const uint8_t *)snap->order;
+                        cur_size = snap->n_order << 1;
+                }
+        } else if (snap && !strncmp(name, "Boot", 4)) {
+                int num = (int)strtol(name + 4, NULL, 16);
+                boot_rec_t *rec = bootvar_find_boot_rec_by_num(snap, num);
+                if (rec && !strcmp(rec->name, name)) {
+                        cur = rec->data;
+                        cur_size = rec->size;
+                }
+        }
+
+        if (cur && cur_size == size && !memcmp(cur, data, size)) {
+                LOG_DEBUG("EFI variable %s is unchanged, skipping write", name);
+                cbm_stats_inc(CBM_STAT_EFI_VAR_SKIPPED);
+                return 0;
+        }
+
+        if (test_mode == BOOTVAR_TEST_MODE_NVRAM) {
+                if (bootvar_test_store(name, data, size, attrs) < 0) {
+                        return -EBOOT_VAR_ERR;
+                }
+                cbm_stats_inc(CBM_STAT_EFI_VAR_WRITTEN);
+                return 0;
+        }
+
+        /* the snapshot no longer reflects the firmware state, it is reloaded
+         * lazily on the next lookup. */
+        bootvar_snapshot_invalidate();
+        if (efi_set_variable(EFI_GLOBAL_GUID, name, data, size, attrs, 0644) < 0) {
+                LOG_ERROR("efi_set_variable() failed: %s", strerror(errno));
+                return -EBOOT_VAR_ERR;
+        }
+        cbm_stats_inc(CBM_STAT_EFI_VAR_WRITTEN);
+        return 0;
+}
+
+/* given the record number, puts it first in the boot order (via BootOrder EFI
  * variable). */
-static int bootvar_push_to_boot_order(boot_rec_t *rec)
+static int bootvar_push_to_boot_order(int num)
 {
-        uint16_t number;
-        uint16_t *boot_order;
+        uint16_t number = (uint16_t)num;
         uint16_t *new_boot_order;
-        size_t boot_order_size;
         size_t new_boot_order_size;
         uint32_t boot_order_attrs;
+        boot_snapshot_t *snap = NULL;
         unsigned int i;
         int found = 0;
+        uint16_t *c;
 
-        if (!rec || !rec->name) {
+        if (num < 0 || !(snap = bootvar_get_snapshot())) {
                 return -EBOOT_VAR_ERR;
         }
 
-        if (efi_get_variable(EFI_GLOBAL_GUID,
-                             "BootOrder",
-                             (uint8_t **)&boot_order,
-                             &boot_order_size,
-                             &boot_order_attrs)) {
-                LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
+        if (!snap->has_order) {
+                LOG_ERROR("Unable to read BootOrder");
                 return -EBOOT_VAR_ERR;
         }
 
-        sscanf(rec->name, "Boot%04hX", &number);
-
-        /* read as uint16_t, hence twice less the returned size */
-        boot_order_size >>= 1;
-
-        for (i = 0; i < boot_order_size; i++) {
-                if (boot_order[i] == number) {
+        for (i = 0; i < snap->n_order; i++) {
+                if (snap->order[i] == number) {
                         found = 1;
                         break;
                 }
         }
 
-        if (!found) {
-                new_boot_order_size = boot_order_size + 1;
-                new_boot_order = (uint16_t *)malloc(new_boot_order_size * sizeof(uint16_t));
-                new_boot_order[0] = number;
-                memcpy(new_boot_order + 1, boot_order, boot_order_size * sizeof(uint16_t));
-        } else {
-                uint16_t *c;
-                new_boot_order = (uint16_t *)malloc(boot_order_size * sizeof(uint16_t));
-                new_boot_order[0] = number;
-                c = new_boot_order + 1;
-                for (i = 0; i < boot_order_size; i++) {
-                        if (boot_order[i] != number) {
-                                *c = boot_order[i];
-                                c++;
-                        }
+        new_boot_order = (uint16_t *)alloca((snap->n_order + 1) * sizeof(uint16_t));
+        new_boot_order[0] = number;
+        c = new_boot_order + 1;
+        for (i = 0; i < snap->n_order; i++) {
+                if (!found || snap->order[i] != number) {
+                        *c = snap->order[i];
+                        c++;
                 }
-                new_boot_order_size = (size_t)(c - new_boot_order);
         }
+        new_boot_order_size = (size_t)(c - new_boot_order);
+        boot_order_attrs = snap->order_attrs;
 
         new_boot_order_size <<= 1;
-        if (efi_set_variable(EFI_GLOBAL_GUID,
-                             "BootOrder",
-                             (uint8_t *)new_boot_order,
-                             new_boot_order_size,
-                             boot_order_attrs,
-                             0644)) {
-                LOG_ERROR("efi_set_variable() failed: %s", strerror(errno));
-                return -EBOOT_VAR_ERR;
-        }
 
-        return 0;
+        /* no write happens when we're already first, the common case */
+        return bootvar_set_variable("BootOrder",
+                                    (uint8_t *)new_boot_order,
+                                    new_boot_order_size,
+                                    boot_order_attrs);
 }
 
-static int cmp(const void *a, const void *b)
+/* given the record number, adds it last in the boot order unless it is already
+ * in there, wherever that may be. */
+static int bootvar_append_to_boot_order(int num)
 {
-        return *((int *)a) - *((int *)b);
-}
+        uint16_t number = (uint16_t)num;
+        uint16_t *new_boot_order;
+        boot_snapshot_t *snap = NULL;
+        unsigned int i;
 
-/* finds the first available free number for a boot var. */
-static int bootvar_find_free_no(void)
-{
-        int *nums;
-        int res;
-        int i = 0;
-        boot_rec_t *c = boot_recs;
-        size_t cnt;
+        if (num < 0 || !(snap = bootvar_get_snapshot())) {
+                return -EBOOT_VAR_ERR;
+        }
 
-        if (!boot_recs) {
-                return -1;
+        if (!snap->has_order) {
+                LOG_ERROR("Unable to read BootOrder");
+                return -EBOOT_VAR_ERR;
         }
-        if (!boot_recs_cnt) {
-                return 0; /* no records. */
+
+        for (i = 0; i < snap->n_order; i++) {
+                if (snap->order[i] == number) {
+                        return 0;
+                }
         }
 
-        cnt = (size_t)boot_recs_cnt;
+        new_boot_order = (uint16_t *)alloca((snap->n_order + 1) * sizeof(uint16_t));
+        if (snap->n_order) {
+                memcpy(new_boot_order, snap->order, snap->n_order * sizeof(uint16_t));
+        }
+        new_boot_order[snap->n_order] = number;
 
-        nums = (int *)alloca(sizeof(int) * cnt);
-        memset(nums, 0, sizeof(int) * cnt);
+        return bootvar_set_variable("BootOrder",
+                                    (uint8_t *)new_boot_order,
+                                    (snap->n_order + 1) << 1,
+                                    snap->order_attrs);
+}
 
-        do {
-                nums[i] = c->num;
-                i++;
-        } while ((c = c->next));
+/* finds the first available free number for a boot var. */
+static int bootvar_find_free_no(void)
+{
+        boot_snapshot_t *snap = bootvar_get_snapshot();
+        int res = 0;
 
-        qsort(nums, cnt, sizeof(int), cmp);
+        if (!snap) {
+                return -1;
+        }
 
-        for (i = 0, res = 0; i < boot_recs_cnt; i++, res++) {
-                if (res < nums[i]) {
+        /* records are sorted by number, the first gap is the free slot. */
+        for (size_t i = 0; i < snap->n_recs; i++) {
+                if (snap->recs[i].num > res) {
                         break;
                 }
+                res = snap->recs[i].num + 1;
         }
-        if (res == nums[boot_recs_cnt - 1]) {
-                res++; /* no gap. */
+        if (res > 0xFFFF) {
+                return -1;
         }
         return res;
 }
@@ -252,29 +462,23 @@ static int bootvar_find_free_no(void)
 /* finds and returns boot rec whose value is data of size. NULL if not found. */
 static boot_rec_t *bootvar_find_boot_rec(uint8_t *data, size_t size)
 {
-        boot_rec_t *c = boot_recs;
-        boot_rec_t *res = NULL;
+        boot_snapshot_t *snap = bootvar_get_snapshot();
+        uint32_t hash;
 
-        uint8_t *cdata;
-        size_t csize;
-        uint32_t cattr;
-
-        if (!boot_recs || !boot_recs_cnt) {
+        if (!snap || !snap->n_recs) {
                 return NULL;
         }
 
-        do {
-                if (efi_get_variable(EFI_GLOBAL_GUID, c->name, &cdata, &csize, &cattr) < 0) {
-                        LOG_ERROR("efi_get_variable() failed: %s", strerror(errno));
-                        continue;
+        hash = bootvar_hash(data, size);
+        for (int i = snap->buckets[hash & (BOOT_REC_BUCKETS - 1)]; i >= 0;
+             i = snap->recs[i].hash_next) {
+                boot_rec_t *c = &snap->recs[i];
+                if (c->hash == hash && c->size == size && !memcmp(c->data, data, size)) {
+                        return c;
                 }
-                if (csize == size && !memcmp(cdata, data, csize)) {
-                        res = c;
-                        break;
-                }
-        } while ((c = c->next));
+        }
 
-        return res;
+        return NULL;
 }
 
 typedef struct part_info {
@@ -287,107 +491,52 @@ typedef struct part_info {
  * needed to create boot variable which points to that bootloader. */
 static int bootvar_get_part_info(const char *path, part_info_t *pi)
 {
-        blkid_probe probe;
-        blkid_partition part;
-        blkid_partlist parts;
-        struct stat st;
-        dev_t disk_dev;
-        char disk_path[PATH_MAX];
-        const char *part_type;
+        const CbmDiskInfo *disk = NULL;
+        const CbmPartition *part;
 
-        if (stat(path, &st)) {
-                LOG_ERROR("stat() failed on %s: %s", path, strerror(errno));
+        if (!(part = cbm_topology_get_partition(path, &disk))) {
+                LOG_ERROR("Unable to determine the partition of %s", path);
                 return -EBOOT_VAR_ERR;
         }
 
-        strcpy(disk_path, "/dev/");
-        if (blkid_devno_to_wholedisk(st.st_dev, disk_path + 5, PATH_MAX - 5, &disk_dev)) {
-                LOG_ERROR("blkid_devno_to_wholedisk() error");
+        pi->part_no = part->partno;
+        if (strlen(part->type) != 36) {
+                LOG_ERROR("partition type does not seem to be a GUID: %s", part->type);
                 return -EBOOT_VAR_ERR;
         }
 
-        if (!(probe = blkid_new_probe_from_filename(disk_path))) {
-                LOG_ERROR("blkid_new_probe_from_filename() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        if (blkid_probe_enable_partitions(probe, 1)) {
-                LOG_ERROR("blkid_probe_enable_partitions() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        if (!(parts = blkid_probe_get_partitions(probe))) {
-                LOG_ERROR("blkid_probe_get_partitions() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        if (!(part = blkid_partlist_devno_to_partition(parts, st.st_dev))) {
-                LOG_ERROR("blkid_partlist_devno_to_partition() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        if ((pi->part_no = blkid_partition_get_partno(part)) < 0) {
-                LOG_ERROR("blkid_partition_get_partno() error");
-                return -EBOOT_VAR_ERR;
-        }
-
-        part_type = blkid_partition_get_type_string(part);
-        if (!part_type) {
-                LOG_ERROR("blkid_partition_get_type_string() returned NULL");
-                return -EBOOT_VAR_ERR;
-        } else if (strlen(part_type) != 36) {
-                LOG_ERROR("partition type does not seem to be a GUID: %s", part_type);
-                return -EBOOT_VAR_ERR;
-        }
-
-        snprintf(pi->disk_path, strlen(disk_path) + 1, "%s", disk_path);
-        snprintf(pi->part_type, 36 + 1, "%s", part_type);
-
-        blkid_free_probe(probe);
+        snprintf(pi->disk_path, sizeof(pi->disk_path), "%s", disk->devname);
+        snprintf(pi->part_type, 36 + 1, "%s", part->type);
 
         return 0;
 }
 
-/* attempts to look up existing record, otherwise creates a new one. */
-static boot_rec_t *bootvar_add_boot_rec(uint8_t *data, size_t len)
+/* attempts to look up existing record, otherwise creates a new one. returns
+ * the record number, or -1 on failure. */
+static int bootvar_add_boot_rec(uint8_t *data, size_t len)
 {
         char name[9]; /* variable name, e.g. "BootXXXX". */
         int slot;
         uint32_t attr = EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS |
                         EFI_VARIABLE_RUNTIME_ACCESS;
-        boot_rec_t *c, *res = bootvar_find_boot_rec(data, len);
+        boot_rec_t *res = bootvar_find_boot_rec(data, len);
 
         if (res) {
-                return res;
+                return res->num;
         }
         /* no such record, create one. */
         slot = bootvar_find_free_no();
         if (slot < 0) {
-                return NULL;
+                return -1;
         }
         if (snprintf(name, 9, "Boot%04X", slot) > 8) {
-                return NULL;
-        }
-        if (efi_set_variable(EFI_GLOBAL_GUID, name, data, len, attr, 0644) < 0) {
-                LOG_ERROR("efi_set_variable() failed: %s", strerror(errno));
-                return NULL;
-        }
-        /* re-read the records and find the variable that was just created. */
-        if (bootvar_read_boot_recs() < 0) {
-                return NULL;
+                return -1;
         }
-        if (!boot_recs) {
-                return NULL; /* something went terribly wrong. */
+        if (bootvar_set_variable(name, data, len, attr) < 0) {
+                return -1;
         }
-        c = boot_recs;
-        do {
-                if (!strcmp(c->name, name)) {
-                        res = c;
-                        break;
-                }
-        } while ((c = c->next));
 
-        return res;
+        return slot;
 }
 
 /* fills out data based on the partition data (pointed to by esp_mount_path) and
@@ -399,6 +548,18 @@ static int bootvar_make_boot_rec_data(const char *esp_mount_path, const char *bo
         uint8_t fdev_path[PATH_MAX];
         long int len;
 
+        /* there is no disk behind the emulated store, any stable encoding of
+         * the location does. */
+        if (test_mode == BOOTVAR_TEST_MODE_NVRAM) {
+                len = snprintf((char *)data, (size_t)*size, "HD(%s)/File(%s)", esp_mount_path,
+                               bootloader_esp_path);
+                if (len < 0 || len >= *size) {
+                        return -EBOOT_VAR_ERR;
+                }
+                *size = len;
+                return 0;
+        }
+
         if (bootvar_get_part_info(esp_mount_path, &pi)) {
                 return -1;
         }
@@ -436,7 +597,7 @@ int bootvar_has_boot_rec(const char *esp_mount_path, const char *bootloader_esp_
         uint8_t data[BOOT_VAR_MAX];
         ssize_t data_size = BOOT_VAR_MAX;
 
-        if (test_mode) {
+        if (test_mode == BOOTVAR_TEST_MODE_NOOP) {
                 return 1;
         }
 
@@ -453,9 +614,9 @@ int bootvar_create(const char *esp_mount_path, const char *bootloader_esp_path,
         uint8_t data[BOOT_VAR_MAX]; /* this is what efivar supports and it should be
                                        enough. */
         ssize_t data_size = BOOT_VAR_MAX;
-        boot_rec_t *rec;
+        int num;
 
-        if (test_mode) {
+        if (test_mode == BOOTVAR_TEST_MODE_NOOP) {
                 return 0;
         }
 
@@ -463,19 +624,20 @@ int bootvar_create(const char *esp_mount_path, const char *bootloader_esp_path,
                 return -EBOOT_VAR_ERR;
         }
 
-        rec = bootvar_add_boot_rec(data, (size_t)data_size);
-        if (!rec) {
+        num = bootvar_add_boot_rec(data, (size_t)data_size);
+        if (num < 0) {
                 return -EBOOT_VAR_ERR;
         }
 
-        if (bootvar_push_to_boot_order(rec)) {
+        if (bootvar_push_to_boot_order(num)) {
                 return -EBOOT_VAR_ERR;
         }
 
         if (varname && size) {
-                size_t len = strlen(rec->name);
+                char name[9];
+                size_t len = (size_t)snprintf(name, sizeof(name), "Boot%04X", num);
                 if (len < size) {
-                        snprintf(varname, len + 1, "%s", rec->name);
+                        snprintf(varname, len + 1, "%s", name);
                 } else {
                         LOG_ERROR("%lu bytes is not enough. Need %lu.", size, len);
                 }
@@ -484,12 +646,37 @@ int bootvar_create(const char *esp_mount_path, const char *bootloader_esp_path,
         return 0;
 }
 
+int bootvar_append(const char *esp_mount_path, const char *bootloader_esp_path)
+{
+        uint8_t data[BOOT_VAR_MAX];
+        ssize_t data_size = BOOT_VAR_MAX;
+        int num;
+
+        if (test_mode == BOOTVAR_TEST_MODE_NOOP) {
+                return 0;
+        }
+
+        if (bootvar_make_boot_rec_data(esp_mount_path, bootloader_esp_path, data, &data_size)) {
+                return -EBOOT_VAR_ERR;
+        }
+
+        num = bootvar_add_boot_rec(data, (size_t)data_size);
+        if (num < 0 || bootvar_append_to_boot_order(num)) {
+                return -EBOOT_VAR_ERR;
+        }
+
+        return 0;
+}
+
 int bootvar_init(void)
 {
         char *test_mode_env = getenv(CBM_BOOTVAR_TEST_MODE_VAR);
         if (test_mode_env && !strncmp(test_mode_env, "yes", 4)) {
                 LOG_INFO("EFI variables support is disabled: " CBM_BOOTVAR_TEST_MODE_VAR " is set");
-                test_mode = 1;
+                test_mode = BOOTVAR_TEST_MODE_NOOP;
+        } else if (test_mode_env && !strncmp(test_mode_env, "nvram", 6)) {
+                LOG_INFO("EFI variables are emulated: " CBM_BOOTVAR_TEST_MODE_VAR " is set");
+                test_mode = BOOTVAR_TEST_MODE_NVRAM;
         }
         if (test_mode) {
                 return 0;
@@ -505,10 +692,11 @@ int bootvar_init(void)
 
 void bootvar_destroy(void)
 {
+        /* the emulated store outlives the manager, like the firmware does. */
         if (test_mode) {
                 return;
         }
-        bootvar_free_boot_recs();
+        bootvar_snapshot_invalidate();
 }
 
 /* vim: set nosi noai cin ts=8 sw=8 et tw=80: */
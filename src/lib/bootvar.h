@@ -18,5 +18,8 @@ int bootvar_init(void);
 void bootvar_destroy(void);
 int bootvar_create(const char *, const char *, char *, size_t);
 int bootvar_has_boot_rec(const char *, const char *);
+/* like bootvar_create, but keeps the boot order the firmware already has:
+ * the entry is only added to the end of it, if it isn't there at all. */
+int bootvar_append(const char *, const char *);
 
 /* vim: set nosi noai cin ts=8 sw=8 et tw=80: */
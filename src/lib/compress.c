@@ -0,0 +1,194 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "compress.h"
+#include "files.h"
+#include "nica/util.h"
+#include "util.h"
+
+#define CPIO_HEADER_SIZE 110
+
+static const struct {
+        const char *name;
+        const char *magic;
+        size_t magic_len;
+} formats[CBM_COMPRESS_MAX] = {
+        [CBM_COMPRESS_UNKNOWN] = { NULL, NULL, 0 },
+        [CBM_COMPRESS_NONE] = { "none", NULL, 0 },
+        [CBM_COMPRESS_GZIP] = { "gzip", "\x1f\x8b", 2 },
+        [CBM_COMPRESS_BZIP2] = { "bzip2", "BZh", 3 },
+        [CBM_COMPRESS_LZMA] = { "lzma", "\x5d\x00\x00", 3 },
+        [CBM_COMPRESS_XZ] = { "xz", "\xfd" "7zXZ\x00", 6 },
+        [CBM_COMPRESS_LZ4] = { "lz4", "\x02\x21\x4c\x18", 4 },
+        [CBM_COMPRESS_ZSTD] = { "zstd", "\x28\xb5\x2f\xfd", 4 },
+};
+
+/**
+ * Early archives are unpacked by the kernel before any decompressor is
+ * available, and must stay exactly as they are.
+ */
+static const char *early_prefixes[] = {
+        "kernel/x86/microcode/",
+        "kernel/firmware/acpi/",
+};
+
+static bool cpio_parse_hex(const char *field, size_t *value)
+{
+        size_t ret = 0;
+
+        for (int i = 0; i < 8; i++) {
+                char c = field[i];
+                int digit;
+
+                if (c >= '0' && c <= '9') {
+                        digit = c - '0';
+                } else if (c >= 'a' && c <= 'f') {
+                        digit = c - 'a' + 10;
+                } else if (c >= 'A' && c <= 'F') {
+                        digit = c - 'A' + 10;
+                } else {
+                        return false;
+                }
+                ret = (ret << 4) | (size_t)digit;
+        }
+
+        *value = ret;
+        return true;
+}
+
+static inline size_t cpio_align(size_t offset)
+{
+        return (offset + 3) & ~(size_t)3;
+}
+
+static inline bool cpio_is_header(const char *buffer, size_t length)
+{
+        return length >= 6 &&
+               (strncmp(buffer, "070701", 6) == 0 || strncmp(buffer, "070702", 6) == 0);
+}
+
+/**
+ * Walk the newc archive(s) in @buffer, ensuring they span the whole file and
+ * contain nothing the kernel needs to see uncompressed.
+ */
+static bool cpio_is_plain(const char *buffer, size_t length)
+{
+        size_t offset = 0;
+
+        while (offset < length) {
+                const char *header = buffer + offset;
+                const char *name = NULL;
+                size_t file_size, name_size;
+
+                /* Archives may be separated by zero padding */
+                if (header[0] == '\0') {
+                        offset++;
+                        continue;
+                }
+
+                if (length - offset < CPIO_HEADER_SIZE ||
+                    !cpio_is_header(header, length - offset)) {
+                        return false;
+                }
+                if (!cpio_parse_hex(header + 54, &file_size) ||
+                    !cpio_parse_hex(header + 94, &name_size)) {
+                        return false;
+                }
+                if (name_size == 0 || name_size > length - offset - CPIO_HEADER_SIZE) {
+                        return false;
+                }
+
+                name = header + CPIO_HEADER_SIZE;
+                if (name[name_size - 1] != '\0') {
+                        return false;
+                }
+                for (size_t i = 0; i < ARRAY_SIZE(early_prefixes); i++) {
+                        if (strncmp(name, early_prefixes[i], strlen(early_prefixes[i])) == 0) {
+                                return false;
+                        }
+                }
+
+                offset = cpio_align(offset + CPIO_HEADER_SIZE + name_size);
+                if (file_size > length || offset > length - file_size) {
+                        return false;
+                }
+                offset = cpio_align(offset + file_size);
+        }
+
+        return true;
+}
+
+CbmCompression cbm_compression_detect(const char *path)
+{
+        autofree(CbmMappedFile) *file = &(CbmMappedFile){ .fd = -1 };
+        struct stat st = { 0 };
+
+        if (stat(path, &st) != 0 || st.st_size < CPIO_HEADER_SIZE) {
+                return CBM_COMPRESS_UNKNOWN;
+        }
+        if (!cbm_mapped_file_open(path, file)) {
+                return CBM_COMPRESS_UNKNOWN;
+        }
+
+        for (int i = CBM_COMPRESS_GZIP; i < CBM_COMPRESS_MAX; i++) {
+                if (memcmp(file->buffer, formats[i].magic, formats[i].magic_len) == 0) {
+                        return (CbmCompression)i;
+                }
+        }
+
+        if (cpio_is_header(file->buffer, file->length) &&
+            cpio_is_plain(file->buffer, file->length)) {
+                return CBM_COMPRESS_NONE;
+        }
+
+        return CBM_COMPRESS_UNKNOWN;
+}
+
+CbmCompression cbm_compression_from_name(const char *name)
+{
+        if (!name) {
+                return CBM_COMPRESS_UNKNOWN;
+        }
+        for (int i = CBM_COMPRESS_NONE; i < CBM_COMPRESS_MAX; i++) {
+                if (streq(name, formats[i].name)) {
+                        return (CbmCompression)i;
+                }
+        }
+        return CBM_COMPRESS_UNKNOWN;
+}
+
+const char *cbm_compression_name(CbmCompression compression)
+{
+        if (compression <= CBM_COMPRESS_UNKNOWN || compression >= CBM_COMPRESS_MAX) {
+                return "unknown";
+        }
+        return formats[compression].name;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,63 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+/**
+ * Compression formats an initrd may be stored in, as understood by the
+ * kernel's initramfs unpacker.
+ */
+typedef enum {
+        CBM_COMPRESS_UNKNOWN = 0, /**<Unrecognised, or must not be touched */
+        CBM_COMPRESS_NONE,        /**<A plain newc cpio archive */
+        CBM_COMPRESS_GZIP,
+        CBM_COMPRESS_BZIP2,
+        CBM_COMPRESS_LZMA,
+        CBM_COMPRESS_XZ,
+        CBM_COMPRESS_LZ4,
+        CBM_COMPRESS_ZSTD,
+        CBM_COMPRESS_MAX
+} CbmCompression;
+
+/**
+ * Determine the compression format of the initrd at @path from its magic.
+ *
+ * Uncompressed archives are only reported as CBM_COMPRESS_NONE if they
+ * consist of a single cpio archive running to the end of the file. Archives
+ * followed by further (compressed) data, and early microcode archives which
+ * the kernel requires to be uncompressed, are reported as CBM_COMPRESS_UNKNOWN.
+ */
+CbmCompression cbm_compression_detect(const char *path);
+
+/**
+ * Look up a compression format by its name, i.e. "zstd"
+ *
+ * @return the format, or CBM_COMPRESS_UNKNOWN if @name is not recognised
+ */
+CbmCompression cbm_compression_from_name(const char *name);
+
+/**
+ * Return the name of @compression
+ */
+const char *cbm_compression_name(CbmCompression compression);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,239 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "digest.h"
+#include "log.h"
+#include "stats.h"
+#include "util.h"
+
+#ifdef HAVE_FSVERITY
+#include <linux/fsverity.h>
+#endif
+
+/**
+ * Bump whenever the layout of the cached attribute changes
+ */
+#define CBM_DIGEST_XATTR_VERSION 1
+
+/**
+ * Largest digest fs-verity produces, for SHA-512
+ */
+#define CBM_VERITY_MAX_DIGEST_SIZE 64
+
+/**
+ * The cached attribute is only valid for this exact inode, size and
+ * modification time. ctime would be stronger, but setting the attribute
+ * changes it.
+ */
+static char *digest_xattr_prefix(const struct stat *st)
+{
+        return string_printf("%d %ju %jd %jd.%09ld ",
+                             CBM_DIGEST_XATTR_VERSION,
+                             (uintmax_t)st->st_ino,
+                             (intmax_t)st->st_size,
+                             (intmax_t)st->st_mtim.tv_sec,
+                             st->st_mtim.tv_nsec);
+}
+
+static int hex_value(char c)
+{
+        if (c >= '0' && c <= '9') {
+                return c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+                return c - 'a' + 10;
+        }
+        return -1;
+}
+
+/**
+ * Fill @digest from the attribute of @fd, if it was stored for @st
+ */
+static bool digest_xattr_load(int fd, const struct stat *st,
+                              uint8_t digest[CBM_SHA256_DIGEST_SIZE])
+{
+        autofree(char) *prefix = digest_xattr_prefix(st);
+        size_t prefix_len = strlen(prefix);
+        char value[256];
+        const char *hex = NULL;
+        ssize_t len;
+
+        len = fgetxattr(fd, CBM_DIGEST_XATTR, value, sizeof(value) - 1);
+        if (len < 0) {
+                return false;
+        }
+        value[len] = '\0';
+
+        if ((size_t)len != prefix_len + CBM_SHA256_HEX_SIZE - 1 ||
+            strncmp(value, prefix, prefix_len) != 0) {
+                return false;
+        }
+
+        hex = value + prefix_len;
+        for (size_t i = 0; i < CBM_SHA256_DIGEST_SIZE; i++) {
+                int hi = hex_value(hex[i * 2]);
+                int lo = hex_value(hex[i * 2 + 1]);
+
+                if (hi < 0 || lo < 0) {
+                        return false;
+                }
+                digest[i] = (uint8_t)(hi << 4 | lo);
+        }
+
+        return true;
+}
+
+/**
+ * Whether computed digests may be remembered in the files themselves
+ */
+static bool cbm_digest_store = true;
+
+void cbm_set_digest_xattrs(bool store)
+{
+        cbm_digest_store = store;
+}
+
+static void digest_xattr_store(const char *path, int fd, const struct stat *st,
+                               const uint8_t digest[CBM_SHA256_DIGEST_SIZE])
+{
+        autofree(char) *prefix = digest_xattr_prefix(st);
+        autofree(char) *value = NULL;
+        char hex[CBM_SHA256_HEX_SIZE];
+
+        cbm_sha256_to_hex(digest, hex);
+        value = string_printf("%s%s", prefix, hex);
+
+        if (fsetxattr(fd, CBM_DIGEST_XATTR, value, strlen(value), 0) != 0) {
+                LOG_DEBUG("Unable to cache the digest of %s: %s", path, strerror(errno));
+        }
+}
+
+bool cbm_file_digest(const char *path, uint8_t digest[CBM_SHA256_DIGEST_SIZE])
+{
+        struct stat st = { 0 };
+        struct stat after = { 0 };
+        int saved_errno;
+        bool ret = false;
+        int fd = -1;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+        if (fstat(fd, &st) != 0) {
+                goto end;
+        }
+
+        if (digest_xattr_load(fd, &st, digest)) {
+                cbm_stats_inc(CBM_STAT_DIGEST_CACHED);
+                ret = true;
+                goto end;
+        }
+
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (!cbm_sha256_fd(fd, digest)) {
+                goto end;
+        }
+        cbm_stats_inc(CBM_STAT_DIGEST_COMPUTED);
+        ret = true;
+
+        /* Don't vouch for contents that changed while we read them */
+        if (cbm_digest_store && fstat(fd, &after) == 0 && after.st_size == st.st_size &&
+            after.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+            after.st_mtim.tv_nsec == st.st_mtim.tv_nsec) {
+                digest_xattr_store(path, fd, &st, digest);
+        }
+
+end:
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return ret;
+}
+
+char *cbm_file_verity_digest(const char *path)
+{
+#ifdef HAVE_FSVERITY
+        autofree(char) *hex = NULL;
+        struct fsverity_digest *measured = NULL;
+        const char *algorithm = NULL;
+        char *ret = NULL;
+        int fd = -1;
+        int r;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return NULL;
+        }
+        measured = calloc(1, sizeof(struct fsverity_digest) + CBM_VERITY_MAX_DIGEST_SIZE);
+        OOM_CHECK(measured);
+        measured->digest_size = CBM_VERITY_MAX_DIGEST_SIZE;
+        r = ioctl(fd, FS_IOC_MEASURE_VERITY, measured);
+        close(fd);
+
+        /* ENODATA for files without verity, ENOTTY or EOPNOTSUPP without support */
+        if (r != 0 || measured->digest_size == 0 ||
+            measured->digest_size > CBM_VERITY_MAX_DIGEST_SIZE) {
+                goto end;
+        }
+
+        switch (measured->digest_algorithm) {
+        case FS_VERITY_HASH_ALG_SHA256:
+                algorithm = "sha256";
+                break;
+        case FS_VERITY_HASH_ALG_SHA512:
+                algorithm = "sha512";
+                break;
+        default:
+                goto end;
+        }
+
+        hex = calloc((size_t)measured->digest_size * 2 + 1, 1);
+        OOM_CHECK(hex);
+        for (size_t i = 0; i < measured->digest_size; i++) {
+                snprintf(hex + i * 2, 3, "%02x", measured->digest[i]);
+        }
+        ret = string_printf("verity-%s:%s", algorithm, hex);
+
+end:
+        free(measured);
+        return ret;
+#else
+        (void)path;
+        return NULL;
+#endif
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
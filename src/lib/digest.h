@@ -0,0 +1,64 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+/**
+ * Extended attribute caching the SHA-256 of a file's contents
+ */
+#define CBM_DIGEST_XATTR "user.cbm.digest"
+
+/**
+ * Compute the SHA-256 of the contents of @path.
+ *
+ * Kernels and initrds are never modified in place once installed, so the
+ * digest is remembered in the CBM_DIGEST_XATTR attribute of the file along
+ * with its inode, size and modification time. While those still match the
+ * file isn't read at all. Filesystems without user xattrs, or that are
+ * read-only, simply hash the file every time.
+ *
+ * @return True if the digest could be determined
+ */
+bool cbm_file_digest(const char *path, uint8_t digest[CBM_SHA256_DIGEST_SIZE]);
+
+/**
+ * Set whether cbm_file_digest() may store CBM_DIGEST_XATTR on the files it
+ * hashes. Attributes already present are still used either way.
+ */
+void cbm_set_digest_xattrs(bool store);
+
+/**
+ * Measure @path with FS_IOC_MEASURE_VERITY. The result is the root of the
+ * file's Merkle tree, which the kernel holds and enforces, so identifies the
+ * contents without reading them. It is not the SHA-256 of the contents.
+ *
+ * @return a newly allocated "verity-$algorithm:$hex" string, or NULL if
+ * fs-verity isn't enabled for @path
+ */
+char *cbm_file_verity_digest(const char *path);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
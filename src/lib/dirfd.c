@@ -0,0 +1,375 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dirfd.h"
+#include "esp-index.h"
+#include "log.h"
+#include "util.h"
+
+#ifdef HAVE_OPENAT2
+#include <linux/openat2.h>
+
+/**
+ * Set once the kernel (or a seccomp filter) has turned openat2() down
+ */
+static bool cbm_openat2_unsupported = false;
+#endif
+
+/**
+ * Names are always relative to the directory, even with a leading slash
+ */
+static const char *dir_relative(const char *name)
+{
+        while (*name == '/') {
+                name++;
+        }
+        return *name ? name : ".";
+}
+
+#ifdef HAVE_OPENAT2
+static long dir_openat2(const CbmDir *dir, const char *name, int flags, mode_t mode)
+{
+        struct open_how how = {
+                .flags = (__u64)(flags | O_CLOEXEC),
+                .mode = (flags & O_CREAT) ? mode : 0,
+                .resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS,
+        };
+
+        return syscall(SYS_openat2, dir->fd, name, &how, sizeof(how));
+}
+
+/**
+ * Seccomp filters commonly refuse syscalls they don't know with EPERM, which
+ * a real lookup can also fail with. Looking up @dir itself tells them apart.
+ */
+static bool dir_openat2_refused(const CbmDir *dir)
+{
+        long fd = dir_openat2(dir, ".", O_PATH | O_DIRECTORY, 0);
+
+        if (fd >= 0) {
+                close((int)fd);
+                return false;
+        }
+        return errno == EPERM || errno == ENOSYS;
+}
+#endif
+
+static int dir_resolve(const CbmDir *dir, const char *name, int flags, mode_t mode)
+{
+        name = dir_relative(name);
+
+#ifdef HAVE_OPENAT2
+        if (dir->confined && !cbm_openat2_unsupported) {
+                long fd = dir_openat2(dir, name, flags, mode);
+
+                if (fd >= 0 || (errno != ENOSYS && errno != EPERM)) {
+                        return (int)fd;
+                }
+                if (errno == EPERM && !dir_openat2_refused(dir)) {
+                        errno = EPERM;
+                        return -1;
+                }
+                LOG_WARNING("openat2() is unavailable, lookups beneath %s are not confined",
+                            dir->path);
+                cbm_openat2_unsupported = true;
+        }
+#endif
+
+        return openat(dir->fd, name, flags | O_CLOEXEC, mode);
+}
+
+/**
+ * Open the directory holding the final component of @name, which is
+ * returned in @base. The descriptor of @dir itself is reused where possible.
+ */
+static int dir_resolve_parent(const CbmDir *dir, const char *name, const char **base)
+{
+        autofree(char) *parent = NULL;
+        const char *slash = NULL;
+
+        name = dir_relative(name);
+        slash = strrchr(name, '/');
+        if (!slash) {
+                *base = name;
+                return dir->fd;
+        }
+
+        *base = slash + 1;
+        parent = strndup(name, (size_t)(slash - name));
+        OOM_CHECK(parent);
+
+        return dir_resolve(dir, parent, O_PATH | O_DIRECTORY, 0);
+}
+
+static void dir_close_parent(const CbmDir *dir, int fd)
+{
+        int saved_errno = errno;
+
+        if (fd >= 0 && fd != dir->fd) {
+                close(fd);
+        }
+        errno = saved_errno;
+}
+
+/**
+ * Ask the kernel where @fd ended up, as symlinks may have been resolved.
+ * Within a detached mount the answer is relative to the mount itself, so
+ * it only counts if it leads back to the same directory.
+ */
+static char *dir_fd_path(int fd)
+{
+        struct stat fd_st = { 0 };
+        struct stat path_st = { 0 };
+        char proc_path[64];
+        char buf[PATH_MAX];
+        ssize_t len;
+        char *ret = NULL;
+
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+        len = readlink(proc_path, buf, sizeof(buf) - 1);
+        if (len <= 0 || buf[0] != '/') {
+                return NULL;
+        }
+        buf[len] = '\0';
+
+        if (fstat(fd, &fd_st) != 0 || stat(buf, &path_st) != 0 ||
+            fd_st.st_dev != path_st.st_dev || fd_st.st_ino != path_st.st_ino) {
+                return NULL;
+        }
+
+        ret = strdup(buf);
+        OOM_CHECK(ret);
+        return ret;
+}
+
+CbmDir *cbm_dir_open(const CbmDir *parent, const char *path, bool confined)
+{
+        CbmDir *ret = NULL;
+        int fd;
+
+        if (parent) {
+                fd = dir_resolve(parent, path, O_PATH | O_DIRECTORY, 0);
+        } else {
+                fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (fd < 0) {
+                return NULL;
+        }
+
+        ret = calloc(1, sizeof(CbmDir));
+        OOM_CHECK(ret);
+        ret->fd = fd;
+        ret->confined = parent ? parent->confined : confined;
+        ret->path = dir_fd_path(fd);
+        if (!ret->path) {
+                ret->path = parent ? cbm_dir_path(parent, path) : strdup(path);
+                OOM_CHECK(ret->path);
+        }
+
+        return ret;
+}
+
+void cbm_dir_free(CbmDir *dir)
+{
+        if (!dir) {
+                return;
+        }
+        close(dir->fd);
+        free(dir->path);
+        free(dir);
+}
+
+int cbm_dir_openat(const CbmDir *dir, const char *name, int flags, mode_t mode)
+{
+        return dir_resolve(dir, name, flags, mode);
+}
+
+bool cbm_dir_stat(const CbmDir *dir, const char *name, struct stat *st)
+{
+        int saved_errno;
+        int fd;
+        int r;
+
+        fd = dir_resolve(dir, name, O_PATH, 0);
+        if (fd < 0) {
+                return false;
+        }
+        r = fstat(fd, st);
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+
+        return r == 0;
+}
+
+/**
+ * Keep the ESP index in step with a change to @name
+ */
+static void dir_index_update(const CbmDir *dir, const char *name)
+{
+        autofree(char) *path = cbm_dir_path(dir, name);
+
+        cbm_esp_index_update(path);
+}
+
+bool cbm_dir_unlink(const CbmDir *dir, const char *name)
+{
+        const char *base = NULL;
+        int saved_errno;
+        int pfd;
+        int r;
+
+        pfd = dir_resolve_parent(dir, name, &base);
+        if (pfd < 0) {
+                return false;
+        }
+        r = unlinkat(pfd, base, 0);
+        saved_errno = errno;
+        dir_close_parent(dir, pfd);
+
+        dir_index_update(dir, name);
+        errno = saved_errno;
+        return r == 0;
+}
+
+bool cbm_dir_mkdir(const CbmDir *dir, const char *name, mode_t mode)
+{
+        const char *base = NULL;
+        struct stat st = { 0 };
+        int saved_errno;
+        int pfd;
+        int r;
+
+        pfd = dir_resolve_parent(dir, name, &base);
+        if (pfd < 0) {
+                return false;
+        }
+        r = mkdirat(pfd, base, mode);
+        if (r != 0 && errno == EEXIST && fstatat(pfd, base, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISDIR(st.st_mode)) {
+                r = 0;
+        }
+        saved_errno = errno;
+        dir_close_parent(dir, pfd);
+
+        dir_index_update(dir, name);
+        errno = saved_errno;
+        return r == 0;
+}
+
+bool cbm_dir_mkdir_p(const CbmDir *dir, const char *name, mode_t mode)
+{
+        autofree(char) *path = strdup(dir_relative(name));
+
+        OOM_CHECK(path);
+
+        for (char *c = path;; c++) {
+                char saved = *c;
+
+                if ((saved != '/' || c[-1] == '/') && saved != '\0') {
+                        continue;
+                }
+                *c = '\0';
+                if (!cbm_dir_mkdir(dir, path, mode)) {
+                        return false;
+                }
+                if (saved == '\0') {
+                        return true;
+                }
+                *c = saved;
+        }
+}
+
+bool cbm_dir_rmdir(const CbmDir *dir, const char *name)
+{
+        const char *base = NULL;
+        int saved_errno;
+        int pfd;
+        int r;
+
+        pfd = dir_resolve_parent(dir, name, &base);
+        if (pfd < 0) {
+                return false;
+        }
+        r = unlinkat(pfd, base, AT_REMOVEDIR);
+        saved_errno = errno;
+        dir_close_parent(dir, pfd);
+
+        dir_index_update(dir, name);
+        errno = saved_errno;
+        return r == 0;
+}
+
+bool cbm_dir_rename(const CbmDir *dir, const char *from, const char *to)
+{
+        const char *from_base = NULL;
+        const char *to_base = NULL;
+        int saved_errno;
+        int from_fd = -1;
+        int to_fd = -1;
+        int r = -1;
+
+        from_fd = dir_resolve_parent(dir, from, &from_base);
+        if (from_fd < 0) {
+                return false;
+        }
+        to_fd = dir_resolve_parent(dir, to, &to_base);
+        if (to_fd >= 0) {
+                r = renameat(from_fd, from_base, to_fd, to_base);
+        }
+        saved_errno = errno;
+        dir_close_parent(dir, to_fd);
+        dir_close_parent(dir, from_fd);
+
+        dir_index_update(dir, from);
+        dir_index_update(dir, to);
+        errno = saved_errno;
+        return r == 0;
+}
+
+char *cbm_dir_path(const CbmDir *dir, const char *name)
+{
+        const char *rel = dir_relative(name);
+
+        if (streq(rel, ".")) {
+                char *ret = strdup(dir->path);
+                OOM_CHECK(ret);
+                return ret;
+        }
+
+        return string_printf("%s/%s", streq(dir->path, "/") ? "" : dir->path, rel);
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,104 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "nica/util.h"
+
+/**
+ * An open directory that further lookups are made relative to, rather than
+ * rebuilding and walking an absolute path for each of them.
+ */
+typedef struct CbmDir {
+        int fd;         /**<O_PATH descriptor of the directory */
+        char *path;     /**<Resolved absolute path, for messages and path based APIs */
+        bool confined;  /**<Resolve every name as if @fd were the root directory */
+} CbmDir;
+
+/**
+ * Open the directory @path.
+ *
+ * With a @parent, @path is looked up beneath it and inherits its
+ * confinement. Otherwise @path must be absolute, and @confined determines
+ * whether names beneath the new directory may escape it, through ".." or
+ * symlinks, as they would on the target system itself.
+ *
+ * @return a newly allocated directory, or NULL with errno set
+ */
+CbmDir *cbm_dir_open(const CbmDir *parent, const char *path, bool confined);
+
+/**
+ * Close and free @dir
+ */
+void cbm_dir_free(CbmDir *dir);
+
+/**
+ * openat() counterpart, resolving @name beneath @dir
+ *
+ * @return a new file descriptor, or -1 with errno set
+ */
+int cbm_dir_openat(const CbmDir *dir, const char *name, int flags, mode_t mode);
+
+/**
+ * stat() counterpart, resolving @name beneath @dir
+ */
+bool cbm_dir_stat(const CbmDir *dir, const char *name, struct stat *st);
+
+/**
+ * unlink() counterpart, resolving @name beneath @dir. The final component
+ * of @name is removed, never followed.
+ */
+bool cbm_dir_unlink(const CbmDir *dir, const char *name);
+
+/**
+ * mkdir() counterpart, resolving @name beneath @dir. An existing directory
+ * is not an error.
+ */
+bool cbm_dir_mkdir(const CbmDir *dir, const char *name, mode_t mode);
+
+/**
+ * nc_mkdir_p counterpart, creating @name and any missing parents beneath @dir
+ */
+bool cbm_dir_mkdir_p(const CbmDir *dir, const char *name, mode_t mode);
+
+/**
+ * rmdir() counterpart, resolving @name beneath @dir
+ */
+bool cbm_dir_rmdir(const CbmDir *dir, const char *name);
+
+/**
+ * rename() counterpart, resolving both @from and @to beneath @dir
+ */
+bool cbm_dir_rename(const CbmDir *dir, const char *from, const char *to);
+
+/**
+ * Build the absolute path of @name beneath @dir
+ */
+char *cbm_dir_path(const CbmDir *dir, const char *name);
+
+DEF_AUTOFREE(CbmDir, cbm_dir_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,488 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "esp-index.h"
+#include "log.h"
+#include "nica/array.h"
+#include "nica/files.h"
+#include "nica/hashmap.h"
+#include "util.h"
+
+/**
+ * Subtrees of the root indexed in full. They only hold the bootloader,
+ * its entries and the kernels, so are cheap to walk once.
+ */
+static const char *esp_index_subtrees[] = { "efi", "loader" };
+
+/**
+ * Deepest directory level walked beneath the root
+ */
+#define ESP_INDEX_MAX_DEPTH 8
+
+/**
+ * Maps the lower-cased path of every indexed file to its entry
+ */
+static NcHashmap *esp_index = NULL;
+static char *esp_index_root = NULL;
+
+/**
+ * Identity of the root when it was indexed
+ */
+static dev_t esp_index_dev = 0;
+static ino_t esp_index_ino = 0;
+
+static void esp_entry_free(void *v)
+{
+        CbmEspEntry *entry = v;
+
+        if (!entry) {
+                return;
+        }
+        if (entry->children) {
+                nc_hashmap_free(entry->children);
+        }
+        free(entry->path);
+        free(entry);
+}
+
+/**
+ * Collapse repeated and trailing slashes, so every spelling of a path maps
+ * to the same entry
+ */
+static char *esp_index_normalize(const char *path)
+{
+        char *ret = strdup(path);
+        char *w = ret;
+
+        OOM_CHECK(ret);
+
+        for (const char *r = path; *r; r++) {
+                if (*r == '/' && w > ret && w[-1] == '/') {
+                        continue;
+                }
+                *w++ = *r;
+        }
+        while (w > ret + 1 && w[-1] == '/') {
+                w--;
+        }
+        *w = '\0';
+
+        return ret;
+}
+
+static char *esp_index_key(const char *normalized)
+{
+        char *ret = strdup(normalized);
+
+        OOM_CHECK(ret);
+        for (char *c = ret; *c; c++) {
+                *c = (char)tolower((unsigned char)*c);
+        }
+        return ret;
+}
+
+static bool esp_index_within(const char *normalized)
+{
+        struct stat st = { 0 };
+        size_t len;
+
+        if (!esp_index) {
+                return false;
+        }
+
+        /* Something else was mounted over the root, or it went away */
+        if (stat(esp_index_root, &st) != 0 || st.st_dev != esp_index_dev ||
+            st.st_ino != esp_index_ino) {
+                LOG_DEBUG("%s changed since it was indexed, dropping the index", esp_index_root);
+                cbm_esp_index_reset();
+                return false;
+        }
+        len = strlen(esp_index_root);
+
+        return strncmp(normalized, esp_index_root, len) == 0 &&
+               (normalized[len] == '\0' || normalized[len] == '/');
+}
+
+static CbmEspEntry *esp_index_get(const char *normalized)
+{
+        autofree(char) *key = esp_index_key(normalized);
+
+        return nc_hashmap_get(esp_index, key);
+}
+
+/**
+ * Drop the entry stored under @key and everything beneath it. Only that
+ * subtree is visited, through the children of each directory.
+ *
+ * @param detach Also unlink the entry from its parent, which isn't needed
+ * when the parent itself is going away
+ */
+static void esp_index_remove_key(const char *key, bool detach)
+{
+        CbmEspEntry *entry = nc_hashmap_get(esp_index, key);
+
+        if (!entry) {
+                return;
+        }
+
+        if (entry->children) {
+                NcHashmapIter iter = { 0 };
+                NcArray *keys = NULL;
+                void *k = NULL;
+                void *v = NULL;
+
+                /* Removing a child must not disturb the walk over them */
+                keys = nc_array_new();
+                OOM_CHECK(keys);
+                nc_hashmap_iter_init(entry->children, &iter);
+                while (nc_hashmap_iter_next(&iter, &k, &v)) {
+                        char *copy = strdup(k);
+                        OOM_CHECK(copy);
+                        OOM_CHECK(nc_array_add(keys, copy));
+                }
+                for (int i = 0; i < keys->len; i++) {
+                        esp_index_remove_key(nc_array_get(keys, i), false);
+                }
+                nc_array_free(&keys, free);
+        }
+
+        if (detach && entry->parent && entry->parent->children) {
+                nc_hashmap_remove(entry->parent->children, key);
+        }
+        nc_hashmap_remove(esp_index, key);
+}
+
+/**
+ * Drop @normalized and everything beneath it
+ */
+static void esp_index_remove(const char *normalized)
+{
+        autofree(char) *key = esp_index_key(normalized);
+
+        esp_index_remove_key(key, true);
+}
+
+static CbmEspEntry *esp_index_put(CbmEspEntry *parent, const char *normalized,
+                                  const struct stat *st)
+{
+        CbmEspEntry *entry = NULL;
+        char *key = esp_index_key(normalized);
+
+        entry = nc_hashmap_get(esp_index, key);
+
+        /* Replaced by something else entirely, forget what it held */
+        if (entry && entry->dir != S_ISDIR(st->st_mode)) {
+                esp_index_remove_key(key, true);
+                entry = NULL;
+        }
+
+        if (!entry) {
+                entry = calloc(1, sizeof(CbmEspEntry));
+                OOM_CHECK(entry);
+                entry->path = strdup(normalized);
+                OOM_CHECK(entry->path);
+                entry->parent = parent;
+                if (parent) {
+                        char *child_key = strdup(key);
+
+                        OOM_CHECK(child_key);
+                        if (!parent->children) {
+                                parent->children = nc_hashmap_new_full(nc_string_hash,
+                                                                       nc_string_compare,
+                                                                       free,
+                                                                       NULL);
+                                OOM_CHECK(parent->children);
+                        }
+                        OOM_CHECK(nc_hashmap_put(parent->children, child_key, entry));
+                }
+                OOM_CHECK(nc_hashmap_put(esp_index, key, entry));
+        } else {
+                free(key);
+        }
+
+        entry->dir = S_ISDIR(st->st_mode);
+        entry->size = st->st_size;
+        entry->mtime = st->st_mtime;
+        return entry;
+}
+
+/**
+ * Index the children of the directory @entry, recursing @depth levels
+ */
+static void esp_index_walk(CbmEspEntry *entry, int depth)
+{
+        struct dirent *ent = NULL;
+        DIR *dir = NULL;
+
+        dir = opendir(entry->path);
+        if (!dir) {
+                return;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *path = NULL;
+                struct stat st = { 0 };
+                CbmEspEntry *child = NULL;
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+
+                path = string_printf("%s/%s", entry->path, ent->d_name);
+                if (lstat(path, &st) != 0) {
+                        continue;
+                }
+                child = esp_index_put(entry, path, &st);
+                if (child->dir && depth > 0) {
+                        esp_index_walk(child, depth - 1);
+                }
+        }
+        closedir(dir);
+
+        entry->listed = true;
+}
+
+void cbm_esp_index_reset(void)
+{
+        if (esp_index) {
+                nc_hashmap_free(esp_index);
+                esp_index = NULL;
+        }
+        free(esp_index_root);
+        esp_index_root = NULL;
+}
+
+bool cbm_esp_index_load(const char *root)
+{
+        struct stat st = { 0 };
+        struct dirent *ent = NULL;
+        CbmEspEntry *root_entry = NULL;
+        DIR *dir = NULL;
+
+        cbm_esp_index_reset();
+
+        if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+                return false;
+        }
+
+        esp_index = nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, esp_entry_free);
+        OOM_CHECK(esp_index);
+        esp_index_root = esp_index_normalize(root);
+        esp_index_dev = st.st_dev;
+        esp_index_ino = st.st_ino;
+        root_entry = esp_index_put(NULL, esp_index_root, &st);
+
+        dir = opendir(root_entry->path);
+        if (!dir) {
+                cbm_esp_index_reset();
+                return false;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *path = NULL;
+                struct stat cst = { 0 };
+                CbmEspEntry *child = NULL;
+
+                if (streq(ent->d_name, ".") || streq(ent->d_name, "..")) {
+                        continue;
+                }
+
+                path = string_printf("%s/%s", root_entry->path, ent->d_name);
+                if (lstat(path, &cst) != 0) {
+                        continue;
+                }
+                child = esp_index_put(root_entry, path, &cst);
+                if (!child->dir) {
+                        continue;
+                }
+                for (size_t i = 0; i < ARRAY_SIZE(esp_index_subtrees); i++) {
+                        if (strcasecmp(ent->d_name, esp_index_subtrees[i]) == 0) {
+                                esp_index_walk(child, ESP_INDEX_MAX_DEPTH);
+                                break;
+                        }
+                }
+        }
+        closedir(dir);
+
+        root_entry->listed = true;
+        LOG_DEBUG("Indexed %d paths beneath %s", nc_hashmap_size(esp_index), esp_index_root);
+
+        return true;
+}
+
+const CbmEspEntry *cbm_esp_index_lookup(const char *path)
+{
+        autofree(char) *normalized = esp_index_normalize(path);
+
+        if (!esp_index_within(normalized)) {
+                return NULL;
+        }
+        return esp_index_get(normalized);
+}
+
+/**
+ * Bring @normalized into the index, along with any parents we didn't know
+ * about. New directories are walked, which is cheap as we just made them.
+ */
+static void esp_index_refresh(const char *normalized)
+{
+        struct stat st = { 0 };
+        CbmEspEntry *entry = NULL;
+        CbmEspEntry *parent = NULL;
+        bool known;
+
+        if (lstat(normalized, &st) != 0) {
+                esp_index_remove(normalized);
+                return;
+        }
+
+        entry = esp_index_get(normalized);
+        known = entry && entry->dir == S_ISDIR(st.st_mode);
+        if (!entry && !streq(normalized, esp_index_root)) {
+                autofree(char) *parent_path = strdup(normalized);
+                OOM_CHECK(parent_path);
+                *strrchr(parent_path, '/') = '\0';
+                parent = esp_index_get(parent_path);
+                if (!parent) {
+                        esp_index_refresh(parent_path);
+                        parent = esp_index_get(parent_path);
+                }
+        } else if (entry) {
+                parent = entry->parent;
+        }
+
+        entry = esp_index_put(parent, normalized, &st);
+        if (!known && entry->dir) {
+                esp_index_walk(entry, ESP_INDEX_MAX_DEPTH);
+        }
+}
+
+void cbm_esp_index_update(const char *path)
+{
+        autofree(char) *normalized = NULL;
+
+        if (!esp_index || !path) {
+                return;
+        }
+        normalized = esp_index_normalize(path);
+        if (!esp_index_within(normalized)) {
+                return;
+        }
+        esp_index_refresh(normalized);
+}
+
+bool cbm_esp_exists(const char *path)
+{
+        autofree(char) *normalized = esp_index_normalize(path);
+        const CbmEspEntry *entry = NULL;
+        char *slash = NULL;
+
+        if (!esp_index_within(normalized)) {
+                return nc_file_exists(path);
+        }
+        if (esp_index_get(normalized)) {
+                return true;
+        }
+
+        /* Only a fully listed (or non-directory) ancestor proves absence */
+        while ((slash = strrchr(normalized, '/')) != NULL && slash != normalized) {
+                *slash = '\0';
+                entry = esp_index_get(normalized);
+                if (entry) {
+                        if (entry->listed || !entry->dir) {
+                                return false;
+                        }
+                        break;
+                }
+        }
+
+        return nc_file_exists(path);
+}
+
+/**
+ * Append the case-correct spelling of @component to @parent
+ */
+static char *esp_index_build_component(const char *parent, const char *component)
+{
+        autofree(char) *normalized = NULL;
+        const CbmEspEntry *entry = NULL;
+        const CbmEspEntry *parent_entry = NULL;
+        char *ret = NULL;
+
+        normalized = esp_index_normalize(parent);
+        if (!esp_index_within(normalized)) {
+                return nc_build_case_correct_path(parent, component, NULL);
+        }
+
+        parent_entry = esp_index_get(normalized);
+        ret = string_printf("%s/%s", parent_entry ? parent_entry->path : normalized, component);
+        entry = esp_index_get(ret);
+        if (entry) {
+                free(ret);
+                ret = strdup(entry->path);
+                OOM_CHECK(ret);
+                return ret;
+        }
+
+        /* Nothing to correct within a missing directory, or one we listed */
+        if ((parent_entry && parent_entry->listed) || !cbm_esp_exists(normalized)) {
+                return ret;
+        }
+
+        free(ret);
+        return nc_build_case_correct_path(parent, component, NULL);
+}
+
+char *cbm_esp_build_path(const char *base, ...)
+{
+        const char *component = NULL;
+        char *ret = NULL;
+        va_list ap;
+
+        ret = strdup(base);
+        OOM_CHECK(ret);
+
+        va_start(ap, base);
+        while ((component = va_arg(ap, const char *)) != NULL) {
+                char *next = esp_index_build_component(ret, component);
+
+                free(ret);
+                ret = next;
+                if (!ret) {
+                        break;
+                }
+        }
+        va_end(ap);
+
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,86 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "nica/hashmap.h"
+
+/**
+ * A single file or directory known to the ESP index
+ */
+typedef struct CbmEspEntry {
+        char *path;                  /**<Case-correct absolute path */
+        bool dir;                    /**<Whether this is a directory */
+        bool listed;                 /**<Directory whose children are all indexed */
+        off_t size;                  /**<Size in bytes */
+        time_t mtime;                /**<Last modification time */
+        struct CbmEspEntry *parent;  /**<Containing directory, NULL for the root */
+        NcHashmap *children;         /**<Keys of the indexed children of a directory */
+} CbmEspEntry;
+
+/**
+ * Index the boot directory @root, along with everything beneath its EFI/
+ * and loader/ directories, replacing any previous index.
+ *
+ * On vfat every case-insensitive lookup means walking a directory on the
+ * medium, so the bootloaders answer existence and case correction queries
+ * from this index instead. The index only stays in use while @root is the
+ * same directory on the same filesystem it was loaded from, so an ESP that
+ * was unmounted or remounted beneath it is never answered for.
+ */
+bool cbm_esp_index_load(const char *root);
+
+/**
+ * Drop the index, so all queries go to the filesystem again
+ */
+void cbm_esp_index_reset(void);
+
+/**
+ * Look up @path within the index
+ *
+ * @return the entry, owned by the index, or NULL if it is unknown
+ */
+const CbmEspEntry *cbm_esp_index_lookup(const char *path);
+
+/**
+ * Refresh the index entry for @path after it was written, created or
+ * removed. Paths outside of the index are ignored.
+ */
+void cbm_esp_index_update(const char *path);
+
+/**
+ * Equivalent of nc_file_exists, answered from the index for any path
+ * within it
+ */
+bool cbm_esp_exists(const char *path);
+
+/**
+ * Equivalent of nc_build_case_correct_path, answered from the index for
+ * any path within it
+ */
+char *cbm_esp_build_path(const char *base, ...) __attribute__((sentinel(0)));
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,715 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#include "blkid_stub.h"
+#include "config.h"
+#include "esp.h"
+#include "files.h"
+#include "log.h"
+#include "nica/files.h"
+#include "parttable.h"
+#include "system_stub.h"
+#include "topology.h"
+#include "util.h"
+
+/**
+ * Remembers the last discovery as a single line:
+ *
+ *      $root_identity $disk_name $esp_partuuid
+ */
+#define ESP_CACHE_FILE "esp-device"
+
+/**
+ * Partition tables are read in parallel, as each read on a busy SAN or a
+ * spun down disk is dominated by latency rather than bandwidth.
+ */
+#define ESP_MAX_WORKERS 16
+
+/**
+ * How deep md and dm devices may be stacked beneath the root
+ */
+#define ESP_MAX_STACK_DEPTH 8
+
+typedef struct EspDisk {
+        char *name;          /**<Kernel name, i.e. "sda" */
+        char *devnode;       /**<Device node within devfs */
+        dev_t devno;
+        bool read;           /**<Whether @table was read */
+        CbmPartTable table;
+} EspDisk;
+
+typedef struct EspScan {
+        EspDisk *disks;
+        size_t count;
+        size_t size;         /**<Allocated length of @disks */
+        size_t next;         /**<Next disk to be claimed by a worker */
+} EspScan;
+
+static void esp_scan_free(EspScan *scan)
+{
+        for (size_t i = 0; i < scan->count; i++) {
+                free(scan->disks[i].name);
+                free(scan->disks[i].devnode);
+                cbm_part_table_clear(&scan->disks[i].table);
+        }
+        free(scan->disks);
+        scan->disks = NULL;
+        scan->count = 0;
+        scan->size = 0;
+}
+
+static bool read_sysfs_devno(const char *dir, dev_t *devno)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+        unsigned int dev_major, dev_minor;
+
+        path = string_printf("%s/dev", dir);
+        if (!file_get_attribute(path, &text) ||
+            sscanf(text, "%u:%u", &dev_major, &dev_minor) != 2) {
+                return false;
+        }
+
+        *devno = makedev(dev_major, dev_minor);
+        return true;
+}
+
+/**
+ * Map a sysfs block name to its node in devfs, which doesn't depend on udev
+ * having run. Slashes in device names are escaped as '!' within sysfs.
+ */
+static char *sysfs_name_to_devnode(const char *name)
+{
+        char *ret = string_printf("%s/%s", cbm_system_get_devfs_path(), name);
+
+        for (char *c = ret + strlen(cbm_system_get_devfs_path()); *c; c++) {
+                if (*c == '!') {
+                        *c = '/';
+                }
+        }
+        return ret;
+}
+
+/**
+ * Find the device node of partition @partno of the disk @disk_name
+ */
+static char *esp_partition_node(const char *disk_name, int partno)
+{
+        autofree(char) *disk_dir = NULL;
+        char *ret = NULL;
+        struct dirent *ent = NULL;
+        DIR *dir = NULL;
+
+        disk_dir = string_printf("%s/block/%s", cbm_system_get_sysfs_path(), disk_name);
+        dir = opendir(disk_dir);
+        if (!dir) {
+                return NULL;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *path = NULL;
+                autofree(char) *text = NULL;
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+
+                path = string_printf("%s/%s/partition", disk_dir, ent->d_name);
+                if (!file_get_attribute(path, &text) || atoi(text) != partno) {
+                        continue;
+                }
+
+                ret = sysfs_name_to_devnode(ent->d_name);
+                break;
+        }
+        closedir(dir);
+
+        if (ret && !nc_file_exists(ret)) {
+                free(ret);
+                return NULL;
+        }
+        return ret;
+}
+
+static int esp_disk_compare(const void *a, const void *b)
+{
+        return strcmp(((const EspDisk *)a)->name, ((const EspDisk *)b)->name);
+}
+
+static void esp_scan_add(EspScan *scan, const char *name, dev_t devno)
+{
+        EspDisk *disk = NULL;
+
+        for (size_t i = 0; i < scan->count; i++) {
+                if (scan->disks[i].devno == devno) {
+                        return;
+                }
+        }
+
+        if (scan->count == scan->size) {
+                scan->size = scan->size ? scan->size * 2 : 8;
+                scan->disks = realloc(scan->disks, scan->size * sizeof(EspDisk));
+                OOM_CHECK(scan->disks);
+        }
+        disk = &scan->disks[scan->count++];
+        memset(disk, 0, sizeof(*disk));
+        disk->name = strdup(name);
+        OOM_CHECK(disk->name);
+        disk->devnode = sysfs_name_to_devnode(name);
+        disk->devno = devno;
+}
+
+/**
+ * Collect every physical whole disk known to sysfs
+ */
+static bool esp_scan_disks(EspScan *scan)
+{
+        autofree(char) *block_dir = NULL;
+        struct dirent *ent = NULL;
+        DIR *dir = NULL;
+
+        block_dir = string_printf("%s/block", cbm_system_get_sysfs_path());
+        dir = opendir(block_dir);
+        if (!dir) {
+                return false;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *disk_dir = NULL;
+                autofree(char) *device = NULL;
+                dev_t devno;
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+
+                /* Virtual devices (loop, dm, md, zram) have no backing device */
+                disk_dir = string_printf("%s/%s", block_dir, ent->d_name);
+                device = string_printf("%s/device", disk_dir);
+                if (!nc_file_exists(device) || !read_sysfs_devno(disk_dir, &devno)) {
+                        continue;
+                }
+
+                esp_scan_add(scan, ent->d_name, devno);
+        }
+        closedir(dir);
+
+        if (scan->count > 1) {
+                qsort(scan->disks, scan->count, sizeof(EspDisk), esp_disk_compare);
+        }
+        return scan->count > 0;
+}
+
+static void *esp_scan_worker(void *data)
+{
+        EspScan *scan = data;
+
+        for (;;) {
+                size_t i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+                if (i >= scan->count) {
+                        break;
+                }
+                scan->disks[i].read = cbm_blkid_read_partition_table(scan->disks[i].devnode,
+                                                                     &scan->disks[i].table);
+        }
+
+        return NULL;
+}
+
+static void esp_read_tables(EspScan *scan)
+{
+        pthread_t workers[ESP_MAX_WORKERS];
+        size_t nworkers = 0;
+
+        for (size_t i = 1; i < scan->count && nworkers < ESP_MAX_WORKERS; i++) {
+                if (pthread_create(&workers[nworkers], NULL, esp_scan_worker, scan) != 0) {
+                        break;
+                }
+                nworkers++;
+        }
+
+        /* Help out, which also covers being unable to start any workers */
+        esp_scan_worker(scan);
+
+        for (size_t i = 0; i < nworkers; i++) {
+                pthread_join(workers[i], NULL);
+        }
+}
+
+static const CbmPartition *esp_find_in_table(const CbmPartTable *table, const char *uuid)
+{
+        for (int i = 0; i < table->count; i++) {
+                const CbmPartition *part = &table->parts[i];
+
+                if (!streq(part->type, CBM_ESP_TYPE_GUID)) {
+                        continue;
+                }
+                if (!uuid || streq(part->uuid, uuid)) {
+                        return part;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * Identify the root disk by its GPT disk GUID where possible, falling back
+ * to the root filesystem's UUID for roots on md, dm or unpartitioned disks.
+ */
+static char *esp_root_identity(const char *root, dev_t *root_disk)
+{
+        autofree(char) *dev_path = NULL;
+        const CbmDiskInfo *disk = NULL;
+        const CbmDeviceInfo *info = NULL;
+        char *ret = NULL;
+
+        disk = cbm_topology_get_disk(root);
+        if (disk) {
+                *root_disk = disk->devno;
+                if (disk->table.uuid[0]) {
+                        ret = strdup(disk->table.uuid);
+                        OOM_CHECK(ret);
+                        return ret;
+                }
+        }
+
+        dev_path = cbm_system_get_device_for_mountpoint(root);
+        if (dev_path) {
+                info = cbm_topology_get_device(dev_path);
+        }
+        if (info && info->uuid) {
+                ret = strdup(info->uuid);
+                OOM_CHECK(ret);
+        }
+        return ret;
+}
+
+static char *esp_cache_path(const char *root)
+{
+        return string_printf("%s%s/" ESP_CACHE_FILE, streq(root, "/") ? "" : root, CACHE_DIRECTORY);
+}
+
+/**
+ * Confirm the remembered ESP with a single partition table read. Anything
+ * short of a well formed entry for @identity, on @root_disk if it is set,
+ * is ignored and the disks are scanned again.
+ */
+static char *esp_cache_lookup(const char *cache_path, const char *identity, dev_t root_disk)
+{
+        autofree(char) *text = NULL;
+        autofree(char) *disk_dir = NULL;
+        autofree(char) *devnode = NULL;
+        CbmPartTable table = { 0 };
+        const CbmPartition *part = NULL;
+        char cached_identity[128], disk_name[128], uuid[CBM_GUID_STRING_SIZE];
+        dev_t devno;
+        char *ret = NULL;
+
+        /* Read rather than mapped, the file may be empty or cut short */
+        if (!file_get_attribute(cache_path, &text)) {
+                return NULL;
+        }
+        if (sscanf(text, "%127s %127s %36s", cached_identity, disk_name, uuid) != 3 ||
+            strcmp(cached_identity, identity) != 0 || strchr(disk_name, '/') ||
+            disk_name[0] == '.') {
+                return NULL;
+        }
+
+        if (root_disk) {
+                disk_dir = string_printf("%s/block/%s", cbm_system_get_sysfs_path(), disk_name);
+                if (!read_sysfs_devno(disk_dir, &devno) || devno != root_disk) {
+                        return NULL;
+                }
+        }
+
+        devnode = sysfs_name_to_devnode(disk_name);
+        if (!cbm_blkid_read_partition_table(devnode, &table)) {
+                return NULL;
+        }
+
+        part = esp_find_in_table(&table, uuid);
+        if (part) {
+                ret = esp_partition_node(disk_name, part->partno);
+        }
+        cbm_part_table_clear(&table);
+
+        return ret;
+}
+
+static void esp_cache_store(const char *cache_path, const char *identity, const char *disk_name,
+                            const char *uuid)
+{
+        autofree(char) *dir = NULL;
+        autofree(char) *text = NULL;
+
+        dir = strdup(cache_path);
+        OOM_CHECK(dir);
+        if (!nc_mkdir_p(dirname(dir), 00755)) {
+                LOG_DEBUG("Unable to create the directory for %s", cache_path);
+                return;
+        }
+
+        text = string_printf("%s %s %s\n", identity, disk_name, uuid);
+        if (!file_set_text_atomic(cache_path, text)) {
+                LOG_DEBUG("Unable to remember the ESP in %s", cache_path);
+        }
+}
+
+/**
+ * Add the whole disk @devno to the scan, provided sysfs knows it
+ */
+static bool esp_scan_disk(EspScan *scan, dev_t devno)
+{
+        autofree(char) *link = NULL;
+        autofree(char) *sysdir = NULL;
+
+        link = string_printf("%s/dev/block/%u:%u",
+                             cbm_system_get_sysfs_path(),
+                             major(devno),
+                             minor(devno));
+        sysdir = realpath(link, NULL);
+        if (!sysdir) {
+                return false;
+        }
+
+        esp_scan_add(scan, basename(sysdir), devno);
+        return true;
+}
+
+char *cbm_esp_discover(const char *root, bool root_disk_only)
+{
+        autofree(char) *identity = NULL;
+        autofree(char) *cache_path = NULL;
+        EspScan scan = { 0 };
+        const EspDisk *best_disk = NULL;
+        const CbmPartition *best = NULL;
+        dev_t root_disk = 0;
+        char *ret = NULL;
+
+        identity = esp_root_identity(root, &root_disk);
+        cache_path = esp_cache_path(root);
+
+        if (identity) {
+                ret = esp_cache_lookup(cache_path, identity, root_disk_only ? root_disk : 0);
+                if (ret) {
+                        LOG_DEBUG("Using remembered ESP %s", ret);
+                        return ret;
+                }
+        }
+
+        if (root_disk_only) {
+                if (!root_disk || !esp_scan_disk(&scan, root_disk)) {
+                        return NULL;
+                }
+        } else if (!esp_scan_disks(&scan)) {
+                return NULL;
+        }
+        esp_read_tables(&scan);
+
+        for (size_t i = 0; i < scan.count; i++) {
+                const EspDisk *disk = &scan.disks[i];
+                const CbmPartition *part = NULL;
+
+                if (!disk->read || !(part = esp_find_in_table(&disk->table, NULL))) {
+                        continue;
+                }
+                if (!best || (disk->devno == root_disk && best_disk->devno != root_disk)) {
+                        best_disk = disk;
+                        best = part;
+                }
+        }
+
+        if (best) {
+                ret = esp_partition_node(best_disk->name, best->partno);
+        }
+        if (ret) {
+                LOG_INFO("Discovered ESP %s on %s", ret, best_disk->devnode);
+                if (identity) {
+                        esp_cache_store(cache_path, identity, best_disk->name, best->uuid);
+                }
+        }
+
+        esp_scan_free(&scan);
+        return ret;
+}
+
+/**
+ * Profiles and md levels keeping more than one copy of the data, so that
+ * the system survives losing a disk. Anything else, say a btrfs "single"
+ * or md "raid0", spreads the data over the disks without copies.
+ */
+static const char *esp_redundant_profiles[] = { "raid1",  "raid1c3", "raid1c4", "raid10",
+                                                "raid4",  "raid5",   "raid6" };
+
+/**
+ * Profiles of btrfs data chunks without copies on other devices
+ */
+static const char *esp_single_profiles[] = { "single", "raid0", "dup" };
+
+static bool esp_profile_in(const char *profile, const char **profiles, size_t n_profiles)
+{
+        for (size_t i = 0; i < n_profiles; i++) {
+                if (streq(profile, profiles[i])) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Whether the data of the btrfs filesystem @uuid is kept redundantly. The
+ * data chunks of each profile in use show up as a directory in sysfs, and
+ * while a balance converts them there are several.
+ */
+static bool esp_btrfs_redundant(const char *uuid)
+{
+        autofree(char) *path = NULL;
+        struct dirent *ent = NULL;
+        bool redundant = false;
+        bool single = false;
+        DIR *dir = NULL;
+
+        path = string_printf("%s/fs/btrfs/%s/allocation/data",
+                             cbm_system_get_sysfs_path(),
+                             uuid);
+        dir = opendir(path);
+        if (!dir) {
+                return false;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                if (esp_profile_in(ent->d_name,
+                                   esp_redundant_profiles,
+                                   ARRAY_SIZE(esp_redundant_profiles))) {
+                        redundant = true;
+                } else if (esp_profile_in(ent->d_name,
+                                          esp_single_profiles,
+                                          ARRAY_SIZE(esp_single_profiles))) {
+                        single = true;
+                }
+        }
+        closedir(dir);
+
+        return redundant && !single;
+}
+
+/**
+ * Whether the md device at @sysdir keeps copies of its data
+ */
+static bool esp_md_redundant(const char *sysdir)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *level = NULL;
+
+        path = string_printf("%s/md/level", sysdir);
+        if (!file_get_attribute(path, &level)) {
+                return false;
+        }
+        return esp_profile_in(level, esp_redundant_profiles, ARRAY_SIZE(esp_redundant_profiles));
+}
+
+/**
+ * Whether @a and @b are the same device node, or for anything else that
+ * isn't a block device, the same file
+ */
+static bool esp_same_node(const struct stat *a, const struct stat *b)
+{
+        if (S_ISBLK(a->st_mode) && S_ISBLK(b->st_mode)) {
+                return a->st_rdev == b->st_rdev;
+        }
+        return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
+}
+
+static void esp_collect_members(EspScan *scan, const char *sysdir, int depth, bool *raid);
+
+/**
+ * Collect the disks behind every block device linked from @dir, which is
+ * either the slaves of a stacked device or the devices of a btrfs filesystem
+ *
+ * @return true if @dir had any entries
+ */
+static bool esp_collect_linked(EspScan *scan, const char *dir_path, int depth, bool *raid)
+{
+        struct dirent *ent = NULL;
+        bool ret = false;
+        DIR *dir = NULL;
+
+        dir = opendir(dir_path);
+        if (!dir) {
+                return false;
+        }
+
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *link = NULL;
+                autofree(char) *target = NULL;
+
+                if (ent->d_name[0] == '.') {
+                        continue;
+                }
+                ret = true;
+
+                link = string_printf("%s/%s", dir_path, ent->d_name);
+                target = realpath(link, NULL);
+                if (target) {
+                        esp_collect_members(scan, target, depth + 1, raid);
+                }
+        }
+        closedir(dir);
+
+        return ret;
+}
+
+/**
+ * Follow the block device at @sysdir down through md and dm to the whole
+ * disks it lives on
+ */
+static void esp_collect_members(EspScan *scan, const char *sysdir, int depth, bool *raid)
+{
+        autofree(char) *slaves = NULL;
+        autofree(char) *md = NULL;
+        autofree(char) *partition = NULL;
+        autofree(char) *disk_dir = NULL;
+        autofree(char) *device = NULL;
+        dev_t devno;
+
+        if (depth > ESP_MAX_STACK_DEPTH) {
+                return;
+        }
+
+        md = string_printf("%s/md", sysdir);
+        if (nc_file_exists(md) && esp_md_redundant(sysdir)) {
+                *raid = true;
+        }
+
+        slaves = string_printf("%s/slaves", sysdir);
+        if (esp_collect_linked(scan, slaves, depth, raid)) {
+                return;
+        }
+
+        /* Partitions live beneath the directory of their disk */
+        disk_dir = strdup(sysdir);
+        OOM_CHECK(disk_dir);
+        partition = string_printf("%s/partition", sysdir);
+        if (nc_file_exists(partition)) {
+                dirname(disk_dir);
+        }
+
+        device = string_printf("%s/device", disk_dir);
+        if (!nc_file_exists(device) || !read_sysfs_devno(disk_dir, &devno)) {
+                return;
+        }
+        esp_scan_add(scan, basename(disk_dir), devno);
+}
+
+NcArray *cbm_esp_discover_mirrors(const char *root, const char *boot_device)
+{
+        autofree(char) *dev_path = NULL;
+        autofree(char) *members = NULL;
+        autofree(char) *sysdir = NULL;
+        const CbmDeviceInfo *info = NULL;
+        struct stat root_st = { 0 };
+        struct stat boot_st = { 0 };
+        EspScan scan = { 0 };
+        NcArray *ret = NULL;
+        bool raid = false;
+
+        dev_path = cbm_system_get_device_for_mountpoint(root);
+        if (!dev_path || !boot_device || stat(boot_device, &boot_st) != 0) {
+                return NULL;
+        }
+
+        info = cbm_topology_get_device(dev_path);
+        if (info && info->type && info->uuid && streq(info->type, "btrfs")) {
+                /* Every device of a multi-device btrfs keeping copies of its data */
+                members = string_printf("%s/fs/btrfs/%s/devices",
+                                        cbm_system_get_sysfs_path(),
+                                        info->uuid);
+                raid = esp_btrfs_redundant(info->uuid);
+                esp_collect_linked(&scan, members, 0, &raid);
+        } else if (stat(dev_path, &root_st) == 0 && S_ISBLK(root_st.st_mode)) {
+                members = string_printf("%s/dev/block/%u:%u",
+                                        cbm_system_get_sysfs_path(),
+                                        major(root_st.st_rdev),
+                                        minor(root_st.st_rdev));
+                sysdir = realpath(members, NULL);
+                if (sysdir) {
+                        esp_collect_members(&scan, sysdir, 0, &raid);
+                }
+        }
+
+        if (!raid || scan.count < 2) {
+                esp_scan_free(&scan);
+                return NULL;
+        }
+
+        qsort(scan.disks, scan.count, sizeof(EspDisk), esp_disk_compare);
+        esp_read_tables(&scan);
+
+        for (size_t i = 0; i < scan.count; i++) {
+                const EspDisk *disk = &scan.disks[i];
+
+                if (!disk->read) {
+                        LOG_WARNING("Unable to read the partition table of %s", disk->devnode);
+                        continue;
+                }
+
+                for (int j = 0; j < disk->table.count; j++) {
+                        const CbmPartition *part = &disk->table.parts[j];
+                        struct stat st = { 0 };
+                        char *node = NULL;
+
+                        if (!streq(part->type, CBM_ESP_TYPE_GUID)) {
+                                continue;
+                        }
+                        node = esp_partition_node(disk->name, part->partno);
+                        if (!node) {
+                                continue;
+                        }
+                        if (stat(node, &st) == 0 && esp_same_node(&st, &boot_st)) {
+                                free(node);
+                                continue;
+                        }
+
+                        if (!ret) {
+                                ret = nc_array_new();
+                                OOM_CHECK(ret);
+                        }
+                        OOM_CHECK(nc_array_add(ret, node));
+                        LOG_DEBUG("Discovered mirrored ESP %s on %s", node, disk->devnode);
+                }
+        }
+
+        esp_scan_free(&scan);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,63 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "nica/array.h"
+
+/**
+ * Partition type GUID of an EFI System Partition
+ */
+#define CBM_ESP_TYPE_GUID "c12a7328-f81f-11d2-ba4b-00a0c93ec93b"
+
+/**
+ * Find the EFI System Partition without relying on the loader or udev, by
+ * reading the partition table of every disk listed in sysfs. An ESP on the
+ * same disk as @root is preferred over any other.
+ *
+ * With @root_disk_only set, only the disk backing @root is considered,
+ * which is what an image wants: the host's own disks are none of its
+ * business.
+ *
+ * The result is remembered beneath @root, keyed by the identity of the
+ * root disk, so later runs only need to confirm it.
+ *
+ * @return a newly allocated path to the ESP device node, or NULL if none
+ * could be found
+ */
+char *cbm_esp_discover(const char *root, bool root_disk_only);
+
+/**
+ * Find the ESPs mirroring @boot_device, for roots on md RAID or a multi
+ * device btrfs that keep copies of their data: every other ESP on the disks
+ * the root is spread over, following dm devices such as LUKS down to them.
+ * A btrfs "single" or md "raid0" root doesn't survive losing a disk, so its
+ * disks aren't treated as mirrors.
+ *
+ * @return a newly allocated array of device nodes, or NULL if the root
+ * isn't on such a set or there are no other ESPs on its disks
+ */
+NcArray *cbm_esp_discover_mirrors(const char *root, const char *boot_device);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -19,23 +19,37 @@
 #include <glob.h>
 #include <libgen.h>
 #include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
 
-#include "blkid_stub.h"
+#include "config.h"
+#include "dirfd.h"
+#include "esp-index.h"
+#include "esp.h"
 #include "files.h"
 #include "log.h"
 #include "nica/files.h"
+#include "sha256.h"
+#include "stats.h"
 #include "system_stub.h"
+#include "topology.h"
 #include "util.h"
 
+#ifdef HAVE_FSMOUNT
+#include <linux/mount.h>
+#endif
+
 /**
  * Legacy boot bit, i.e. partition flag on a GPT disk
  */
@@ -54,16 +68,33 @@ void cbm_sync(void)
         }
 }
 
+/**
+ * Map @path for a single sequential comparison. Readahead is raised, and
+ * the contents are dropped from the page cache again once unmapped.
+ */
+static bool stream_mapped_file_open(const char *path, CbmMappedFile *file)
+{
+        if (!cbm_mapped_file_open(path, file)) {
+                return false;
+        }
+        file->stream = true;
+        if (file->length > 0) {
+                (void)posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                (void)madvise(file->buffer, file->length, MADV_SEQUENTIAL);
+        }
+        return true;
+}
+
 bool cbm_files_match(const char *p1, const char *p2)
 {
         autofree(CbmMappedFile) *m1 = CBM_MAPPED_FILE_INIT;
         autofree(CbmMappedFile) *m2 = CBM_MAPPED_FILE_INIT;
 
-        if (!cbm_mapped_file_open(p1, m1)) {
+        if (!stream_mapped_file_open(p1, m1)) {
                 return false;
         }
 
-        if (!cbm_mapped_file_open(p2, m2)) {
+        if (!stream_mapped_file_open(p2, m2)) {
                 return false;
         }
 
@@ -73,13 +104,125 @@ bool cbm_files_match(const char *p1, const char *p2)
         }
 
         /* Compare both buffers */
+        cbm_stats_add(CBM_STAT_BYTES_COMPARED, (uint64_t)(m1->length + m2->length));
         if (memcmp(m1->buffer, m2->buffer, m1->length) == 0) {
                 return true;
         }
         return false;
 }
 
-char *get_boot_device()
+/**
+ * Bytes of zero padding needed for a member at @offset to start on an @align
+ * boundary, none if @align is 0
+ */
+static size_t member_padding(off_t offset, size_t align)
+{
+        if (!align) {
+                return 0;
+        }
+        return (align - (size_t)offset % align) % align;
+}
+
+/**
+ * Compare the concatenation of @sources, each starting on an @align boundary,
+ * with @target, feeding the matching bytes into @hash if set
+ */
+static bool files_concat_match(const char *const *sources, const char *target, size_t align,
+                               CbmSha256 *hash)
+{
+        autofree(CbmMappedFile) *dst = &(CbmMappedFile){ .fd = -1 };
+        struct stat st = { 0 };
+        size_t length = 0;
+        size_t offset = 0;
+
+        if (stat(target, &st) != 0) {
+                return false;
+        }
+
+        /* Cheap length check before touching any contents */
+        for (size_t i = 0; sources[i]; i++) {
+                struct stat sst = { 0 };
+
+                if (stat(sources[i], &sst) != 0) {
+                        return false;
+                }
+                length += member_padding((off_t)length, align) + (size_t)sst.st_size;
+        }
+        if (length != (size_t)st.st_size) {
+                return false;
+        }
+        if (length == 0) {
+                return true;
+        }
+
+        if (!stream_mapped_file_open(target, dst)) {
+                return false;
+        }
+
+        for (size_t i = 0; sources[i]; i++) {
+                autofree(CbmMappedFile) *src = &(CbmMappedFile){ .fd = -1 };
+                struct stat sst = { 0 };
+                size_t pad = member_padding((off_t)offset, align);
+
+                if (pad > dst->length - offset) {
+                        return false;
+                }
+                for (size_t j = 0; j < pad; j++) {
+                        if (dst->buffer[offset + j] != '\0') {
+                                return false;
+                        }
+                }
+                if (hash && pad) {
+                        cbm_sha256_update(hash, dst->buffer + offset, pad);
+                }
+                offset += pad;
+
+                /* Empty members contribute nothing and cannot be mapped */
+                if (stat(sources[i], &sst) != 0) {
+                        return false;
+                }
+                if (sst.st_size == 0) {
+                        continue;
+                }
+
+                if (!stream_mapped_file_open(sources[i], src)) {
+                        return false;
+                }
+                if (src->length > dst->length - offset) {
+                        return false;
+                }
+                cbm_stats_add(CBM_STAT_BYTES_COMPARED, 2 * (uint64_t)src->length);
+                if (memcmp(dst->buffer + offset, src->buffer, src->length) != 0) {
+                        return false;
+                }
+                if (hash) {
+                        cbm_sha256_update(hash, src->buffer, src->length);
+                }
+                offset += src->length;
+        }
+
+        return offset == dst->length;
+}
+
+bool cbm_files_concat_match(const char *const *sources, const char *target)
+{
+        return files_concat_match(sources, target, 0, NULL);
+}
+
+bool cbm_files_concat_match_digest(const char *const *sources, const char *target, size_t align,
+                                   uint8_t digest[CBM_SHA256_DIGEST_SIZE])
+{
+        CbmSha256 hash;
+
+        cbm_sha256_init(&hash);
+        if (!files_concat_match(sources, target, align, &hash)) {
+                return false;
+        }
+        cbm_sha256_final(&hash, digest);
+        return true;
+}
+
+static char *find_boot_device(const char *root, bool root_disk_only)
 {
         glob_t glo = { 0 };
         char read_buf[4096];
@@ -91,6 +234,7 @@ char *get_boot_device()
         autofree(char) *p = NULL;
         autofree(char) *glob_path = NULL;
         autofree(char) *dev_path = NULL;
+        char *esp = NULL;
 
         glob_path = string_printf("%s/firmware/efi/efivars/LoaderDevicePartUUID-*",
                                   cbm_system_get_sysfs_path());
@@ -139,6 +283,11 @@ char *get_boot_device()
                 return strdup(p);
         }
 next:
+        /* Partition tables don't depend on udev having settled */
+        esp = cbm_esp_discover(root, root_disk_only);
+        if (esp) {
+                return esp;
+        }
 
         dev_path = string_printf("%s/disk/by-partlabel/ESP", cbm_system_get_devfs_path());
 
@@ -148,43 +297,14 @@ next:
         return NULL;
 }
 
-/**
- * Use libblkid to determine the parent disk for the given path,
- * in order to facilitate partition enumeration
- */
-static bool get_parent_disk_devno(char *path, dev_t *diskdevno)
+char *get_boot_device(const char *root)
 {
-        struct stat st = { 0 };
-        autofree(char) *dev_path = NULL;
-
-        if (stat(path, &st) != 0) {
-                return false;
-        }
-
-        dev_path = cbm_system_get_device_for_mountpoint(path);
-        if (dev_path) {
-                blkid_probe pr = cbm_blkid_new_probe_from_filename(dev_path);
-                if (cbm_blkid_do_safeprobe(pr) != 0) {
-                        LOG_ERROR("Invalid block device: %s", path);
-                        cbm_blkid_free_probe(pr);
-                        return false;
-                }
-
-                *diskdevno = cbm_probe_get_wholedisk_devno(pr);
-                cbm_blkid_free_probe(pr);
-        } else {
-                /* Fall back to stat, possibly /proc/self/mounts has /dev/root
-                   as the root device.
-                */
-                dev_t ret;
-                if (cbm_blkid_devno_to_wholedisk(st.st_dev, NULL, 0, &ret) < 0) {
-                        LOG_ERROR("Invalid block device: %s", path);
-                        return false;
-                }
-                *diskdevno = ret;
-        }
+        return find_boot_device(root, false);
+}
 
-        return true;
+char *get_image_boot_device(const char *root)
+{
+        return find_boot_device(root, true);
 }
 
 bool cbm_file_has_content(char *path)
@@ -215,57 +335,43 @@ bool cbm_file_has_content(char *path)
 
 char *get_parent_disk(char *path)
 {
-        dev_t devt;
-        autofree(char) *node = NULL;
+        const CbmDiskInfo *disk = NULL;
 
-        if (!get_parent_disk_devno(path, &devt)) {
+        disk = cbm_topology_get_disk(path);
+        if (!disk) {
                 return NULL;
         }
 
-        node = cbm_blkid_devno_to_devname(devt);
-        return realpath(node, NULL);
+        return strdup(disk->devname);
 }
 
 int get_partition_index(const char *path, const char *devnode)
 {
-        autofree(char) *parent_disk = NULL;
         autofree(char) *devnode_rpath = NULL;
-        blkid_partlist parts = NULL;
-        blkid_probe probe = NULL;
+        const CbmDiskInfo *disk = NULL;
         const char *devfs = NULL;
-        int part_count = 0;
         int ret = -1;
 
-        parent_disk = get_parent_disk((char *)path);
-        if (!parent_disk) {
+        disk = cbm_topology_get_disk(path);
+        if (!disk) {
                 LOG_ERROR("Failed to get parent disk");
                 return ret;
         }
 
-        probe = cbm_blkid_new_probe_from_filename(parent_disk);
-        if (!probe) {
-                LOG_ERROR("Unable to blkid probe %s", parent_disk);
-                return ret;
-        }
-
-        parts = cbm_blkid_probe_get_partitions(probe);
-
-        part_count = cbm_blkid_partlist_numof_partitions(parts);
-        if (part_count <= 0) {
+        if (disk->table.count <= 0) {
                 LOG_ERROR("Invalid partition list");
-                goto clean;
+                return ret;
         }
 
         devfs = cbm_system_get_devfs_path();
         devnode_rpath = realpath(devnode, NULL);
 
-        for (int i = 0; i < part_count; i++) {
-                blkid_partition part = cbm_blkid_partlist_get_partition(parts, i);
-                const char *part_id = cbm_blkid_partition_get_uuid(part);
+        for (int i = 0; i < disk->table.count; i++) {
+                const char *part_id = disk->table.parts[i].uuid;
                 autofree(char) *pt_path = NULL;
                 autofree(char) *rpath = NULL;
 
-                if (!part_id) {
+                if (!part_id[0]) {
                         LOG_ERROR("Not a valid GPT disk");
                         break;
                 }
@@ -279,59 +385,32 @@ int get_partition_index(const char *path, const char *devnode)
                 }
         }
 
- clean:
-        cbm_blkid_free_probe(probe);
         return ret;
 }
 
 char *get_legacy_boot_device(char *path)
 {
-        blkid_probe probe = NULL;
-        blkid_partlist parts = NULL;
-        int part_count = 0;
+        const CbmDiskInfo *disk = NULL;
         char *ret = NULL;
-        autofree(char) *parent_disk = NULL;
         const char *devfs = cbm_system_get_devfs_path();
 
-        parent_disk = get_parent_disk(path);
-        if (!parent_disk) {
+        disk = cbm_topology_get_disk(path);
+        if (!disk) {
                 return NULL;
         }
 
-        probe = cbm_blkid_new_probe_from_filename(parent_disk);
-        if (!probe) {
-                LOG_ERROR("Unable to blkid probe %s", parent_disk);
-                return NULL;
-        }
-
-        cbm_blkid_probe_enable_superblocks(probe, 1);
-        cbm_blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE);
-        cbm_blkid_probe_enable_partitions(probe, 1);
-        cbm_blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
-
-        if (cbm_blkid_do_safeprobe(probe) != 0) {
-                LOG_ERROR("Error probing filesystem of %s: %s", parent_disk, strerror(errno));
-                goto clean;
-        }
-
-        parts = cbm_blkid_probe_get_partitions(probe);
-
-        part_count = cbm_blkid_partlist_numof_partitions(parts);
-        if (part_count <= 0) {
-                /* No partitions */
+        if (!disk->probed) {
+                LOG_ERROR("Error probing filesystem of %s", disk->devname);
                 goto clean;
         }
 
-        for (int i = 0; i < part_count; i++) {
-                blkid_partition part = cbm_blkid_partlist_get_partition(parts, i);
-                const char *part_id = NULL;
-                unsigned long long flags;
+        for (int i = 0; i < disk->table.count; i++) {
+                const CbmPartition *part = &disk->table.parts[i];
                 autofree(char) *pt_path = NULL;
 
-                flags = cbm_blkid_partition_get_flags(part);
-                if (flags & CBM_MBR_BOOT_FLAG) {
-                        part_id = cbm_blkid_partition_get_uuid(part);
-                        if (!part_id) {
+                if (part->flags & CBM_MBR_BOOT_FLAG) {
+                        const char *part_id = part->uuid;
+                        if (!part_id[0]) {
                                 LOG_ERROR("Not a valid GPT disk");
                                 goto clean;
                         }
@@ -342,7 +421,6 @@ char *get_legacy_boot_device(char *path)
         }
 
 clean:
-        cbm_blkid_free_probe(probe);
         errno = 0;
         return ret;
 }
@@ -381,10 +459,42 @@ end:
                 fclose(fp);
         }
         cbm_sync();
+        cbm_esp_index_update(path);
 
         return ret;
 }
 
+bool file_set_text_atomic(const char *path, const char *text)
+{
+        autofree(char) *new_name = NULL;
+        size_t length = strlen(text);
+        size_t done = 0;
+        int fd = -1;
+
+        new_name = string_printf("%s.TmpWrite", path);
+
+        fd = open(new_name, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return false;
+        }
+        while (done < length) {
+                ssize_t r = write(fd, text + done, length - done);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        break;
+                }
+                done += (size_t)r;
+        }
+        if (close(fd) != 0 || done != length || rename(new_name, path) != 0) {
+                (void)unlink(new_name);
+                return false;
+        }
+
+        return true;
+}
+
 bool file_get_text(const char *path, char **out_buf)
 {
         autofree(CbmMappedFile) *mapped_file = CBM_MAPPED_FILE_INIT;
@@ -399,72 +509,709 @@ bool file_get_text(const char *path, char **out_buf)
                 return false;
         }
 
-        *out_buf = strdup(mapped_file->buffer);
+        /* The mapping isn't terminated */
+        *out_buf = strndup(mapped_file->buffer, mapped_file->length);
         if (!*out_buf) {
                 return false;
         }
         return true;
 }
 
-bool copy_file(const char *src, const char *target, mode_t mode)
+bool file_get_attribute(const char *path, char **out_buf)
+{
+        char buf[4096];
+        ssize_t size;
+        int fd;
+
+        if (!out_buf) {
+                return false;
+        }
+
+        *out_buf = NULL;
+
+        fd = open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+        size = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (size < 0) {
+                return false;
+        }
+
+        while (size > 0 && buf[size - 1] == '\n') {
+                size--;
+        }
+        buf[size] = '\0';
+
+        *out_buf = strdup(buf);
+        return *out_buf != NULL;
+}
+
+/**
+ * Files are copied, and written back, in chunks of this size, so that the
+ * page cache never holds more than a couple of chunks of any one copy
+ */
+#define CBM_COPY_CHUNK (8 * 1024 * 1024)
+
+/**
+ * Buffer and offset alignment for O_DIRECT, suiting both 512 byte and 4K
+ * sector devices
+ */
+#define CBM_DIRECT_ALIGN 4096
+
+/**
+ * Whether copies should bypass the page cache for the destination
+ */
+static bool cbm_direct_io = false;
+
+void cbm_set_direct_io(bool direct_io)
+{
+        cbm_direct_io = direct_io;
+}
+
+/**
+ * Tracks writeback of the destination while copying
+ */
+typedef struct CbmCopy {
+        int fd;          /**<Destination */
+        off_t written;   /**<Bytes written so far */
+        off_t flushed;   /**<Bytes written back and dropped from the cache */
+        CbmSha256 *hash; /**<Digest of everything written, if wanted */
+        char *buf;       /**<Bounce buffer, only needed to hash buffered copies */
+        size_t align;    /**<Each source starts on this boundary, must divide the chunk */
+} CbmCopy;
+
+/**
+ * Account for @len bytes just written through the page cache. Writeback of
+ * them starts straight away, and everything but the latest chunk is waited
+ * for and dropped, so a large copy doesn't evict everything else.
+ */
+static void copy_written(CbmCopy *copy, off_t len)
+{
+        off_t start = copy->written;
+        off_t done;
+
+        copy->written += len;
+        cbm_stats_add(CBM_STAT_BYTES_CACHED, (uint64_t)len);
+        (void)sync_file_range(copy->fd, start, len, SYNC_FILE_RANGE_WRITE);
+
+        if (copy->written - copy->flushed < 2 * CBM_COPY_CHUNK) {
+                return;
+        }
+        done = copy->written - CBM_COPY_CHUNK - copy->flushed;
+        (void)sync_file_range(copy->fd,
+                              copy->flushed,
+                              done,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                  SYNC_FILE_RANGE_WAIT_AFTER);
+        (void)posix_fadvise(copy->fd, copy->flushed, done, POSIX_FADV_DONTNEED);
+        copy->flushed += done;
+}
+
+/**
+ * Write back and drop whatever remains of the destination
+ */
+static void copy_finish(CbmCopy *copy)
+{
+        (void)sync_file_range(copy->fd,
+                              copy->flushed,
+                              0,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                  SYNC_FILE_RANGE_WAIT_AFTER);
+        (void)posix_fadvise(copy->fd, copy->flushed, 0, POSIX_FADV_DONTNEED);
+        copy->flushed = copy->written;
+}
+
+/**
+ * Open @src for a single sequential pass
+ */
+static int open_source(const char *src)
+{
+        int fd = open(src, O_RDONLY | O_CLOEXEC);
+
+        if (fd >= 0) {
+                (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        return fd;
+}
+
+/**
+ * Close @fd, dropping its contents from the page cache as we won't be back
+ */
+static void close_source(int fd)
+{
+        int saved_errno = errno;
+
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        errno = saved_errno;
+}
+
+/**
+ * Write all of @len bytes of @buf to @fd
+ */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+        while (len > 0) {
+                ssize_t w = write(fd, buf, len);
+
+                if (w < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return false;
+                }
+                buf += w;
+                len -= (size_t)w;
+        }
+        return true;
+}
+
+/**
+ * Zero fill the destination of @copy up to the alignment of the next source
+ */
+static bool append_padding(CbmCopy *copy)
+{
+        static const char zeros[64] = { 0 };
+        size_t pad = member_padding(copy->written, copy->align);
+
+        while (pad > 0) {
+                size_t n = pad < sizeof(zeros) ? pad : sizeof(zeros);
+
+                if (!write_all(copy->fd, zeros, n)) {
+                        return false;
+                }
+                if (copy->hash) {
+                        cbm_sha256_update(copy->hash, zeros, n);
+                }
+                copy_written(copy, (off_t)n);
+                pad -= n;
+        }
+        return true;
+}
+
+/**
+ * Append the full contents of @src to the destination of @copy
+ */
+static bool append_file(CbmCopy *copy, const char *src)
 {
         struct stat sst = { 0 };
         ssize_t sz;
-        int sfd = -1;
-        int dfd = -1;
-        bool ret = false;
         ssize_t written;
+        bool ret = false;
+        int sfd = -1;
 
-        sfd = open(src, O_RDONLY);
+        sfd = open_source(src);
         if (sfd < 0) {
                 return false;
         }
-        dfd = open(target, O_WRONLY | O_TRUNC | O_CREAT, mode);
-        if (dfd < 0) {
-                goto end;
-        }
         if (fstat(sfd, &sst) != 0) {
                 goto end;
         }
 
         sz = sst.st_size;
-        for (;;) {
-                written = sendfile(dfd, sfd, NULL, (size_t)sz);
-                if (written == sz) {
-                        break;
+
+        /* sendfile() never shows us the data, so read it in to hash it */
+        while (copy->hash && sz > 0) {
+                written = read(sfd, copy->buf, (size_t)(sz < CBM_COPY_CHUNK ? sz : CBM_COPY_CHUNK));
+                if (written < 0 && errno == EINTR) {
+                        continue;
                 } else if (written < 0) {
                         goto end;
+                } else if (written == 0) {
+                        errno = EIO;
+                        goto end;
+                }
+                cbm_sha256_update(copy->hash, copy->buf, (size_t)written);
+                if (!write_all(copy->fd, copy->buf, (size_t)written)) {
+                        goto end;
+                }
+                copy_written(copy, written);
+                sz -= written;
+        }
+
+        while (sz > 0) {
+                written = sendfile(copy->fd,
+                                   sfd,
+                                   NULL,
+                                   (size_t)(sz < CBM_COPY_CHUNK ? sz : CBM_COPY_CHUNK));
+                if (written < 0) {
+                        goto end;
+                } else if (written == 0) {
+                        /* Source shrunk underneath us */
+                        errno = EIO;
+                        goto end;
                 }
+                copy_written(copy, written);
                 sz -= written;
         }
         ret = true;
 
 end:
-        if (sfd > 0) {
-                close(sfd);
+        close_source(sfd);
+        return ret;
+}
+
+/**
+ * Allocate a chunk sized buffer suitable for O_DIRECT
+ */
+static char *direct_buffer(void)
+{
+        char *buf = NULL;
+
+        if (posix_memalign((void **)&buf, CBM_DIRECT_ALIGN, CBM_COPY_CHUNK) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+        return buf;
+}
+
+/**
+ * Write @len bytes of the aligned @buf to the destination of @copy, which is
+ * open with O_DIRECT and positioned on a block boundary. Every whole block
+ * bypasses the page cache, and only a partial block at the end, which
+ * O_DIRECT cannot write, goes through it once the original @flags of the
+ * destination are restored. Only the last write of a copy may be partial.
+ */
+static bool copy_write_direct(CbmCopy *copy, int flags, const char *buf, size_t len)
+{
+        size_t whole = len & ~((size_t)CBM_DIRECT_ALIGN - 1);
+
+        if (whole > 0) {
+                if (!write_all(copy->fd, buf, whole)) {
+                        return false;
+                }
+                copy->written += (off_t)whole;
+                cbm_stats_add(CBM_STAT_BYTES_DIRECT, whole);
+        }
+        if (whole == len) {
+                return true;
+        }
+
+        if (fcntl(copy->fd, F_SETFL, flags) != 0 ||
+            !write_all(copy->fd, buf + whole, len - whole)) {
+                return false;
+        }
+        copy_written(copy, (off_t)(len - whole));
+        return true;
+}
+
+/**
+ * Copy @sources to @copy with O_DIRECT, through a single aligned buffer so
+ * the boundaries between sources don't matter. Only the final partial block
+ * is written through the page cache.
+ *
+ * @return 1 on success, 0 on failure, or -1 if the destination refused
+ * O_DIRECT before anything was written
+ */
+static int write_files_direct(CbmCopy *copy, const char *const *sources)
+{
+        char *buf = NULL;
+        size_t fill = 0;
+        int flags;
+        int ret = 0;
+
+        flags = fcntl(copy->fd, F_GETFL);
+        if (flags < 0 || fcntl(copy->fd, F_SETFL, flags | O_DIRECT) != 0) {
+                return -1;
+        }
+        buf = direct_buffer();
+
+        for (size_t i = 0; sources[i]; i++) {
+                size_t pad = member_padding(copy->written + (off_t)fill, copy->align);
+                int sfd = -1;
+
+                /* A full buffer is aligned already, otherwise the padding fits */
+                memset(buf + fill, 0, pad);
+                if (copy->hash && pad) {
+                        cbm_sha256_update(copy->hash, buf + fill, pad);
+                }
+                fill += pad;
+
+                sfd = open_source(sources[i]);
+                if (sfd < 0) {
+                        goto end;
+                }
+                for (;;) {
+                        ssize_t r;
+
+                        /* Write out full chunks only once there's more to read */
+                        if (fill == CBM_COPY_CHUNK) {
+                                if (!copy_write_direct(copy, flags, buf, fill)) {
+                                        if (errno == EINVAL && copy->written == 0) {
+                                                ret = -1;
+                                        }
+                                        close_source(sfd);
+                                        goto end;
+                                }
+                                fill = 0;
+                        }
+
+                        r = read(sfd, buf + fill, CBM_COPY_CHUNK - fill);
+                        if (r < 0 && errno == EINTR) {
+                                continue;
+                        }
+                        if (r < 0) {
+                                close_source(sfd);
+                                goto end;
+                        }
+                        if (r == 0) {
+                                break;
+                        }
+                        if (copy->hash) {
+                                cbm_sha256_update(copy->hash, buf + fill, (size_t)r);
+                        }
+                        fill += (size_t)r;
+                }
+                close_source(sfd);
+        }
+
+        if (!copy_write_direct(copy, flags, buf, fill)) {
+                if (errno == EINVAL && copy->written == 0) {
+                        ret = -1;
+                }
+                goto end;
+        }
+        copy_finish(copy);
+        ret = 1;
+
+end:
+        (void)fcntl(copy->fd, F_SETFL, flags);
+        free(buf);
+        return ret;
+}
+
+/**
+ * Reserve @size bytes for @fd up front, so the filesystem can lay the file
+ * out contiguously rather than growing it a cluster at a time. vfat only
+ * supports fallocate() from Linux 4.19, older kernels extend the file
+ * instead, which costs a pass of zeroes but allocates in one go.
+ */
+static void preallocate_file(int fd, off_t size)
+{
+        if (size <= 0) {
+                return;
+        }
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0) {
+                return;
         }
-        if (dfd > 0) {
-                close(dfd);
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+                (void)ftruncate(fd, size);
         }
+        errno = 0;
+}
+
+/**
+ * Release whatever preallocate_file() reserved for @fd beyond the @written
+ * bytes, i.e. when a source shrunk while it was copied. A reservation made
+ * with FALLOC_FL_KEEP_SIZE doesn't show in the file size, but truncating
+ * frees every block past the new end of the file all the same.
+ */
+static bool trim_preallocation(int fd, off_t reserved, off_t written)
+{
+        struct stat st = { 0 };
+
+        if (fstat(fd, &st) != 0) {
+                return false;
+        }
+        if (st.st_size <= written && reserved <= written) {
+                return true;
+        }
+        return ftruncate(fd, written) == 0;
+}
+
+/**
+ * Write each of the NULL terminated list of @sources to the open file @dfd,
+ * zero padding between them so each starts on an @align boundary
+ */
+static bool write_files(int dfd, const char *const *sources, size_t align, CbmSha256 *hash)
+{
+        CbmCopy copy = { .fd = dfd, .hash = hash, .align = align };
+        struct stat st = { 0 };
+        off_t total = 0;
+        int direct = -1;
+
+        for (size_t i = 0; sources[i]; i++) {
+                if (stat(sources[i], &st) == 0) {
+                        total += (off_t)member_padding(total, align) + st.st_size;
+                }
+        }
+        preallocate_file(dfd, total);
+
+        if (cbm_direct_io) {
+                direct = write_files_direct(&copy, sources);
+                if (direct == 0) {
+                        return false;
+                } else if (direct < 0) {
+                        LOG_DEBUG("O_DIRECT is unavailable, copying through the page cache");
+                }
+        }
+
+        if (direct < 0) {
+                bool ret = true;
+
+                if (hash) {
+                        /* Forget anything read before O_DIRECT was refused */
+                        cbm_sha256_init(hash);
+                        copy.buf = malloc(CBM_COPY_CHUNK);
+                        OOM_CHECK(copy.buf);
+                }
+                for (size_t i = 0; sources[i] && ret; i++) {
+                        ret = append_padding(&copy) && append_file(&copy, sources[i]);
+                }
+                free(copy.buf);
+                if (!ret) {
+                        return false;
+                }
+                copy_finish(&copy);
+        }
+
+        return trim_preallocation(dfd, total, copy.written);
+}
+
+/**
+ * Copy @len bytes from @in_offset of @in_fd to the end of @copy through the
+ * page cache, advancing @in_offset
+ */
+static bool copy_range_cached(CbmCopy *copy, int in_fd, off_t *in_offset, uint64_t len)
+{
+        while (len > 0) {
+                ssize_t r = sendfile(copy->fd,
+                                     in_fd,
+                                     in_offset,
+                                     len < CBM_COPY_CHUNK ? (size_t)len : CBM_COPY_CHUNK);
+
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                } else if (r < 0) {
+                        return false;
+                } else if (r == 0) {
+                        /* Source shrunk underneath us */
+                        errno = EIO;
+                        return false;
+                }
+                copy_written(copy, r);
+                len -= (uint64_t)r;
+        }
+        return true;
+}
+
+/**
+ * Copy @len bytes from @in_offset of @in_fd to the block aligned end of
+ * @copy with O_DIRECT, advancing @in_offset and @len as it goes
+ *
+ * @return 1 on success, 0 on failure, or -1 if the destination refused
+ * O_DIRECT before anything was written
+ */
+static int copy_range_direct(CbmCopy *copy, int in_fd, off_t *in_offset, uint64_t *len)
+{
+        off_t start = copy->written;
+        char *buf = NULL;
+        int flags;
+        int ret = 0;
+
+        flags = fcntl(copy->fd, F_GETFL);
+        if (flags < 0 || fcntl(copy->fd, F_SETFL, flags | O_DIRECT) != 0) {
+                return -1;
+        }
+        buf = direct_buffer();
+
+        while (*len > 0) {
+                size_t want = *len < CBM_COPY_CHUNK ? (size_t)*len : CBM_COPY_CHUNK;
+                size_t fill = 0;
+
+                /* Anything short of a whole chunk has to be the end */
+                while (fill < want) {
+                        ssize_t r = pread(in_fd, buf + fill, want - fill, *in_offset + (off_t)fill);
+
+                        if (r < 0 && errno == EINTR) {
+                                continue;
+                        } else if (r < 0) {
+                                goto end;
+                        } else if (r == 0) {
+                                errno = EIO;
+                                goto end;
+                        }
+                        fill += (size_t)r;
+                }
+                if (!copy_write_direct(copy, flags, buf, fill)) {
+                        if (errno == EINVAL && copy->written == start) {
+                                ret = -1;
+                        }
+                        goto end;
+                }
+                *in_offset += (off_t)fill;
+                *len -= fill;
+        }
+        ret = 1;
+
+end:
+        (void)fcntl(copy->fd, F_SETFL, flags);
+        free(buf);
         return ret;
 }
 
+bool cbm_copy_range(int in_fd, off_t in_offset, uint64_t len, int out_fd, off_t out_offset)
+{
+        CbmCopy copy = { .fd = out_fd, .written = out_offset, .flushed = out_offset };
+        size_t head = member_padding(out_offset, CBM_DIRECT_ALIGN);
+
+        if (lseek(out_fd, out_offset, SEEK_SET) != out_offset) {
+                return false;
+        }
+
+        /* Through the page cache up to the first block boundary */
+        if (cbm_direct_io && len > head) {
+                int direct;
+
+                if (!copy_range_cached(&copy, in_fd, &in_offset, head)) {
+                        return false;
+                }
+                len -= head;
+
+                direct = copy_range_direct(&copy, in_fd, &in_offset, &len);
+                if (direct == 0) {
+                        return false;
+                } else if (direct < 0) {
+                        LOG_DEBUG("O_DIRECT is unavailable, copying through the page cache");
+                        if (lseek(out_fd, copy.written, SEEK_SET) != copy.written) {
+                                return false;
+                        }
+                }
+        }
+
+        if (!copy_range_cached(&copy, in_fd, &in_offset, len)) {
+                return false;
+        }
+        copy_finish(&copy);
+        return true;
+}
+
+int cbm_file_extents(int fd, bool sync)
+{
+        struct fiemap map = { 0 };
+
+        /* With no room for extents the kernel only counts them */
+        map.fm_length = FIEMAP_MAX_OFFSET;
+        map.fm_flags = sync ? FIEMAP_FLAG_SYNC : 0;
+        if (ioctl(fd, FS_IOC_FIEMAP, &map) != 0) {
+                return -1;
+        }
+
+        return (int)map.fm_mapped_extents;
+}
+
+bool copy_file(const char *src, const char *target, mode_t mode)
+{
+        const char *sources[] = { src, NULL };
+
+        return copy_files(sources, target, mode);
+}
+
+bool copy_files(const char *const *sources, const char *target, mode_t mode)
+{
+        bool ret = true;
+        int dfd = -1;
+
+        dfd = open(target, O_WRONLY | O_TRUNC | O_CREAT, mode);
+        if (dfd < 0) {
+                return false;
+        }
+
+        ret = write_files(dfd, sources, 0, NULL);
+
+        close(dfd);
+        return ret;
+}
+
+/**
+ * Replace @target with the already written @new_name
+ */
+static bool replace_file_atomic(const char *new_name, const char *target)
+{
+        struct stat st = { 0 };
+
+        cbm_sync();
+
+        /* Delete target if needed  */
+        if (stat(target, &st) == 0) {
+                if (!S_ISDIR(st.st_mode) && unlink(target) != 0) {
+                        return false;
+                }
+                cbm_sync();
+        } else {
+                errno = 0;
+        }
+
+        if (!cbm_rename(new_name, target)) {
+                return false;
+        }
+        /* vfat protect */
+        cbm_sync();
+
+        return true;
+}
+
 bool copy_file_atomic(const char *src, const char *target, mode_t mode)
+{
+        const char *sources[] = { src, NULL };
+
+        return copy_files_atomic(sources, target, mode);
+}
+
+bool copy_files_atomic(const char *const *sources, const char *target, mode_t mode)
 {
         autofree(char) *new_name = NULL;
-        struct stat st = { 0 };
 
         new_name = string_printf("%s.TmpWrite", target);
 
-        if (!copy_file(src, new_name, mode)) {
+        if (!copy_files(sources, new_name, mode)) {
                 (void)unlink(new_name);
                 return false;
         }
+
+        return replace_file_atomic(new_name, target);
+}
+
+bool copy_file_atomic_at(const CbmDir *dir, const char *name, const char *src, mode_t mode)
+{
+        const char *sources[] = { src, NULL };
+
+        return copy_files_atomic_at(dir, name, sources, mode);
+}
+
+/**
+ * copy_files_atomic_at, hashing the contents into @hash as they are written
+ * if it is set
+ */
+static bool files_atomic_at(const CbmDir *dir, const char *name, const char *const *sources,
+                            size_t align, mode_t mode, CbmSha256 *hash)
+{
+        autofree(char) *new_name = NULL;
+        struct stat st = { 0 };
+        bool ret = true;
+        int dfd = -1;
+
+        new_name = string_printf("%s.TmpWrite", name);
+
+        dfd = cbm_dir_openat(dir, new_name, O_WRONLY | O_TRUNC | O_CREAT, mode);
+        if (dfd < 0) {
+                return false;
+        }
+        ret = write_files(dfd, sources, align, hash);
+        close(dfd);
+
+        if (!ret) {
+                (void)cbm_dir_unlink(dir, new_name);
+                return false;
+        }
+
         cbm_sync();
 
         /* Delete target if needed  */
-        if (stat(target, &st) == 0) {
-                if (!S_ISDIR(st.st_mode) && unlink(target) != 0) {
+        if (cbm_dir_stat(dir, name, &st)) {
+                if (!S_ISDIR(st.st_mode) && !cbm_dir_unlink(dir, name)) {
                         return false;
                 }
                 cbm_sync();
@@ -472,7 +1219,7 @@ bool copy_file_atomic(const char *src, const char *target, mode_t mode)
                 errno = 0;
         }
 
-        if (rename(new_name, target) != 0) {
+        if (!cbm_dir_rename(dir, new_name, name)) {
                 return false;
         }
         /* vfat protect */
@@ -481,6 +1228,26 @@ bool copy_file_atomic(const char *src, const char *target, mode_t mode)
         return true;
 }
 
+bool copy_files_atomic_at(const CbmDir *dir, const char *name, const char *const *sources,
+                          mode_t mode)
+{
+        return files_atomic_at(dir, name, sources, 0, mode, NULL);
+}
+
+bool copy_files_atomic_at_digest(const CbmDir *dir, const char *name,
+                                 const char *const *sources, size_t align, mode_t mode,
+                                 uint8_t digest[CBM_SHA256_DIGEST_SIZE])
+{
+        CbmSha256 hash;
+
+        cbm_sha256_init(&hash);
+        if (!files_atomic_at(dir, name, sources, align, mode, &hash)) {
+                return false;
+        }
+        cbm_sha256_final(&hash, digest);
+        return true;
+}
+
 bool cbm_is_mounted(const char *path)
 {
         autofree(FILE_MNT) *tab = NULL;
@@ -535,6 +1302,68 @@ char *cbm_get_mountpoint_for_device(const char *device)
         return NULL;
 }
 
+int cbm_mount_detached(const char *source, const char *filesystemtype, const char *options)
+{
+#ifdef HAVE_FSMOUNT
+        autofree(char) *opts = NULL;
+        char *saveptr = NULL;
+        int saved_errno;
+        int mntfd = -1;
+        int fsfd;
+
+        fsfd = (int)syscall(SYS_fsopen, filesystemtype, FSOPEN_CLOEXEC);
+        if (fsfd < 0) {
+                return -1;
+        }
+        if (syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, "source", source, 0) < 0) {
+                goto end;
+        }
+
+        opts = strdup(options ? options : "");
+        OOM_CHECK(opts);
+        for (char *opt = strtok_r(opts, ",", &saveptr); opt;
+             opt = strtok_r(NULL, ",", &saveptr)) {
+                char *value = strchr(opt, '=');
+                long r;
+
+                if (value) {
+                        *value++ = '\0';
+                        r = syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, opt, value, 0);
+                } else {
+                        r = syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_FLAG, opt, NULL, 0);
+                }
+                /* Only tuning, the filesystem works without it */
+                if (r < 0) {
+                        LOG_DEBUG("Ignoring mount option %s for %s: %s",
+                                  opt,
+                                  source,
+                                  strerror(errno));
+                }
+        }
+
+        if (syscall(SYS_fsconfig, fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) < 0) {
+                goto end;
+        }
+        mntfd = (int)syscall(SYS_fsmount,
+                             fsfd,
+                             FSMOUNT_CLOEXEC,
+                             MOUNT_ATTR_NOATIME | MOUNT_ATTR_NODEV | MOUNT_ATTR_NOSUID |
+                                 MOUNT_ATTR_NOEXEC);
+
+end:
+        saved_errno = errno;
+        close(fsfd);
+        errno = saved_errno;
+        return mntfd;
+#else
+        (void)source;
+        (void)filesystemtype;
+        (void)options;
+        errno = ENOSYS;
+        return -1;
+#endif
+}
+
 char *cbm_get_device_for_mountpoint(const char *mount)
 {
         autofree(char) *dev_path = NULL;
@@ -590,7 +1419,7 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file)
         length = st.st_size;
 
         buffer = mmap(NULL, (size_t)length, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (!buffer) {
+        if (buffer == MAP_FAILED) {
                 close(fd);
                 return false;
         }
@@ -606,6 +1435,9 @@ void cbm_mapped_file_close(CbmMappedFile *file)
                 return;
         }
         munmap(file->buffer, file->length);
+        if (file->stream) {
+                (void)posix_fadvise(file->fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
         close(file->fd);
         memset(file, 0, sizeof(CbmMappedFile));
 }
@@ -624,6 +1456,57 @@ bool cbm_path_check(const char *path, const char *resolved)
         return streq(p, resolved);
 }
 
+bool cbm_unlink(const char *path)
+{
+        int r = unlink(path);
+        int saved_errno = errno;
+
+        cbm_esp_index_update(path);
+        errno = saved_errno;
+        return r == 0;
+}
+
+bool cbm_rmdir(const char *path)
+{
+        int r = rmdir(path);
+        int saved_errno = errno;
+
+        cbm_esp_index_update(path);
+        errno = saved_errno;
+        return r == 0;
+}
+
+bool cbm_rename(const char *from, const char *to)
+{
+        int r = rename(from, to);
+        int saved_errno = errno;
+
+        cbm_esp_index_update(from);
+        cbm_esp_index_update(to);
+        errno = saved_errno;
+        return r == 0;
+}
+
+bool cbm_mkdir_p(const char *path, mode_t mode)
+{
+        bool ret = nc_mkdir_p(path, mode);
+        int saved_errno = errno;
+
+        cbm_esp_index_update(path);
+        errno = saved_errno;
+        return ret;
+}
+
+bool cbm_rm_rf(const char *path)
+{
+        bool ret = nc_rm_rf(path);
+        int saved_errno = errno;
+
+        cbm_esp_index_update(path);
+        errno = saved_errno;
+        return ret;
+}
+
 bool cbm_is_dir_empty(const char *path)
 {
         DIR *dir = NULL;
@@ -17,6 +17,8 @@
 #include <stdbool.h>
 #include <sys/stat.h>
 
+#include "dirfd.h"
+#include "sha256.h"
 #include "util.h"
 
 typedef FILE FILE_MNT;
@@ -36,14 +38,25 @@ typedef struct CbmMappedFile {
         int fd;        /**< File descriptor for the mapped file */
         char *buffer;  /**< Pointer to the mmap()'d contents */
         size_t length; /**< Length of the mmap()'d file (see fstat) */
+        bool stream;   /**< Read once, front to back, and dropped from the cache on close */
 } CbmMappedFile;
 
 /**
- * Return the UEFI device that is used for booting (/boot)
+ * Return the UEFI device that is used for booting (/boot). When the loader
+ * didn't say which partition it booted from, an ESP is searched for,
+ * preferring one on the same disk as @root.
  *
  * @return a newly allocated string, or NULL on error
  */
-char *get_boot_device(void);
+char *get_boot_device(const char *root);
+
+/**
+ * Like get_boot_device, but for an image at @root: the ESP search is limited
+ * to the disk backing the image, so the host's own ESP is never picked up.
+ *
+ * @return a newly allocated string, or NULL on error
+ */
+char *get_image_boot_device(const char *root);
 
 /**
  * Get the parent disk of a given device
@@ -71,6 +84,21 @@ char *get_legacy_boot_device(char *path);
  */
 bool cbm_files_match(const char *p1, const char *p2);
 
+/**
+ * Determine whether @target holds exactly the concatenated contents of the
+ * NULL terminated list of @sources, in order.
+ */
+bool cbm_files_concat_match(const char *const *sources, const char *target);
+
+/**
+ * cbm_files_concat_match, also storing the SHA-256 of the contents in
+ * @digest when they match, so they needn't be read again to hash them. If
+ * @align is set, each source is expected to start on an @align boundary,
+ * zero padded.
+ */
+bool cbm_files_concat_match_digest(const char *const *sources, const char *target, size_t align,
+                                   uint8_t digest[CBM_SHA256_DIGEST_SIZE]);
+
 /**
  * Return the parent path for a given file
  *
@@ -92,6 +120,18 @@ char *cbm_get_file_parent(const char *p);
  */
 bool file_set_text(const char *path, char *text);
 
+/**
+ * Write a small text file next to @path and rename it into place, so that
+ * readers only ever see the old or the new contents. Nothing is synced,
+ * which suits caches that are validated when they are read back.
+ *
+ * @param path Path of the file to be written
+ * @param text Contents of the new file
+ *
+ * @return True if this succeeded
+ */
+bool file_set_text_atomic(const char *path, const char *text);
+
 /**
  * Quick utility for reading very small files into a string
  *
@@ -102,6 +142,17 @@ bool file_set_text(const char *path, char *text);
  */
 bool file_get_text(const char *path, char **out_buf);
 
+/**
+ * Read a sysfs (or procfs) attribute into a string, without the trailing
+ * newline. These can't be mapped like regular files, so they are read.
+ *
+ * @param path Path of the attribute to be read
+ * @param text Pointer to store newly allocated string
+ *
+ * @return True if this succeeded, otherwise no allocation is performed
+ */
+bool file_get_attribute(const char *path, char **out_buf);
+
 /**
  * Simple utility to copy path @src to path @dst, with mode @mode
  *
@@ -119,6 +170,12 @@ bool file_get_text(const char *path, char **out_buf);
  */
 bool copy_file(const char *src, const char *dst, mode_t mode);
 
+/**
+ * Like copy_file, but writes the contents of each of the NULL terminated list
+ * of @sources to @dst in turn, without intermediate copies.
+ */
+bool copy_files(const char *const *sources, const char *dst, mode_t mode);
+
 /**
  * Wrapper around copy_file to ensure an atomic update of files. This requires
  * that a new file first be written with a new unique name, and only when this
@@ -130,6 +187,52 @@ bool copy_file(const char *src, const char *dst, mode_t mode);
  */
 bool copy_file_atomic(const char *src, const char *dst, mode_t mode);
 
+/**
+ * copy_files counterpart of copy_file_atomic
+ */
+bool copy_files_atomic(const char *const *sources, const char *dst, mode_t mode);
+
+/**
+ * copy_file_atomic counterpart writing to @name beneath the directory
+ * handle @dir, so the target path is never walked from the root again
+ */
+bool copy_file_atomic_at(const CbmDir *dir, const char *name, const char *src, mode_t mode);
+
+/**
+ * copy_files_atomic counterpart of copy_file_atomic_at
+ */
+bool copy_files_atomic_at(const CbmDir *dir, const char *name, const char *const *sources,
+                          mode_t mode);
+
+/**
+ * copy_files_atomic_at, storing the SHA-256 of everything written in
+ * @digest. The sources are hashed as they stream to the target, so they are
+ * still only read once. If @align is set, each source starts on an @align
+ * boundary, zero padded, i.e. to concatenate cpio archives.
+ */
+bool copy_files_atomic_at_digest(const CbmDir *dir, const char *name,
+                                 const char *const *sources, size_t align, mode_t mode,
+                                 uint8_t digest[CBM_SHA256_DIGEST_SIZE]);
+
+/**
+ * Copy @len bytes at @in_offset of @in_fd to @out_offset of @out_fd, for
+ * writers that lay files out themselves. Like the copy_file() family it
+ * honours cbm_set_direct_io(), writing every whole block past the first
+ * block boundary with O_DIRECT, and otherwise writes back as it goes.
+ */
+bool cbm_copy_range(int in_fd, off_t in_offset, uint64_t len, int out_fd, off_t out_offset);
+
+/**
+ * Count the extents the open file @fd is stored in, using FIEMAP
+ *
+ * @param sync Flush the file first, so that delayed allocations are counted.
+ * This writes the file back, so read-only callers leave it unset.
+ *
+ * @return the number of extents, 1 being contiguous, or -1 if the
+ * filesystem cannot tell
+ */
+int cbm_file_extents(int fd, bool sync);
+
 /**
  * Attempt to determine if the given path is actually mounted or not
  *
@@ -137,6 +240,20 @@ bool copy_file_atomic(const char *src, const char *dst, mode_t mode);
  */
 bool cbm_is_mounted(const char *path);
 
+/**
+ * Mount @source with fsopen() and fsmount() without attaching it to any
+ * mountpoint, so nothing else sees it come and go. Each of the comma
+ * separated @options is applied where the filesystem supports it, and the
+ * mount is always noatime, nodev, nosuid and noexec.
+ *
+ * The filesystem stays mounted for as long as the returned descriptor (or
+ * anything opened beneath it) stays open, and is reachable through
+ * /proc/self/fd/$fd meanwhile.
+ *
+ * @return the mount descriptor, or -1 with errno set
+ */
+int cbm_mount_detached(const char *source, const char *filesystemtype, const char *options);
+
 /**
  * Determine the mountpoint for the given device
  */
@@ -160,6 +277,12 @@ bool cbm_system_has_uefi(void);
  */
 void cbm_set_sync_filesystems(bool should_sync);
 
+/**
+ * Write copies with O_DIRECT, bypassing the page cache entirely. Falls back
+ * to buffered copies when the destination refuses O_DIRECT.
+ */
+void cbm_set_direct_io(bool direct_io);
+
 /**
  * Sync filesystem if should_sync is set
  * If not set, then this is a no-op
@@ -182,6 +305,31 @@ bool cbm_mapped_file_open(const char *path, CbmMappedFile *file);
  */
 bool cbm_path_check(const char *path, const char *resolved);
 
+/**
+ * unlink() counterpart that keeps the ESP index in step with the removal
+ */
+bool cbm_unlink(const char *path);
+
+/**
+ * rmdir() counterpart that keeps the ESP index in step with the removal
+ */
+bool cbm_rmdir(const char *path);
+
+/**
+ * rename() counterpart that keeps the ESP index in step with both paths
+ */
+bool cbm_rename(const char *from, const char *to);
+
+/**
+ * nc_mkdir_p counterpart that brings every new directory into the ESP index
+ */
+bool cbm_mkdir_p(const char *path, mode_t mode);
+
+/**
+ * nc_rm_rf counterpart that drops @path and its contents from the ESP index
+ */
+bool cbm_rm_rf(const char *path);
+
 /**
  * Check if @path is a directory and if it's empty. Returns true case it exists and
  * contains files/directories, returns false otherwise.
@@ -0,0 +1,241 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ledger.h"
+#include "log.h"
+#include "nica/util.h"
+#include "util.h"
+
+/**
+ * Vendor GUID of the variables exported by systemd-boot
+ */
+#define LOADER_GUID "4a67b082-0a4c-41cf-b6c7-440b29bb8c4f"
+
+/**
+ * The ledger is plain text with one line per boot, so it can be appended to
+ * with a single write and inspected without any tooling:
+ *
+ *      boot_id timestamp kernel firmware loader kernel userspace entry
+ *
+ * All times are in microseconds.
+ */
+#define LEDGER_FORMAT                                                                              \
+        "%36s %" SCNu64 " %127s %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %127s"
+#define LEDGER_FIELDS 8
+
+/**
+ * Read the loader variable @name as an ASCII string. EFI variables are
+ * exposed as a 4 byte attribute mask followed by the UCS-2 payload.
+ */
+static bool read_loader_string(const char *efivars_dir, const char *name, char *buf, size_t len)
+{
+        autofree(char) *path = NULL;
+        unsigned char data[512];
+        ssize_t n;
+        size_t j = 0;
+        int fd;
+
+        path = string_printf("%s/%s-" LOADER_GUID, efivars_dir, name);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+        n = read(fd, data, sizeof(data));
+        close(fd);
+
+        if (n < 4) {
+                return false;
+        }
+
+        for (ssize_t i = 4; i + 1 < n && j + 1 < len; i += 2) {
+                if (data[i] == 0 && data[i + 1] == 0) {
+                        break;
+                }
+                /* Keep the ledger one record per line, whatever the loader says */
+                buf[j++] = isgraph(data[i]) && data[i + 1] == 0 ? (char)data[i] : '_';
+        }
+        buf[j] = '\0';
+
+        return j > 0;
+}
+
+static bool read_loader_usec(const char *efivars_dir, const char *name, uint64_t *usec)
+{
+        char buf[32];
+        char *end = NULL;
+
+        if (!read_loader_string(efivars_dir, name, buf, sizeof(buf))) {
+                return false;
+        }
+
+        errno = 0;
+        *usec = strtoull(buf, &end, 10);
+        return errno == 0 && end != buf && *end == '\0';
+}
+
+bool cbm_boot_record_read_loader(CbmBootRecord *record, const char *efivars_dir)
+{
+        uint64_t init_usec = 0, exec_usec = 0;
+
+        if (!read_loader_string(efivars_dir,
+                                "LoaderEntrySelected",
+                                record->entry,
+                                sizeof(record->entry))) {
+                snprintf(record->entry, sizeof(record->entry), "-");
+        }
+
+        if (!read_loader_usec(efivars_dir, "LoaderTimeInitUSec", &init_usec) ||
+            !read_loader_usec(efivars_dir, "LoaderTimeExecUSec", &exec_usec)) {
+                return false;
+        }
+
+        /* Both count from the CPU coming out of reset: Init is when the
+         * loader started, Exec when it handed over to the kernel */
+        record->firmware_usec = init_usec;
+        record->loader_usec = exec_usec > init_usec ? exec_usec - init_usec : 0;
+
+        return true;
+}
+
+static bool ledger_parse_line(const char *line, CbmBootRecord *record)
+{
+        return sscanf(line,
+                      LEDGER_FORMAT,
+                      record->boot_id,
+                      &record->timestamp,
+                      record->kernel,
+                      &record->firmware_usec,
+                      &record->loader_usec,
+                      &record->kernel_usec,
+                      &record->userspace_usec,
+                      record->entry) == LEDGER_FIELDS;
+}
+
+NcArray *cbm_ledger_load(const char *path)
+{
+        autofree(FILE) *fp = NULL;
+        autofree(char) *line = NULL;
+        NcArray *records = NULL;
+        size_t size = 0;
+
+        fp = fopen(path, "r");
+        if (!fp) {
+                return NULL;
+        }
+
+        records = nc_array_new();
+        OOM_CHECK_RET(records, NULL);
+
+        while (getline(&line, &size, fp) > 0) {
+                CbmBootRecord *record = calloc(1, sizeof(CbmBootRecord));
+                OOM_CHECK(record);
+
+                if (!ledger_parse_line(line, record)) {
+                        LOG_DEBUG("Skipping malformed boot record in %s", path);
+                        free(record);
+                        continue;
+                }
+                OOM_CHECK(nc_array_add(records, record));
+        }
+
+        return records;
+}
+
+/**
+ * Determine whether the ledger at @path already has a record for @boot_id
+ */
+static bool ledger_has_boot(int dir_fd, const char *path, const char *boot_id)
+{
+        autofree(FILE) *fp = NULL;
+        autofree(char) *line = NULL;
+        size_t id_len = strlen(boot_id);
+        size_t size = 0;
+        int fd;
+
+        fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+        fp = fdopen(fd, "r");
+        if (!fp) {
+                close(fd);
+                return false;
+        }
+
+        while (getline(&line, &size, fp) > 0) {
+                if (strncmp(line, boot_id, id_len) == 0 && line[id_len] == ' ') {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+bool cbm_ledger_append(int dir_fd, const char *path, const CbmBootRecord *record)
+{
+        autofree(char) *line = NULL;
+        size_t len;
+        ssize_t n;
+        int fd;
+
+        if (ledger_has_boot(dir_fd, path, record->boot_id)) {
+                return true;
+        }
+
+        line = string_printf("%s %" PRIu64 " %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                             " %s\n",
+                             record->boot_id,
+                             record->timestamp,
+                             record->kernel,
+                             record->firmware_usec,
+                             record->loader_usec,
+                             record->kernel_usec,
+                             record->userspace_usec,
+                             record->entry[0] ? record->entry : "-");
+        len = strlen(line);
+
+        fd = openat(dir_fd, path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return false;
+        }
+
+        /* A single append, so a crash can't interleave a partial record */
+        n = write(fd, line, len);
+        if (close(fd) < 0 || n < 0 || (size_t)n != len) {
+                return false;
+        }
+
+        return true;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,79 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "nica/array.h"
+
+/**
+ * Location of the boot ledger, relative to the root filesystem
+ */
+#define CBM_LEDGER_NAME "boot-stats"
+#define CBM_LEDGER_PATH "/var/lib/kernel/" CBM_LEDGER_NAME
+
+/**
+ * Location of the EFI variables exported by the kernel
+ */
+#define CBM_EFIVARS_DIR "/sys/firmware/efi/efivars"
+
+/**
+ * Timings of a single boot. Any time that could not be determined is 0.
+ */
+typedef struct CbmBootRecord {
+        char boot_id[37];        /**<Kernel's random boot ID */
+        uint64_t timestamp;      /**<Wall clock time of the report, in seconds */
+        char kernel[128];        /**<Booted kernel, i.e. 4.4.0-120.lts */
+        uint64_t firmware_usec;  /**<Firmware start until the loader started */
+        uint64_t loader_usec;    /**<Loader start until the kernel was executed */
+        uint64_t kernel_usec;    /**<Kernel start until userspace started */
+        uint64_t userspace_usec; /**<Userspace start until the boot was reported */
+        char entry[128];         /**<Loader entry booted, or "-" if unknown */
+} CbmBootRecord;
+
+/**
+ * Fill in the firmware and loader times and the selected entry of @record
+ * from the variables systemd-boot exports within @efivars_dir
+ *
+ * @return true if the loader exported its timings
+ */
+bool cbm_boot_record_read_loader(CbmBootRecord *record, const char *efivars_dir);
+
+/**
+ * Append @record to the ledger @path, relative to @dir_fd as for openat(),
+ * unless a record for the same boot is already present
+ *
+ * @return true if the ledger holds a record for this boot
+ */
+bool cbm_ledger_append(int dir_fd, const char *path, const CbmBootRecord *record);
+
+/**
+ * Load every record within the ledger at @path, oldest first
+ *
+ * @return an array of newly allocated CbmBootRecord, or NULL if the ledger
+ * cannot be read
+ */
+NcArray *cbm_ledger_load(const char *path);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,323 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "digest.h"
+#include "files.h"
+#include "log.h"
+#include "manifest.h"
+#include "util.h"
+#include "writer.h"
+
+/**
+ * Bump whenever the layout of the manifest changes
+ */
+#define CBM_MANIFEST_VERSION 1
+
+static void manifest_entry_free(void *v)
+{
+        CbmManifestEntry *entry = v;
+
+        if (!entry) {
+                return;
+        }
+        free(entry->source);
+        free(entry);
+}
+
+static CbmManifest *manifest_new(const char *name)
+{
+        CbmManifest *ret = calloc(1, sizeof(CbmManifest));
+
+        OOM_CHECK(ret);
+        ret->name = name;
+        ret->entries =
+            nc_hashmap_new_full(nc_string_hash, nc_string_compare, free, manifest_entry_free);
+        OOM_CHECK(ret->entries);
+        return ret;
+}
+
+/**
+ * Parse a single "name digest size mtime source" line, tab separated
+ */
+static void manifest_parse_line(CbmManifest *manifest, char *line)
+{
+        CbmManifestEntry *entry = NULL;
+        char *fields[5] = { 0 };
+        char *saveptr = NULL;
+        char *name = NULL;
+        size_t n = 0;
+
+        for (char *f = strtok_r(line, "\t", &saveptr); f && n < ARRAY_SIZE(fields);
+             f = strtok_r(NULL, "\t", &saveptr)) {
+                fields[n++] = f;
+        }
+        if (n != ARRAY_SIZE(fields) || strlen(fields[1]) != CBM_SHA256_HEX_SIZE - 1 ||
+            nc_hashmap_get(manifest->entries, fields[0])) {
+                return;
+        }
+
+        entry = calloc(1, sizeof(CbmManifestEntry));
+        OOM_CHECK(entry);
+        memcpy(entry->digest, fields[1], CBM_SHA256_HEX_SIZE);
+        entry->size = strtoll(fields[2], NULL, 10);
+        entry->mtime = strtoll(fields[3], NULL, 10);
+        entry->source = strdup(fields[4]);
+        OOM_CHECK(entry->source);
+        name = strdup(fields[0]);
+        OOM_CHECK(name);
+
+        OOM_CHECK(nc_hashmap_put(manifest->entries, name, entry));
+}
+
+CbmManifest *cbm_manifest_load(const CbmDir *dir)
+{
+        return cbm_manifest_load_named(dir, CBM_MANIFEST_NAME);
+}
+
+CbmManifest *cbm_manifest_load_named(const CbmDir *dir, const char *name)
+{
+        CbmManifest *ret = manifest_new(name);
+        autofree(char) *line = NULL;
+        size_t line_n = 0;
+        ssize_t r = 0;
+        FILE *fp = NULL;
+        int fd;
+
+        fd = cbm_dir_openat(dir, name, O_RDONLY, 0);
+        if (fd < 0) {
+                return ret;
+        }
+        fp = fdopen(fd, "r");
+        if (!fp) {
+                close(fd);
+                return ret;
+        }
+
+        /* Anything else is from a newer (or older) release, start afresh */
+        r = getline(&line, &line_n, fp);
+        if (r <= 0 || strtol(line, NULL, 10) != CBM_MANIFEST_VERSION) {
+                fclose(fp);
+                return ret;
+        }
+
+        while ((r = getline(&line, &line_n, fp)) > 0) {
+                if (line[r - 1] == '\n') {
+                        line[r - 1] = '\0';
+                }
+                manifest_parse_line(ret, line);
+        }
+        fclose(fp);
+
+        LOG_DEBUG("Loaded %d manifest entries for %s", nc_hashmap_size(ret->entries), dir->path);
+        return ret;
+}
+
+bool cbm_manifest_save(CbmManifest *manifest, const CbmDir *dir)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        autofree(char) *tmp_name = NULL;
+        NcHashmapIter iter = { 0 };
+        void *key = NULL;
+        void *value = NULL;
+        ssize_t w = 0;
+        size_t off = 0;
+        int fd;
+
+        if (!manifest->dirty) {
+                return true;
+        }
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+        cbm_writer_append_printf(writer, "%d\n", CBM_MANIFEST_VERSION);
+
+        nc_hashmap_iter_init(manifest->entries, &iter);
+        while (nc_hashmap_iter_next(&iter, &key, &value)) {
+                const CbmManifestEntry *entry = value;
+                struct stat st = { 0 };
+
+                if (!cbm_dir_stat(dir, key, &st)) {
+                        continue;
+                }
+                cbm_writer_append_printf(writer,
+                                         "%s\t%s\t%" PRId64 "\t%" PRId64 "\t%s\n",
+                                         (const char *)key,
+                                         entry->digest,
+                                         entry->size,
+                                         entry->mtime,
+                                         entry->source);
+        }
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        tmp_name = string_printf("%s.TmpWrite", manifest->name);
+        fd = cbm_dir_openat(dir, tmp_name, O_WRONLY | O_TRUNC | O_CREAT, 00644);
+        if (fd < 0) {
+                return false;
+        }
+        while (off < writer->buffer_n) {
+                w = write(fd, writer->buffer + off, writer->buffer_n - off);
+                if (w < 0 && errno == EINTR) {
+                        continue;
+                } else if (w < 0) {
+                        break;
+                }
+                off += (size_t)w;
+        }
+        close(fd);
+
+        if (off != writer->buffer_n || !cbm_dir_rename(dir, tmp_name, manifest->name)) {
+                (void)cbm_dir_unlink(dir, tmp_name);
+                return false;
+        }
+        cbm_sync();
+        manifest->dirty = false;
+
+        return true;
+}
+
+void cbm_manifest_free(CbmManifest *manifest)
+{
+        if (!manifest) {
+                return;
+        }
+        nc_hashmap_free(manifest->entries);
+        free(manifest);
+}
+
+char *cbm_manifest_source_key(const char *const *sources)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        char *ret = NULL;
+
+        if (!cbm_writer_open(writer)) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        for (size_t i = 0; sources[i]; i++) {
+                autofree(char) *verity = NULL;
+                struct stat st = { 0 };
+
+                if (stat(sources[i], &st) != 0) {
+                        return NULL;
+                }
+
+                /* Survives reinstalls of the same contents, unlike stat() */
+                verity = cbm_file_verity_digest(sources[i]);
+                if (verity) {
+                        cbm_writer_append_printf(writer, "%s%s", i > 0 ? "," : "", verity);
+                        continue;
+                }
+
+                cbm_writer_append_printf(writer,
+                                         "%s%ju:%ju:%jd:%jd.%09ld",
+                                         i > 0 ? "," : "",
+                                         (uintmax_t)st.st_dev,
+                                         (uintmax_t)st.st_ino,
+                                         (intmax_t)st.st_size,
+                                         (intmax_t)st.st_mtim.tv_sec,
+                                         st.st_mtim.tv_nsec);
+        }
+        cbm_writer_close(writer);
+        if (cbm_writer_error(writer) != 0) {
+                DECLARE_OOM();
+                abort();
+        }
+
+        ret = strdup(writer->buffer ? writer->buffer : "");
+        OOM_CHECK(ret);
+        return ret;
+}
+
+const CbmManifestEntry *cbm_manifest_lookup(CbmManifest *manifest, const CbmDir *dir,
+                                            const char *name, const char *source)
+{
+        const CbmManifestEntry *entry = NULL;
+        struct stat st = { 0 };
+
+        entry = nc_hashmap_get(manifest->entries, name);
+        if (!entry || (source && !streq(entry->source, source))) {
+                return NULL;
+        }
+        if (!cbm_dir_stat(dir, name, &st) || !S_ISREG(st.st_mode) ||
+            (int64_t)st.st_size != entry->size || (int64_t)st.st_mtime != entry->mtime) {
+                return NULL;
+        }
+
+        return entry;
+}
+
+void cbm_manifest_record(CbmManifest *manifest, const CbmDir *dir, const char *name,
+                         const char *source, const uint8_t digest[CBM_SHA256_DIGEST_SIZE])
+{
+        CbmManifestEntry *entry = NULL;
+        struct stat st = { 0 };
+
+        if (!source || !cbm_dir_stat(dir, name, &st)) {
+                cbm_manifest_forget(manifest, name);
+                return;
+        }
+
+        entry = nc_hashmap_get(manifest->entries, name);
+        if (!entry) {
+                char *key = strdup(name);
+
+                OOM_CHECK(key);
+                entry = calloc(1, sizeof(CbmManifestEntry));
+                OOM_CHECK(entry);
+                OOM_CHECK(nc_hashmap_put(manifest->entries, key, entry));
+        }
+
+        cbm_sha256_to_hex(digest, entry->digest);
+        entry->size = (int64_t)st.st_size;
+        entry->mtime = (int64_t)st.st_mtime;
+        free(entry->source);
+        entry->source = strdup(source);
+        OOM_CHECK(entry->source);
+        manifest->dirty = true;
+}
+
+void cbm_manifest_forget(CbmManifest *manifest, const char *name)
+{
+        if (nc_hashmap_remove(manifest->entries, name)) {
+                manifest->dirty = true;
+        }
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
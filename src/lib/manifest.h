@@ -0,0 +1,113 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dirfd.h"
+#include "nica/hashmap.h"
+#include "sha256.h"
+
+/**
+ * Name of the manifest within the directory it describes
+ */
+#define CBM_MANIFEST_NAME ".clr-boot-manager.manifest"
+
+/**
+ * Records the SHA-256 of every file we copied into a directory, along with
+ * the identity of the sources it was copied from and of the copy itself.
+ * While both still match, the copy is known to be current without reading
+ * either of them.
+ */
+typedef struct CbmManifest {
+        NcHashmap *entries; /**<Maps file names to their CbmManifestEntry */
+        const char *name;   /**<Name of the manifest file within its directory */
+        bool dirty;         /**<Whether entries changed since loading */
+} CbmManifest;
+
+typedef struct CbmManifestEntry {
+        char digest[CBM_SHA256_HEX_SIZE]; /**<SHA-256 of the contents, as hex */
+        int64_t size;                     /**<Size of the copy when recorded */
+        int64_t mtime;                    /**<Modification time of the copy when recorded */
+        char *source;                     /**<Identity of the sources it was copied from */
+} CbmManifestEntry;
+
+/**
+ * Load the manifest of @dir. A missing or unreadable manifest is empty.
+ *
+ * @return a newly allocated manifest
+ */
+CbmManifest *cbm_manifest_load(const CbmDir *dir);
+
+/**
+ * Load the manifest stored as @name within @dir, for manifests describing
+ * more than a single directory. @name must outlive the manifest.
+ *
+ * @return a newly allocated manifest
+ */
+CbmManifest *cbm_manifest_load_named(const CbmDir *dir, const char *name);
+
+/**
+ * Write @manifest back to @dir if it changed, dropping entries for files
+ * that no longer exist
+ */
+bool cbm_manifest_save(CbmManifest *manifest, const CbmDir *dir);
+
+/**
+ * Free @manifest without saving it
+ */
+void cbm_manifest_free(CbmManifest *manifest);
+
+/**
+ * Build the key identifying the current contents of the NULL terminated
+ * list of @sources without reading them, from their fs-verity measurement
+ * where enabled and stat() otherwise
+ *
+ * @return a newly allocated key, or NULL if a source cannot be found
+ */
+char *cbm_manifest_source_key(const char *const *sources);
+
+/**
+ * Look up the entry for @name, provided it was recorded for @source and the
+ * copy within @dir hasn't changed since. A NULL @source matches whatever the
+ * copy was made from.
+ */
+const CbmManifestEntry *cbm_manifest_lookup(CbmManifest *manifest, const CbmDir *dir,
+                                            const char *name, const char *source);
+
+/**
+ * Record that @name within @dir now holds the contents with @digest, copied
+ * from @source
+ */
+void cbm_manifest_record(CbmManifest *manifest, const CbmDir *dir, const char *name,
+                         const char *source, const uint8_t digest[CBM_SHA256_DIGEST_SIZE]);
+
+/**
+ * Forget whatever we knew about @name
+ */
+void cbm_manifest_forget(CbmManifest *manifest, const char *name);
+
+DEF_AUTOFREE(CbmManifest, cbm_manifest_free)
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
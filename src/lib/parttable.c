@@ -0,0 +1,364 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "parttable.h"
+#include "util.h"
+
+/**
+ * A single read from the start of the disk covers the MBR, the GPT header
+ * and a full 128 entry array for both 512 and 4096 byte sectors.
+ */
+#define PT_READ_SIZE (32 * 1024)
+
+/**
+ * Upper bound on the entry array we're prepared to read, the spec minimum
+ * is 16KiB and nobody goes far beyond it.
+ */
+#define PT_MAX_ENTRIES_SIZE (1024 * 1024)
+
+#define MBR_SIGNATURE_OFFSET 510
+#define MBR_DISK_ID_OFFSET 440
+#define MBR_ENTRIES_OFFSET 446
+#define MBR_ENTRY_SIZE 16
+#define MBR_ENTRIES 4
+#define MBR_TYPE_PROTECTIVE 0xEE
+#define MBR_BOOT_ACTIVE 0x80
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_MIN_SIZE 92
+#define GPT_ENTRY_MIN_SIZE 128
+
+/**
+ * Nibble-wise lookup for the reflected CRC32 polynomial 0xEDB88320
+ */
+static const uint32_t crc32_nibbles[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+        0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+        0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t cbm_crc32(uint32_t crc, const void *data, size_t len)
+{
+        const uint8_t *p = data;
+
+        crc = ~crc;
+        for (size_t i = 0; i < len; i++) {
+                crc = (crc >> 4) ^ crc32_nibbles[(crc ^ p[i]) & 0x0F];
+                crc = (crc >> 4) ^ crc32_nibbles[(crc ^ (uint32_t)(p[i] >> 4)) & 0x0F];
+        }
+        return ~crc;
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return le32toh(v);
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return le64toh(v);
+}
+
+/**
+ * Format a GPT GUID (mixed endian) the way libblkid presents it
+ */
+static void guid_to_string(const uint8_t *g, char *out)
+{
+        snprintf(out,
+                 CBM_GUID_STRING_SIZE,
+                 "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                 g[3], g[2], g[1], g[0], g[5], g[4], g[7], g[6],
+                 g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15]);
+}
+
+static inline bool guid_is_zero(const uint8_t *g)
+{
+        for (int i = 0; i < 16; i++) {
+                if (g[i]) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/**
+ * Validate the GPT header in @buf, assuming sectors of @sector_size bytes
+ */
+static bool gpt_header_valid(const uint8_t *buf, size_t len, size_t sector_size)
+{
+        const uint8_t *header = buf + sector_size;
+        uint8_t copy[512];
+        uint32_t header_size;
+
+        if (len < sector_size + GPT_HEADER_MIN_SIZE) {
+                return false;
+        }
+        if (memcmp(header, GPT_SIGNATURE, strlen(GPT_SIGNATURE)) != 0) {
+                return false;
+        }
+
+        header_size = get_le32(header + 12);
+        if (header_size < GPT_HEADER_MIN_SIZE || header_size > sizeof(copy) ||
+            header_size > len - sector_size) {
+                return false;
+        }
+        if (get_le64(header + 24) != 1) {
+                return false;
+        }
+
+        /* The CRC is computed with its own field zeroed */
+        memcpy(copy, header, header_size);
+        memset(copy + 16, 0, 4);
+
+        return cbm_crc32(0, copy, header_size) == get_le32(header + 16);
+}
+
+static bool gpt_read(int fd, const uint8_t *buf, size_t len, size_t sector_size,
+                     CbmPartTable *table)
+{
+        const uint8_t *header = buf + sector_size;
+        autofree(char) *extra = NULL;
+        const uint8_t *entries = NULL;
+        uint64_t entries_offset;
+        uint32_t entry_count, entry_size;
+        size_t entries_size;
+
+        entries_offset = get_le64(header + 72) * sector_size;
+        entry_count = get_le32(header + 80);
+        entry_size = get_le32(header + 84);
+
+        if (entry_size < GPT_ENTRY_MIN_SIZE || entry_size % 8 != 0 || entry_count == 0 ||
+            entry_count > PT_MAX_ENTRIES_SIZE / entry_size) {
+                return false;
+        }
+        entries_size = (size_t)entry_count * entry_size;
+
+        if (entries_offset <= len && entries_size <= len - entries_offset) {
+                entries = buf + entries_offset;
+        } else {
+                /* Unusual layout, the array lives further into the disk */
+                ssize_t n;
+
+                extra = malloc(entries_size);
+                OOM_CHECK_RET(extra, false);
+                n = pread(fd, extra, entries_size, (off_t)entries_offset);
+                if (n < 0 || (size_t)n != entries_size) {
+                        return false;
+                }
+                entries = (const uint8_t *)extra;
+        }
+
+        if (cbm_crc32(0, entries, entries_size) != get_le32(header + 88)) {
+                LOG_DEBUG("GPT entry array CRC mismatch");
+                return false;
+        }
+
+        table->parts = calloc(entry_count, sizeof(CbmPartition));
+        OOM_CHECK_RET(table->parts, false);
+
+        for (uint32_t i = 0; i < entry_count; i++) {
+                const uint8_t *entry = entries + (size_t)i * entry_size;
+                CbmPartition *part = NULL;
+
+                if (guid_is_zero(entry)) {
+                        continue;
+                }
+
+                part = &table->parts[table->count++];
+                part->partno = (int)i + 1;
+                guid_to_string(entry, part->type);
+                guid_to_string(entry + 16, part->uuid);
+                part->flags = get_le64(entry + 48);
+        }
+
+        snprintf(table->type, sizeof(table->type), "gpt");
+        guid_to_string(header + 56, table->uuid);
+        return true;
+}
+
+/**
+ * Find the size of the disk or image behind @fd in logical sectors
+ */
+static bool device_sectors(int fd, uint64_t *sectors)
+{
+        struct stat st = { 0 };
+        uint64_t bytes = 0;
+        int sector_size = 512;
+
+        if (fstat(fd, &st) != 0) {
+                return false;
+        }
+        if (S_ISBLK(st.st_mode)) {
+                if (ioctl(fd, BLKGETSIZE64, &bytes) != 0 ||
+                    ioctl(fd, BLKSSZGET, &sector_size) != 0 || sector_size <= 0) {
+                        return false;
+                }
+        } else {
+                bytes = (uint64_t)st.st_size;
+        }
+
+        *sectors = bytes / (uint64_t)sector_size;
+        return true;
+}
+
+/**
+ * Read the MBR in @buf, provided every entry is plausible for the disk
+ * behind @fd. FAT and NTFS boot sectors carry the same signature, so an
+ * unpartitioned disk would otherwise pass for one with garbage partitions.
+ */
+static bool mbr_read(int fd, const uint8_t *buf, CbmPartTable *table)
+{
+        uint32_t disk_id = get_le32(buf + MBR_DISK_ID_OFFSET);
+        uint64_t sectors = 0;
+
+        if (!device_sectors(fd, &sectors)) {
+                return false;
+        }
+
+        table->parts = calloc(MBR_ENTRIES, sizeof(CbmPartition));
+        OOM_CHECK_RET(table->parts, false);
+
+        for (int i = 0; i < MBR_ENTRIES; i++) {
+                const uint8_t *entry = buf + MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE;
+                uint8_t type = entry[4];
+                uint32_t start = get_le32(entry + 8);
+                uint32_t size = get_le32(entry + 12);
+                CbmPartition *part = NULL;
+
+                if (entry[0] != 0 && entry[0] != MBR_BOOT_ACTIVE) {
+                        return false;
+                }
+
+                if (type == 0) {
+                        continue;
+                }
+
+                if (start == 0 || size == 0 || (uint64_t)start + size > sectors) {
+                        LOG_DEBUG("MBR entry %d lies outside the disk, not a partition table",
+                                  i + 1);
+                        return false;
+                }
+
+                /* Logical partitions need the EBR chain walked, leave it to blkid */
+                if (type == 0x05 || type == 0x0F || type == 0x85) {
+                        return false;
+                }
+
+                part = &table->parts[table->count++];
+                part->partno = i + 1;
+                snprintf(part->uuid, sizeof(part->uuid), "%08x-%02x", disk_id, i + 1);
+                part->flags = entry[0];
+        }
+
+        /* Nothing to go on, blkid can tell an empty table from a filesystem */
+        if (table->count == 0) {
+                return false;
+        }
+
+        snprintf(table->type, sizeof(table->type), "dos");
+        snprintf(table->uuid, sizeof(table->uuid), "%08x", disk_id);
+        return true;
+}
+
+bool cbm_part_table_read(const char *path, CbmPartTable *table)
+{
+        autofree(char) *buf = NULL;
+        const uint8_t *data = NULL;
+        bool protective = false;
+        bool ret = false;
+        ssize_t n;
+        int fd;
+
+        memset(table, 0, sizeof(*table));
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+
+        buf = malloc(PT_READ_SIZE);
+        OOM_CHECK(buf);
+
+        n = pread(fd, buf, PT_READ_SIZE, 0);
+        if (n < 512) {
+                goto done;
+        }
+        data = (const uint8_t *)buf;
+
+        if (data[MBR_SIGNATURE_OFFSET] != 0x55 || data[MBR_SIGNATURE_OFFSET + 1] != 0xAA) {
+                goto done;
+        }
+
+        for (int i = 0; i < MBR_ENTRIES; i++) {
+                if (data[MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE + 4] == MBR_TYPE_PROTECTIVE) {
+                        protective = true;
+                        break;
+                }
+        }
+
+        if (!protective) {
+                ret = mbr_read(fd, data, table);
+                goto done;
+        }
+
+        /* The logical sector size isn't known up front, so try both */
+        if (gpt_header_valid(data, (size_t)n, 512)) {
+                ret = gpt_read(fd, data, (size_t)n, 512, table);
+        } else if (gpt_header_valid(data, (size_t)n, 4096)) {
+                ret = gpt_read(fd, data, (size_t)n, 4096, table);
+        }
+
+done:
+        close(fd);
+        if (!ret) {
+                cbm_part_table_clear(table);
+        }
+        return ret;
+}
+
+void cbm_part_table_clear(CbmPartTable *table)
+{
+        if (!table) {
+                return;
+        }
+        free(table->parts);
+        memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
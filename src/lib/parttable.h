@@ -0,0 +1,77 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Length of a GUID in hyphen notation, including the terminator
+ */
+#define CBM_GUID_STRING_SIZE 37
+
+/**
+ * A single partition, described the same way libblkid would
+ */
+typedef struct CbmPartition {
+        int partno;                       /**<1-based partition number */
+        char uuid[CBM_GUID_STRING_SIZE];  /**<PartUUID, empty if unknown */
+        char type[CBM_GUID_STRING_SIZE];  /**<GPT type GUID, empty for MBR */
+        unsigned long long flags;         /**<GPT attributes, or the MBR boot indicator */
+} CbmPartition;
+
+/**
+ * The partition table of a whole disk
+ */
+typedef struct CbmPartTable {
+        char type[8];                     /**<"gpt" or "dos", empty if unpartitioned */
+        char uuid[CBM_GUID_STRING_SIZE];  /**<Disk GUID, or the MBR disk signature */
+        int count;                        /**<Number of used partitions within @parts */
+        CbmPartition *parts;              /**<Partitions, in on-disk order */
+} CbmPartTable;
+
+/**
+ * Read the partition table of the disk @path directly, without libblkid.
+ *
+ * Only the protective MBR, the primary GPT header and its entries are read,
+ * and both CRCs must match. MBR disks are supported as long as they have
+ * no extended partitions, and every entry fits on the disk.
+ *
+ * @return true if @table was filled in, false if the disk must be probed
+ * some other way. Release @table with cbm_part_table_clear.
+ */
+bool cbm_part_table_read(const char *path, CbmPartTable *table);
+
+/**
+ * Release the partitions held by @table
+ */
+void cbm_part_table_clear(CbmPartTable *table);
+
+/**
+ * Update the CRC32 (as used by GPT and zlib) @crc with @len bytes of @data.
+ * Start with a @crc of 0.
+ */
+uint32_t cbm_crc32(uint32_t crc, const void *data, size_t len);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,578 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "files.h"
+#include "log.h"
+#include "pe.h"
+#include "util.h"
+
+/* Offsets within the DOS, COFF and section headers */
+#define DOS_MAGIC "MZ"
+#define DOS_LFANEW_OFFSET 0x3c
+#define PE_MAGIC "PE\0\0"
+#define COFF_HEADER_SIZE 20
+#define COFF_NSECTIONS_OFFSET 2
+#define COFF_OPT_SIZE_OFFSET 16
+#define SECTION_HEADER_SIZE 40
+#define SECTION_NAME_SIZE 8
+#define SECTION_VSIZE_OFFSET 8
+#define SECTION_RAW_SIZE_OFFSET 16
+#define SECTION_RAW_PTR_OFFSET 20
+#define SECTION_VADDR_OFFSET 12
+#define SECTION_FLAGS_OFFSET 36
+
+/* IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ */
+#define SECTION_FLAGS_DATA 0x40000040
+
+/* Offsets within the optional header, shared by PE32 and PE32+ */
+#define OPT_MAGIC_PE32 0x10b
+#define OPT_MAGIC_PE32_PLUS 0x20b
+#define OPT_INIT_DATA_SIZE_OFFSET 8
+#define OPT_SECTION_ALIGN_OFFSET 32
+#define OPT_FILE_ALIGN_OFFSET 36
+#define OPT_IMAGE_SIZE_OFFSET 56
+#define OPT_HEADERS_SIZE_OFFSET 60
+#define OPT_CHECKSUM_OFFSET 64
+#define OPT_PE32_NDIRS_OFFSET 92
+#define OPT_PE32_PLUS_NDIRS_OFFSET 108
+#define DATA_DIR_SIZE 8
+#define DATA_DIR_SECURITY 4
+
+/* Headers of any sane image fit well within this */
+#define PE_MAX_HEADERS_SIZE (64 * 1024)
+
+/* Sane upper bound, the PE spec permits 96 sections */
+#define PE_MAX_SECTIONS 96
+
+#define SDMAGIC_PREFIX "LoaderInfo: "
+#define SDMAGIC_SUFFIX " ####"
+
+static inline uint16_t read_le16(const unsigned char *p)
+{
+        return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+               ((uint32_t)p[3] << 24);
+}
+
+static inline void write_le16(unsigned char *p, uint16_t v)
+{
+        p[0] = (unsigned char)(v & 0xff);
+        p[1] = (unsigned char)(v >> 8);
+}
+
+static inline void write_le32(unsigned char *p, uint32_t v)
+{
+        for (int i = 0; i < 4; i++) {
+                p[i] = (unsigned char)((v >> (i * 8)) & 0xff);
+        }
+}
+
+static inline uint64_t align_up(uint64_t v, uint32_t alignment)
+{
+        return (v + alignment - 1) & ~((uint64_t)alignment - 1);
+}
+
+static bool read_exact(int fd, void *buf, size_t len, off_t offset)
+{
+        size_t done = 0;
+
+        while (done < len) {
+                ssize_t r = pread(fd, (char *)buf + done, len - done, offset + (off_t)done);
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r <= 0) {
+                        return false;
+                }
+                done += (size_t)r;
+        }
+        return true;
+}
+
+char *cbm_pe_read_section(const char *path, const char *section, size_t *len)
+{
+        unsigned char hdr[COFF_HEADER_SIZE + 4];
+        unsigned char sect[SECTION_HEADER_SIZE];
+        unsigned char dos[DOS_LFANEW_OFFSET + 4];
+        uint32_t pe_offset;
+        uint16_t n_sections;
+        uint16_t opt_size;
+        off_t table;
+        size_t name_len;
+        char *ret = NULL;
+        int fd = -1;
+
+        if (!path || !section) {
+                return NULL;
+        }
+
+        name_len = strlen(section);
+        if (name_len == 0 || name_len > SECTION_NAME_SIZE) {
+                return NULL;
+        }
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return NULL;
+        }
+
+        if (!read_exact(fd, dos, sizeof(dos), 0) || memcmp(dos, DOS_MAGIC, 2) != 0) {
+                goto end;
+        }
+        pe_offset = read_le32(dos + DOS_LFANEW_OFFSET);
+
+        if (!read_exact(fd, hdr, sizeof(hdr), (off_t)pe_offset) || memcmp(hdr, PE_MAGIC, 4) != 0) {
+                goto end;
+        }
+        n_sections = read_le16(hdr + 4 + COFF_NSECTIONS_OFFSET);
+        opt_size = read_le16(hdr + 4 + COFF_OPT_SIZE_OFFSET);
+        if (n_sections > PE_MAX_SECTIONS) {
+                goto end;
+        }
+
+        table = (off_t)pe_offset + 4 + COFF_HEADER_SIZE + opt_size;
+        for (uint16_t i = 0; i < n_sections; i++) {
+                uint32_t vsize, raw_size, raw_ptr, size;
+
+                if (!read_exact(fd, sect, sizeof(sect), table + (off_t)i * SECTION_HEADER_SIZE)) {
+                        goto end;
+                }
+                /* Names shorter than 8 bytes are NUL padded */
+                if (memcmp(sect, section, name_len) != 0 ||
+                    (name_len < SECTION_NAME_SIZE && sect[name_len] != '\0')) {
+                        continue;
+                }
+
+                vsize = read_le32(sect + SECTION_VSIZE_OFFSET);
+                raw_size = read_le32(sect + SECTION_RAW_SIZE_OFFSET);
+                raw_ptr = read_le32(sect + SECTION_RAW_PTR_OFFSET);
+
+                /* Raw data is padded to the file alignment, trust the
+                 * virtual size when it is smaller */
+                size = vsize && vsize < raw_size ? vsize : raw_size;
+                if (size > CBM_PE_MAX_SECTION_SIZE) {
+                        goto end;
+                }
+
+                ret = calloc(1, (size_t)size + 1);
+                OOM_CHECK(ret);
+                if (!read_exact(fd, ret, size, (off_t)raw_ptr)) {
+                        free(ret);
+                        ret = NULL;
+                        goto end;
+                }
+                if (len) {
+                        *len = size;
+                }
+                break;
+        }
+
+end:
+        close(fd);
+        return ret;
+}
+
+/**
+ * Grab the unquoted value of @key from os-release formatted @data
+ */
+static char *osrel_get_value(const char *data, const char *key)
+{
+        size_t key_len = strlen(key);
+        const char *line = data;
+
+        while (line && *line) {
+                const char *eol = strchr(line, '\n');
+                size_t line_len = eol ? (size_t)(eol - line) : strlen(line);
+
+                if (line_len > key_len && strncmp(line, key, key_len) == 0 &&
+                    line[key_len] == '=') {
+                        const char *value = line + key_len + 1;
+                        size_t value_len = line_len - key_len - 1;
+
+                        if (value_len >= 2 && (value[0] == '"' || value[0] == '\'') &&
+                            value[value_len - 1] == value[0]) {
+                                value++;
+                                value_len -= 2;
+                        }
+                        return strndup(value, value_len);
+                }
+                line = eol ? eol + 1 : NULL;
+        }
+        return NULL;
+}
+
+char *cbm_pe_get_version(const char *path)
+{
+        autofree(char) *sdmagic = NULL;
+        autofree(char) *osrel = NULL;
+        autofree(char) *id = NULL;
+        char *version = NULL;
+
+        /* i.e. "#### LoaderInfo: systemd-boot 255.4 ####" */
+        sdmagic = cbm_pe_read_section(path, ".sdmagic", NULL);
+        if (sdmagic) {
+                char *start = strstr(sdmagic, SDMAGIC_PREFIX);
+                char *end = NULL;
+
+                if (start) {
+                        start += strlen(SDMAGIC_PREFIX);
+                        end = strstr(start, SDMAGIC_SUFFIX);
+                        if (end && end > start) {
+                                return strndup(start, (size_t)(end - start));
+                        }
+                }
+        }
+
+        osrel = cbm_pe_read_section(path, ".osrel", NULL);
+        if (!osrel) {
+                return NULL;
+        }
+        version = osrel_get_value(osrel, "VERSION");
+        if (!version) {
+                return NULL;
+        }
+        id = osrel_get_value(osrel, "ID");
+        if (id) {
+                char *tmp = version;
+                version = string_printf("%s %s", id, version);
+                free(tmp);
+        }
+        return version;
+}
+
+bool cbm_pe_blobs_match(const char *a, const char *b)
+{
+        autofree(char) *version_a = NULL;
+        autofree(char) *version_b = NULL;
+
+        version_a = cbm_pe_get_version(a);
+        if (version_a) {
+                version_b = cbm_pe_get_version(b);
+        }
+
+        if (version_a && version_b) {
+                LOG_DEBUG("Comparing versions of %s (%s) and %s (%s)", a, version_a, b, version_b);
+                return streq(version_a, version_b);
+        }
+
+        return cbm_files_match(a, b);
+}
+
+
+static bool write_exact(int fd, const void *buf, size_t len, off_t offset)
+{
+        size_t done = 0;
+
+        while (done < len) {
+                ssize_t r = pwrite(fd, (const char *)buf + done, len - done, offset + (off_t)done);
+                if (r < 0 && errno == EINTR) {
+                        continue;
+                }
+                if (r <= 0) {
+                        return false;
+                }
+                done += (size_t)r;
+        }
+        return true;
+}
+
+/**
+ * Size of the contents of @section, stat'ing the files if need be
+ */
+static bool section_size(const CbmPeSection *section, uint64_t *size)
+{
+        struct stat st = { 0 };
+
+        if (section->data) {
+                *size = section->len;
+                return true;
+        }
+
+        *size = 0;
+        for (size_t i = 0; section->files && section->files[i]; i++) {
+                if (stat(section->files[i], &st) != 0) {
+                        LOG_ERROR("Cannot stat %s: %s", section->files[i], strerror(errno));
+                        return false;
+                }
+                if (section->align) {
+                        *size = align_up(*size, (uint32_t)section->align);
+                }
+                *size += (uint64_t)st.st_size;
+        }
+        return true;
+}
+
+/**
+ * Write the contents of @section at @offset of @out_fd
+ */
+static bool section_write(const CbmPeSection *section, int out_fd, off_t offset)
+{
+        off_t start = offset;
+
+        if (section->data) {
+                return write_exact(out_fd, section->data, section->len, offset);
+        }
+
+        for (size_t i = 0; section->files && section->files[i]; i++) {
+                struct stat st = { 0 };
+                bool ok;
+                int fd;
+
+                /* The gap is never written, it reads back as zeroes */
+                if (section->align) {
+                        offset = start + (off_t)align_up((uint64_t)(offset - start),
+                                                         (uint32_t)section->align);
+                }
+
+                fd = open(section->files[i], O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                        LOG_ERROR("Cannot open %s: %s", section->files[i], strerror(errno));
+                        return false;
+                }
+                ok = fstat(fd, &st) == 0 &&
+                     cbm_copy_range(fd, 0, (uint64_t)st.st_size, out_fd, offset);
+                close(fd);
+                if (!ok) {
+                        LOG_ERROR("Cannot append %s: %s", section->files[i], strerror(errno));
+                        return false;
+                }
+                offset += st.st_size;
+        }
+        return true;
+}
+
+bool cbm_pe_write_image(const char *stub, const CbmPeSection *sections, size_t n_sections,
+                        const CbmDir *dir, const char *output)
+{
+        unsigned char dos[DOS_LFANEW_OFFSET + 4];
+        unsigned char *headers = NULL;
+        unsigned char *coff = NULL;
+        unsigned char *opt = NULL;
+        off_t *offsets = NULL;
+        uint64_t va_end = 0;
+        uint64_t raw_end = 0;
+        uint64_t init_data;
+        uint64_t va, raw;
+        uint32_t pe_offset, headers_size, section_align, file_align, n_dirs;
+        uint16_t n_old, opt_size, magic;
+        size_t table;
+        bool ret = false;
+        int in_fd = -1;
+        int out_fd = -1;
+
+        if (!stub || !dir || !output || (n_sections && !sections)) {
+                return false;
+        }
+
+        in_fd = open(stub, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) {
+                LOG_ERROR("Cannot open %s: %s", stub, strerror(errno));
+                return false;
+        }
+
+        if (!read_exact(in_fd, dos, sizeof(dos), 0) || memcmp(dos, DOS_MAGIC, 2) != 0) {
+                goto invalid;
+        }
+        pe_offset = read_le32(dos + DOS_LFANEW_OFFSET);
+        if (pe_offset > PE_MAX_HEADERS_SIZE) {
+                goto invalid;
+        }
+
+        /* Grab the full header block, we patch it in place */
+        headers = calloc(1, PE_MAX_HEADERS_SIZE);
+        OOM_CHECK(headers);
+        if (!read_exact(in_fd, headers, (size_t)pe_offset + 4 + COFF_HEADER_SIZE, 0) ||
+            memcmp(headers + pe_offset, PE_MAGIC, 4) != 0) {
+                goto invalid;
+        }
+        coff = headers + pe_offset + 4;
+        n_old = read_le16(coff + COFF_NSECTIONS_OFFSET);
+        opt_size = read_le16(coff + COFF_OPT_SIZE_OFFSET);
+        table = (size_t)pe_offset + 4 + COFF_HEADER_SIZE + opt_size;
+
+        if (opt_size < OPT_PE32_PLUS_NDIRS_OFFSET + 4 || n_old + n_sections > PE_MAX_SECTIONS ||
+            table + (n_old + n_sections) * SECTION_HEADER_SIZE > PE_MAX_HEADERS_SIZE) {
+                goto invalid;
+        }
+        opt = coff + COFF_HEADER_SIZE;
+        if (!read_exact(in_fd, opt, opt_size, (off_t)(opt - headers))) {
+                goto invalid;
+        }
+
+        magic = read_le16(opt);
+        section_align = read_le32(opt + OPT_SECTION_ALIGN_OFFSET);
+        file_align = read_le32(opt + OPT_FILE_ALIGN_OFFSET);
+        headers_size = read_le32(opt + OPT_HEADERS_SIZE_OFFSET);
+        if ((magic != OPT_MAGIC_PE32 && magic != OPT_MAGIC_PE32_PLUS) || !section_align ||
+            (section_align & (section_align - 1)) || !file_align ||
+            (file_align & (file_align - 1)) || headers_size > PE_MAX_HEADERS_SIZE) {
+                goto invalid;
+        }
+
+        /* New section headers must fit in the space reserved for headers */
+        if (table + (n_old + n_sections) * SECTION_HEADER_SIZE > headers_size) {
+                LOG_ERROR("No room for %zu more sections in %s", n_sections, stub);
+                goto end;
+        }
+        if (!read_exact(in_fd, headers, headers_size, 0)) {
+                goto invalid;
+        }
+
+        /* Find the end of the existing image, in memory and on disk */
+        for (uint16_t i = 0; i < n_old; i++) {
+                const unsigned char *sect = headers + table + (size_t)i * SECTION_HEADER_SIZE;
+                uint32_t vsize = read_le32(sect + SECTION_VSIZE_OFFSET);
+                uint32_t vaddr = read_le32(sect + SECTION_VADDR_OFFSET);
+                uint32_t raw_size = read_le32(sect + SECTION_RAW_SIZE_OFFSET);
+                uint32_t raw_ptr = read_le32(sect + SECTION_RAW_PTR_OFFSET);
+
+                if ((uint64_t)vaddr + (vsize > raw_size ? vsize : raw_size) > va_end) {
+                        va_end = (uint64_t)vaddr + (vsize > raw_size ? vsize : raw_size);
+                }
+                if ((uint64_t)raw_ptr + raw_size > raw_end) {
+                        raw_end = (uint64_t)raw_ptr + raw_size;
+                }
+        }
+        if (raw_end < headers_size) {
+                raw_end = headers_size;
+        }
+
+        /* Lay the new sections out after the existing ones */
+        offsets = calloc(n_sections + 1, sizeof(off_t));
+        OOM_CHECK(offsets);
+        va = align_up(va_end, section_align);
+        raw = align_up(raw_end, file_align);
+        init_data = read_le32(opt + OPT_INIT_DATA_SIZE_OFFSET);
+        for (size_t i = 0; i < n_sections; i++) {
+                unsigned char *sect = headers + table + (n_old + i) * SECTION_HEADER_SIZE;
+                size_t name_len = sections[i].name ? strlen(sections[i].name) : 0;
+                uint64_t size;
+
+                if (name_len == 0 || name_len > SECTION_NAME_SIZE) {
+                        LOG_ERROR("Invalid PE section name: %s", sections[i].name);
+                        goto end;
+                }
+                if (!section_size(&sections[i], &size)) {
+                        goto end;
+                }
+                if (va + size > UINT32_MAX || raw + size > UINT32_MAX) {
+                        LOG_ERROR("Section %s is too large for a PE image", sections[i].name);
+                        goto end;
+                }
+
+                memset(sect, 0, SECTION_HEADER_SIZE);
+                memcpy(sect, sections[i].name, name_len);
+                write_le32(sect + SECTION_VSIZE_OFFSET, (uint32_t)size);
+                write_le32(sect + SECTION_VADDR_OFFSET, (uint32_t)va);
+                write_le32(sect + SECTION_RAW_SIZE_OFFSET, (uint32_t)align_up(size, file_align));
+                write_le32(sect + SECTION_RAW_PTR_OFFSET, (uint32_t)raw);
+                write_le32(sect + SECTION_FLAGS_OFFSET, SECTION_FLAGS_DATA);
+
+                offsets[i] = (off_t)raw;
+                va = align_up(va + size, section_align);
+                raw += align_up(size, file_align);
+                init_data += align_up(size, file_align);
+        }
+        offsets[n_sections] = (off_t)raw;
+
+        if (va > UINT32_MAX || raw > UINT32_MAX || init_data > UINT32_MAX) {
+                LOG_ERROR("Image assembled from %s is too large", stub);
+                goto end;
+        }
+
+        /* Patch up the headers. The checksum and signature no longer apply */
+        write_le16(coff + COFF_NSECTIONS_OFFSET, (uint16_t)(n_old + n_sections));
+        write_le32(opt + OPT_INIT_DATA_SIZE_OFFSET, (uint32_t)init_data);
+        write_le32(opt + OPT_IMAGE_SIZE_OFFSET, (uint32_t)va);
+        write_le32(opt + OPT_CHECKSUM_OFFSET, 0);
+        n_dirs = read_le32(opt + (magic == OPT_MAGIC_PE32 ? OPT_PE32_NDIRS_OFFSET
+                                                          : OPT_PE32_PLUS_NDIRS_OFFSET));
+        if (n_dirs > DATA_DIR_SECURITY) {
+                size_t dir = (magic == OPT_MAGIC_PE32 ? OPT_PE32_NDIRS_OFFSET
+                                                      : OPT_PE32_PLUS_NDIRS_OFFSET) +
+                             4 + DATA_DIR_SECURITY * DATA_DIR_SIZE;
+                if (dir + DATA_DIR_SIZE <= opt_size) {
+                        memset(opt + dir, 0, DATA_DIR_SIZE);
+                }
+        }
+
+        out_fd = cbm_dir_openat(dir, output, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+        if (out_fd < 0) {
+                LOG_ERROR("Cannot create %s: %s", output, strerror(errno));
+                goto end;
+        }
+
+        if (!write_exact(out_fd, headers, headers_size, 0) ||
+            !cbm_copy_range(in_fd,
+                            (off_t)headers_size,
+                            raw_end - headers_size,
+                            out_fd,
+                            (off_t)headers_size)) {
+                LOG_ERROR("Cannot write %s: %s", output, strerror(errno));
+                goto end;
+        }
+
+        for (size_t i = 0; i < n_sections; i++) {
+                if (!section_write(&sections[i], out_fd, offsets[i])) {
+                        goto end;
+                }
+        }
+
+        /* Zero fill the padding of the last section */
+        if (ftruncate(out_fd, offsets[n_sections]) != 0) {
+                LOG_ERROR("Cannot write %s: %s", output, strerror(errno));
+                goto end;
+        }
+
+        ret = true;
+        goto end;
+
+invalid:
+        LOG_ERROR("Not a valid PE image: %s", stub);
+end:
+        if (out_fd >= 0) {
+                close(out_fd);
+                if (!ret) {
+                        (void)cbm_dir_unlink(dir, output);
+                }
+        }
+        close(in_fd);
+        free(offsets);
+        free(headers);
+        return ret;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,90 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dirfd.h"
+
+/**
+ * Upper bound on the size of a section we're willing to read. Version
+ * sections are tiny, this simply guards against bogus headers.
+ */
+#define CBM_PE_MAX_SECTION_SIZE (64 * 1024)
+
+/**
+ * Read the raw contents of the named section (i.e. ".sdmagic") from the PE
+ * image at @path. Only the section table is parsed, the rest of the image is
+ * never read.
+ *
+ * @param len Optional, set to the length of the section data on success
+ *
+ * @return a newly allocated, NUL terminated buffer, or NULL if the file is
+ * not a PE image or has no such section
+ */
+char *cbm_pe_read_section(const char *path, const char *section, size_t *len);
+
+/**
+ * Return the version string embedded in an EFI binary, i.e.
+ * "systemd-boot 255.4". The .sdmagic section is preferred, falling back to
+ * the ID and VERSION fields of the .osrel section.
+ *
+ * @return a newly allocated string, or NULL if no version is embedded
+ */
+char *cbm_pe_get_version(const char *path);
+
+/**
+ * Determine whether two EFI binaries are the same build. When both carry an
+ * embedded version only the versions are compared, otherwise this falls back
+ * to comparing the files in full.
+ */
+bool cbm_pe_blobs_match(const char *a, const char *b);
+
+/**
+ * A section to be appended to a PE image by cbm_pe_write_image. The contents
+ * are either held in memory (@data) or streamed from the concatenation of
+ * @files, which are never loaded in full. Files are zero padded up to @align
+ * so that every one of them starts aligned within the section.
+ */
+typedef struct CbmPeSection {
+        const char *name;         /**<Section name, i.e. ".linux", at most 8 bytes */
+        const char *data;         /**<In-memory contents, or NULL to use @files */
+        size_t len;               /**<Length of @data */
+        const char *const *files; /**<NULL terminated list of files to concatenate */
+        size_t align;             /**<If non-zero, each of @files starts on this boundary */
+} CbmPeSection;
+
+/**
+ * Write a copy of the PE image @stub to @output beneath @dir with @sections
+ * appended, i.e. to assemble a Unified Kernel Image from the systemd EFI
+ * stub. Any signature on the stub is dropped, as it would no longer be valid.
+ *
+ * @return true if the whole image was written
+ */
+bool cbm_pe_write_image(const char *stub, const CbmPeSection *sections, size_t n_sections,
+                        const CbmDir *dir, const char *output);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
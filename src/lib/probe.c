@@ -28,6 +28,7 @@
 #include "log.h"
 #include "probe.h"
 #include "system_stub.h"
+#include "topology.h"
 #include "util.h"
 
 /**
@@ -65,9 +66,8 @@ static char *cbm_get_luks_uuid(const char *part)
         autofree(char) *npath = NULL;
         autofree(char) *dpath = NULL;
         glob_t glo = { 0 };
-        blkid_probe blk_probe = NULL;
+        const CbmDeviceInfo *info = NULL;
         char *ret = NULL;
-        const char *value = NULL;
         const char *sys = cbm_system_get_sysfs_path();
 
         /* i.e. /sys/block/dm-1/slaves/dm-0/slaves/sdb1/dev
@@ -88,43 +88,26 @@ static char *cbm_get_luks_uuid(const char *part)
                 return NULL;
         }
 
-        blk_probe = cbm_blkid_new_probe_from_filename(dpath);
-        if (!blk_probe) {
-                LOG_ERROR("Unable to probe %s", dpath);
+        info = cbm_topology_get_device(dpath);
+        if (!info) {
                 return NULL;
         }
 
-        cbm_blkid_probe_enable_superblocks(blk_probe, 1);
-        cbm_blkid_probe_set_superblocks_flags(blk_probe, BLKID_SUBLKS_TYPE | BLKID_SUBLKS_UUID);
-        cbm_blkid_probe_enable_partitions(blk_probe, 1);
-        cbm_blkid_probe_set_partitions_flags(blk_probe, BLKID_PARTS_ENTRY_DETAILS);
-
-        if (cbm_blkid_do_safeprobe(blk_probe) != 0) {
-                LOG_ERROR("Error probing filesystem: %s", strerror(errno));
-                goto clean;
-        }
-
         /* Grab the type */
-        if (cbm_blkid_probe_lookup_value(blk_probe, "TYPE", &value, NULL) != 0) {
-                LOG_ERROR("Error determining type of device %s: %s\n", dpath, strerror(errno));
-                goto clean;
+        if (!info->type) {
+                LOG_ERROR("Error determining type of device %s", dpath);
+                return NULL;
         }
 
         /* Ensure that this parent disk really is LUKS */
-        if (!streq(value, "crypto_LUKS")) {
-                goto clean;
+        if (!streq(info->type, "crypto_LUKS") || !info->uuid) {
+                return NULL;
         }
 
-        if (cbm_blkid_probe_lookup_value(blk_probe, "UUID", &value, NULL) == 0) {
-                ret = strdup(value);
-                if (!ret) {
-                        DECLARE_OOM();
-                        goto clean;
-                }
+        ret = strdup(info->uuid);
+        if (!ret) {
+                DECLARE_OOM();
         }
-
-clean:
-        cbm_blkid_free_probe(blk_probe);
         return ret;
 }
 
@@ -134,60 +117,21 @@ clean:
  */
 static bool cbm_probe_is_gpt(const char *path)
 {
-        autofree(char) *parent_disk = NULL;
-        blkid_probe probe = NULL;
-        blkid_partlist parts = NULL;
-        blkid_parttable table = NULL;
-        bool ret = false;
-        const char *table_type = NULL;
+        const CbmDiskInfo *disk = NULL;
 
         /* Could be a weird image type or --path into chroot */
-        parent_disk = get_parent_disk((char *)path);
-        if (!parent_disk) {
+        disk = cbm_topology_get_disk(path);
+        if (!disk) {
                 return false;
         }
 
-        probe = cbm_blkid_new_probe_from_filename(parent_disk);
-        if (!probe) {
-                LOG_ERROR("Unable to blkid probe %s", parent_disk);
-                return NULL;
-        }
-
-        cbm_blkid_probe_enable_superblocks(probe, 1);
-        cbm_blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE);
-        cbm_blkid_probe_enable_partitions(probe, 1);
-        cbm_blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
-
-        if (cbm_blkid_do_safeprobe(probe) != 0) {
-                LOG_ERROR("Error probing filesystem of %s: %s", parent_disk, strerror(errno));
-                goto clean;
-        }
-
-        parts = cbm_blkid_probe_get_partitions(probe);
-        if (cbm_blkid_partlist_numof_partitions(parts) <= 0) {
-                /* No partitions */
-                goto clean;
-        }
-
-        /* Grab the partition table */
-        table = cbm_blkid_partlist_get_table(parts);
-        if (!table) {
-                LOG_ERROR("Unable to discover partitiojn table for %s: %s",
-                          parent_disk,
-                          strerror(errno));
-                goto clean;
+        if (!disk->probed) {
+                LOG_ERROR("Error probing filesystem of %s", disk->devname);
+                return false;
         }
 
         /* Determine the partition table type. We only care if its GPT. */
-        table_type = cbm_blkid_parttable_get_type(table);
-        if (table_type && streq(table_type, "gpt")) {
-                ret = true;
-        }
-
-clean:
-        cbm_blkid_free_probe(probe);
-        errno = 0;
-        return ret;
+        return streq(disk->table.type, "gpt");
 }
 
 CbmDeviceProbe *cbm_probe_path(const char *path)
@@ -196,8 +140,7 @@ CbmDeviceProbe *cbm_probe_path(const char *path)
         CbmDeviceProbe *ret = NULL;
         autofree(char) *devnode = NULL;
         struct stat st = { 0 };
-        blkid_probe blk_probe = NULL;
-        const char *value = NULL;
+        const CbmDeviceInfo *info = NULL;
         char *basenom = NULL;
 
         if (stat(path, &st) != 0) {
@@ -216,39 +159,25 @@ CbmDeviceProbe *cbm_probe_path(const char *path)
                 }
         }
 
-        blk_probe = cbm_blkid_new_probe_from_filename(devnode);
-        if (!blk_probe) {
-                if (devnode) {
-                        fprintf(stderr, "Unable to probe device %s", devnode);
-                } else {
-                        fprintf(stderr, "Unable to probe %u:%u", major(st.st_dev), minor(st.st_dev));
-                }
+        info = cbm_topology_get_device(devnode);
+        if (!info) {
                 return NULL;
         }
 
-        cbm_blkid_probe_enable_superblocks(blk_probe, 1);
-        cbm_blkid_probe_set_superblocks_flags(blk_probe, BLKID_SUBLKS_TYPE | BLKID_SUBLKS_UUID);
-        cbm_blkid_probe_enable_partitions(blk_probe, 1);
-        cbm_blkid_probe_set_partitions_flags(blk_probe, BLKID_PARTS_ENTRY_DETAILS);
-
-        if (cbm_blkid_do_safeprobe(blk_probe) != 0) {
-                LOG_ERROR("Error probing filesystem: %s", strerror(errno));
-                goto clean;
-        }
-
-        if (cbm_blkid_probe_lookup_value(blk_probe, "PART_ENTRY_UUID", &value, NULL) == 0) {
-                probe.part_uuid = strdup(value);
+        if (info->part_uuid) {
+                probe.part_uuid = strdup(info->part_uuid);
                 if (!probe.part_uuid) {
                         DECLARE_OOM();
-                        goto clean;
+                        return NULL;
                 }
         }
 
-        if (cbm_blkid_probe_lookup_value(blk_probe, "UUID", &value, NULL) == 0) {
-                probe.uuid = strdup(value);
+        if (info->uuid) {
+                probe.uuid = strdup(info->uuid);
                 if (!probe.uuid) {
                         DECLARE_OOM();
-                        goto clean;
+                        free(probe.part_uuid);
+                        return NULL;
                 }
         }
 
@@ -298,8 +227,6 @@ CbmDeviceProbe *cbm_probe_path(const char *path)
         }
         *ret = probe;
 
-clean:
-        cbm_blkid_free_probe(blk_probe);
         return ret;
 }
 
@@ -312,6 +239,7 @@ void cbm_probe_free(CbmDeviceProbe *probe)
         free(probe->uuid);
         free(probe->part_uuid);
         free(probe->luks_uuid);
+        free(probe->btrfs_sub);
         free(probe);
         return;
 }
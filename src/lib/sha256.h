@@ -0,0 +1,79 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CBM_SHA256_DIGEST_SIZE 32
+#define CBM_SHA256_HEX_SIZE (CBM_SHA256_DIGEST_SIZE * 2 + 1)
+
+/**
+ * Streaming SHA-256 state. Initialise with cbm_sha256_init, feed data with
+ * cbm_sha256_update and obtain the digest with cbm_sha256_final.
+ */
+typedef struct CbmSha256 {
+        uint32_t state[8];      /**<Intermediate hash value */
+        uint64_t length;        /**<Total bytes processed */
+        uint8_t block[64];      /**<Pending partial block */
+        size_t block_len;       /**<Bytes used in block */
+} CbmSha256;
+
+/**
+ * Reset @ctx to begin a new digest
+ */
+void cbm_sha256_init(CbmSha256 *ctx);
+
+/**
+ * Feed @len bytes of @data into the digest
+ */
+void cbm_sha256_update(CbmSha256 *ctx, const void *data, size_t len);
+
+/**
+ * Finish the digest, storing it in @digest. @ctx must be re-initialised
+ * before being used again.
+ */
+void cbm_sha256_final(CbmSha256 *ctx, uint8_t digest[CBM_SHA256_DIGEST_SIZE]);
+
+/**
+ * Compute the digest of everything from the current offset of @fd onwards
+ *
+ * @return True if the file could be read in its entirety
+ */
+bool cbm_sha256_fd(int fd, uint8_t digest[CBM_SHA256_DIGEST_SIZE]);
+
+/**
+ * Compute the digest of the full contents of the file at @path
+ *
+ * @return True if the file could be read in its entirety
+ */
+bool cbm_sha256_file(const char *path, uint8_t digest[CBM_SHA256_DIGEST_SIZE]);
+
+/**
+ * Format @digest as a NUL terminated lowercase hex string into @out
+ */
+void cbm_sha256_to_hex(const uint8_t digest[CBM_SHA256_DIGEST_SIZE],
+                       char out[CBM_SHA256_HEX_SIZE]);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,86 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "log.h"
+#include "stats.h"
+
+static uint64_t cbm_stats[CBM_STAT_MAX];
+
+static const char *cbm_stat_names[CBM_STAT_MAX] = {
+        [CBM_STAT_EFI_VAR_WRITTEN] = "EFI variables written",
+        [CBM_STAT_EFI_VAR_SKIPPED] = "EFI variable writes skipped (unchanged)",
+        [CBM_STAT_INITRD_BLOB_WRITTEN] = "Initrd blobs written",
+        [CBM_STAT_INITRD_BLOB_REUSED] = "Initrd blobs reused",
+        [CBM_STAT_INITRD_TRANSCODED] = "Initrds recompressed",
+        [CBM_STAT_INITRD_BYTES_SAVED] = "Initrd bytes saved by recompression",
+        [CBM_STAT_BYTES_CACHED] = "Bytes copied through the page cache",
+        [CBM_STAT_BYTES_DIRECT] = "Bytes copied with O_DIRECT",
+        [CBM_STAT_BYTES_COMPARED] = "Bytes compared",
+        [CBM_STAT_DIGEST_CACHED] = "File digests reused from xattrs",
+        [CBM_STAT_DIGEST_COMPUTED] = "File digests computed",
+        [CBM_STAT_MIRROR_COPIED] = "Files copied to mirrored ESPs",
+        [CBM_STAT_MIRROR_REUSED] = "Files already current on mirrored ESPs",
+};
+
+void cbm_stats_inc(CbmStat stat)
+{
+        cbm_stats_add(stat, 1);
+}
+
+void cbm_stats_add(CbmStat stat, uint64_t value)
+{
+        if (stat >= CBM_STAT_MAX) {
+                return;
+        }
+        /* Mirrored ESPs are written from several threads */
+        __atomic_fetch_add(&cbm_stats[stat], value, __ATOMIC_RELAXED);
+}
+
+uint64_t cbm_stats_get(CbmStat stat)
+{
+        if (stat >= CBM_STAT_MAX) {
+                return 0;
+        }
+        return cbm_stats[stat];
+}
+
+void cbm_stats_reset(void)
+{
+        memset(cbm_stats, 0, sizeof(cbm_stats));
+}
+
+void cbm_stats_report(void)
+{
+        for (int i = 0; i < CBM_STAT_MAX; i++) {
+                if (!cbm_stats[i]) {
+                        continue;
+                }
+                LOG_INFO("%s: %" PRIu64, cbm_stat_names[i], cbm_stats[i]);
+        }
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,73 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Counters collected over a single clr-boot-manager invocation, reported
+ * once the update completes.
+ */
+typedef enum {
+        CBM_STAT_EFI_VAR_WRITTEN = 0, /**<EFI variables written to NVRAM */
+        CBM_STAT_EFI_VAR_SKIPPED,     /**<EFI variable writes skipped, value unchanged */
+        CBM_STAT_INITRD_BLOB_WRITTEN, /**<Content addressed initrds written to the ESP */
+        CBM_STAT_INITRD_BLOB_REUSED,  /**<Content addressed initrds already present */
+        CBM_STAT_INITRD_TRANSCODED,   /**<Initrds recompressed during this run */
+        CBM_STAT_INITRD_BYTES_SAVED,  /**<Bytes saved by recompressed initrds in use */
+        CBM_STAT_BYTES_CACHED,        /**<Bytes copied through the page cache */
+        CBM_STAT_BYTES_DIRECT,        /**<Bytes copied with O_DIRECT */
+        CBM_STAT_BYTES_COMPARED,      /**<Bytes read to compare files */
+        CBM_STAT_DIGEST_CACHED,       /**<File digests taken from the xattr cache */
+        CBM_STAT_DIGEST_COMPUTED,     /**<File digests computed by reading the file */
+        CBM_STAT_MIRROR_COPIED,       /**<Files copied to mirrored ESPs */
+        CBM_STAT_MIRROR_REUSED,       /**<Files already current on mirrored ESPs */
+        CBM_STAT_MAX
+} CbmStat;
+
+/**
+ * Increment the given counter by one
+ */
+void cbm_stats_inc(CbmStat stat);
+
+/**
+ * Increment the given counter by @value
+ */
+void cbm_stats_add(CbmStat stat, uint64_t value);
+
+/**
+ * Return the current value of the given counter
+ */
+uint64_t cbm_stats_get(CbmStat stat);
+
+/**
+ * Reset all counters to zero
+ */
+void cbm_stats_reset(void);
+
+/**
+ * Log all non-zero counters at info level
+ */
+void cbm_stats_report(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -12,12 +12,14 @@
 #include "system_stub.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <sys/mount.h>
 #include <sys/sysmacros.h>
 
 #include "files.h"
 #include "log.h"
+#include "topology.h"
 
 /**
  * Factory function to convert a dev_t to the full device path
@@ -52,6 +54,7 @@ static const char *cbm_get_devfs_path(void)
 static CbmSystemOps default_system_ops = {
         .mount = mount,
         .umount = umount,
+        .mount_detached = cbm_mount_detached,
         .system = system,
         .is_mounted = cbm_is_mounted,
         .get_mountpoint_for_device = cbm_get_mountpoint_for_device,
@@ -68,14 +71,22 @@ static CbmSystemOps *system_ops = &default_system_ops;
 
 void cbm_system_reset_vtable(void)
 {
+        /* Mountpoints are resolved through the vtable, so forget them */
+        cbm_topology_reset();
         system_ops = &default_system_ops;
 }
 
+bool cbm_system_is_native(void)
+{
+        return system_ops == &default_system_ops;
+}
+
 void cbm_system_set_vtable(CbmSystemOps *ops)
 {
         if (!ops) {
                 cbm_system_reset_vtable();
         } else {
+                cbm_topology_reset();
                 system_ops = ops;
         }
         /* Ensure the vtable is valid at this point. */
@@ -95,6 +106,16 @@ int cbm_system_mount(const char *source, const char *target, const char *filesys
         return system_ops->mount(source, target, filesystemtype, mountflags, data);
 }
 
+int cbm_system_mount_detached(const char *source, const char *filesystemtype,
+                              const char *options)
+{
+        if (!system_ops->mount_detached) {
+                errno = ENOSYS;
+                return -1;
+        }
+        return system_ops->mount_detached(source, filesystemtype, options);
+}
+
 int cbm_system_umount(const char *target)
 {
         return system_ops->umount(target);
@@ -26,6 +26,8 @@ typedef struct CbmSystemOps {
         int (*mount)(const char *source, const char *target, const char *filesystemtype,
                      unsigned long mountflags, const void *data);
         int (*umount)(const char *target);
+        int (*mount_detached)(const char *source, const char *filesystemtype,
+                              const char *options); /**<Optional */
 
         /* wrap cbm lib functions */
         bool (*is_mounted)(const char *target);
@@ -55,12 +57,26 @@ void cbm_system_reset_vtable(void);
  */
 void cbm_system_set_vtable(CbmSystemOps *ops);
 
+/**
+ * Whether the default vtable is in use, i.e. we're talking to the real system
+ */
+bool cbm_system_is_native(void);
+
 /**
  * Wrap the mount syscall
  */
 int cbm_system_mount(const char *source, const char *target, const char *filesystemtype,
                      unsigned long mountflags, const void *data);
 
+/**
+ * Mount @source without attaching it anywhere, see cbm_mount_detached()
+ *
+ * @return the mount descriptor, or -1 with errno set to ENOSYS if the
+ * vtable has no support for it
+ */
+int cbm_system_mount_detached(const char *source, const char *filesystemtype,
+                              const char *options);
+
 /**
  * Determine if the given mount point is already mounted
  */
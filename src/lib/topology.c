@@ -0,0 +1,423 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "files.h"
+#include "log.h"
+#include "nica/array.h"
+#include "nica/hashmap.h"
+#include "system_stub.h"
+#include "topology.h"
+#include "util.h"
+
+/**
+ * Resolving a mountpoint to its disk means parsing the mount table and
+ * probing the device, so remember the answer along with the st_dev it was
+ * computed for. Anything mounted over the path since changes st_dev and
+ * forces a fresh lookup.
+ */
+typedef struct CbmMountInfo {
+        dev_t dev;
+        dev_t disk_devno;
+} CbmMountInfo;
+
+/**
+ * One snapshot serves the whole run: every query during an update is about
+ * the same handful of devices, and probing a disk means reading its
+ * partition table again, which isn't cheap on remote or multipath storage.
+ */
+static NcHashmap *topology_devices = NULL;
+static NcHashmap *topology_mounts = NULL;
+static NcArray *topology_disks = NULL;
+
+static void cbm_device_info_free(void *v)
+{
+        CbmDeviceInfo *info = v;
+
+        if (!info) {
+                return;
+        }
+        free(info->devnode);
+        free(info->type);
+        free(info->uuid);
+        free(info->part_uuid);
+        free(info);
+}
+
+static void cbm_disk_info_free(void *v)
+{
+        CbmDiskInfo *disk = v;
+
+        if (!disk) {
+                return;
+        }
+        cbm_part_table_clear(&disk->table);
+        free(disk->devname);
+        free(disk);
+}
+
+void cbm_topology_reset(void)
+{
+        if (topology_devices) {
+                nc_hashmap_free(topology_devices);
+                topology_devices = NULL;
+        }
+        if (topology_mounts) {
+                nc_hashmap_free(topology_mounts);
+                topology_mounts = NULL;
+        }
+        if (topology_disks) {
+                nc_array_free(&topology_disks, cbm_disk_info_free);
+                topology_disks = NULL;
+        }
+}
+
+/**
+ * Copy @name out of the probe, if it is set
+ */
+static char *probe_dup_value(blkid_probe probe, const char *name)
+{
+        const char *value = NULL;
+        char *ret = NULL;
+
+        if (cbm_blkid_probe_lookup_value(probe, name, &value, NULL) != 0 || !value) {
+                return NULL;
+        }
+        ret = strdup(value);
+        OOM_CHECK(ret);
+        return ret;
+}
+
+static CbmDeviceInfo *cbm_topology_probe_device(const char *devnode)
+{
+        CbmDeviceInfo *info = NULL;
+        blkid_probe probe = NULL;
+
+        probe = cbm_blkid_new_probe_from_filename(devnode);
+        if (!probe) {
+                LOG_ERROR("Unable to probe device %s", devnode);
+                return NULL;
+        }
+
+        cbm_blkid_probe_enable_superblocks(probe, 1);
+        cbm_blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE | BLKID_SUBLKS_UUID);
+        cbm_blkid_probe_enable_partitions(probe, 1);
+        cbm_blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
+
+        if (cbm_blkid_do_safeprobe(probe) != 0) {
+                LOG_ERROR("Error probing filesystem of %s: %s", devnode, strerror(errno));
+                cbm_blkid_free_probe(probe);
+                return NULL;
+        }
+
+        info = calloc(1, sizeof(CbmDeviceInfo));
+        OOM_CHECK(info);
+
+        info->devnode = strdup(devnode);
+        OOM_CHECK(info->devnode);
+        info->type = probe_dup_value(probe, "TYPE");
+        info->uuid = probe_dup_value(probe, "UUID");
+        info->part_uuid = probe_dup_value(probe, "PART_ENTRY_UUID");
+        info->disk_devno = cbm_probe_get_wholedisk_devno(probe);
+
+        cbm_blkid_free_probe(probe);
+        return info;
+}
+
+const CbmDeviceInfo *cbm_topology_get_device(const char *devnode)
+{
+        CbmDeviceInfo *info = NULL;
+
+        if (!topology_devices) {
+                topology_devices = nc_hashmap_new_full(nc_string_hash,
+                                                       nc_string_compare,
+                                                       NULL,
+                                                       cbm_device_info_free);
+                OOM_CHECK(topology_devices);
+        }
+
+        info = nc_hashmap_get(topology_devices, devnode);
+        if (info) {
+                return info;
+        }
+
+        /* Failures aren't remembered, the device may well turn up later */
+        info = cbm_topology_probe_device(devnode);
+        if (!info) {
+                return NULL;
+        }
+        OOM_CHECK(nc_hashmap_put(topology_devices, info->devnode, info));
+
+        return info;
+}
+
+bool cbm_topology_get_disk_devno(const char *path, dev_t *diskdevno)
+{
+        struct stat st = { 0 };
+        autofree(char) *dev_path = NULL;
+        CbmMountInfo *mount = NULL;
+        dev_t ret;
+
+        if (stat(path, &st) != 0) {
+                return false;
+        }
+
+        if (!topology_mounts) {
+                topology_mounts = nc_hashmap_new_full(nc_string_hash,
+                                                      nc_string_compare,
+                                                      free,
+                                                      free);
+                OOM_CHECK(topology_mounts);
+        }
+
+        mount = nc_hashmap_get(topology_mounts, path);
+        if (mount && mount->dev == st.st_dev) {
+                *diskdevno = mount->disk_devno;
+                return true;
+        }
+
+        dev_path = cbm_system_get_device_for_mountpoint(path);
+        if (dev_path) {
+                const CbmDeviceInfo *info = cbm_topology_get_device(dev_path);
+                if (!info) {
+                        LOG_ERROR("Invalid block device: %s", path);
+                        return false;
+                }
+                ret = info->disk_devno;
+        } else {
+                /* Fall back to stat, possibly /proc/self/mounts has /dev/root
+                   as the root device.
+                */
+                if (cbm_blkid_devno_to_wholedisk(st.st_dev, NULL, 0, &ret) < 0) {
+                        LOG_ERROR("Invalid block device: %s", path);
+                        return false;
+                }
+        }
+
+        if (!mount) {
+                char *key = strdup(path);
+                OOM_CHECK(key);
+                mount = calloc(1, sizeof(CbmMountInfo));
+                OOM_CHECK(mount);
+                OOM_CHECK(nc_hashmap_put(topology_mounts, key, mount));
+        }
+        mount->dev = st.st_dev;
+        mount->disk_devno = ret;
+
+        *diskdevno = ret;
+        return true;
+}
+
+/**
+ * Fill in the partition table of @disk with libblkid, for anything the
+ * native reader didn't understand
+ */
+static bool cbm_topology_probe_table(CbmDiskInfo *disk)
+{
+        CbmPartTable *table = &disk->table;
+        blkid_probe probe = NULL;
+        blkid_partlist parts = NULL;
+        blkid_parttable parttable = NULL;
+        const char *value = NULL;
+        int count;
+
+        probe = cbm_blkid_new_probe_from_filename(disk->devname);
+        if (!probe) {
+                LOG_ERROR("Unable to blkid probe %s", disk->devname);
+                return false;
+        }
+
+        cbm_blkid_probe_enable_superblocks(probe, 1);
+        cbm_blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE);
+        cbm_blkid_probe_enable_partitions(probe, 1);
+        cbm_blkid_probe_set_partitions_flags(probe, BLKID_PARTS_ENTRY_DETAILS);
+
+        disk->probed = cbm_blkid_do_safeprobe(probe) == 0;
+        if (!disk->probed) {
+                LOG_DEBUG("Error probing filesystem of %s: %s", disk->devname, strerror(errno));
+        }
+
+        parts = cbm_blkid_probe_get_partitions(probe);
+        count = cbm_blkid_partlist_numof_partitions(parts);
+        if (count <= 0) {
+                goto clean;
+        }
+
+        parttable = cbm_blkid_partlist_get_table(parts);
+        if (!parttable) {
+                LOG_ERROR("Unable to discover partition table for %s: %s",
+                          disk->devname,
+                          strerror(errno));
+                goto clean;
+        }
+        value = cbm_blkid_parttable_get_type(parttable);
+        if (value) {
+                snprintf(table->type, sizeof(table->type), "%s", value);
+        }
+
+        table->parts = calloc((size_t)count, sizeof(CbmPartition));
+        OOM_CHECK(table->parts);
+        table->count = count;
+
+        for (int i = 0; i < count; i++) {
+                blkid_partition part = cbm_blkid_partlist_get_partition(parts, i);
+                CbmPartition *entry = &table->parts[i];
+
+                entry->partno = cbm_blkid_partition_get_partno(part);
+                entry->flags = cbm_blkid_partition_get_flags(part);
+                value = cbm_blkid_partition_get_uuid(part);
+                if (value) {
+                        snprintf(entry->uuid, sizeof(entry->uuid), "%s", value);
+                }
+                value = cbm_blkid_partition_get_type_string(part);
+                if (value) {
+                        snprintf(entry->type, sizeof(entry->type), "%s", value);
+                }
+        }
+
+clean:
+        cbm_blkid_free_probe(probe);
+        return true;
+}
+
+static CbmDiskInfo *cbm_topology_probe_disk(dev_t devno)
+{
+        autofree(char) *node = NULL;
+        CbmDiskInfo *disk = NULL;
+
+        disk = calloc(1, sizeof(CbmDiskInfo));
+        OOM_CHECK(disk);
+        disk->devno = devno;
+
+        node = cbm_blkid_devno_to_devname(devno);
+        if (!node || !(disk->devname = realpath(node, NULL))) {
+                free(disk);
+                return NULL;
+        }
+
+        /* Reading the table directly is far cheaper than a full safeprobe */
+        if (cbm_blkid_read_partition_table(disk->devname, &disk->table)) {
+                disk->probed = true;
+                return disk;
+        }
+
+        if (!cbm_topology_probe_table(disk)) {
+                cbm_disk_info_free(disk);
+                return NULL;
+        }
+
+        return disk;
+}
+
+const CbmDiskInfo *cbm_topology_get_disk(const char *path)
+{
+        CbmDiskInfo *disk = NULL;
+        dev_t devno;
+
+        if (!cbm_topology_get_disk_devno(path, &devno)) {
+                return NULL;
+        }
+
+        if (!topology_disks) {
+                topology_disks = nc_array_new();
+                OOM_CHECK(topology_disks);
+        }
+
+        for (int i = 0; i < topology_disks->len; i++) {
+                disk = nc_array_get(topology_disks, i);
+                if (disk->devno == devno) {
+                        return disk;
+                }
+        }
+
+        disk = cbm_topology_probe_disk(devno);
+        if (!disk) {
+                return NULL;
+        }
+        OOM_CHECK(nc_array_add(topology_disks, disk));
+
+        return disk;
+}
+
+/**
+ * Read the partition number of @dev from sysfs, which is all libblkid does
+ * to map a device back to its partition
+ */
+static int cbm_topology_get_partno(dev_t dev)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+        int partno;
+
+        path = string_printf("%s/dev/block/%u:%u/partition",
+                             cbm_system_get_sysfs_path(),
+                             major(dev),
+                             minor(dev));
+        if (!file_get_attribute(path, &text) || sscanf(text, "%d", &partno) != 1) {
+                return -1;
+        }
+
+        return partno;
+}
+
+const CbmPartition *cbm_topology_get_partition(const char *path, const CbmDiskInfo **disk)
+{
+        const CbmDiskInfo *info = NULL;
+        struct stat st = { 0 };
+        int partno;
+
+        if (stat(path, &st) != 0) {
+                return NULL;
+        }
+
+        info = cbm_topology_get_disk(path);
+        if (!info) {
+                return NULL;
+        }
+
+        partno = cbm_topology_get_partno(st.st_dev);
+        if (partno <= 0) {
+                return NULL;
+        }
+
+        for (int i = 0; i < info->table.count; i++) {
+                if (info->table.parts[i].partno == partno) {
+                        if (disk) {
+                                *disk = info;
+                        }
+                        return &info->table.parts[i];
+                }
+        }
+
+        return NULL;
+}
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
@@ -0,0 +1,91 @@
+/*
+ * This file is part of clr-boot-manager.
+ *
+ * Copyright © 2024 Solus Project
+ *
+ * clr-boot-manager is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2.1
+ * of the License, or (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "blkid_stub.h"
+#include "parttable.h"
+
+/**
+ * Everything learned from probing a single block device, i.e. a partition
+ * or a device-mapper node. Absent values are NULL.
+ */
+typedef struct CbmDeviceInfo {
+        char *devnode;     /**<Device node the info was probed from */
+        char *type;        /**<Superblock type, i.e. "vfat" or "crypto_LUKS" */
+        char *uuid;        /**<Filesystem UUID */
+        char *part_uuid;   /**<Partition UUID */
+        dev_t disk_devno;  /**<Whole disk containing the device */
+} CbmDeviceInfo;
+
+/**
+ * A whole disk and its partition table
+ */
+typedef struct CbmDiskInfo {
+        dev_t devno;          /**<Device number of the disk */
+        char *devname;        /**<Resolved path to the disk's device node */
+        bool probed;          /**<Whether the partition table could be read */
+        CbmPartTable table;   /**<Partitions of the disk */
+} CbmDiskInfo;
+
+/**
+ * Return the probed information for @devnode, probing it on first use.
+ *
+ * @return the cached info, owned by the snapshot, or NULL if the device
+ * could not be probed
+ */
+const CbmDeviceInfo *cbm_topology_get_device(const char *devnode);
+
+/**
+ * Determine the whole disk backing the filesystem @path lives on
+ *
+ * @return true if @diskdevno was set
+ */
+bool cbm_topology_get_disk_devno(const char *path, dev_t *diskdevno);
+
+/**
+ * Return the whole disk backing the filesystem @path lives on, along with
+ * its partition table, probing it on first use.
+ *
+ * @return the cached info, owned by the snapshot, or NULL if the disk could
+ * not be found or probed
+ */
+const CbmDiskInfo *cbm_topology_get_disk(const char *path);
+
+/**
+ * Return the partition the filesystem @path lives on, along with its disk
+ * in @disk if it is non-NULL
+ *
+ * @return the cached partition, owned by the snapshot, or NULL if it is
+ * not part of a known partition table
+ */
+const CbmPartition *cbm_topology_get_partition(const char *path, const CbmDiskInfo **disk);
+
+/**
+ * Drop the snapshot, so the next query probes afresh
+ */
+void cbm_topology_reset(void);
+
+/*
+ * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
+ *
+ * Local variables:
+ * c-basic-offset: 8
+ * tab-width: 8
+ * indent-tabs-mode: nil
+ * End:
+ *
+ * vi: set shiftwidth=8 tabstop=8 expandtab:
+ * :indentSize=8:tabSize=8:noTabs=true:
+ */
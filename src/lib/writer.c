@@ -14,25 +14,46 @@
 #include "writer.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "esp-index.h"
 
 bool cbm_writer_open(CbmWriter *writer)
+{
+        return cbm_writer_open_sized(writer, CBM_WRITER_DEFAULT_SIZE);
+}
+
+bool cbm_writer_open_sized(CbmWriter *writer, size_t size_hint)
 {
         if (!writer) {
                 return false;
         }
 
-        if (writer->buffer || writer->memstream) {
+        if (writer->buffer || writer->open) {
                 return false;
         }
 
-        writer->memstream = open_memstream(&writer->buffer, &writer->buffer_n);
-        if (!writer->memstream) {
+        if (size_hint < 1) {
+                size_hint = 1;
+        }
+
+        writer->buffer = malloc(size_hint);
+        if (!writer->buffer) {
                 writer->error = ENOMEM;
                 return false;
         }
+        writer->buffer[0] = '\0';
+        writer->buffer_n = 0;
+        writer->capacity = size_hint;
+        writer->open = true;
 
         return true;
 }
@@ -44,6 +65,7 @@ void cbm_writer_free(CbmWriter *self)
         }
         cbm_writer_close(self);
         free(self->buffer);
+        self->buffer = NULL;
 }
 
 void cbm_writer_close(CbmWriter *self)
@@ -51,49 +73,140 @@ void cbm_writer_close(CbmWriter *self)
         if (!self) {
                 return;
         }
-        if (!self->memstream) {
-                return;
+        self->open = false;
+}
+
+/**
+ * Ensure there is room for @len more bytes plus the terminator, setting
+ * the error state when that isn't possible.
+ */
+static bool cbm_writer_reserve(CbmWriter *self, size_t len)
+{
+        size_t need;
+        size_t capacity;
+        char *buffer = NULL;
+
+        if (self->error != 0) {
+                return false;
+        }
+
+        /* Set EBADF as we tried to use a closed writer */
+        if (!self->open) {
+                self->error = EBADF;
+                return false;
+        }
+
+        if (len > SIZE_MAX - self->buffer_n - 1) {
+                self->error = EOVERFLOW;
+                return false;
+        }
+        need = self->buffer_n + len + 1;
+        if (need <= self->capacity) {
+                return true;
+        }
+
+        capacity = self->capacity;
+        while (capacity < need) {
+                capacity = capacity > SIZE_MAX / 2 ? need : capacity * 2;
+        }
+
+        buffer = realloc(self->buffer, capacity);
+        if (!buffer) {
+                self->error = ENOMEM;
+                return false;
         }
-        fclose(self->memstream);
-        self->memstream = NULL;
+        self->buffer = buffer;
+        self->capacity = capacity;
+        return true;
 }
 
-void cbm_writer_append(CbmWriter *self, const char *s)
+void cbm_writer_append_len(CbmWriter *self, const char *s, size_t len)
 {
-        if (!self || self->error != 0) {
+        if (!self || !s) {
                 return;
         }
 
-        /* Set EBADF as we tried to use a closed memstream */
-        if (!self->memstream) {
-                self->error = EBADF;
+        if (!cbm_writer_reserve(self, len)) {
+                return;
+        }
+
+        memcpy(self->buffer + self->buffer_n, s, len);
+        self->buffer_n += len;
+        self->buffer[self->buffer_n] = '\0';
+}
+
+void cbm_writer_append(CbmWriter *self, const char *s)
+{
+        if (!s) {
                 return;
         }
+        cbm_writer_append_len(self, s, strlen(s));
+}
+
+void cbm_writer_append_int(CbmWriter *self, int64_t value)
+{
+        /* Large enough for INT64_MIN */
+        char digits[21];
+        char *p = digits + sizeof(digits);
+        uint64_t v = value < 0 ? -(uint64_t)value : (uint64_t)value;
 
-        if (fprintf(self->memstream, "%s", s) < 0) {
-                self->error = errno;
+        do {
+                *--p = (char)('0' + (v % 10));
+                v /= 10;
+        } while (v != 0);
+
+        if (value < 0) {
+                *--p = '-';
         }
+
+        cbm_writer_append_len(self, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+void cbm_writer_append_path(CbmWriter *self, const char *dir, const char *name)
+{
+        cbm_writer_append(self, dir);
+        cbm_writer_append_len(self, "/", 1);
+        cbm_writer_append(self, name);
 }
 
 void cbm_writer_append_printf(CbmWriter *self, const char *fmt, ...)
 {
-        if (!self || self->error != 0) {
+        va_list va;
+        va_list va2;
+        int len;
+
+        if (!self) {
                 return;
         }
 
-        /* Set EBADF as we tried to use a closed memstream */
-        if (!self->memstream) {
-                self->error = EBADF;
+        /* Format straight into the spare capacity, and only grow when
+         * it turns out to be too small. */
+        if (!cbm_writer_reserve(self, 0)) {
                 return;
         }
 
-        va_list va;
-
         va_start(va, fmt);
-        if (vfprintf(self->memstream, fmt, va) < 0) {
-                self->error = errno;
-        }
+        va_copy(va2, va);
+        len = vsnprintf(self->buffer + self->buffer_n, self->capacity - self->buffer_n, fmt, va);
         va_end(va);
+
+        if (len < 0) {
+                self->error = errno ? errno : EINVAL;
+                goto end;
+        }
+
+        if ((size_t)len >= self->capacity - self->buffer_n) {
+                if (!cbm_writer_reserve(self, (size_t)len)) {
+                        /* Drop the truncated output */
+                        self->buffer[self->buffer_n] = '\0';
+                        goto end;
+                }
+                vsnprintf(self->buffer + self->buffer_n, self->capacity - self->buffer_n, fmt, va2);
+        }
+        self->buffer_n += (size_t)len;
+
+end:
+        va_end(va2);
 }
 
 int cbm_writer_error(CbmWriter *self)
@@ -105,6 +218,83 @@ int cbm_writer_error(CbmWriter *self)
         return ENOMEM;
 }
 
+bool cbm_writer_matches_file(CbmWriter *self, const char *path)
+{
+        struct stat st = { 0 };
+        void *mapped = NULL;
+        bool ret = false;
+        int fd = -1;
+
+        if (!self || !self->buffer || self->error != 0 || !path) {
+                return false;
+        }
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return false;
+        }
+
+        /* Size mismatch means we never need to look at the contents */
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size != self->buffer_n) {
+                goto end;
+        }
+
+        if (self->buffer_n == 0) {
+                ret = true;
+                goto end;
+        }
+
+        mapped = mmap(NULL, self->buffer_n, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+                goto end;
+        }
+        ret = memcmp(mapped, self->buffer, self->buffer_n) == 0;
+        munmap(mapped, self->buffer_n);
+
+end:
+        close(fd);
+        return ret;
+}
+
+bool cbm_writer_write_file(CbmWriter *self, const char *path)
+{
+        size_t written = 0;
+        bool ret = false;
+        int fd = -1;
+
+        if (!self || !self->buffer || self->error != 0 || !path) {
+                return false;
+        }
+
+        if (unlink(path) < 0 && errno != ENOENT) {
+                return false;
+        }
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00644);
+        if (fd < 0) {
+                return false;
+        }
+
+        while (written < self->buffer_n) {
+                ssize_t r = write(fd, self->buffer + written, self->buffer_n - written);
+                if (r < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        goto end;
+                }
+                written += (size_t)r;
+        }
+        ret = true;
+
+end:
+        if (close(fd) != 0) {
+                ret = false;
+        }
+        cbm_esp_index_update(path);
+        return ret;
+}
+
 /*
  * Editor modelines  -  https://www.wireshark.org/tools/modelines.html
  *
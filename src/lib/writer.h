@@ -11,15 +11,26 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "nica/util.h"
 
 #define _GNU_SOURCE
 
+/**
+ * Initial buffer size used by cbm_writer_open(). Large enough to hold a
+ * typical loader entry without ever growing.
+ */
+#define CBM_WRITER_DEFAULT_SIZE 512
+
 typedef struct CbmWriter {
-        FILE *memstream;
-        char *buffer;
-        size_t buffer_n;
-        int error;
+        char *buffer;    /**< NUL terminated contents */
+        size_t buffer_n; /**< Length of the contents, excluding the terminator */
+        size_t capacity; /**< Allocated size of buffer */
+        bool open;       /**< Whether further appends are permitted */
+        int error;       /**< First error encountered, or 0 */
 } CbmWriter;
 
 #define CBM_WRITER_INIT &(CbmWriter){ 0 };
@@ -29,6 +40,13 @@ typedef struct CbmWriter {
  */
 bool cbm_writer_open(CbmWriter *writer);
 
+/**
+ * Construct a new CbmWriter, preallocating room for @size_hint bytes.
+ * The buffer still grows on demand, the hint only avoids reallocations
+ * when the caller knows roughly how much will be written.
+ */
+bool cbm_writer_open_sized(CbmWriter *writer, size_t size_hint);
+
 /**
  * Clean up a previously allocated CbmWriter
  */
@@ -41,10 +59,25 @@ void cbm_writer_free(CbmWriter *writer);
 void cbm_writer_close(CbmWriter *writer);
 
 /**
- * Append string to the buffer
+ * Append string to the buffer. A NULL string appends nothing.
  */
 void cbm_writer_append(CbmWriter *writer, const char *s);
 
+/**
+ * Append exactly @len bytes of @s to the buffer
+ */
+void cbm_writer_append_len(CbmWriter *writer, const char *s, size_t len);
+
+/**
+ * Append the decimal representation of @value to the buffer
+ */
+void cbm_writer_append_int(CbmWriter *writer, int64_t value);
+
+/**
+ * Append "@dir/@name" to the buffer
+ */
+void cbm_writer_append_path(CbmWriter *writer, const char *dir, const char *name);
+
 /**
  * Append, printf style, to the buffer
  */
@@ -58,6 +91,22 @@ void cbm_writer_append_printf(CbmWriter *writer, const char *fmt, ...)
  */
 int cbm_writer_error(CbmWriter *writer);
 
+/**
+ * Determine whether the file at @path has exactly the contents of the
+ * writer. The file is mapped and compared in place, so no copy is made.
+ *
+ * @return false if the file differs, or cannot be read.
+ */
+bool cbm_writer_matches_file(CbmWriter *writer, const char *path);
+
+/**
+ * Replace the file at @path with the contents of the writer.
+ *
+ * @note No sync is performed, allowing callers to write many files and
+ * then issue a single cbm_sync()
+ */
+bool cbm_writer_write_file(CbmWriter *writer, const char *path);
+
 /* Convenience: Automatically clean up the CbmWriter */
 DEF_AUTOFREE(CbmWriter, cbm_writer_free)
 
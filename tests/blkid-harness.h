@@ -116,6 +116,16 @@ static inline const char *test_blkid_partition_get_uuid(__cbm_unused__ blkid_par
         return NULL;
 }
 
+static inline int test_blkid_partition_get_partno(__cbm_unused__ blkid_partition par)
+{
+        return 1;
+}
+
+static inline const char *test_blkid_partition_get_type_string(__cbm_unused__ blkid_partition par)
+{
+        return NULL;
+}
+
 static inline int test_blkid_devno_to_wholedisk(__cbm_unused__ dev_t dev,
                                                 __cbm_unused__ char *diskname,
                                                 __cbm_unused__ size_t len,
@@ -143,6 +153,13 @@ static inline const char *test_blkid_parttable_get_type(__cbm_unused__ blkid_par
         return "gpt";
 }
 
+static inline bool test_blkid_read_partition_table(__cbm_unused__ const char *devname,
+                                                   __cbm_unused__ CbmPartTable *table)
+{
+        /* Always fall back to the blkid functions above */
+        return false;
+}
+
 /**
  * Default vtable for testing. Copy into a local struct and override specific
  * fields.
@@ -164,6 +181,8 @@ CbmBlkidOps BlkidTestOps = {
         .partlist_get_partition = test_blkid_partlist_get_partition,
         .partition_get_flags = test_blkid_partition_get_flags,
         .partition_get_uuid = test_blkid_partition_get_uuid,
+        .partition_get_partno = test_blkid_partition_get_partno,
+        .partition_get_type_string = test_blkid_partition_get_type_string,
 
         /* Partition table functions */
         .partlist_get_table = test_blkid_partlist_get_table,
@@ -172,6 +191,7 @@ CbmBlkidOps BlkidTestOps = {
         /* Misc */
         .devno_to_wholedisk = test_blkid_devno_to_wholedisk,
         .devno_to_devname = test_blkid_devno_to_devname,
+        .read_partition_table = test_blkid_read_partition_table,
 };
 
 /*
@@ -13,16 +13,29 @@
 #define _GNU_SOURCE
 #include <check.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
 
 #include "bootman.h"
+#include "compress.h"
 #include "config.h"
+#include "digest.h"
+#include "esp-index.h"
 #include "files.h"
+#include "ledger.h"
 #include "log.h"
+#include "manifest.h"
 #include "nica/array.h"
 #include "nica/files.h"
+#include "pe.h"
+#include "sha256.h"
+#include "stats.h"
 #include "util.h"
 #include "writer.h"
 
@@ -350,6 +363,233 @@ START_TEST(bootman_console_mode_test)
 }
 END_TEST
 
+/**
+ * Replace the first "@field=" line of the cached system configuration
+ */
+static bool sysconfig_cache_set(const char *path, const char *field, const char *value)
+{
+        autofree(char) *text = NULL;
+        autofree(char) *prefix = NULL;
+        autofree(char) *next = NULL;
+        char *start = NULL;
+        char *end = NULL;
+
+        if (!file_get_text(path, &text)) {
+                return false;
+        }
+        prefix = string_printf("\n%s=", field);
+        start = strstr(text, prefix);
+        if (!start || !(end = strchr(start + 1, '\n'))) {
+                return false;
+        }
+        *start = '\0';
+        next = string_printf("%s%s%s%s", text, prefix, value, end);
+        return file_set_text(path, next);
+}
+
+START_TEST(bootman_sysconfig_cache_test)
+{
+        const char *root = TOP_BUILD_DIR "/tests/update_playground";
+        const char *cache_path = TOP_BUILD_DIR "/tests/update_playground" CACHE_DIRECTORY
+                                              "/sysconfig";
+        autofree(BootManager) *m = NULL;
+        autofree(char) *text = NULL;
+        autofree(char) *expected = NULL;
+        SystemConfig *config = NULL;
+
+        /* Mocked vtables otherwise turn the cache off */
+        setenv("CBM_TEST_SYSCONFIG_CACHE", "1", 1);
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare update playground");
+        (void)unlink(cache_path);
+
+        /* Read-only inspections must leave the root alone */
+        config = cbm_inspect_root(root, false, false);
+        fail_if(!config || !config->root_device, "Failed to inspect root");
+        cbm_free_sysconfig(config);
+        fail_if(nc_file_exists(cache_path), "Read-only inspection wrote the cache");
+
+        config = cbm_inspect_root(root, false, true);
+        fail_if(!config || !config->root_device, "Failed to inspect root");
+        fail_if(!config->boot_device, "No boot device found");
+        cbm_free_sysconfig(config);
+        fail_if(!file_get_text(cache_path, &text), "System configuration was not cached");
+        expected = string_printf("\nuuid=%s\n", DEFAULT_UUID);
+        fail_if(!strstr(text, expected), "Unexpected cache: %s", text);
+        fail_if(!strstr(text, "\nboot_identity="), "Boot device identity not cached");
+
+        /* A matching entry is used as is */
+        fail_if(!sysconfig_cache_set(cache_path, "uuid", "cached-uuid"), "Failed to edit cache");
+        config = cbm_inspect_root(root, false, true);
+        fail_if(!config || !config->root_device, "Failed to load cached root");
+        fail_if(!config->root_device->uuid || !streq(config->root_device->uuid, "cached-uuid"),
+                "Cached system configuration was not used");
+        fail_if(!config->boot_device, "Cached boot device was lost");
+        cbm_free_sysconfig(config);
+
+        /* Any doubt about the boot device means inspecting afresh */
+        fail_if(!sysconfig_cache_set(cache_path, "boot_identity", "other-disk"),
+                "Failed to edit cache");
+        config = cbm_inspect_root(root, false, true);
+        fail_if(!config || !config->root_device, "Failed to inspect root");
+        fail_if(!streq(config->root_device->uuid, DEFAULT_UUID), "Stale cache was used");
+        cbm_free_sysconfig(config);
+
+        fail_if(!sysconfig_cache_set(cache_path, "uuid", "cached-uuid"), "Failed to edit cache");
+        fail_if(!sysconfig_cache_set(cache_path, "wanted_boot_mask", "garbage"),
+                "Failed to edit cache");
+        config = cbm_inspect_root(root, false, true);
+        fail_if(!config || !streq(config->root_device->uuid, DEFAULT_UUID),
+                "Malformed cache was used");
+        cbm_free_sysconfig(config);
+
+        /* Empty and truncated entries are ignored, then replaced */
+        fail_if(!file_set_text((char *)cache_path, ""), "Failed to empty cache");
+        config = cbm_inspect_root(root, false, true);
+        fail_if(!config || !config->root_device, "Failed to inspect with an empty cache");
+        cbm_free_sysconfig(config);
+
+        free(text);
+        fail_if(!file_get_text(cache_path, &text), "System configuration was not cached");
+        text[strlen(text) / 2] = '\0';
+        fail_if(!file_set_text((char *)cache_path, text), "Failed to truncate cache");
+        config = cbm_inspect_root(root, false, true);
+        fail_if(!config || !config->root_device, "Failed to inspect with a truncated cache");
+        fail_if(!streq(config->root_device->uuid, DEFAULT_UUID), "Truncated cache was used");
+        cbm_free_sysconfig(config);
+        fail_if(nc_file_exists(TOP_BUILD_DIR "/tests/update_playground" CACHE_DIRECTORY
+                                             "/sysconfig.TmpWrite"),
+                "Temporary cache file left behind");
+}
+END_TEST
+
+/**
+ * A long-lived inspection must notice its devices changing underneath it
+ */
+START_TEST(bootman_sysconfig_current_test)
+{
+        const char *root = TOP_BUILD_DIR "/tests/update_playground";
+        autofree(BootManager) *m = NULL;
+        SystemConfig *config = NULL;
+
+        m = prepare_playground(&core_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        config = cbm_inspect_root(root, false, false);
+        fail_if(!config || !config->boot_device, "Failed to inspect root");
+        fail_if(!cbm_is_sysconfig_current(config, false), "Fresh inspection is not current");
+        fail_if(cbm_is_sysconfig_current(config, true), "Inspection holds for image mode");
+
+        fail_if(unlink(config->boot_device) != 0, "Failed to remove the boot device");
+        fail_if(cbm_is_sysconfig_current(config, false), "Missing boot device went unnoticed");
+        cbm_free_sysconfig(config);
+}
+END_TEST
+
+/**
+ * Changes are told apart by the directory and file they happen to
+ */
+START_TEST(bootman_watch_stale_test)
+{
+        const BootManagerWatch *watches = NULL;
+        const BootManagerWatch *kernels = NULL;
+        const BootManagerWatch *conf = NULL;
+        const BootManagerWatch *cmdline = NULL;
+        const BootManagerWatch *vendor = NULL;
+        size_t n_watches = 0;
+
+        watches = boot_manager_get_watches(&n_watches);
+        for (size_t i = 0; i < n_watches; i++) {
+                if (streq(watches[i].path, KERNEL_DIRECTORY)) {
+                        kernels = &watches[i];
+                } else if (streq(watches[i].path, KERNEL_CONF_DIRECTORY)) {
+                        conf = &watches[i];
+                } else if (streq(watches[i].path, KERNEL_CONF_DIRECTORY "/cmdline.d")) {
+                        cmdline = &watches[i];
+                } else if (streq(watches[i].path, VENDOR_KERNEL_CONF_DIRECTORY)) {
+                        vendor = &watches[i];
+                }
+        }
+        fail_if(!kernels || !conf || !cmdline || !vendor, "Directories are not watched");
+
+        fail_if(boot_manager_watch_stale(kernels, "org.clearlinux.native.4.2.1-137", false) !=
+                    BOOT_MANAGER_STALE_KERNELS,
+                "Kernel change not recognised");
+        fail_if(boot_manager_watch_stale(kernels, NULL, false) != BOOT_MANAGER_STALE_KERNELS,
+                "Kernel directory change not recognised");
+        fail_if(boot_manager_watch_stale(cmdline, "10-quiet.conf", false) !=
+                    BOOT_MANAGER_STALE_CMDLINE,
+                "cmdline.d change not recognised");
+
+        /* The configuration directory holds all sorts */
+        fail_if(boot_manager_watch_stale(conf, "cmdline", false) != BOOT_MANAGER_STALE_CMDLINE,
+                "cmdline change not recognised");
+        fail_if(boot_manager_watch_stale(conf, "initrd-native", false) !=
+                    BOOT_MANAGER_STALE_KERNELS,
+                "Kernel initrd setting not recognised");
+        fail_if(boot_manager_watch_stale(conf, "timeout", false) != BOOT_MANAGER_STALE_CONFIG,
+                "Other settings must forget everything");
+        fail_if(boot_manager_watch_stale(conf, NULL, false) != BOOT_MANAGER_STALE_CONFIG,
+                "Configuration directory change must forget everything");
+
+        /* Watched directories coming and going */
+        fail_if(boot_manager_watch_stale(conf, "cmdline.d", true) !=
+                    (BOOT_MANAGER_STALE_INITRDS | BOOT_MANAGER_STALE_CMDLINE),
+                "New cmdline.d not recognised");
+        fail_if(boot_manager_watch_stale(vendor, "cmdline.d", true) !=
+                    (BOOT_MANAGER_STALE_INITRDS | BOOT_MANAGER_STALE_CMDLINE),
+                "New vendor cmdline.d not recognised");
+        fail_if(boot_manager_watch_stale(vendor, "README", false) != 0,
+                "Unrelated vendor file makes things stale");
+}
+END_TEST
+
+/**
+ * Updates wait for things to settle, but not for ever, and not at all when
+ * asked for
+ */
+START_TEST(bootman_watch_timeout_test)
+{
+        BootManagerChanges changes = { 0 };
+        const int64_t start = 1000;
+        const int64_t settled = start + BOOT_MANAGER_WATCH_DEBOUNCE_MS;
+        int64_t last;
+
+        fail_if(boot_manager_changes_timeout(&changes, start) != -1, "Update due without changes");
+
+        boot_manager_changes_mark(&changes, BOOT_MANAGER_STALE_KERNELS, start);
+        fail_if(boot_manager_changes_timeout(&changes, start) != BOOT_MANAGER_WATCH_DEBOUNCE_MS,
+                "Update does not wait for things to settle");
+        fail_if(boot_manager_changes_timeout(&changes, settled - 1) != 1, "Wrong time left");
+        fail_if(boot_manager_changes_timeout(&changes, settled) != 0, "Settled update is not due");
+        fail_if(boot_manager_changes_timeout(&changes, settled * 1000) != 0,
+                "Overdue update is not due");
+
+        /* Each change holds the update back, but only for so long */
+        last = start + BOOT_MANAGER_WATCH_DEBOUNCE_MS / 2;
+        boot_manager_changes_mark(&changes, BOOT_MANAGER_STALE_INITRDS, last);
+        fail_if(boot_manager_changes_timeout(&changes, last) != BOOT_MANAGER_WATCH_DEBOUNCE_MS,
+                "Change did not hold the update back");
+        last = start + BOOT_MANAGER_WATCH_MAX_DELAY_MS - 1;
+        boot_manager_changes_mark(&changes, BOOT_MANAGER_STALE_INITRDS, last);
+        fail_if(boot_manager_changes_timeout(&changes, last) != 1,
+                "Changes held the update back for too long");
+
+        fail_if(boot_manager_changes_take(&changes) !=
+                    (BOOT_MANAGER_STALE_KERNELS | BOOT_MANAGER_STALE_INITRDS),
+                "Changes were lost");
+        fail_if(boot_manager_changes_timeout(&changes, last) != -1, "Update still due once taken");
+
+        /* Asking for an update doesn't wait for anything */
+        boot_manager_changes_mark(&changes, BOOT_MANAGER_STALE_CMDLINE, start);
+        boot_manager_changes_request(&changes, start);
+        fail_if(boot_manager_changes_timeout(&changes, start) != 0, "Requested update has to wait");
+        fail_if(boot_manager_changes_take(&changes) != BOOT_MANAGER_STALE_CMDLINE,
+                "Changes were lost");
+        fail_if(changes.pending || changes.requested, "Request outlived its update");
+}
+END_TEST
+
 START_TEST(bootman_writer_simple_test)
 {
         autofree(CbmWriter) *writer = CBM_WRITER_INIT;
@@ -412,6 +652,798 @@ START_TEST(bootman_writer_mut_test)
 }
 END_TEST
 
+START_TEST(bootman_writer_typed_test)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+
+        /* Deliberately tiny so that appends must grow the buffer */
+        fail_if(!cbm_writer_open_sized(writer, 2), "Failed to create writer");
+
+        cbm_writer_append(writer, "linux ");
+        cbm_writer_append_path(writer, "/EFI/org.clearlinux", "kernel");
+        cbm_writer_append_len(writer, " -12345", 2);
+        cbm_writer_append_int(writer, 0);
+        cbm_writer_append_len(writer, " ", 1);
+        cbm_writer_append_int(writer, -42);
+        cbm_writer_append_printf(writer, " %s=%d", "release", 138);
+        cbm_writer_append(writer, NULL);
+        fail_if(cbm_writer_error(writer) != 0, "Error should be 0");
+
+        cbm_writer_close(writer);
+        fail_if(!streq(writer->buffer, "linux /EFI/org.clearlinux/kernel -0 -42 release=138"),
+                "Returned data is incorrect: %s",
+                writer->buffer);
+        fail_if(writer->buffer_n != strlen(writer->buffer), "Length does not match contents");
+        fail_if(writer->capacity <= writer->buffer_n, "Buffer is not terminated");
+}
+END_TEST
+
+START_TEST(bootman_writer_matches_file_test)
+{
+        autofree(CbmWriter) *writer = CBM_WRITER_INIT;
+        const char *path = TOP_BUILD_DIR "/tests/writer_matches_file";
+
+        fail_if(!cbm_writer_open(writer), "Failed to create writer");
+        cbm_writer_append(writer, "title Clear Linux\n");
+        cbm_writer_close(writer);
+
+        unlink(path);
+        fail_if(cbm_writer_matches_file(writer, path), "Matched missing file");
+
+        fail_if(!file_set_text(path, "title Clear Linux\n"), "Failed to write file");
+        fail_if(!cbm_writer_matches_file(writer, path), "Failed to match identical file");
+
+        fail_if(!file_set_text(path, "title Clear Linux!\n"), "Failed to write file");
+        fail_if(cbm_writer_matches_file(writer, path), "Matched file of different length");
+
+        fail_if(!file_set_text(path, "title Clear Linuz\n"), "Failed to write file");
+        fail_if(cbm_writer_matches_file(writer, path), "Matched file of different content");
+
+        unlink(path);
+}
+END_TEST
+
+START_TEST(bootman_concat_test)
+{
+        const char *part1 = TOP_BUILD_DIR "/tests/concat-part1";
+        const char *part2 = TOP_BUILD_DIR "/tests/concat-part2";
+        const char *empty = TOP_BUILD_DIR "/tests/concat-empty";
+        const char *target = TOP_BUILD_DIR "/tests/concat-target";
+        const char *sources[] = { part1, empty, part2, NULL };
+        const char *reversed[] = { part2, empty, part1, NULL };
+        const char *missing[] = { part1, "PATHTHATWONT@EXIST!", NULL };
+        autofree(char) *contents = NULL;
+        autofree(CbmDir) *dir = NULL;
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        uint8_t expected[CBM_SHA256_DIGEST_SIZE];
+        CbmSha256 hash;
+
+        fail_if(!file_set_text(part1, "first-"), "Failed to write part1");
+        fail_if(!file_set_text(part2, "second"), "Failed to write part2");
+        fail_if(!file_set_text(empty, ""), "Failed to write empty part");
+        unlink(target);
+
+        fail_if(cbm_files_concat_match(sources, target), "Matched a missing target");
+
+        fail_if(!copy_files_atomic(sources, target, 00644), "Failed to concatenate files");
+        fail_if(!file_get_text(target, &contents), "Failed to read target");
+        fail_if(!streq(contents, "first-second"), "Incorrect concatenation: %s", contents);
+
+        fail_if(!cbm_files_concat_match(sources, target), "Failed to match concatenation");
+        fail_if(cbm_files_concat_match(reversed, target), "Matched members in the wrong order");
+        fail_if(cbm_files_concat_match(missing, target), "Matched with a missing member");
+
+        fail_if(copy_files_atomic(missing, target, 00644), "Concatenated a missing member");
+        fail_if(!cbm_files_concat_match(sources, target), "Failed copy replaced the target");
+
+        /* Aligned members are zero padded, and only match as such */
+        dir = cbm_dir_open(NULL, TOP_BUILD_DIR "/tests", false);
+        fail_if(!dir, "Failed to open the test directory");
+        fail_if(!copy_files_atomic_at_digest(dir, "concat-target", sources, 4, 00644, digest),
+                "Failed to concatenate aligned files");
+        fail_if(!cbm_sha256_file(target, expected), "Failed to hash the target");
+        fail_if(memcmp(digest, expected, sizeof(digest)) != 0, "Incorrect aligned digest");
+        fail_if(!cbm_files_concat_match_digest(sources, target, 4, digest),
+                "Failed to match aligned concatenation");
+        fail_if(cbm_files_concat_match(sources, target), "Matched padding as contents");
+        cbm_sha256_init(&hash);
+        cbm_sha256_update(&hash, "first-\0\0second", 14);
+        cbm_sha256_final(&hash, digest);
+        fail_if(memcmp(digest, expected, sizeof(digest)) != 0, "Incorrect padding");
+
+        unlink(part1);
+        unlink(part2);
+        unlink(empty);
+        unlink(target);
+}
+END_TEST
+
+/**
+ * Write @len bytes of a repeating pattern starting with @c to @path
+ */
+static bool write_pattern(const char *path, size_t len, char c)
+{
+        autofree(char) *text = calloc(len + 1, 1);
+
+        if (!text) {
+                return false;
+        }
+        for (size_t i = 0; i < len; i++) {
+                text[i] = (char)(c + (char)(i % 26));
+        }
+        return file_set_text(path, text);
+}
+
+START_TEST(bootman_direct_io_test)
+{
+        /* Large enough that padding fills the first 8MiB copy chunk exactly */
+        const size_t big = 8 * 1024 * 1024 - 100;
+        const char *part1 = TOP_BUILD_DIR "/tests/direct-part1";
+        const char *part2 = TOP_BUILD_DIR "/tests/direct-part2";
+        const char *part3 = TOP_BUILD_DIR "/tests/direct-part3";
+        const char *target = TOP_BUILD_DIR "/tests/direct-target";
+        const char *cached = TOP_BUILD_DIR "/tests/direct-cached";
+        const char *sources[] = { part1, part2, part3, NULL };
+        autofree(CbmDir) *dir = NULL;
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        uint8_t expected[CBM_SHA256_DIGEST_SIZE];
+        uint64_t direct, buffered;
+        struct stat st = { 0 };
+        char range[64] = { 0 };
+        int in_fd, out_fd;
+
+        fail_if(!write_pattern(part1, big, 'a'), "Failed to write part1");
+        fail_if(!write_pattern(part2, 5000, 'A'), "Failed to write part2");
+        fail_if(!write_pattern(part3, 9000, 'a'), "Failed to write part3");
+        dir = cbm_dir_open(NULL, TOP_BUILD_DIR "/tests", false);
+        fail_if(!dir, "Failed to open the test directory");
+
+        /* Buffered copy to compare against */
+        cbm_set_direct_io(false);
+        fail_if(!copy_files_atomic_at_digest(dir, "direct-cached", sources, 4096, 00644, expected),
+                "Failed to copy through the page cache");
+
+        cbm_set_direct_io(true);
+        cbm_stats_reset();
+        fail_if(!copy_files_atomic_at_digest(dir, "direct-target", sources, 4096, 00644, digest),
+                "Failed to copy with O_DIRECT");
+        fail_if(memcmp(digest, expected, sizeof(digest)) != 0, "Incorrect O_DIRECT digest");
+        fail_if(!cbm_files_match(cached, target), "O_DIRECT copy differs");
+        fail_if(stat(target, &st) != 0, "Failed to stat the target");
+        fail_if(st.st_size != 8 * 1024 * 1024 + 8192 + 9000, "Incorrect padded size");
+
+        /* Everything but the final partial block bypasses the cache, if allowed */
+        direct = cbm_stats_get(CBM_STAT_BYTES_DIRECT);
+        buffered = cbm_stats_get(CBM_STAT_BYTES_CACHED);
+        fail_if(direct + buffered != (uint64_t)st.st_size, "Copied bytes not accounted for");
+        fail_if(direct % 4096 != 0, "Wrote a partial block with O_DIRECT");
+        fail_if(direct > 0 && buffered != 9000 % 4096, "Buffered more than the final block");
+
+        /* Ranges start buffered up to the first block boundary */
+        out_fd = open(target, O_RDWR);
+        fail_if(out_fd < 0, "Failed to open the target");
+        in_fd = open(part3, O_RDONLY);
+        fail_if(in_fd < 0, "Failed to open part3");
+        cbm_stats_reset();
+        fail_if(!cbm_copy_range(in_fd, 100, 8800, out_fd, 700), "Failed to copy a range");
+        direct = cbm_stats_get(CBM_STAT_BYTES_DIRECT);
+        buffered = cbm_stats_get(CBM_STAT_BYTES_CACHED);
+        fail_if(direct + buffered != 8800, "Copied range not accounted for");
+        fail_if(direct > 0 && (direct != 4096 || buffered != 8800 - 4096),
+                "Incorrect split of an unaligned range");
+        fail_if(pread(out_fd, range, 26, 700) != 26, "Failed to read the range back");
+        fail_if(!streq(range, "wxyzabcdefghijklmnopqrstuv"), "Incorrect range: %s", range);
+        fail_if(pread(out_fd, range, 26, 700 + 8800 - 26) != 26, "Failed to read the range end");
+        fail_if(!streq(range, "ijklmnopqrstuvwxyzabcdefgh"), "Incorrect range end: %s", range);
+        close(in_fd);
+        close(out_fd);
+        cbm_set_direct_io(false);
+
+        /* Files of different sizes are never read to compare them */
+        cbm_stats_reset();
+        fail_if(cbm_files_match(part2, part3), "Matched files of different sizes");
+        fail_if(cbm_stats_get(CBM_STAT_BYTES_COMPARED) != 0, "Read files of different sizes");
+        fail_if(!cbm_files_match(part2, part2), "Failed to match a file with itself");
+        fail_if(cbm_stats_get(CBM_STAT_BYTES_COMPARED) != 2 * 5000, "Incorrect bytes compared");
+
+        unlink(part1);
+        unlink(part2);
+        unlink(part3);
+        unlink(target);
+        unlink(cached);
+}
+END_TEST
+
+START_TEST(bootman_manifest_test)
+{
+        const char *part1 = TOP_BUILD_DIR "/tests/manifest-part1";
+        const char *part2 = TOP_BUILD_DIR "/tests/manifest-part2";
+        const char *target = TOP_BUILD_DIR "/tests/manifest-target";
+        const char *sources[] = { part1, part2, NULL };
+        uint8_t copied[CBM_SHA256_DIGEST_SIZE];
+        uint8_t matched[CBM_SHA256_DIGEST_SIZE];
+        uint8_t expected[CBM_SHA256_DIGEST_SIZE];
+        autofree(CbmDir) *dir = NULL;
+        autofree(CbmManifest) *manifest = NULL;
+        autofree(char) *source = NULL;
+        const CbmManifestEntry *entry = NULL;
+        char hex[CBM_SHA256_HEX_SIZE];
+
+        fail_if(!file_set_text(part1, "first-"), "Failed to write part1");
+        fail_if(!file_set_text(part2, "second"), "Failed to write part2");
+        unlink(target);
+
+        dir = cbm_dir_open(NULL, TOP_BUILD_DIR "/tests", false);
+        fail_if(!dir, "Failed to open the test directory");
+        (void)cbm_dir_unlink(dir, CBM_MANIFEST_NAME);
+
+        /* The digest taken while copying is that of the written file */
+        fail_if(!copy_files_atomic_at_digest(dir, "manifest-target", sources, 0, 00644, copied),
+                "Failed to copy with a digest");
+        fail_if(!cbm_sha256_file(target, expected), "Failed to hash the target");
+        fail_if(memcmp(copied, expected, sizeof(expected)) != 0, "Incorrect copy digest");
+
+        fail_if(!cbm_files_concat_match_digest(sources, target, 0, matched), "Failed to match");
+        fail_if(memcmp(matched, expected, sizeof(expected)) != 0, "Incorrect match digest");
+
+        source = cbm_manifest_source_key(sources);
+        fail_if(!source, "Failed to build the source key");
+
+        manifest = cbm_manifest_load(dir);
+        fail_if(cbm_manifest_lookup(manifest, dir, "manifest-target", source),
+                "Found an entry in an empty manifest");
+        cbm_manifest_record(manifest, dir, "manifest-target", source, copied);
+        cbm_manifest_record(manifest, dir, "manifest-missing", source, copied);
+        fail_if(!cbm_manifest_save(manifest, dir), "Failed to save the manifest");
+        cbm_manifest_free(manifest);
+
+        manifest = cbm_manifest_load(dir);
+        entry = cbm_manifest_lookup(manifest, dir, "manifest-target", source);
+        fail_if(!entry, "Failed to find the recorded entry");
+        cbm_sha256_to_hex(expected, hex);
+        fail_if(!streq(entry->digest, hex), "Incorrect recorded digest: %s", entry->digest);
+        fail_if(cbm_manifest_lookup(manifest, dir, "manifest-missing", source),
+                "Kept an entry for a missing file");
+        fail_if(cbm_manifest_lookup(manifest, dir, "manifest-target", "stale"),
+                "Matched an entry for different sources");
+
+        /* Changing the copy behind our back invalidates its entry */
+        fail_if(!file_set_text(target, "first-SECOND-changed"), "Failed to rewrite the target");
+        fail_if(cbm_manifest_lookup(manifest, dir, "manifest-target", source),
+                "Matched an entry for a modified copy");
+
+        (void)cbm_dir_unlink(dir, CBM_MANIFEST_NAME);
+        unlink(part1);
+        unlink(part2);
+        unlink(target);
+}
+END_TEST
+
+START_TEST(bootman_manifest_named_test)
+{
+        const char *subdir = TOP_BUILD_DIR "/tests/manifest-sub";
+        const char *file = TOP_BUILD_DIR "/tests/manifest-sub/file";
+        const char *name = ".manifest-named";
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        autofree(CbmDir) *dir = NULL;
+        autofree(CbmManifest) *manifest = NULL;
+
+        fail_if(!nc_mkdir_p(subdir, 00755), "Failed to create the subdirectory");
+        fail_if(!file_set_text(file, "nested"), "Failed to write the nested file");
+        fail_if(!cbm_sha256_file(file, digest), "Failed to hash the nested file");
+
+        dir = cbm_dir_open(NULL, TOP_BUILD_DIR "/tests", false);
+        fail_if(!dir, "Failed to open the test directory");
+        (void)cbm_dir_unlink(dir, name);
+
+        /* Entries may describe files beneath the directory, too */
+        manifest = cbm_manifest_load_named(dir, name);
+        cbm_manifest_record(manifest, dir, "manifest-sub/file", "source", digest);
+        fail_if(!cbm_manifest_save(manifest, dir), "Failed to save the named manifest");
+        cbm_manifest_free(manifest);
+
+        fail_if(!cbm_dir_stat(dir, name, &(struct stat){ 0 }), "Named manifest not written");
+        manifest = cbm_manifest_load(dir);
+        fail_if(cbm_manifest_lookup(manifest, dir, "manifest-sub/file", NULL),
+                "Named manifest was read as the default one");
+        cbm_manifest_free(manifest);
+
+        manifest = cbm_manifest_load_named(dir, name);
+        fail_if(!cbm_manifest_lookup(manifest, dir, "manifest-sub/file", "source"),
+                "Failed to find the nested entry");
+
+        (void)cbm_dir_unlink(dir, name);
+        unlink(file);
+        rmdir(subdir);
+}
+END_TEST
+
+START_TEST(bootman_esp_index_test)
+{
+        const char *root = TOP_BUILD_DIR "/tests/esp-index";
+        const char *moved = TOP_BUILD_DIR "/tests/esp-index-moved";
+        const char *blob = TOP_BUILD_DIR "/tests/esp-index/EFI/Boot/BOOTX64.EFI";
+        const char *stray = TOP_BUILD_DIR "/tests/esp-index/EFI/Boot/stray";
+        const char *uki_dir = TOP_BUILD_DIR "/tests/esp-index/EFI/Linux";
+        const char *uki = TOP_BUILD_DIR "/tests/esp-index/EFI/Linux/uki.efi";
+        autofree(CbmDir) *dir = NULL;
+        autofree(char) *path = NULL;
+        const CbmEspEntry *entry = NULL;
+
+        (void)nc_rm_rf(root);
+        (void)nc_rm_rf(moved);
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR "/tests/esp-index/EFI/Boot", 00755),
+                "Failed to create the ESP");
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR "/tests/esp-index/loader", 00755),
+                "Failed to create the loader directory");
+        fail_if(!file_set_text(blob, "blob"), "Failed to write the bootloader");
+
+        fail_if(!cbm_esp_index_load(root), "Failed to index the ESP");
+
+        /* Lookups ignore case, and answer with the on-disk spelling */
+        fail_if(!cbm_esp_exists(TOP_BUILD_DIR "/tests/esp-index/efi/boot/bootx64.efi"),
+                "Missed a differently cased file");
+        fail_if(cbm_esp_exists(TOP_BUILD_DIR "/tests/esp-index/EFI/Boot/missing"),
+                "Found a missing file");
+        path = cbm_esp_build_path(root, "efi", "BOOT", "bootx64.efi", NULL);
+        fail_if(!streq(path, blob), "Incorrect case correction: %s", path);
+        free(path);
+        path = cbm_esp_build_path(root, "efi", "Linux", NULL);
+        fail_if(!streq(path, uki_dir), "Incorrect path for a missing directory: %s", path);
+
+        /* Listed directories answer for absence, until told otherwise */
+        fail_if(!file_set_text(stray, "stray"), "Failed to write behind the index");
+        cbm_esp_index_reset();
+        fail_if(!cbm_esp_index_load(root), "Failed to index the ESP");
+        fail_if(!cbm_esp_exists(stray), "Missed a file after reloading");
+        fail_if(unlink(stray) != 0, "Failed to remove the stray file");
+        fail_if(!cbm_esp_exists(stray), "Index was not answering for the removed file");
+        cbm_esp_index_update(stray);
+        fail_if(cbm_esp_exists(stray), "Update missed a removed file");
+
+        /* The file helpers keep the index in step */
+        fail_if(!cbm_mkdir_p(uki_dir, 00755), "Failed to create the UKI directory");
+        entry = cbm_esp_index_lookup(TOP_BUILD_DIR "/tests/esp-index/efi/linux");
+        fail_if(!entry || !entry->dir, "New directory missing from the index");
+        fail_if(!file_set_text(uki, "image"), "Failed to write the UKI");
+        entry = cbm_esp_index_lookup(uki);
+        fail_if(!entry || entry->size != 5, "New file missing from the index");
+
+        dir = cbm_dir_open(NULL, TOP_BUILD_DIR "/tests/esp-index/EFI/Boot", false);
+        fail_if(!dir, "Failed to open the bootloader directory");
+        fail_if(!cbm_dir_rename(dir, "BOOTX64.EFI", "renamed.efi"), "Failed to rename");
+        fail_if(cbm_esp_index_lookup(blob), "Kept a renamed file");
+        fail_if(!cbm_esp_index_lookup(TOP_BUILD_DIR "/tests/esp-index/EFI/Boot/RENAMED.EFI"),
+                "Missed a renamed file");
+        fail_if(!cbm_dir_unlink(dir, "renamed.efi"), "Failed to unlink");
+        fail_if(cbm_esp_exists(TOP_BUILD_DIR "/tests/esp-index/EFI/Boot/renamed.efi"),
+                "Kept an unlinked file");
+
+        /* Removing a directory drops its whole subtree, and only that */
+        fail_if(!cbm_rm_rf(uki_dir), "Failed to remove the UKI directory");
+        fail_if(cbm_esp_index_lookup(uki_dir), "Kept a removed directory");
+        fail_if(cbm_esp_index_lookup(uki), "Kept a file within a removed directory");
+        fail_if(!cbm_esp_index_lookup(TOP_BUILD_DIR "/tests/esp-index/loader"),
+                "Dropped a sibling of a removed directory");
+        fail_if(!cbm_mkdir_p(uki_dir, 00755), "Failed to recreate the UKI directory");
+        fail_if(!cbm_esp_index_lookup(uki_dir), "Recreated directory missing from the index");
+        fail_if(cbm_esp_exists(uki), "Recreated directory kept its old contents");
+
+        /* A different directory in place of the root is never answered for */
+        fail_if(rename(root, moved) != 0, "Failed to move the ESP");
+        fail_if(!nc_mkdir_p(root, 00755), "Failed to replace the ESP");
+        fail_if(cbm_esp_index_lookup(TOP_BUILD_DIR "/tests/esp-index/loader"),
+                "Answered for a replaced root");
+        fail_if(cbm_esp_exists(TOP_BUILD_DIR "/tests/esp-index/loader"),
+                "Found a directory of the replaced root");
+
+        cbm_esp_index_reset();
+        (void)nc_rm_rf(root);
+        (void)nc_rm_rf(moved);
+}
+END_TEST
+
+START_TEST(bootman_dirfd_test)
+{
+        const char *root = TOP_BUILD_DIR "/tests/dirfd-root";
+        autofree(CbmDir) *dir = NULL;
+        autofree(CbmDir) *child = NULL;
+        autofree(char) *path = NULL;
+        struct stat st = { 0 };
+        int fd;
+
+        (void)nc_rm_rf(root);
+        fail_if(!nc_mkdir_p(TOP_BUILD_DIR "/tests/dirfd-root/inside", 00755),
+                "Failed to create the root");
+        fail_if(symlink("/inside", TOP_BUILD_DIR "/tests/dirfd-root/abs-link") != 0,
+                "Failed to create an absolute link");
+        fail_if(symlink("../../..", TOP_BUILD_DIR "/tests/dirfd-root/inside/up-link") != 0,
+                "Failed to create a relative link");
+
+        dir = cbm_dir_open(NULL, root, true);
+        fail_if(!dir, "Failed to open the root");
+        fail_if(!dir->confined, "Root is not confined");
+
+        /* Names are relative to the directory, even with a leading slash */
+        path = cbm_dir_path(dir, "/inside/file");
+        fail_if(!streq(path, TOP_BUILD_DIR "/tests/dirfd-root/inside/file"),
+                "Incorrect path: %s",
+                path);
+
+        /* Plain operations beneath the directory */
+        fail_if(!cbm_dir_mkdir(dir, "inside/sub", 00755), "Failed to create a directory");
+        fail_if(!cbm_dir_mkdir(dir, "inside/sub", 00755), "Failed on an existing directory");
+        fd = cbm_dir_openat(dir, "inside/sub/file", O_WRONLY | O_CREAT | O_TRUNC, 00644);
+        fail_if(fd < 0, "Failed to create a file");
+        close(fd);
+        fail_if(cbm_dir_mkdir(dir, "inside/sub/file", 00755), "Made a directory over a file");
+        fail_if(!cbm_dir_rename(dir, "inside/sub/file", "inside/sub/renamed"), "Failed to rename");
+        fail_if(!cbm_dir_stat(dir, "inside/sub/renamed", &st) || !S_ISREG(st.st_mode),
+                "Failed to stat the renamed file");
+        fail_if(cbm_dir_rmdir(dir, "inside/sub"), "Removed a non-empty directory");
+        fail_if(!cbm_dir_unlink(dir, "inside/sub/renamed"), "Failed to unlink");
+        fail_if(!cbm_dir_rmdir(dir, "inside/sub"), "Failed to remove a directory");
+        fail_if(!cbm_dir_mkdir_p(dir, "inside/a//b/c", 00755), "Failed to create parents");
+        fail_if(!cbm_dir_stat(dir, "inside/a/b/c", &st) || !S_ISDIR(st.st_mode),
+                "Missing a nested directory");
+        fail_if(nc_file_exists(TOP_BUILD_DIR "/tests/dirfd-root/inside/sub"),
+                "Directory was not removed");
+
+        /* Children inherit the confinement */
+        child = cbm_dir_open(dir, "inside", false);
+        fail_if(!child, "Failed to open a child");
+        fail_if(!child->confined, "Child is not confined");
+        fail_if(!streq(child->path, TOP_BUILD_DIR "/tests/dirfd-root/inside"),
+                "Incorrect child path: %s",
+                child->path);
+
+#ifdef HAVE_OPENAT2
+        /* Absolute links, and any amount of "..", stay within the root */
+        fd = cbm_dir_openat(dir, "abs-link/escaped", O_WRONLY | O_CREAT | O_TRUNC, 00644);
+        fail_if(fd < 0, "Failed to create a file through an absolute link");
+        close(fd);
+        fail_if(!nc_file_exists(TOP_BUILD_DIR "/tests/dirfd-root/inside/escaped"),
+                "Absolute link escaped the root");
+        fail_if(!cbm_dir_stat(dir, "inside/up-link/inside/escaped", &st),
+                "Relative link escaped the root");
+        fail_if(!cbm_dir_unlink(dir, "inside/up-link/abs-link"),
+                "Failed to unlink through a link");
+        fail_if(cbm_dir_stat(dir, "abs-link", &st), "Link was not removed");
+#endif
+
+        /* The final component is removed, never followed */
+        fail_if(!nc_file_exists(TOP_BUILD_DIR "/tests/dirfd-root/inside"),
+                "Removed the target of a link");
+        fail_if(!cbm_dir_unlink(dir, "inside/up-link"), "Failed to unlink a link");
+        fail_if(!nc_file_exists(TOP_BUILD_DIR "/tests/dirfd-root/inside"),
+                "Removed the target of a link");
+
+        (void)nc_rm_rf(root);
+}
+END_TEST
+
+START_TEST(bootman_pe_version_test)
+{
+        autofree(char) *version = NULL;
+        const char *sd_255 = TOP_DIR "/tests/data/sdboot-255.efi";
+        const char *sd_256 = TOP_DIR "/tests/data/sdboot-256.efi";
+        const char *osrel = TOP_DIR "/tests/data/osrel.efi";
+
+        version = cbm_pe_get_version(sd_255);
+        fail_if(!version, "Failed to read .sdmagic version");
+        fail_if(!streq(version, "systemd-boot 255.4"), "Incorrect .sdmagic version: %s", version);
+        free(version);
+
+        version = cbm_pe_get_version(osrel);
+        fail_if(!version, "Failed to read .osrel version");
+        fail_if(!streq(version, "systemd-boot 255.4"), "Incorrect .osrel version: %s", version);
+        free(version);
+
+        version = cbm_pe_get_version(TOP_DIR "/tests/data/match");
+        fail_if(version != NULL, "Found a version in a non-PE file");
+
+        fail_if(!cbm_pe_blobs_match(sd_255, sd_255), "Identical blobs should match");
+        fail_if(cbm_pe_blobs_match(sd_255, sd_256), "Different versions should not match");
+        fail_if(!cbm_pe_blobs_match(sd_255, osrel), "Same versions should match");
+
+        /* No version section, fall back to comparing the contents */
+        fail_if(!cbm_pe_blobs_match(TOP_DIR "/tests/data/match", TOP_DIR "/tests/data/match1"),
+                "Identical files should match");
+        fail_if(cbm_pe_blobs_match(TOP_DIR "/tests/data/match", TOP_DIR "/tests/data/nomatch1"),
+                "Different files should not match");
+}
+END_TEST
+
+START_TEST(bootman_pe_write_image_test)
+{
+        autofree(char) *data = NULL;
+        const char *stub = TOP_DIR "/tests/data/uki-stub.efi";
+        const char *part1 = TOP_BUILD_DIR "/tests/uki-part1";
+        const char *part2 = TOP_BUILD_DIR "/tests/uki-part2";
+        const char *output = TOP_BUILD_DIR "/tests/uki-test.efi";
+        const char *const files[] = { part1, part2, NULL };
+        autofree(CbmDir) *dir = NULL;
+        const CbmPeSection sections[] = {
+                { .name = ".osrel", .data = "ID=test\n", .len = 8 },
+                { .name = ".linux", .files = files },
+        };
+        size_t len = 0;
+
+        fail_if(!file_set_text(part1, "kernel-"), "Failed to write part1");
+        fail_if(!file_set_text(part2, "image"), "Failed to write part2");
+
+        dir = cbm_dir_open(NULL, TOP_BUILD_DIR "/tests", false);
+        fail_if(!dir, "Failed to open the test directory");
+        fail_if(!cbm_pe_write_image(stub, sections, ARRAY_SIZE(sections), dir, "uki-test.efi"),
+                "Failed to write PE image");
+
+        data = cbm_pe_read_section(output, ".osrel", &len);
+        fail_if(!data, "Missing .osrel section");
+        fail_if(len != 8 || memcmp(data, "ID=test\n", len) != 0, "Incorrect .osrel section");
+        free(data);
+
+        data = cbm_pe_read_section(output, ".linux", &len);
+        fail_if(!data, "Missing .linux section");
+        fail_if(len != 12 || memcmp(data, "kernel-image", len) != 0,
+                "Incorrect .linux section");
+        free(data);
+
+        /* Existing sections of the stub must survive */
+        data = cbm_pe_read_section(output, ".text", &len);
+        fail_if(!data, "Missing .text section");
+        fail_if((unsigned char)data[0] != 0xc3, "Corrupted .text section");
+
+        /* Not a PE file */
+        unlink(output);
+        fail_if(cbm_pe_write_image(part1, sections, ARRAY_SIZE(sections), dir, "uki-test.efi"),
+                "Wrote an image from a non-PE stub");
+        fail_if(nc_file_exists(output), "Left a partial image behind");
+
+        unlink(part1);
+        unlink(part2);
+}
+END_TEST
+
+START_TEST(bootman_sha256_test)
+{
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        CbmSha256 ctx;
+        const char *long_input = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+        cbm_sha256_init(&ctx);
+        cbm_sha256_final(&ctx, digest);
+        cbm_sha256_to_hex(digest, hex);
+        fail_if(!streq(hex, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"),
+                "Incorrect digest of empty input: %s", hex);
+
+        /* Feed in uneven pieces to exercise the partial block handling */
+        cbm_sha256_init(&ctx);
+        cbm_sha256_update(&ctx, long_input, 3);
+        cbm_sha256_update(&ctx, long_input + 3, strlen(long_input) - 3);
+        cbm_sha256_final(&ctx, digest);
+        cbm_sha256_to_hex(digest, hex);
+        fail_if(!streq(hex, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"),
+                "Incorrect digest of two block input: %s", hex);
+
+        fail_if(!cbm_sha256_file(TOP_DIR "/tests/data/uki-stub.efi", digest),
+                "Failed to hash file");
+        cbm_sha256_to_hex(digest, hex);
+        fail_if(!streq(hex, "195d8ae31d6ab74994529edf5c0b2eba1db14b93c9b1d0ff917f7d48c77b1dd4"),
+                "Incorrect digest of file: %s", hex);
+
+        fail_if(cbm_sha256_file("PATHTHATWONT@EXIST!", digest), "Hashed a missing file");
+}
+END_TEST
+
+START_TEST(bootman_file_digest_test)
+{
+        const char *path = TOP_BUILD_DIR "/tests/digest-test";
+        uint8_t expected[CBM_SHA256_DIGEST_SIZE];
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        struct timespec times[2] = { { 0 }, { .tv_sec = 1000000000 } };
+        char value[256];
+        bool cached;
+        int fd;
+
+        fail_if(!file_set_text(path, "first"), "Failed to write test file");
+        fail_if(!cbm_sha256_file(path, expected), "Failed to hash test file");
+
+        /* Not remembered while asked not to, as for images */
+        cbm_set_digest_xattrs(false);
+        fail_if(!cbm_file_digest(path, digest), "Failed to take file digest");
+        fail_if(memcmp(digest, expected, sizeof(expected)) != 0, "Incorrect file digest");
+        fail_if(getxattr(path, CBM_DIGEST_XATTR, value, sizeof(value)) >= 0,
+                "Cached a digest when told not to");
+        cbm_set_digest_xattrs(true);
+
+        /* Once to fill the cache, where supported, and once to use it */
+        cbm_stats_reset();
+        fail_if(!cbm_file_digest(path, digest), "Failed to take file digest");
+        fail_if(memcmp(digest, expected, sizeof(expected)) != 0, "Incorrect file digest");
+        cached = getxattr(path, CBM_DIGEST_XATTR, value, sizeof(value)) > 0;
+        fail_if(!cached && errno != ENOTSUP, "Failed to cache the digest: %s", strerror(errno));
+        fail_if(!cbm_file_digest(path, digest), "Failed to take file digest");
+        fail_if(memcmp(digest, expected, sizeof(expected)) != 0, "Incorrect cached digest");
+        fail_if(cbm_stats_get(CBM_STAT_DIGEST_CACHED) != (cached ? 1 : 0),
+                "Cached digest was not used");
+        fail_if(cbm_stats_get(CBM_STAT_DIGEST_COMPUTED) != (cached ? 1 : 2),
+                "Incorrect number of digests computed");
+
+        /* Same inode and size, but a new modification time invalidates it */
+        fd = open(path, O_WRONLY | O_CLOEXEC);
+        fail_if(fd < 0, "Failed to open test file");
+        fail_if(pwrite(fd, "fir5t", 5, 0) != 5, "Failed to modify test file");
+        fail_if(futimens(fd, times) != 0, "Failed to set the modification time");
+        close(fd);
+        fail_if(!cbm_sha256_file(path, expected), "Failed to hash test file");
+        fail_if(!cbm_file_digest(path, digest), "Failed to take file digest");
+        fail_if(memcmp(digest, expected, sizeof(expected)) != 0, "Used a stale cached digest");
+
+        /* A replaced file is a new inode, without the attribute */
+        fail_if(!file_set_text(path, "second"), "Failed to rewrite test file");
+        fail_if(!cbm_sha256_file(path, expected), "Failed to hash test file");
+        fail_if(!cbm_file_digest(path, digest), "Failed to take file digest");
+        fail_if(memcmp(digest, expected, sizeof(expected)) != 0, "Used a stale cached digest");
+
+        fail_if(cbm_file_digest("PATHTHATWONT@EXIST!", digest), "Took digest of a missing file");
+        fail_if(cbm_file_verity_digest("PATHTHATWONT@EXIST!") != NULL,
+                "Measured a missing file");
+
+        unlink(path);
+}
+END_TEST
+
+/**
+ * Write a newc archive holding a single file @name, followed by @tail
+ */
+static bool write_test_cpio(const char *path, const char *name, const char *tail, size_t tail_len)
+{
+        static const char zeroes[4] = { 0 };
+        const char *names[] = { name, "TRAILER!!!" };
+        FILE *fp = NULL;
+        bool ret;
+
+        fp = fopen(path, "w");
+        if (!fp) {
+                return false;
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(names); i++) {
+                size_t name_size = strlen(names[i]) + 1;
+                size_t data_size = i == 0 ? 4 : 0;
+
+                fprintf(fp,
+                        "070701%08X%08X%08X%08X%08X%08X%08zX%08X%08X%08X%08X%08zX%08X",
+                        (unsigned)i + 1, 0100644U, 0U, 0U, 1U, 0U, data_size, 0U, 0U, 0U, 0U,
+                        name_size, 0U);
+                fwrite(names[i], 1, name_size, fp);
+                fwrite(zeroes, 1, (4 - (110 + name_size) % 4) % 4, fp);
+                fwrite("data", 1, data_size, fp);
+        }
+        fwrite(tail, 1, tail_len, fp);
+
+        ret = ferror(fp) == 0;
+        return fclose(fp) == 0 && ret;
+}
+
+START_TEST(bootman_compression_test)
+{
+        const char *path = TOP_BUILD_DIR "/tests/initrd-test.cpio";
+        static const char padding[512] = { 0 };
+        static const char zstd[128] = { 0x28, (char)0xb5, 0x2f, (char)0xfd };
+        FILE *fp = NULL;
+
+        fail_if(!write_test_cpio(path, "init", padding, sizeof(padding)), "Failed to write cpio");
+        fail_if(cbm_compression_detect(path) != CBM_COMPRESS_NONE,
+                "Failed to detect plain cpio");
+
+        fail_if(!write_test_cpio(path, "kernel/x86/microcode/GenuineIntel.bin", NULL, 0),
+                "Failed to write microcode cpio");
+        fail_if(cbm_compression_detect(path) != CBM_COMPRESS_UNKNOWN,
+                "Early microcode archive must be left alone");
+
+        fail_if(!write_test_cpio(path, "init", "\x1f\x8b\x08\x00", 4),
+                "Failed to write mixed cpio");
+        fail_if(cbm_compression_detect(path) != CBM_COMPRESS_UNKNOWN,
+                "Archive with a compressed tail detected as plain");
+
+        fp = fopen(path, "w");
+        fail_if(!fp, "Failed to open %s", path);
+        fwrite(zstd, 1, sizeof(zstd), fp);
+        fclose(fp);
+        fail_if(cbm_compression_detect(path) != CBM_COMPRESS_ZSTD, "Failed to detect zstd");
+
+        fail_if(cbm_compression_detect("PATHTHATWONT@EXIST!") != CBM_COMPRESS_UNKNOWN,
+                "Detected a missing file");
+
+        fail_if(cbm_compression_from_name("zstd") != CBM_COMPRESS_ZSTD, "Failed to parse zstd");
+        fail_if(cbm_compression_from_name("rar") != CBM_COMPRESS_UNKNOWN, "Parsed unknown name");
+        fail_if(!streq(cbm_compression_name(CBM_COMPRESS_XZ), "xz"), "Incorrect name for xz");
+
+        unlink(path);
+}
+END_TEST
+
+/**
+ * Write the EFI variable @name as systemd-boot would
+ */
+static bool write_loader_var(const char *dir, const char *name, const char *value)
+{
+        autofree(char) *path = NULL;
+        FILE *fp = NULL;
+        bool ret;
+
+        path = string_printf("%s/%s-4a67b082-0a4c-41cf-b6c7-440b29bb8c4f", dir, name);
+        fp = fopen(path, "w");
+        if (!fp) {
+                return false;
+        }
+        fwrite("\x06\x00\x00\x00", 1, 4, fp);
+        for (const char *c = value; *c; c++) {
+                fputc(*c, fp);
+                fputc(0, fp);
+        }
+        fwrite("\x00\x00", 1, 2, fp);
+
+        ret = ferror(fp) == 0;
+        return fclose(fp) == 0 && ret;
+}
+
+START_TEST(bootman_ledger_test)
+{
+        const char *efivars = TOP_BUILD_DIR "/tests/efivars";
+        const char *ledger = TOP_BUILD_DIR "/tests/boot-stats";
+        CbmBootRecord record = { .boot_id = "6f4b5c0e-98a1-4d1c-9a6e-1b0c4a7d3e21",
+                                 .timestamp = 1700000000,
+                                 .kernel = "4.2.3-124.kvm",
+                                 .kernel_usec = 900000,
+                                 .userspace_usec = 2500000 };
+        const CbmBootRecord *loaded = NULL;
+        NcArray *records = NULL;
+
+        fail_if(!nc_mkdir_p(efivars, 00755), "Failed to create efivars");
+        unlink(ledger);
+
+        fail_if(cbm_boot_record_read_loader(&record, efivars), "Read loader times from nowhere");
+        fail_if(!streq(record.entry, "-"), "Unknown entry not marked: %s", record.entry);
+
+        fail_if(!write_loader_var(efivars, "LoaderTimeInitUSec", "1500000"),
+                "Failed to write LoaderTimeInitUSec");
+        fail_if(!write_loader_var(efivars, "LoaderTimeExecUSec", "1750000"),
+                "Failed to write LoaderTimeExecUSec");
+        fail_if(!write_loader_var(efivars, "LoaderEntrySelected", "Clear-linux-kvm-4.2.3-124.conf"),
+                "Failed to write LoaderEntrySelected");
+
+        fail_if(!cbm_boot_record_read_loader(&record, efivars), "Failed to read loader times");
+        fail_if(record.firmware_usec != 1500000, "Incorrect firmware time");
+        fail_if(record.loader_usec != 250000, "Incorrect loader time");
+        fail_if(!streq(record.entry, "Clear-linux-kvm-4.2.3-124.conf"),
+                "Incorrect entry: %s", record.entry);
+
+        fail_if(!cbm_ledger_append(AT_FDCWD, ledger, &record), "Failed to append record");
+        record.kernel_usec = 1;
+        fail_if(!cbm_ledger_append(AT_FDCWD, ledger, &record), "Failed to skip repeated boot");
+
+        records = cbm_ledger_load(ledger);
+        fail_if(!records, "Failed to load ledger");
+        fail_if(records->len != 1, "Boot recorded more than once: %d", records->len);
+
+        loaded = nc_array_get(records, 0);
+        fail_if(!streq(loaded->boot_id, record.boot_id), "Incorrect boot id");
+        fail_if(!streq(loaded->kernel, "4.2.3-124.kvm"), "Incorrect kernel: %s", loaded->kernel);
+        fail_if(loaded->timestamp != 1700000000, "Incorrect timestamp");
+        fail_if(loaded->firmware_usec != 1500000 || loaded->loader_usec != 250000,
+                "Incorrect loader times");
+        fail_if(loaded->kernel_usec != 900000 || loaded->userspace_usec != 2500000,
+                "Incorrect kernel times");
+        fail_if(!streq(loaded->entry, record.entry), "Incorrect entry: %s", loaded->entry);
+
+        nc_array_free(&records, free);
+        unlink(ledger);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -431,12 +1463,48 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_map_kernels_test);
         tcase_add_test(tc, bootman_timeout_test);
         tcase_add_test(tc, bootman_console_mode_test);
+        tcase_add_test(tc, bootman_sysconfig_cache_test);
+        tcase_add_test(tc, bootman_sysconfig_current_test);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_watch_functions");
+        tcase_add_test(tc, bootman_watch_stale_test);
+        tcase_add_test(tc, bootman_watch_timeout_test);
         suite_add_tcase(s, tc);
 
         tc = tcase_create("bootman_writer_functions");
         tcase_add_test(tc, bootman_writer_simple_test);
         tcase_add_test(tc, bootman_writer_printf_test);
         tcase_add_test(tc, bootman_writer_mut_test);
+        tcase_add_test(tc, bootman_writer_typed_test);
+        tcase_add_test(tc, bootman_writer_matches_file_test);
+        tcase_add_test(tc, bootman_concat_test);
+        tcase_add_test(tc, bootman_direct_io_test);
+        tcase_add_test(tc, bootman_manifest_test);
+        tcase_add_test(tc, bootman_manifest_named_test);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_dirfd_functions");
+        tcase_add_test(tc, bootman_dirfd_test);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_esp_index_functions");
+        tcase_add_test(tc, bootman_esp_index_test);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_pe_functions");
+        tcase_add_test(tc, bootman_pe_version_test);
+        tcase_add_test(tc, bootman_pe_write_image_test);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_hash_functions");
+        tcase_add_test(tc, bootman_sha256_test);
+        tcase_add_test(tc, bootman_file_digest_test);
+        tcase_add_test(tc, bootman_compression_test);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_ledger_functions");
+        tcase_add_test(tc, bootman_ledger_test);
         suite_add_tcase(s, tc);
 
         return s;
@@ -64,7 +64,7 @@ START_TEST(bootman_find_boot)
 
         autofree(char) *boot = NULL;
 
-        boot = get_boot_device();
+        boot = get_boot_device(TOP_BUILD_DIR "/tests/update_playground");
         fail_if(!boot, "Unable to determine a boot device");
 }
 END_TEST
@@ -76,7 +76,7 @@ START_TEST(bootman_grub2_get_boot_device)
         /* Ensure cleanup */
         m = prepare_playground(&grub2_config);
 
-        boot_device = get_boot_device();
+        boot_device = get_boot_device(PLAYGROUND_ROOT);
         fail_if(boot_device != NULL, "Found incorrect device for Legacy (GRUB2) Boot");
 }
 END_TEST
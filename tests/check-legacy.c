@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include "bootman.h"
 #include "config.h"
@@ -88,7 +89,7 @@ START_TEST(bootman_legacy_get_boot_device)
         /* Ensure cleanup */
         m = prepare_playground(&legacy_config);
 
-        boot_device = get_boot_device();
+        boot_device = get_boot_device(PLAYGROUND_ROOT);
         fail_if(boot_device != NULL, "Found incorrect UEFI device for Legacy Boot");
 
         boot_device = get_legacy_boot_device(PLAYGROUND_ROOT);
@@ -271,6 +272,48 @@ START_TEST(bootman_legacy_update_native)
 }
 END_TEST
 
+static CbmSystemOps DetachedTestOps;
+static int detached_mounts;
+
+static int legacy_mount_detached(__cbm_unused__ const char *source,
+                                 __cbm_unused__ const char *filesystemtype,
+                                 __cbm_unused__ const char *options)
+{
+        detached_mounts++;
+        errno = ENOSYS;
+        return -1;
+}
+
+/**
+ * extlinux is run on the boot directory, so it must never be mounted
+ * detached where the child can't reach it
+ */
+START_TEST(bootman_legacy_detached_mount)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *detached_conf = NULL;
+
+        DetachedTestOps = SystemTestOps;
+        DetachedTestOps.get_device_for_mountpoint = legacy_get_device_for_mountpoint;
+        DetachedTestOps.mount_detached = legacy_mount_detached;
+        cbm_system_set_vtable(&DetachedTestOps);
+        detached_mounts = 0;
+
+        m = prepare_playground(&legacy_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+
+        detached_conf =
+            string_printf("%s/%s/detached_mount", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        fail_if(!file_set_text(detached_conf, "yes"), "Failed to enable detached mounts");
+
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+        fail_if(detached_mounts != 0, "Mounted detached for a legacy bootloader");
+
+        unlink(detached_conf);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -285,6 +328,7 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_legacy_update_image);
         tcase_add_test(tc, bootman_legacy_update_image);
         tcase_add_test(tc, bootman_legacy_update_native);
+        tcase_add_test(tc, bootman_legacy_detached_mount);
         suite_add_tcase(s, tc);
 
         return s;
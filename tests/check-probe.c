@@ -27,19 +27,26 @@
 
 #define _GNU_SOURCE
 #include <check.h>
+#include <endian.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include "blkid_stub.h"
 #include "bootloader.h"
 #include "bootman.h"
 #include "config.h"
+#include "esp.h"
 #include "files.h"
 #include "log.h"
+#include "nica/array.h"
+#include "nica/files.h"
+#include "parttable.h"
 #include "probe.h"
+#include "topology.h"
 
 #include "blkid-harness.h"
 #include "harness.h"
@@ -92,10 +99,13 @@ static CbmBlkidOps gpt_blkid_ops = {
         .partlist_get_partition = test_blkid_partlist_get_partition,
         .partition_get_flags = test_blkid_partition_get_flags,
         .partition_get_uuid = test_blkid_partition_get_uuid,
+        .partition_get_partno = test_blkid_partition_get_partno,
+        .partition_get_type_string = test_blkid_partition_get_type_string,
         .partlist_get_table = test_blkid_partlist_get_table,
         .parttable_get_type = test_blkid_parttable_get_type,
         .devno_to_wholedisk = gpt_devno_to_wholedisk,
         .devno_to_devname = test_blkid_devno_to_devname,
+        .read_partition_table = test_blkid_read_partition_table,
 };
 
 static inline const char *mbr_parttable_get_type(__cbm_unused__ blkid_parttable tab)
@@ -121,10 +131,13 @@ static CbmBlkidOps mbr_blkid_ops = {
         .partlist_get_partition = test_blkid_partlist_get_partition,
         .partition_get_flags = test_blkid_partition_get_flags,
         .partition_get_uuid = test_blkid_partition_get_uuid,
+        .partition_get_partno = test_blkid_partition_get_partno,
+        .partition_get_type_string = test_blkid_partition_get_type_string,
         .partlist_get_table = test_blkid_partlist_get_table,
         .parttable_get_type = mbr_parttable_get_type,
         .devno_to_wholedisk = gpt_devno_to_wholedisk,
         .devno_to_devname = test_blkid_devno_to_devname,
+        .read_partition_table = test_blkid_read_partition_table,
 };
 
 static void bootman_probe_set_gpt_vtables(void)
@@ -223,6 +236,533 @@ START_TEST(bootman_probe_basic_none)
 }
 END_TEST
 
+/**
+ * Build a minimal 512-byte sector GPT image at @path with two partitions,
+ * the second of which carries the legacy BIOS bootable attribute. If
+ * @corrupt is set, the entry array no longer matches its CRC.
+ */
+static bool write_test_gpt(const char *path, bool corrupt)
+{
+        static const uint8_t esp_type[16] = { 0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+                                              0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b };
+        uint8_t image[34 * 512] = { 0 };
+        uint8_t *header = image + 512;
+        uint8_t *entries = image + 1024;
+        uint32_t v32;
+        uint64_t v64;
+        FILE *fp = NULL;
+        bool ret;
+
+        /* Protective MBR */
+        image[446 + 4] = 0xEE;
+        image[510] = 0x55;
+        image[511] = 0xAA;
+
+        for (int i = 0; i < 2; i++) {
+                uint8_t *entry = entries + i * 128;
+
+                memcpy(entry, esp_type, sizeof(esp_type));
+                for (int j = 0; j < 16; j++) {
+                        entry[16 + j] = (uint8_t)(i * 16 + j);
+                }
+                v64 = htole64(i == 1 ? (1ULL << 2) : 0);
+                memcpy(entry + 48, &v64, sizeof(v64));
+        }
+
+        memcpy(header, "EFI PART", 8);
+        v32 = htole32(0x00010000);
+        memcpy(header + 8, &v32, 4);
+        v32 = htole32(92);
+        memcpy(header + 12, &v32, 4);
+        v64 = htole64(1);
+        memcpy(header + 24, &v64, 8);
+        v64 = htole64(2);
+        memcpy(header + 72, &v64, 8);
+        v32 = htole32(128);
+        memcpy(header + 80, &v32, 4);
+        memcpy(header + 84, &v32, 4);
+        v32 = htole32(cbm_crc32(0, entries, 128 * 128));
+        memcpy(header + 88, &v32, 4);
+        v32 = htole32(cbm_crc32(0, header, 92));
+        memcpy(header + 16, &v32, 4);
+
+        if (corrupt) {
+                entries[200] ^= 0xFF;
+        }
+
+        fp = fopen(path, "w");
+        if (!fp) {
+                return false;
+        }
+        ret = fwrite(image, 1, sizeof(image), fp) == sizeof(image);
+        return fclose(fp) == 0 && ret;
+}
+
+START_TEST(bootman_probe_crc32)
+{
+        const char *check = "123456789";
+
+        fail_if(cbm_crc32(0, check, 9) != 0xCBF43926, "Incorrect CRC32 of the check string");
+        fail_if(cbm_crc32(cbm_crc32(0, check, 4), check + 4, 5) != 0xCBF43926,
+                "CRC32 cannot be computed incrementally");
+        fail_if(cbm_crc32(0, NULL, 0) != 0, "CRC32 of nothing must be 0");
+}
+END_TEST
+
+START_TEST(bootman_probe_native_gpt)
+{
+        const char *path = TOP_BUILD_DIR "/tests/gpt-test.img";
+        CbmPartTable table = { 0 };
+
+        fail_if(!write_test_gpt(path, false), "Failed to write GPT image");
+        fail_if(!cbm_part_table_read(path, &table), "Failed to read valid GPT");
+        fail_if(!streq(table.type, "gpt"), "Expected gpt table, got '%s'", table.type);
+        fail_if(table.count != 2, "Expected 2 partitions, got %d", table.count);
+        fail_if(table.parts[0].partno != 1 || table.parts[1].partno != 2,
+                "Incorrect partition numbers");
+        fail_if(!streq(table.parts[0].uuid, "03020100-0504-0706-0809-0a0b0c0d0e0f"),
+                "Incorrect PartUUID: %s",
+                table.parts[0].uuid);
+        fail_if(!streq(table.parts[1].type, "c12a7328-f81f-11d2-ba4b-00a0c93ec93b"),
+                "Incorrect partition type: %s",
+                table.parts[1].type);
+        fail_if(table.parts[0].flags != 0 || table.parts[1].flags != (1ULL << 2),
+                "Incorrect partition attributes");
+        cbm_part_table_clear(&table);
+
+        fail_if(!write_test_gpt(path, true), "Failed to write corrupt GPT image");
+        fail_if(cbm_part_table_read(path, &table), "Accepted GPT with a bad entry CRC");
+        fail_if(table.count != 0 || table.parts != NULL, "Failed read left partitions behind");
+}
+END_TEST
+
+/**
+ * Write a 64 sector image at @path whose first sector holds @entry as its
+ * first MBR entry, behind a valid boot signature
+ */
+static bool write_test_mbr(const char *path, const uint8_t entry[16])
+{
+        uint8_t image[64 * 512] = { 0 };
+        FILE *fp = NULL;
+        bool ret;
+
+        memcpy(image + 440, "\x78\x56\x34\x12", 4);
+        memcpy(image + 446, entry, 16);
+        image[510] = 0x55;
+        image[511] = 0xAA;
+
+        fp = fopen(path, "w");
+        if (!fp) {
+                return false;
+        }
+        ret = fwrite(image, 1, sizeof(image), fp) == sizeof(image);
+        return fclose(fp) == 0 && ret;
+}
+
+START_TEST(bootman_probe_native_mbr)
+{
+        const char *path = TOP_BUILD_DIR "/tests/mbr-test.img";
+        /* Active Linux partition over sectors 2-63 */
+        const uint8_t valid[16] = { 0x80, 0, 0, 0, 0x83, 0, 0, 0, 2, 0, 0, 0, 62, 0, 0, 0 };
+        /* Boot code of a FAT boot sector, where the entries would be */
+        const uint8_t fat[16] = { 0xcd, 0x19, 0xeb, 0xfe, 0x54, 0x68, 0x69, 0x73,
+                                  0x20, 0x69, 0x73, 0x20, 0x6e, 0x6f, 0x74, 0x20 };
+        const uint8_t zero_start[16] = { 0, 0, 0, 0, 0x83, 0, 0, 0, 0, 0, 0, 0, 8, 0, 0, 0 };
+        const uint8_t too_big[16] = { 0, 0, 0, 0, 0x83, 0, 0, 0, 2, 0, 0, 0, 63, 0, 0, 0 };
+        const uint8_t empty[16] = { 0 };
+        CbmPartTable table = { 0 };
+
+        fail_if(!write_test_mbr(path, valid), "Failed to write MBR image");
+        fail_if(!cbm_part_table_read(path, &table), "Failed to read valid MBR");
+        fail_if(!streq(table.type, "dos"), "Expected dos table, got '%s'", table.type);
+        fail_if(!streq(table.uuid, "12345678"), "Incorrect disk signature: %s", table.uuid);
+        fail_if(table.count != 1 || table.parts[0].partno != 1, "Expected 1 partition");
+        fail_if(!streq(table.parts[0].uuid, "12345678-01"),
+                "Incorrect PartUUID: %s",
+                table.parts[0].uuid);
+        fail_if(table.parts[0].flags != 0x80, "Partition should be active");
+        cbm_part_table_clear(&table);
+
+        fail_if(!write_test_mbr(path, fat), "Failed to write FAT image");
+        fail_if(cbm_part_table_read(path, &table), "Accepted a FAT boot sector as an MBR");
+        fail_if(table.count != 0 || table.parts != NULL, "Failed read left partitions behind");
+
+        fail_if(!write_test_mbr(path, zero_start), "Failed to write MBR image");
+        fail_if(cbm_part_table_read(path, &table), "Accepted a partition starting at 0");
+
+        fail_if(!write_test_mbr(path, too_big), "Failed to write MBR image");
+        fail_if(cbm_part_table_read(path, &table), "Accepted a partition beyond the disk");
+
+        fail_if(!write_test_mbr(path, empty), "Failed to write MBR image");
+        fail_if(cbm_part_table_read(path, &table), "Accepted an MBR without partitions");
+}
+END_TEST
+
+/**
+ * Feed a GPT image through the vtable and ensure the legacy boot partition
+ * is found without any help from the blkid functions
+ */
+START_TEST(bootman_probe_native_legacy)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = false };
+        autofree(BootManager) *m = NULL;
+        autofree(char) *boot_device = NULL;
+        autofree(char) *expected = NULL;
+        autofree(char) *partuuid = NULL;
+        const char *legacy_uuid = "13121110-1514-1716-1819-1a1b1c1d1e1f";
+        CbmBlkidOps native_ops = gpt_blkid_ops;
+
+        bootman_probe_set_gpt_vtables();
+        m = prepare_playground(&config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        fail_if(!write_test_gpt(PLAYGROUND_ROOT "/dev/leRootDevice", false),
+                "Failed to write GPT image");
+        partuuid = string_printf(PLAYGROUND_ROOT "/dev/disk/by-partuuid/%s", legacy_uuid);
+        fail_if(!file_set_text(partuuid, "legacy boot partition"), "Failed to write partuuid");
+        expected = realpath(partuuid, NULL);
+
+        /* blkid would report no legacy boot partition at all */
+        native_ops.read_partition_table = cbm_part_table_read;
+        cbm_blkid_set_vtable(&native_ops);
+
+        boot_device = get_legacy_boot_device(PLAYGROUND_ROOT);
+        fail_if(!boot_device, "Failed to find the legacy boot partition");
+        fail_if(!streq(boot_device, expected), "Expected '%s', got '%s'", expected, boot_device);
+}
+END_TEST
+
+/**
+ * Count every trip to libblkid and the mount table made through the vtables
+ */
+static int topology_probes = 0;
+static int topology_disk_lookups = 0;
+static int topology_mount_lookups = 0;
+
+static blkid_probe counting_new_probe_from_filename(const char *filename)
+{
+        topology_probes++;
+        return test_blkid_new_probe_from_filename(filename);
+}
+
+static char *counting_devno_to_devname(dev_t dev)
+{
+        topology_disk_lookups++;
+        return test_blkid_devno_to_devname(dev);
+}
+
+static char *counting_get_device_for_mountpoint(const char *mountpoint)
+{
+        topology_mount_lookups++;
+        return test_get_device_for_mountpoint(mountpoint);
+}
+
+/**
+ * Repeated queries about the same root must be answered from the snapshot,
+ * until it is reset
+ */
+START_TEST(bootman_probe_topology_cached)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        autofree(BootManager) *m = NULL;
+        CbmBlkidOps blkid_ops = gpt_blkid_ops;
+        CbmSystemOps system_ops = SystemTestOps;
+        const CbmDiskInfo *disk = NULL;
+        int probes, disks;
+
+        bootman_probe_set_gpt_vtables();
+        m = prepare_playground(&config);
+        fail_if(!m, "Failed to prepare update playground");
+        set_test_system_legacy();
+
+        blkid_ops.probe_new_from_filename = counting_new_probe_from_filename;
+        blkid_ops.devno_to_devname = counting_devno_to_devname;
+        system_ops.get_device_for_mountpoint = counting_get_device_for_mountpoint;
+        /* Switching vtables drops the snapshot */
+        cbm_blkid_set_vtable(&blkid_ops);
+        cbm_system_set_vtable(&system_ops);
+        topology_probes = topology_disk_lookups = topology_mount_lookups = 0;
+
+        for (int i = 0; i < 3; i++) {
+                autofree(CbmDeviceProbe) *probe = cbm_probe_path(PLAYGROUND_ROOT);
+                fail_if(!probe, "Failed to get probe for a valid rootfs");
+                fail_if(!probe->gpt, "GPT root not detected as GPT");
+        }
+        fail_if(topology_probes != 2,
+                "Expected one device and one disk probe, got %d",
+                topology_probes);
+        fail_if(topology_disk_lookups != 1,
+                "Expected a single disk lookup, got %d",
+                topology_disk_lookups);
+
+        topology_mount_lookups = 0;
+        for (int i = 0; i < 3; i++) {
+                disk = cbm_topology_get_disk(PLAYGROUND_ROOT);
+                fail_if(!disk, "Failed to get disk for a valid rootfs");
+                fail_if(disk->devno != makedev(8, 8), "Incorrect disk for rootfs");
+        }
+        fail_if(topology_mount_lookups != 0,
+                "Mount table consulted again for a known mountpoint: %d",
+                topology_mount_lookups);
+        fail_if(topology_probes != 2, "Disk probed again: %d", topology_probes);
+
+        /* A reset must probe afresh */
+        probes = topology_probes;
+        disks = topology_disk_lookups;
+        cbm_topology_reset();
+        disk = cbm_topology_get_disk(PLAYGROUND_ROOT);
+        fail_if(!disk, "Failed to get disk after reset");
+        fail_if(topology_mount_lookups != 1,
+                "Expected a mount table lookup after reset, got %d",
+                topology_mount_lookups);
+        fail_if(topology_probes != probes + 2,
+                "Expected device and disk to be probed again after reset");
+        fail_if(topology_disk_lookups != disks + 1,
+                "Expected the disk to be looked up again after reset");
+}
+END_TEST
+
+/**
+ * Plant a whole disk @name with device number @devno in the test sysfs,
+ * with a partition node for @partno. @gpt decides whether its devfs node
+ * carries a partition table.
+ */
+static void esp_test_add_disk(const char *name, unsigned int devno_minor, int partno, bool gpt)
+{
+        autofree(char) *disk_dir = NULL;
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+        autofree(char) *link = NULL;
+        autofree(char) *target = NULL;
+
+        disk_dir = string_printf(PLAYGROUND_ROOT "/sys/block/%s", name);
+        path = string_printf("%s/device", disk_dir);
+        fail_if(!nc_mkdir_p(path, 00755), "Failed to create %s", path);
+        free(path);
+
+        path = string_printf("%s/dev", disk_dir);
+        text = string_printf("8:%u\n", devno_minor);
+        fail_if(!file_set_text(path, text), "Failed to write %s", path);
+        free(path);
+
+        path = string_printf("%s/%s%d", disk_dir, name, partno);
+        fail_if(!nc_mkdir_p(path, 00755), "Failed to create %s", path);
+        free(path);
+        free(text);
+        path = string_printf("%s/%s%d/partition", disk_dir, name, partno);
+        text = string_printf("%d\n", partno);
+        fail_if(!file_set_text(path, text), "Failed to write %s", path);
+        free(path);
+
+        fail_if(!nc_mkdir_p(PLAYGROUND_ROOT "/sys/dev/block", 00755), "Failed to create sysfs");
+        link = string_printf(PLAYGROUND_ROOT "/sys/dev/block/8:%u", devno_minor);
+        target = string_printf("../../block/%s", name);
+        fail_if(symlink(target, link) != 0, "Failed to link %s", link);
+
+        path = string_printf(PLAYGROUND_ROOT "/dev/%s", name);
+        if (gpt) {
+                fail_if(!write_test_gpt(path, false), "Failed to write GPT image");
+        } else {
+                fail_if(!file_set_text(path, "not a partition table"), "Failed to write %s", path);
+        }
+        free(path);
+
+        path = string_printf(PLAYGROUND_ROOT "/dev/%s%d", name, partno);
+        fail_if(!file_set_text(path, "esp"), "Failed to write %s", path);
+}
+
+/**
+ * Discover the ESP from partition tables alone, and make sure what we
+ * remember about it is only used while it still holds
+ */
+START_TEST(bootman_probe_esp_discover)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = false };
+        const char *cache_path = PLAYGROUND_ROOT CACHE_DIRECTORY "/esp-device";
+        autofree(BootManager) *m = NULL;
+        CbmBlkidOps native_ops = gpt_blkid_ops;
+        char *esp = NULL;
+        char *text = NULL;
+
+        bootman_probe_set_gpt_vtables();
+        m = prepare_playground(&config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        native_ops.read_partition_table = cbm_part_table_read;
+        cbm_blkid_set_vtable(&native_ops);
+
+        /* The root lives on 8:8 */
+        esp_test_add_disk("sda", 8, 1, true);
+        esp_test_add_disk("sdb", 16, 1, true);
+
+        esp = cbm_esp_discover(PLAYGROUND_ROOT, false);
+        fail_if(!esp || !streq(esp, PLAYGROUND_ROOT "/dev/sda1"),
+                "Expected the ESP on the root disk, got %s",
+                esp);
+        free(esp);
+
+        fail_if(!file_get_text(cache_path, &text), "ESP was not remembered");
+        fail_if(!strstr(text, " sda 03020100-0504-0706-0809-0a0b0c0d0e0f\n"),
+                "Unexpected ESP cache: %s",
+                text);
+        free(text);
+
+        /* A scan would no longer see the root disk, the cache still does */
+        fail_if(rmdir(PLAYGROUND_ROOT "/sys/block/sda/device") != 0, "Failed to hide sda");
+        esp = cbm_esp_discover(PLAYGROUND_ROOT, false);
+        fail_if(!esp || !streq(esp, PLAYGROUND_ROOT "/dev/sda1"),
+                "Remembered ESP was not used, got %s",
+                esp);
+        free(esp);
+
+        /* Empty and truncated caches are ignored and rewritten */
+        fail_if(!file_set_text((char *)cache_path, ""), "Failed to empty the cache");
+        esp = cbm_esp_discover(PLAYGROUND_ROOT, false);
+        fail_if(!esp || !streq(esp, PLAYGROUND_ROOT "/dev/sdb1"),
+                "Expected a rescan after an empty cache, got %s",
+                esp);
+        free(esp);
+
+        fail_if(!file_set_text((char *)cache_path, "trunc"), "Failed to truncate the cache");
+        esp = cbm_esp_discover(PLAYGROUND_ROOT, false);
+        fail_if(!esp || !streq(esp, PLAYGROUND_ROOT "/dev/sdb1"),
+                "Expected a rescan after a truncated cache, got %s",
+                esp);
+        free(esp);
+
+        fail_if(!file_get_text(cache_path, &text), "ESP was not remembered again");
+        fail_if(!strstr(text, " sdb 03020100-0504-0706-0809-0a0b0c0d0e0f\n"),
+                "Unexpected ESP cache: %s",
+                text);
+        free(text);
+        fail_if(nc_file_exists(PLAYGROUND_ROOT CACHE_DIRECTORY "/esp-device.TmpWrite"),
+                "Temporary cache file left behind");
+}
+END_TEST
+
+/**
+ * Images must only ever find an ESP on their own disk
+ */
+START_TEST(bootman_probe_esp_discover_image)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = false };
+        const char *cache_path = PLAYGROUND_ROOT CACHE_DIRECTORY "/esp-device";
+        autofree(BootManager) *m = NULL;
+        CbmBlkidOps native_ops = gpt_blkid_ops;
+        char *esp = NULL;
+
+        bootman_probe_set_gpt_vtables();
+        m = prepare_playground(&config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        native_ops.read_partition_table = cbm_part_table_read;
+        cbm_blkid_set_vtable(&native_ops);
+
+        esp_test_add_disk("sda", 8, 1, true);
+        esp_test_add_disk("sdb", 16, 1, true);
+
+        /* The host's disk is remembered, but doesn't back the image */
+        fail_if(rmdir(PLAYGROUND_ROOT "/sys/block/sda/device") != 0, "Failed to hide sda");
+        esp = cbm_esp_discover(PLAYGROUND_ROOT, false);
+        fail_if(!esp || !streq(esp, PLAYGROUND_ROOT "/dev/sdb1"), "Unexpected ESP %s", esp);
+        free(esp);
+
+        esp = cbm_esp_discover(PLAYGROUND_ROOT, true);
+        fail_if(!esp || !streq(esp, PLAYGROUND_ROOT "/dev/sda1"),
+                "Image did not use its own ESP, got %s",
+                esp);
+        free(esp);
+
+        /* No ESP on the image's disk means none at all */
+        fail_if(!write_test_gpt(PLAYGROUND_ROOT "/dev/sda", true), "Failed to corrupt sda");
+        fail_if(unlink(cache_path) != 0, "Failed to drop the cache");
+        esp = cbm_esp_discover(PLAYGROUND_ROOT, true);
+        fail_if(esp, "Image picked up the host ESP %s", esp);
+        esp = cbm_esp_discover(PLAYGROUND_ROOT, false);
+        fail_if(!esp || !streq(esp, PLAYGROUND_ROOT "/dev/sdb1"), "Unexpected ESP %s", esp);
+        free(esp);
+}
+END_TEST
+
+/**
+ * Report every device as part of a btrfs filesystem
+ */
+static int btrfs_probe_lookup_value(blkid_probe pr, const char *name, const char **data,
+                                    size_t *len)
+{
+        if (name && data && streq(name, "TYPE")) {
+                *data = "btrfs";
+                if (len) {
+                        *len = strlen(*data);
+                }
+                return 0;
+        }
+        return test_blkid_probe_lookup_value(pr, name, data, len);
+}
+
+/**
+ * The other disks of a btrfs root only carry mirrors of the ESP when its
+ * data is kept on more than one of them
+ */
+START_TEST(bootman_probe_esp_discover_mirrors)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = false };
+        const char *boot_device = PLAYGROUND_ROOT "/dev/sda1";
+        autofree(BootManager) *m = NULL;
+        autofree(char) *fs_dir = NULL;
+        autofree(char) *devices = NULL;
+        autofree(char) *single = NULL;
+        autofree(char) *raid1 = NULL;
+        CbmBlkidOps native_ops = gpt_blkid_ops;
+        NcArray *mirrors = NULL;
+        const char *disks[] = { "sda", "sdb" };
+
+        bootman_probe_set_gpt_vtables();
+        m = prepare_playground(&config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        native_ops.read_partition_table = cbm_part_table_read;
+        native_ops.probe_lookup_value = btrfs_probe_lookup_value;
+        cbm_blkid_set_vtable(&native_ops);
+
+        esp_test_add_disk("sda", 8, 1, true);
+        esp_test_add_disk("sdb", 16, 1, true);
+
+        fs_dir = string_printf(PLAYGROUND_ROOT "/sys/fs/btrfs/%s", DEFAULT_UUID);
+        devices = string_printf("%s/devices", fs_dir);
+        fail_if(!nc_mkdir_p(devices, 00755), "Failed to create %s", devices);
+        for (size_t i = 0; i < ARRAY_SIZE(disks); i++) {
+                autofree(char) *link = string_printf("%s/%s1", devices, disks[i]);
+                autofree(char) *target =
+                    string_printf(PLAYGROUND_ROOT "/sys/block/%s/%s1", disks[i], disks[i]);
+
+                fail_if(symlink(target, link) != 0, "Failed to link %s", link);
+        }
+
+        fail_if(cbm_esp_discover_mirrors(PLAYGROUND_ROOT, boot_device),
+                "Mirrored without knowing the profile");
+
+        single = string_printf("%s/allocation/data/single", fs_dir);
+        fail_if(!nc_mkdir_p(single, 00755), "Failed to create %s", single);
+        fail_if(cbm_esp_discover_mirrors(PLAYGROUND_ROOT, boot_device),
+                "Mirrored a single profile");
+
+        /* Still partly single while a balance converts it */
+        raid1 = string_printf("%s/allocation/data/raid1", fs_dir);
+        fail_if(!nc_mkdir_p(raid1, 00755), "Failed to create %s", raid1);
+        fail_if(cbm_esp_discover_mirrors(PLAYGROUND_ROOT, boot_device),
+                "Mirrored a profile being converted");
+
+        fail_if(rmdir(single) != 0, "Failed to remove %s", single);
+        mirrors = cbm_esp_discover_mirrors(PLAYGROUND_ROOT, boot_device);
+        fail_if(!mirrors || mirrors->len != 1, "Expected a single mirrored ESP");
+        fail_if(!streq(nc_array_get(mirrors, 0), PLAYGROUND_ROOT "/dev/sdb1"),
+                "Unexpected mirrored ESP %s",
+                (char *)nc_array_get(mirrors, 0));
+        nc_array_free(&mirrors, free);
+}
+END_TEST
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -235,6 +775,17 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_probe_basic_gpt);
         tcase_add_test(tc, bootman_probe_basic_mbr);
         tcase_add_test(tc, bootman_probe_basic_none);
+        tcase_add_test(tc, bootman_probe_topology_cached);
+        suite_add_tcase(s, tc);
+
+        tc = tcase_create("bootman_probe_native_functions");
+        tcase_add_test(tc, bootman_probe_crc32);
+        tcase_add_test(tc, bootman_probe_native_gpt);
+        tcase_add_test(tc, bootman_probe_native_mbr);
+        tcase_add_test(tc, bootman_probe_native_legacy);
+        tcase_add_test(tc, bootman_probe_esp_discover);
+        tcase_add_test(tc, bootman_probe_esp_discover_image);
+        tcase_add_test(tc, bootman_probe_esp_discover_mirrors);
         suite_add_tcase(s, tc);
 
         return s;
@@ -73,8 +73,9 @@ static void bootman_select_set_default_vtables(void)
 static void ensure_bootloader_is(BootManager *manager, const char *expected)
 {
         fail_if(manager == NULL, "No BootManager");
-        fail_if(!manager->bootloader, "No bootloader is selected. Expected %s", expected);
-        const char *name = manager->bootloader->name;
+        const BootLoader *bootloader = boot_manager_get_bootloader(manager);
+        fail_if(!bootloader, "No bootloader is selected. Expected %s", expected);
+        const char *name = bootloader->name;
         fail_if(!streq(name, expected), "Expected bootloader '%s', got '%s'", expected, name);
 }
 
@@ -170,6 +171,47 @@ START_TEST(bootman_select_uefi_image_without_boot)
 }
 END_TEST
 
+/**
+ * The root is only inspected, and the bootloader only selected, once they
+ * are needed. A failed selection is remembered until the root changes.
+ */
+START_TEST(bootman_select_lazy)
+{
+        static PlaygroundConfig config = { "4.2.1-121.kvm", NULL, 0, .uefi = true };
+        setenv("CBM_TEST_FSTYPE", "vfat", 1);
+        autofree(BootManager) *m = NULL;
+        SystemConfig *sysconfig = NULL;
+        int wanted;
+        bootman_select_set_default_vtables();
+
+        m = prepare_playground(&config);
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to set prefix");
+        fail_if(m->sysconfig, "Root inspected by setting the prefix");
+        fail_if(m->bootloader, "Bootloader selected by setting the prefix");
+
+        /* Plain configuration needs neither */
+        (void)boot_manager_get_timeout_value(m);
+        fail_if(m->sysconfig || m->bootloader, "Reading the timeout inspected the root");
+
+        sysconfig = boot_manager_get_sysconfig(m);
+        fail_if(!sysconfig, "Failed to inspect root");
+        fail_if(m->bootloader, "Inspecting the root selected a bootloader");
+
+        /* Nothing satisfies every capability, nor is it tried again */
+        wanted = sysconfig->wanted_boot_mask;
+        sysconfig->wanted_boot_mask = BOOTLOADER_CAP_MAX - 1;
+        fail_if(boot_manager_has_bootloader(m), "Impossible boot mask was satisfied");
+        sysconfig->wanted_boot_mask = wanted;
+        fail_if(boot_manager_has_bootloader(m), "Failed selection was retried");
+        fail_if(boot_manager_get_bootloader(m), "Failed selection was retried");
+
+        /* A new root gets a new chance */
+        fail_if(!boot_manager_set_prefix(m, PLAYGROUND_ROOT), "Failed to set prefix");
+        ensure_bootloader_is(m, UEFI_BOOTLOADER_NAME);
+        fail_if(!m->sysconfig, "Selecting a bootloader didn't inspect the root");
+}
+END_TEST
+
 /**
  * Coerce legacy lookup
  */
@@ -223,10 +265,13 @@ static CbmBlkidOps legacy_blkid_ops = {
         .partlist_get_partition = test_blkid_partlist_get_partition,
         .partition_get_flags = legacy_partition_get_flags,
         .partition_get_uuid = legacy_partition_get_uuid,
+        .partition_get_partno = test_blkid_partition_get_partno,
+        .partition_get_type_string = test_blkid_partition_get_type_string,
         .partlist_get_table = test_blkid_partlist_get_table,
         .parttable_get_type = test_blkid_parttable_get_type,
         .devno_to_wholedisk = legacy_devno_to_wholedisk,
         .devno_to_devname = test_blkid_devno_to_devname,
+        .read_partition_table = test_blkid_read_partition_table,
 };
 
 static void bootman_select_set_legacy_vtables(void)
@@ -322,10 +367,13 @@ static CbmBlkidOps grub2_blkid_ops = {
         .partlist_get_partition = test_blkid_partlist_get_partition,
         .partition_get_flags = test_blkid_partition_get_flags,
         .partition_get_uuid = test_blkid_partition_get_uuid,
+        .partition_get_partno = test_blkid_partition_get_partno,
+        .partition_get_type_string = test_blkid_partition_get_type_string,
         .partlist_get_table = test_blkid_partlist_get_table,
         .parttable_get_type = test_blkid_parttable_get_type,
         .devno_to_wholedisk = test_blkid_devno_to_wholedisk,
         .devno_to_devname = test_blkid_devno_to_devname,
+        .read_partition_table = test_blkid_read_partition_table,
 };
 
 static void bootman_select_set_grub2_vtables(void)
@@ -425,6 +473,7 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_select_uefi_native_without_boot);
         tcase_add_test(tc, bootman_select_uefi_image_with_boot);
         tcase_add_test(tc, bootman_select_uefi_image_without_boot);
+        tcase_add_test(tc, bootman_select_lazy);
         suite_add_tcase(s, tc);
 
         /* extlinux tests */
@@ -88,7 +88,7 @@ START_TEST(bootman_legacy_get_boot_device)
         /* Ensure cleanup */
         m = prepare_playground(&legacy_config);
 
-        boot_device = get_boot_device();
+        boot_device = get_boot_device(PLAYGROUND_ROOT);
         fail_if(boot_device != NULL, "Found incorrect UEFI device for Legacy Boot");
 
         boot_device = get_legacy_boot_device(PLAYGROUND_ROOT);
@@ -11,19 +11,33 @@
 
 #define _GNU_SOURCE
 #include <check.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "bootloader.h"
 #include "bootman.h"
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+#include "bootvar.h"
+#endif
 #include "config.h"
+#include "esp-index.h"
+#include "esp.h"
 #include "files.h"
 #include "log.h"
 #include "nica/array.h"
 #include "nica/files.h"
+#include "parttable.h"
+#include "pe.h"
+#include "sha256.h"
+#include "stats.h"
+#include "systemd-class.h"
 #include "util.h"
 #include "writer.h"
 
@@ -70,7 +84,7 @@ START_TEST(bootman_uefi_get_boot_device)
         boot_device = get_legacy_boot_device(PLAYGROUND_ROOT);
         fail_if(boot_device != NULL, "Found incorrect legacy device for UEFI Boot");
 
-        boot_device = get_boot_device();
+        boot_device = get_boot_device(PLAYGROUND_ROOT);
         fail_if(!boot_device, "Failed to determine UEFI boot device");
 
         exp = string_printf("%s/dev/disk/by-partuuid/e90f44b5-bb8a-41af-b680-b0bf5b0f2a65",
@@ -411,6 +425,752 @@ START_TEST(bootman_uefi_initrd_freestandings)
 }
 END_TEST
 
+/**
+ * Ensure every initrd of a kernel is merged into a single bundle that the
+ * loader entry references, rather than separate copies.
+ */
+START_TEST(bootman_uefi_initrd_bundle)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *path_initrd = NULL;
+        autofree(char) *bundle_conf = NULL;
+        char *initrd_name = "00-initrd";
+        const char *esp_path = "/efi/" KERNEL_NAMESPACE;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        bundle_conf = string_printf("%s/%s/initrd_bundle", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        fail_if(!file_set_text(bundle_conf, "yes"), "Failed to enable initrd bundles");
+
+        path_initrd = string_printf("%s%s/%s", PLAYGROUND_ROOT, INITRD_DIRECTORY, initrd_name);
+        fail_if(!file_set_text(path_initrd, "Placeholder initrd"), "Failed to write initrd");
+
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to find freestanding initrd");
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(check_initrd_file_exist(m, initrd_name), "Freestanding initrd copied separately");
+
+        for (size_t k = 0; k < uefi_config.n_kernels; k++) {
+                PlaygroundKernel *kernel = &uefi_config.initial_kernels[k];
+                autofree(char) *bundle_name = NULL;
+                autofree(char) *bundle_path = NULL;
+                autofree(char) *initrd_path = NULL;
+                autofree(char) *conf_path = NULL;
+                autofree(char) *config = NULL;
+                autofree(char) *exp = NULL;
+                uint8_t expected[CBM_SHA256_DIGEST_SIZE];
+                uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+                CbmSha256 hash;
+
+                bundle_name = string_printf("initrd-bundle-%s.%s.%s-%d",
+                                            KERNEL_NAMESPACE,
+                                            kernel->ktype,
+                                            kernel->version,
+                                            kernel->release);
+                bundle_path = string_printf("%s%s/%s", BOOT_FULL, esp_path, bundle_name);
+                initrd_path = string_printf("%s%s/initrd-%s.%s.%s-%d",
+                                            BOOT_FULL,
+                                            esp_path,
+                                            KERNEL_NAMESPACE,
+                                            kernel->ktype,
+                                            kernel->version,
+                                            kernel->release);
+
+                /* Kernel initrd first, then the freestanding ones, each 4 byte aligned */
+                exp = string_printf("%s", kernel->version);
+                cbm_sha256_init(&hash);
+                cbm_sha256_update(&hash, exp, strlen(exp));
+                cbm_sha256_update(&hash, "\0\0\0", (4 - strlen(exp) % 4) % 4);
+                cbm_sha256_update(&hash, "Placeholder initrd", strlen("Placeholder initrd"));
+                cbm_sha256_final(&hash, expected);
+                fail_if(!cbm_sha256_file(bundle_path, digest), "Missing bundle %s", bundle_path);
+                fail_if(memcmp(digest, expected, sizeof(digest)) != 0,
+                        "Unexpected bundle contents: %s",
+                        bundle_path);
+                fail_if(nc_file_exists(initrd_path), "Initrd copied separately: %s", initrd_path);
+
+                conf_path = string_printf("%s/loader/entries/Clear-linux-%s-%s-%d.conf",
+                                          BOOT_FULL,
+                                          kernel->ktype,
+                                          kernel->version,
+                                          kernel->release);
+                fail_if(!file_get_text(conf_path, &config), "Missing entry %s", conf_path);
+                free(exp);
+                exp = string_printf("\ninitrd %s/%s\noptions ", esp_path, bundle_name);
+                fail_if(!strstr(config, exp), "Entry does not use the bundle:\n%s", config);
+        }
+
+        unlink(bundle_conf);
+}
+END_TEST
+
+/**
+ * Ensure shared initrds are stored once by content hash, referenced from
+ * every entry, and dropped again once nothing uses them.
+ */
+START_TEST(bootman_uefi_initrd_blobs)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *path_initrd = NULL;
+        autofree(char) *blobs_conf = NULL;
+        autofree(char) *blob_name = NULL;
+        autofree(char) *blob_path = NULL;
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        uint8_t check[CBM_SHA256_DIGEST_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        char *initrd_name = "00-initrd";
+        const char *esp_path = "/efi/" KERNEL_NAMESPACE;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        blobs_conf = string_printf("%s/%s/initrd_blobs", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        fail_if(!file_set_text(blobs_conf, "yes"), "Failed to enable initrd blobs");
+
+        path_initrd = string_printf("%s%s/%s", PLAYGROUND_ROOT, INITRD_DIRECTORY, initrd_name);
+        fail_if(!file_set_text(path_initrd, "Placeholder initrd"), "Failed to write initrd");
+        fail_if(!cbm_sha256_file(path_initrd, digest), "Failed to hash initrd");
+        cbm_sha256_to_hex(digest, hex);
+        blob_name = string_printf("blobs/%s.cpio", hex);
+        blob_path = string_printf("%s%s/%s", BOOT_FULL, esp_path, blob_name);
+
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to find freestanding initrd");
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(!nc_file_exists(blob_path), "Missing initrd blob %s", blob_path);
+        fail_if(check_initrd_file_exist(m, initrd_name), "Freestanding initrd copied separately");
+
+        for (size_t k = 0; k < uefi_config.n_kernels; k++) {
+                PlaygroundKernel *kernel = &uefi_config.initial_kernels[k];
+                autofree(char) *conf_path = NULL;
+                autofree(char) *config = NULL;
+                autofree(char) *exp = NULL;
+
+                conf_path = string_printf("%s/loader/entries/Clear-linux-%s-%s-%d.conf",
+                                          BOOT_FULL,
+                                          kernel->ktype,
+                                          kernel->version,
+                                          kernel->release);
+                fail_if(!file_get_text(conf_path, &config), "Missing entry %s", conf_path);
+
+                /* Own initrd stays a separate file, the shared one is a blob */
+                exp = string_printf("initrd %s/initrd-%s.%s.%s-%d\ninitrd %s/%s\n",
+                                    esp_path,
+                                    KERNEL_NAMESPACE,
+                                    kernel->ktype,
+                                    kernel->version,
+                                    kernel->release,
+                                    esp_path,
+                                    blob_name);
+                fail_if(!strstr(config, exp), "Entry does not use the blob:\n%s", config);
+        }
+
+        /* A blob is only reused while it holds what it is named for */
+        fail_if(!file_set_text(blob_path, "corrupt"), "Failed to corrupt the blob");
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(cbm_stats_get(CBM_STAT_INITRD_BLOB_WRITTEN) != 1, "Corrupt blob was not rewritten");
+        fail_if(!cbm_sha256_file(blob_path, check), "Failed to hash the blob");
+        fail_if(memcmp(check, digest, sizeof(digest)) != 0, "Blob does not hold the initrd");
+
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(cbm_stats_get(CBM_STAT_INITRD_BLOB_WRITTEN) != 0, "Intact blob was rewritten");
+        fail_if(cbm_stats_get(CBM_STAT_INITRD_BLOB_REUSED) == 0, "Intact blob was not reused");
+
+        /* Nothing references the blob any more */
+        unlink(blobs_conf);
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(nc_file_exists(blob_path), "Unreferenced initrd blob was kept");
+        fail_if(!check_initrd_file_exist(m, initrd_name), "Failed copying initrd file");
+}
+END_TEST
+
+/**
+ * Count the regular files directly within @path, leaving out hidden ones
+ */
+static int count_files(const char *path)
+{
+        struct dirent *ent = NULL;
+        DIR *dir = NULL;
+        int ret = 0;
+
+        dir = opendir(path);
+        if (!dir) {
+                return 0;
+        }
+        while ((ent = readdir(dir)) != NULL) {
+                autofree(char) *child = string_printf("%s/%s", path, ent->d_name);
+                struct stat st = { 0 };
+
+                if (ent->d_name[0] != '.' && lstat(child, &st) == 0 && S_ISREG(st.st_mode)) {
+                        ret++;
+                }
+        }
+        closedir(dir);
+
+        return ret;
+}
+
+/**
+ * Ensure the fragmentation scan covers the blobs and UKIs as well as the
+ * kernel destination, and that defragmenting leaves every file intact.
+ */
+START_TEST(bootman_uefi_defrag)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *path_initrd = NULL;
+        autofree(char) *blobs_conf = NULL;
+        autofree(char) *blob_path = NULL;
+        autofree(char) *kernel_dir = NULL;
+        autofree(char) *uki_dir = NULL;
+        autofree(char) *uki_path = NULL;
+        BootManagerStatus status = { 0 };
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        uint8_t check[CBM_SHA256_DIGEST_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        int expected;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        blobs_conf = string_printf("%s/%s/initrd_blobs", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        fail_if(!file_set_text(blobs_conf, "yes"), "Failed to enable initrd blobs");
+        path_initrd = string_printf("%s%s/00-initrd", PLAYGROUND_ROOT, INITRD_DIRECTORY);
+        fail_if(!file_set_text(path_initrd, "Placeholder initrd"), "Failed to write initrd");
+        fail_if(!cbm_sha256_file(path_initrd, digest), "Failed to hash initrd");
+        cbm_sha256_to_hex(digest, hex);
+
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to find freestanding initrd");
+        fail_if(!boot_manager_update(m), "Failed to update image");
+
+        kernel_dir = string_printf("%s/efi/%s", BOOT_FULL, KERNEL_NAMESPACE);
+        blob_path = string_printf("%s/blobs/%s.cpio", kernel_dir, hex);
+        fail_if(!nc_file_exists(blob_path), "Missing initrd blob %s", blob_path);
+
+        /* Not written by us, but still where the loader finds kernels */
+        uki_dir = cbm_esp_build_path(BOOT_FULL, "EFI", "Linux", NULL);
+        uki_path = string_printf("%s/other.efi", uki_dir);
+        fail_if(!nc_mkdir_p(uki_dir, 00755), "Failed to create %s", uki_dir);
+        fail_if(!file_set_text(uki_path, "image"), "Failed to write %s", uki_path);
+
+        expected = count_files(kernel_dir) + 1 + 1;
+        fail_if(!boot_manager_get_status(m, &status), "Failed to get the status");
+        fail_if(status.kernel_files != expected,
+                "Counted %d files instead of %d",
+                status.kernel_files,
+                expected);
+        fail_if(status.fragmented_files > status.kernel_files, "Too many fragmented files");
+        boot_manager_status_free(&status);
+
+        fail_if(!boot_manager_defrag(m), "Failed to defragment");
+        fail_if(!cbm_sha256_file(blob_path, check), "Failed to hash the blob");
+        fail_if(memcmp(check, digest, sizeof(digest)) != 0, "Blob changed by defragmenting");
+        fail_if(count_files(kernel_dir) + 2 != expected, "Files changed by defragmenting");
+
+        unlink(blobs_conf);
+}
+END_TEST
+
+/**
+ * Read a little endian value from the image at @offset, 0 if out of bounds
+ */
+static uint32_t uki_read_le(const unsigned char *image, size_t size, size_t offset, size_t len)
+{
+        uint32_t v = 0;
+
+        if (offset + len > size) {
+                return 0;
+        }
+        for (size_t i = len; i > 0; i--) {
+                v = (v << 8) | image[offset + i - 1];
+        }
+        return v;
+}
+
+/**
+ * Load a whole (small) image into memory
+ */
+static unsigned char *uki_load(const char *path, size_t *size)
+{
+        unsigned char *image = NULL;
+        FILE *fp = NULL;
+        long len;
+
+        fp = fopen(path, "rb");
+        if (!fp) {
+                return NULL;
+        }
+        if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) != 0) {
+                fclose(fp);
+                return NULL;
+        }
+        image = malloc((size_t)len);
+        if (image && fread(image, 1, (size_t)len, fp) != (size_t)len) {
+                free(image);
+                image = NULL;
+        }
+        fclose(fp);
+        *size = (size_t)len;
+        return image;
+}
+
+/**
+ * Ensure the assembled Unified Kernel Image has its sections laid out after
+ * the stub's, with the initrds each starting 4 byte aligned in .initrd and
+ * the optional header accounting for the new data.
+ */
+START_TEST(bootman_uefi_uki_layout)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *uki_conf = NULL;
+        autofree(char) *path_initrd = NULL;
+        autofree(char) *uki_name = NULL;
+        autofree(char) *uki_path = NULL;
+        autofree(char) *initrd = NULL;
+        autofree(char) *exp = NULL;
+        unsigned char *stub = NULL;
+        unsigned char *image = NULL;
+        const char *stub_src = TOP_DIR "/tests/data/uki-stub.efi";
+        PlaygroundKernel *kernel = &uefi_kernels[0];
+        size_t stub_size = 0;
+        size_t size = 0;
+        size_t len = 0;
+        size_t opt, table;
+        uint32_t n_stub, n_sections, file_align, init_data;
+        uint64_t raw_end = 0;
+        const char *last = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        fail_if(!copy_file(stub_src,
+                           PLAYGROUND_ROOT "/usr/lib/systemd/boot/efi/" SYSTEMD_UKI_STUB,
+                           00644),
+                "Failed to install the EFI stub");
+        uki_conf = string_printf("%s/%s/uki", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        fail_if(!file_set_text(uki_conf, "yes"), "Failed to enable UKIs");
+
+        path_initrd = string_printf("%s%s/00-initrd", PLAYGROUND_ROOT, INITRD_DIRECTORY);
+        fail_if(!file_set_text(path_initrd, "Placeholder initrd"), "Failed to write initrd");
+
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to find freestanding initrd");
+        fail_if(!boot_manager_update(m), "Failed to update image");
+
+        uki_name = string_printf("%s-%s-%s-%d.efi",
+                                 boot_manager_get_vendor_prefix(m),
+                                 kernel->ktype,
+                                 kernel->version,
+                                 kernel->release);
+        uki_path = cbm_esp_build_path(BOOT_FULL, "EFI", "Linux", uki_name, NULL);
+        fail_if(!uki_path || !nc_file_exists(uki_path), "Missing UKI %s", uki_name);
+
+        /* Kernel initrd, zero padded, then the freestanding one */
+        initrd = cbm_pe_read_section(uki_path, ".initrd", &len);
+        fail_if(!initrd, "Missing .initrd section");
+        exp = string_printf("%s", kernel->version);
+        fail_if(len != ((strlen(exp) + 3) & ~(size_t)3) + strlen("Placeholder initrd"),
+                "Initrds not 4 byte aligned in .initrd: %zu bytes", len);
+        fail_if(memcmp(initrd, exp, strlen(exp)) != 0, "Kernel initrd missing from .initrd");
+        for (size_t i = strlen(exp); i < len - strlen("Placeholder initrd"); i++) {
+                fail_if(initrd[i] != '\0', "Padding in .initrd is not zeroed");
+        }
+        fail_if(memcmp(initrd + len - strlen("Placeholder initrd"),
+                       "Placeholder initrd",
+                       strlen("Placeholder initrd")) != 0,
+                "Freestanding initrd missing from .initrd");
+
+        stub = uki_load(stub_src, &stub_size);
+        image = uki_load(uki_path, &size);
+        fail_if(!stub || !image, "Failed to load the images");
+
+        opt = uki_read_le(image, size, 0x3c, 4) + 4 + 20;
+        n_stub = uki_read_le(stub, stub_size, uki_read_le(stub, stub_size, 0x3c, 4) + 6, 2);
+        n_sections = uki_read_le(image, size, opt - 20 + 2, 2);
+        table = opt + uki_read_le(image, size, opt - 20 + 16, 2);
+        file_align = uki_read_le(image, size, opt + 36, 4);
+        fail_if(n_sections <= n_stub, "No sections were added to the stub");
+
+        /* Appended sections follow each other on disk and stay in the file */
+        init_data = uki_read_le(stub, stub_size, uki_read_le(stub, stub_size, 0x3c, 4) + 24 + 8, 4);
+        for (uint32_t i = 0; i < n_sections; i++) {
+                size_t sect = table + i * 40;
+                uint32_t raw_size = uki_read_le(image, size, sect + 16, 4);
+                uint32_t raw_ptr = uki_read_le(image, size, sect + 20, 4);
+
+                fail_if(raw_ptr < raw_end, "Section %u overlaps the previous one", i);
+                fail_if((uint64_t)raw_ptr + raw_size > size, "Section %u is truncated", i);
+                raw_end = (uint64_t)raw_ptr + raw_size;
+                if (i < n_stub) {
+                        continue;
+                }
+                fail_if(raw_ptr % file_align || raw_size % file_align,
+                        "Section %u is not file aligned",
+                        i);
+                init_data += raw_size;
+                last = (const char *)image + sect;
+        }
+        fail_if(!last || strncmp(last, ".linux", 8) != 0, "The .linux section is not last");
+        fail_if(uki_read_le(image, size, opt + 8, 4) != init_data,
+                "SizeOfInitializedData does not include the new sections");
+
+        free(stub);
+        free(image);
+        unlink(uki_conf);
+}
+END_TEST
+
+/**
+ * Stand in for the codecs: whatever the filter, write a short output
+ */
+static int transcode_test_system(const char *command)
+{
+        const char *out = strstr(command, " > '");
+        autofree(char) *path = NULL;
+
+        if (!out) {
+                return 1;
+        }
+        path = strdup(out + 4);
+        fail_if(!path, "Out of memory");
+        if (strchr(path, '\'')) {
+                *strchr(path, '\'') = '\0';
+        }
+        return file_set_text(path, "small") ? 0 : 1;
+}
+
+static CbmSystemOps TranscodeTestOps;
+
+/**
+ * Ensure initrds are only recompressed once, only count the savings when
+ * they actually recompress, and that cached results no kernel uses any more
+ * are removed.
+ */
+START_TEST(bootman_uefi_initrd_transcode)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *compression_conf = NULL;
+        autofree(char) *path_initrd = NULL;
+        autofree(char) *cached = NULL;
+        autofree(char) *stale = NULL;
+        autofree(char) *stale_skip = NULL;
+        static const char zstd[128] = { 0x28, (char)0xb5, 0x2f, (char)0xfd };
+        const char *cache_dir = PLAYGROUND_ROOT CACHE_DIRECTORY "/initrd";
+        uint8_t digest[CBM_SHA256_DIGEST_SIZE];
+        char hex[CBM_SHA256_HEX_SIZE];
+        FILE *fp = NULL;
+
+        TranscodeTestOps = SystemTestOps;
+        TranscodeTestOps.system = transcode_test_system;
+        cbm_system_set_vtable(&TranscodeTestOps);
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        compression_conf =
+            string_printf("%s/%s/initrd_compression", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        fail_if(!file_set_text(compression_conf, "gzip"), "Failed to enable recompression");
+
+        path_initrd = string_printf("%s%s/00-initrd", PLAYGROUND_ROOT, INITRD_DIRECTORY);
+        fp = fopen(path_initrd, "w");
+        fail_if(!fp, "Failed to open %s", path_initrd);
+        fwrite(zstd, 1, sizeof(zstd), fp);
+        fclose(fp);
+        fail_if(!cbm_sha256_file(path_initrd, digest), "Failed to hash initrd");
+        cbm_sha256_to_hex(digest, hex);
+        cached = string_printf("%s/%s.gzip-9.cpio", cache_dir, hex);
+
+        boot_manager_set_image_mode(m, true);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to find freestanding initrd");
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(cbm_stats_get(CBM_STAT_INITRD_TRANSCODED) != 1, "Initrd was not recompressed once");
+        fail_if(cbm_stats_get(CBM_STAT_INITRD_BYTES_SAVED) != sizeof(zstd) - strlen("small"),
+                "Incorrect savings");
+        fail_if(!nc_file_exists(cached), "Missing recompressed initrd %s", cached);
+
+        /* Results of other sources, or other settings, are dropped */
+        stale = string_printf("%s/%s.zstd-19.cpio", cache_dir, hex);
+        stale_skip = string_printf("%s/0000.gzip-9.cpio.skip", cache_dir);
+        fail_if(!file_set_text(stale, "stale"), "Failed to write stale entry");
+        fail_if(!file_set_text(stale_skip, ""), "Failed to write stale skip marker");
+
+        /* Reused from the cache, which saves nothing more */
+        boot_manager_invalidate(m, BOOT_MANAGER_STALE_INITRDS);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to enumerate initrds");
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(cbm_stats_get(CBM_STAT_INITRD_TRANSCODED) != 0, "Cached initrd recompressed");
+        fail_if(cbm_stats_get(CBM_STAT_INITRD_BYTES_SAVED) != 0, "Counted savings of a cache hit");
+        fail_if(!nc_file_exists(cached), "Used recompressed initrd was removed");
+        fail_if(nc_file_exists(stale), "Unused recompressed initrd was kept");
+        fail_if(nc_file_exists(stale_skip), "Unused skip marker was kept");
+
+        /* No kernel uses it any more */
+        unlink(path_initrd);
+        boot_manager_invalidate(m, BOOT_MANAGER_STALE_INITRDS);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to enumerate initrds");
+        fail_if(!boot_manager_update(m), "Failed to update image");
+        fail_if(nc_file_exists(cached), "Recompressed initrd of a removed source was kept");
+
+        unlink(compression_conf);
+}
+END_TEST
+
+#define MIRROR_ROOT PLAYGROUND_ROOT "/mirror"
+
+static CbmSystemOps MirrorTestOps;
+static CbmBlkidOps MirrorBlkidOps;
+
+/**
+ * The ESP on sdb is already mounted, so the mirror needs no mounting
+ */
+static char *mirror_test_get_mountpoint_for_device(const char *device)
+{
+        if (device && streq(device, PLAYGROUND_ROOT "/dev/sdb1")) {
+                return strdup(MIRROR_ROOT);
+        }
+        return NULL;
+}
+
+/**
+ * The root is a btrfs spread over sda and sdb
+ */
+static int mirror_test_probe_lookup_value(blkid_probe pr, const char *name, const char **data,
+                                          size_t *len)
+{
+        if (name && data && streq(name, "TYPE")) {
+                *data = "btrfs";
+                if (len) {
+                        *len = strlen(*data);
+                }
+                return 0;
+        }
+        return test_blkid_probe_lookup_value(pr, name, data, len);
+}
+
+/**
+ * Both disks carry an ESP as their first partition
+ */
+static bool mirror_test_read_partition_table(__cbm_unused__ const char *devname,
+                                             CbmPartTable *table)
+{
+        memset(table, 0, sizeof(*table));
+        table->parts = calloc(1, sizeof(CbmPartition));
+        if (!table->parts) {
+                return false;
+        }
+        snprintf(table->type, sizeof(table->type), "gpt");
+        table->count = 1;
+        table->parts[0].partno = 1;
+        snprintf(table->parts[0].type, sizeof(table->parts[0].type), "%s", CBM_ESP_TYPE_GUID);
+        return true;
+}
+
+/**
+ * Add the disk @name with devno 8:@devno_minor as a device of the btrfs
+ * root, with its ESP as the first partition
+ */
+static void mirror_test_add_disk(const char *fs_dir, const char *name, unsigned int devno_minor)
+{
+        autofree(char) *path = NULL;
+        autofree(char) *text = NULL;
+        autofree(char) *target = NULL;
+
+        path = string_printf(PLAYGROUND_ROOT "/sys/block/%s/device", name);
+        fail_if(!nc_mkdir_p(path, 00755), "Failed to create %s", path);
+        free(path);
+
+        path = string_printf(PLAYGROUND_ROOT "/sys/block/%s/dev", name);
+        text = string_printf("8:%u\n", devno_minor);
+        fail_if(!file_set_text(path, text), "Failed to write %s", path);
+        free(path);
+
+        path = string_printf(PLAYGROUND_ROOT "/sys/block/%s/%s1", name, name);
+        fail_if(!nc_mkdir_p(path, 00755), "Failed to create %s", path);
+        free(path);
+        path = string_printf(PLAYGROUND_ROOT "/sys/block/%s/%s1/partition", name, name);
+        fail_if(!file_set_text(path, "1\n"), "Failed to write %s", path);
+        free(path);
+
+        path = string_printf("%s/devices", fs_dir);
+        fail_if(!nc_mkdir_p(path, 00755), "Failed to create %s", path);
+        free(path);
+        path = string_printf("%s/devices/%s1", fs_dir, name);
+        target = string_printf(PLAYGROUND_ROOT "/sys/block/%s/%s1", name, name);
+        fail_if(symlink(target, path) != 0, "Failed to link %s", path);
+}
+
+/**
+ * Return the path on the mirror of @path on the primary ESP
+ */
+static char *mirror_test_path(const char *path)
+{
+        return string_printf(MIRROR_ROOT "%s", path + strlen(BOOT_FULL));
+}
+
+/**
+ * Ensure a redundant root gets its other ESP kept in sync, that only what
+ * we install ends up there, and that copies damaged behind the manifest's
+ * back are caught by reading the mirror back when copies are verified
+ */
+START_TEST(bootman_uefi_mirrors)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *fs_dir = NULL;
+        autofree(char) *profile = NULL;
+        autofree(char) *conf = NULL;
+        autofree(char) *conf_mirror = NULL;
+        autofree(char) *kernel_dir = NULL;
+        autofree(char) *kernel_mirror = NULL;
+        autofree(char) *foreign_dir = NULL;
+        autofree(char) *foreign = NULL;
+        autofree(char) *foreign_mirror = NULL;
+        autofree(char) *contents = NULL;
+        autofree(char) *verify_conf = NULL;
+        struct timespec times[2];
+        struct stat st = { 0 };
+        FILE *fp = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+
+        MirrorBlkidOps = BlkidTestOps;
+        MirrorBlkidOps.probe_lookup_value = mirror_test_probe_lookup_value;
+        MirrorBlkidOps.read_partition_table = mirror_test_read_partition_table;
+        cbm_blkid_set_vtable(&MirrorBlkidOps);
+        MirrorTestOps = SystemTestOps;
+        MirrorTestOps.get_mountpoint_for_device = mirror_test_get_mountpoint_for_device;
+        cbm_system_set_vtable(&MirrorTestOps);
+
+        fs_dir = string_printf(PLAYGROUND_ROOT "/sys/fs/btrfs/%s", DEFAULT_UUID);
+        mirror_test_add_disk(fs_dir, "sda", 0);
+        mirror_test_add_disk(fs_dir, "sdb", 16);
+
+        /* sda1 is the ESP in use, sdb1 is mounted as the mirror */
+        fail_if(symlink("disk/by-partuuid/e90f44b5-bb8a-41af-b680-b0bf5b0f2a65",
+                        PLAYGROUND_ROOT "/dev/sda1") != 0,
+                "Failed to link the primary ESP");
+        fail_if(!file_set_text(PLAYGROUND_ROOT "/dev/sdb1", "esp"), "Failed to write sdb1");
+        fail_if(!nc_mkdir_p(MIRROR_ROOT, 00755), "Failed to create the mirror");
+
+        /* Data kept on a single disk isn't worth mirroring the ESP for */
+        profile = string_printf("%s/allocation/data/single", fs_dir);
+        fail_if(!nc_mkdir_p(profile, 00755), "Failed to create %s", profile);
+        fail_if(!boot_manager_update(m), "Failed to update without mirrors");
+        fail_if(count_files(MIRROR_ROOT) != 0, "Mirrored a single profile filesystem");
+        fail_if(rmdir(profile) != 0, "Failed to remove %s", profile);
+        free(profile);
+
+        /* Somebody else's files on the primary ESP are theirs to look after */
+        foreign_dir = cbm_esp_build_path(BOOT_FULL, "EFI", "Microsoft", "Boot", NULL);
+        fail_if(!nc_mkdir_p(foreign_dir, 00755), "Failed to create %s", foreign_dir);
+        foreign = string_printf("%s/bootmgfw.efi", foreign_dir);
+        fail_if(!file_set_text(foreign, "windows"), "Failed to write %s", foreign);
+        foreign_mirror = mirror_test_path(foreign);
+
+        profile = string_printf("%s/allocation/data/raid1", fs_dir);
+        fail_if(!nc_mkdir_p(profile, 00755), "Failed to create %s", profile);
+        cbm_stats_reset();
+        fail_if(!boot_manager_update(m), "Failed to update the mirrors");
+        fail_if(cbm_stats_get(CBM_STAT_MIRROR_COPIED) == 0, "Nothing was copied to the mirror");
+
+        conf = cbm_esp_build_path(BOOT_FULL, "loader", "loader.conf", NULL);
+        conf_mirror = mirror_test_path(conf);
+        fail_if(!cbm_files_match(conf, conf_mirror), "Loader configuration was not mirrored");
+
+        kernel_dir = cbm_esp_build_path(BOOT_FULL, "EFI", KERNEL_NAMESPACE, NULL);
+        kernel_mirror = mirror_test_path(kernel_dir);
+        fail_if(count_files(kernel_dir) == 0, "No kernels were installed");
+        fail_if(count_files(kernel_mirror) != count_files(kernel_dir), "Kernels were not mirrored");
+        fail_if(nc_file_exists(foreign_mirror), "Mirrored files we don't own");
+
+        /* Damage the copy without the size or times giving it away */
+        fail_if(stat(conf_mirror, &st) != 0, "Failed to stat %s", conf_mirror);
+        fail_if(!file_get_text(conf_mirror, &contents), "Failed to read %s", conf_mirror);
+        contents[0] = contents[0] == 'x' ? 'y' : 'x';
+        fp = fopen(conf_mirror, "r+");
+        fail_if(!fp, "Failed to open %s", conf_mirror);
+        fail_if(fputs(contents, fp) < 0, "Failed to write %s", conf_mirror);
+        fail_if(fclose(fp) != 0, "Failed to close %s", conf_mirror);
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        fail_if(utimensat(AT_FDCWD, conf_mirror, times, 0) != 0, "Failed to restore times");
+
+        /* Only reading the mirror back tells, which is left to verify_copies */
+        fail_if(!boot_manager_update(m), "Copies on the mirror were read back");
+        verify_conf = string_printf("%s/%s/verify_copies", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        fail_if(!file_set_text(verify_conf, "yes"), "Failed to enable verifying copies");
+        fail_if(boot_manager_update(m), "Damaged copy on the mirror went unnoticed");
+        fail_if(!boot_manager_update(m), "Failed to repair the mirror");
+        fail_if(!cbm_files_match(conf, conf_mirror), "Damaged copy was not repaired");
+        unlink(verify_conf);
+}
+END_TEST
+
+static CbmSystemOps DetachedTestOps;
+static int detached_mounts;
+
+/**
+ * Stand in for a detached mount with a descriptor on the boot directory,
+ * which /proc/self/fd resolves just the same
+ */
+static int detached_test_mount(__cbm_unused__ const char *source,
+                               __cbm_unused__ const char *filesystemtype,
+                               __cbm_unused__ const char *options)
+{
+        detached_mounts++;
+        return open(BOOT_FULL, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Ensure updates go through a detached mount when enabled, and that
+ * mount-boot still leaves a mount behind at the boot directory
+ */
+START_TEST(bootman_uefi_detached_mount)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *detached_conf = NULL;
+        autofree(char) *kernel_dir = NULL;
+        autofree(char) *boot_dir = NULL;
+
+        DetachedTestOps = SystemTestOps;
+        DetachedTestOps.mount_detached = detached_test_mount;
+        cbm_system_set_vtable(&DetachedTestOps);
+        detached_mounts = 0;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+
+        detached_conf =
+            string_printf("%s/%s/detached_mount", PLAYGROUND_ROOT, KERNEL_CONF_DIRECTORY);
+        fail_if(!file_set_text(detached_conf, "yes"), "Failed to enable detached mounts");
+
+        fail_if(!boot_manager_update(m), "Failed to update through a detached mount");
+        fail_if(detached_mounts != 1, "Boot partition was not mounted detached");
+        kernel_dir = cbm_esp_build_path(BOOT_FULL, "EFI", KERNEL_NAMESPACE, NULL);
+        fail_if(count_files(kernel_dir) == 0, "No kernels were installed");
+        boot_dir = boot_manager_get_boot_dir(m);
+        fail_if(!boot_dir || !streq(boot_dir, BOOT_FULL), "Boot directory was not restored");
+        free(boot_dir);
+        boot_dir = NULL;
+
+        /* mount-boot is for others to use the boot partition */
+        boot_manager_set_attach_boot(m, true);
+        fail_if(boot_manager_detect_and_mount_boot(m, &boot_dir) != 1,
+                "Failed to mount the boot directory");
+        fail_if(detached_mounts != 1, "Mounted detached for mount-boot");
+        fail_if(!boot_dir || !streq(boot_dir, BOOT_FULL), "Mounted away from the boot directory");
+
+        unlink(detached_conf);
+}
+END_TEST
+
 START_TEST(bootman_uefi_missing_initrd_freestandings)
 {
         autofree(BootManager) *m = NULL;
@@ -437,6 +1197,43 @@ START_TEST(bootman_uefi_missing_initrd_freestandings)
 }
 END_TEST
 
+/**
+ * A manager kept around between updates must notice initrds going away
+ * once told they changed.
+ */
+START_TEST(bootman_uefi_invalidate_initrds)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *path_initrd = NULL;
+        char *initrd_name = "00-initrd";
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+
+        path_initrd = string_printf("%s%s/%s",
+                                    PLAYGROUND_ROOT,
+                                    INITRD_DIRECTORY,
+                                    initrd_name);
+
+        file_set_text(path_initrd, "Placeholder initrd");
+        boot_manager_set_image_mode(m, false);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to find freestanding initrd");
+        fail_if(!boot_manager_update(m), "Failed to update with the initrd");
+        fail_if(!check_initrd_file_exist(m, initrd_name), "Initrd was not copied to the ESP");
+
+        /* Same manager, next update */
+        unlink(path_initrd);
+        boot_manager_invalidate(m, BOOT_MANAGER_STALE_INITRDS);
+        fail_if(!boot_manager_enumerate_initrds_freestanding(m), "Failed to enumerate initrds");
+        fail_if(check_freestanding_initrds_available(m, initrd_name),
+                "Removed initrd still known after invalidation");
+        fail_if(!boot_manager_update(m), "Failed to update without the initrd");
+        fail_if(check_initrd_file_exist(m, initrd_name), "Removed initrd was left on the ESP");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[0])),
+                "Kernel missing after the second update");
+}
+END_TEST
+
 START_TEST(bootman_uefi_initrd_freestandings_image)
 {
         autofree(BootManager) *m = NULL;
@@ -655,6 +1452,42 @@ START_TEST(bootman_uefi_ensure_removed)
 }
 END_TEST
 
+/**
+ * Ensure entries without a matching kernel are dropped during update, while
+ * entries outside of our namespace are left alone.
+ */
+START_TEST(bootman_uefi_orphaned_entries)
+{
+        autofree(BootManager) *m = NULL;
+        autofree(char) *orphan_path = NULL;
+        const char *foreign_path = BOOT_FULL "/loader/entries/other-distro.conf";
+        const char *vendor = NULL;
+
+        m = prepare_playground(&uefi_config);
+        fail_if(!m, "Failed to prepare update playground");
+        boot_manager_set_image_mode(m, false);
+        vendor = boot_manager_get_vendor_prefix(m);
+
+        fail_if(!nc_mkdir_p(BOOT_FULL "/loader/entries", 00755), "Failed to create loader dirs");
+
+        /* Entry for a kernel that no longer exists on the system */
+        orphan_path = string_printf("%s/loader/entries/%s-native-3.0.0-1.conf", BOOT_FULL, vendor);
+        fail_if(!file_set_text(orphan_path, "Placeholder config"), "Failed to write orphan entry");
+        fail_if(!file_set_text(foreign_path, "Placeholder config"),
+                "Failed to write foreign entry");
+
+        fail_if(!set_kernel_booted(&uefi_kernels[1], true), "Failed to set kernel as booted");
+        fail_if(!boot_manager_update(m), "Failed to update in native mode");
+
+        fail_if(nc_file_exists(orphan_path), "Orphaned entry was not removed");
+        fail_if(!nc_file_exists(foreign_path), "Foreign entry should be left alone");
+        fail_if(!confirm_kernel_installed(m, &uefi_config, &(uefi_kernels[1])),
+                "Running kernel not installed");
+        fail_if(!confirm_kernel_uninstalled(m, &(uefi_kernels[2])),
+                "Uninteresting kernel shouldn't be kept around.");
+}
+END_TEST
+
 START_TEST(bootman_uefi_list_kernels)
 {
         autofree(BootManager) *m = NULL;
@@ -746,6 +1579,82 @@ START_TEST(bootman_uefi_set_kernel_missing)
 }
 END_TEST
 
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+/**
+ * Boot entries and a boot order that are already in place must not be
+ * written again. The variables are emulated in memory for this.
+ */
+START_TEST(bootman_uefi_efi_vars_skip_unchanged)
+{
+        char varname[9] = { 0 };
+        const char *loader_a = "\\EFI\\test\\a.efi";
+        const char *loader_b = "\\EFI\\test\\b.efi";
+
+        setenv("CBM_BOOTVAR_TEST_MODE", "nvram", 1);
+        fail_if(bootvar_init() != 0, "Failed to set up the emulated EFI variables");
+        cbm_stats_reset();
+
+        fail_if(bootvar_has_boot_rec(BOOT_FULL, loader_a), "Empty NVRAM has a boot entry");
+        fail_if(bootvar_create(BOOT_FULL, loader_a, varname, sizeof(varname)) != 0,
+                "Failed to create the boot entry");
+        fail_if(!streq(varname, "Boot0000"), "Boot entry got the wrong slot");
+        fail_if(!bootvar_has_boot_rec(BOOT_FULL, loader_a), "Created boot entry not found");
+        /* Boot0000 and BootOrder */
+        fail_if(cbm_stats_get(CBM_STAT_EFI_VAR_WRITTEN) != 2, "Expected two variable writes");
+        fail_if(cbm_stats_get(CBM_STAT_EFI_VAR_SKIPPED) != 0, "Nothing should be skipped yet");
+
+        /* Same entry, already first in the boot order */
+        fail_if(bootvar_create(BOOT_FULL, loader_a, NULL, 0) != 0,
+                "Failed to recreate the boot entry");
+        fail_if(cbm_stats_get(CBM_STAT_EFI_VAR_WRITTEN) != 2, "Unchanged variables were written");
+        fail_if(cbm_stats_get(CBM_STAT_EFI_VAR_SKIPPED) != 1, "BootOrder write was not skipped");
+
+        /* A new entry goes first, the old one stays in the boot order */
+        fail_if(bootvar_create(BOOT_FULL, loader_b, varname, sizeof(varname)) != 0,
+                "Failed to create the second boot entry");
+        fail_if(!streq(varname, "Boot0001"), "Second boot entry got the wrong slot");
+        fail_if(cbm_stats_get(CBM_STAT_EFI_VAR_WRITTEN) != 4, "Expected two more variable writes");
+        fail_if(bootvar_append(BOOT_FULL, loader_a) != 0, "Failed to append the boot entry");
+        fail_if(cbm_stats_get(CBM_STAT_EFI_VAR_WRITTEN) != 4, "Appending a known entry wrote");
+
+        bootvar_destroy();
+}
+END_TEST
+
+/**
+ * With --no-efi-writes-if-bootable no boot entry is created while the
+ * fallback path carries our shim. Without it the entry is created once.
+ */
+START_TEST(bootman_uefi_no_efi_writes_if_bootable)
+{
+        autofree(BootManager) *m = NULL;
+        PlaygroundConfig start_conf = {.uefi = true };
+
+        setenv("CBM_BOOTVAR_TEST_MODE", "nvram", 1);
+        m = prepare_playground(&start_conf);
+        fail_if(!m, "Fatal: Cannot initialise playground");
+        boot_manager_set_image_mode(m, false);
+        boot_manager_set_update_efi_vars(m, true);
+        boot_manager_set_no_efi_writes_if_bootable(m, true);
+        cbm_stats_reset();
+
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_INSTALL),
+                "Failed to install bootloader");
+        fail_if(cbm_stats_get(CBM_STAT_EFI_VAR_WRITTEN) != 0,
+                "EFI variables written although the fallback boots");
+        fail_if(boot_manager_needs_update(m), "Bootable fallback should need no update");
+
+        boot_manager_set_no_efi_writes_if_bootable(m, false);
+        fail_if(!boot_manager_needs_update(m), "Missing boot entry not noticed");
+        fail_if(!boot_manager_modify_bootloader(m, BOOTLOADER_OPERATION_UPDATE),
+                "Failed to update bootloader");
+        /* Boot0000 and BootOrder */
+        fail_if(cbm_stats_get(CBM_STAT_EFI_VAR_WRITTEN) != 2, "Boot entry was not created");
+        fail_if(boot_manager_needs_update(m), "Boot entry in place, no update needed");
+}
+END_TEST
+#endif /* HAVE_SHIM_SYSTEMD_BOOT */
+
 static Suite *core_suite(void)
 {
         Suite *s = NULL;
@@ -762,14 +1671,27 @@ static Suite *core_suite(void)
         tcase_add_test(tc, bootman_uefi_remove_bootloader);
         tcase_add_test(tc, bootman_uefi_namespace_migration);
         tcase_add_test(tc, bootman_uefi_ensure_removed);
+        tcase_add_test(tc, bootman_uefi_orphaned_entries);
         tcase_add_test(tc, bootman_uefi_initrd_freestandings);
+        tcase_add_test(tc, bootman_uefi_initrd_bundle);
+        tcase_add_test(tc, bootman_uefi_initrd_blobs);
+        tcase_add_test(tc, bootman_uefi_defrag);
+        tcase_add_test(tc, bootman_uefi_uki_layout);
+        tcase_add_test(tc, bootman_uefi_initrd_transcode);
+        tcase_add_test(tc, bootman_uefi_mirrors);
+        tcase_add_test(tc, bootman_uefi_detached_mount);
         tcase_add_test(tc, bootman_uefi_missing_initrd_freestandings);
+        tcase_add_test(tc, bootman_uefi_invalidate_initrds);
         tcase_add_test(tc, bootman_uefi_initrd_freestandings_image);
         tcase_add_test(tc, bootman_uefi_list_kernels);
         tcase_add_test(tc, bootman_uefi_set_kernel);
         tcase_add_test(tc, bootman_uefi_set_kernel_missing);
         tcase_add_test(tc, bootman_uefi_initrd_freestandings_ucode);
         tcase_add_test(tc, bootman_uefi_initrd_freestandings_ucode_user);
+#if defined(HAVE_SHIM_SYSTEMD_BOOT)
+        tcase_add_test(tc, bootman_uefi_efi_vars_skip_unchanged);
+        tcase_add_test(tc, bootman_uefi_no_efi_writes_if_bootable);
+#endif
         suite_add_tcase(s, tc);
 
         /* Tests without kernel modules */
@@ -475,8 +475,9 @@ int kernel_installed_files_count(BootManager *manager, PlaygroundKernel *kernel)
         autofree(char) *initrd_file = NULL;
         autofree(char) *initrd_file_legacy = NULL;
         /* where the kernel files are expected to be found on the ESP */
-        const char *esp_path = manager->bootloader->get_kernel_destination
-                                   ? manager->bootloader->get_kernel_destination(manager)
+        const BootLoader *bootloader = boot_manager_get_bootloader(manager);
+        const char *esp_path = bootloader->get_kernel_destination
+                                   ? bootloader->get_kernel_destination(manager)
                                    : "efi/" KERNEL_NAMESPACE;
         const char *vendor = NULL;
         int file_count = 0;
@@ -674,8 +675,9 @@ bool check_initrd_file_exist(BootManager *manager, const char *file_name)
         autofree(char) *initrd_file = NULL;
         struct stat st = { 0 };
         /* where the kernel files are expected to be found on the ESP */
-        const char *esp_path = manager->bootloader->get_kernel_destination
-                                   ? manager->bootloader->get_kernel_destination(manager)
+        const BootLoader *bootloader = boot_manager_get_bootloader(manager);
+        const char *esp_path = bootloader->get_kernel_destination
+                                   ? bootloader->get_kernel_destination(manager)
                                    : "efi/" KERNEL_NAMESPACE;
 
         initrd_file = string_printf("%s/%s/freestanding-%s",